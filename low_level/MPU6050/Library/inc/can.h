@@ -23,12 +23,40 @@
 #define CAN2_ReceiveFIFO CAN2->RF0R
 #define RELEASE (1 << 5)
 
+#define CAN_MCR_INRQ (1 << 0)
+#define CAN_MCR_SLEEP (1 << 1)
+#define CAN_MCR_TXFP (1 << 2)  // mailboxes leave in request order, not by ID
+#define CAN_MCR_NART (1 << 4)
+#define CAN_MSR_INAK (1 << 0)
+#define CAN_BTR_LBKM (1UL << 30)  // loop TX back to RX
+#define CAN_BTR_SILM (1UL << 31)  // keep TX off the bus, with LBKM a self-test needing no bus
+#define CAN_TSR_RQCP_ALL ((1 << 0) | (1 << 8) | (1 << 16))
+#define CAN_TSR_TME_ALL (7UL << 26)
+#define CAN_TSR_CODE(tsr) (((tsr) >> 24) & 3)  // next empty mailbox
+#define CAN_IER_TMEIE (1 << 0)
+#define CAN_TIR_TXRQ (1 << 0)
+#define CAN_RFR_FMP 3        // frames pending in the FIFO
+#define CAN_RFR_FOVR (1 << 4)
+#define CAN_IER_FMPIE0 (1 << 1)
+#define CAN_IER_FOVIE0 (1 << 3)
+#define CAN_IER_FMPIE1 (1 << 4)
+#define CAN_IER_FOVIE1 (1 << 6)
+#define CAN_FMR_FINIT (1 << 0)
+#define CAN_ID_IDE (1 << 2)
+#define CAN_ID_RTR (1 << 1)
+
+#define CAN_FILTER_BANKS 14  // 28 only on the connectivity line, CAN1 alone has 14 here
+#define CAN_RX_QUEUE_LEN 16  // frames received but not yet read, power of two
+
+#define CAN_TX_QUEUE_LEN 16  // frames waiting for a mailbox, power of two
+
 typedef struct {
 	unsigned int id;       // 29 bit identifier
 	char data[8];          // Data field
 	unsigned char len;     // Length of data field in bytes
 	unsigned char format;  // 0 - STANDARD, 1- EXTENDED IDENTIFIER
 	unsigned char type;    // 0 - DATA FRAME, 1 - REMOTE FRAME
+	unsigned char filter;  // received only: filter match index from RDTR
 } CAN_msg;
 
 #define CAN1 ((CAN_TypeDef *)CAN1_BASE)
@@ -80,18 +108,36 @@ typedef struct {
 	CAN_FilterRegister_TypeDef sFilterRegister[28];
 } CAN_TypeDef;
 extern CAN_msg CAN_TxMsg, CAN_RxMsg;
+extern volatile uint32_t can_tx_dropped;  // frames refused because the TX queue was full
+extern volatile uint32_t can_rx_overruns;  // frames lost, hardware FIFO or RX queue full
 
 // Functions Proto-types
 void
 canInit(CAN_TypeDef *CAN, int _mode);
 void
 CAN_wrMsg(CAN_TypeDef *CAN, CAN_msg *msg, int mailIndex);
-void
-canTransmit(CAN_TypeDef *CAN, int id, char idtype, char ftype, unsigned char *m, int _mailIndex);
+int
+canTransmit(CAN_TypeDef *CAN, int id, char idtype, char ftype, unsigned char *m);
+int
+can_set_bitrate(CAN_TypeDef *CAN, uint32_t bitrate);
+int
+can_set_test_mode(CAN_TypeDef *CAN, uint32_t mode);
+int
+can_send(const CAN_msg *msg);
 void
 CAN_wrFilter(CAN_TypeDef *CAN, unsigned int id, unsigned char format, unsigned char mess_type);
 void
 filtersInit(CAN_TypeDef *CAN, int _id);
 void
 canRead(CAN_TypeDef *CAN, CAN_msg *msg, int fifoIndex);
+void
+can_filter_clear(void);
+int
+can_filter_add_id(unsigned int id, unsigned char format, unsigned char fifo);
+int
+can_filter_add_mask(unsigned int id, unsigned int mask, unsigned char format, unsigned char fifo);
+void
+can_rx_init(void);
+int
+can_receive(CAN_msg *msg);
 #endif
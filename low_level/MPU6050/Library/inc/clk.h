@@ -13,86 +13,64 @@
 #define PLLMUL 18
 #define APP1BCLK 10
 #define PLLSCR 16
-#define PSC1
 #define CLKUPTO48 0x11
 #define CLKUPTO72 0x12
-#define PSC1
 
-#ifdef Freq25
-#define CYCLETIME 40
-int __clk = 25;
+#ifndef HSI_VALUE
+#define HSI_VALUE 8000000UL  // internal RC oscillator
 #endif
-#ifdef Freq50
-#define CYCLETIME 20
-int __clk = 50;
+#ifndef HSE_VALUE
+#define HSE_VALUE 8000000UL  // Blue Pill crystal
 #endif
-#ifdef Freq8
-#define CYCLETIME 125
-int __clk = 8;
+
+/* clk_init() target: HSE x 9 = 72 MHz, AHB /1, APB1 /2 (36 MHz max), APB2 /1, ADC /6 */
+#ifndef CLK_PLL_MUL
+#define CLK_PLL_MUL 9
 #endif
+#define CLK_HSE_STARTUP_LOOPS 0x5000  // about 10 ms on HSI, a crystal starts in 2
 
-void
-initClk(void) __attribute__((always_inline));
-void
-delayus(unsigned long __t) __attribute__((always_inline));
-void
-delayms(unsigned long __t) __attribute__((always_inline));
+#define RCC_CR_HSEON (1 << 16)
+#define RCC_CR_HSERDY (1 << 17)
+#define RCC_CR_PLLON (1 << 24)
+#define RCC_CR_PLLRDY (1 << 25)
+#define RCC_CFGR_SW_MASK 0x3
+#define RCC_CFGR_SW_PLL 0x2
+#define RCC_CFGR_PPRE1_DIV2 (4 << 8)
+#define RCC_CFGR_ADCPRE_DIV6 (2 << 14)
+#define FLASH_ACR_LATENCY_2 0x2  // 48 < SYSCLK <= 72 MHz
+#define FLASH_ACR_PRFTBE (1 << 4)
 
-/********************/
+/* clk_stop(): STOP mode, regulator in low-power */
+#define RCC_APB1ENR_PWREN (1 << 28)
+#define PWR_CR MMIO32(APB1PERIPH_BASE + 0x7000)
+#define PWR_CR_LPDS (1 << 0)
+#define PWR_CR_PDDS (1 << 1)  // 0 = STOP, 1 = STANDBY
+#define PWR_CR_CWUF (1 << 2)
+#define SCB_SCR MMIO32(SCB_BASE + 0x10)
+#define SCB_SCR_SLEEPDEEP (1 << 2)
+
+extern int __clk;  // HCLK in MHz, set by clk_init(), defined in usart.c
+
+int
+clk_init(void);
+int
+clk_stop(void);
 void
-initClk()
-{
-#ifdef Freq25
-	RCC->CR |= 1 << HSE;  // HSE on
-	while (RCC->CR & (1 << HSEON))
-		;                    // wait until HSE ready
-	RCC->CFGR = 0x00000001;  // select HSE as system clock
-	__clk = 25;
-#endif
-#ifdef Freq50
-	FLASH->ACR = CLKUPTO72;  // for system clock between 48 and 72MHz
-	RCC->CR |= 1 << HSE;     // HSE on
-	while (!(RCC->CR & (1 << HSEON)))
-		;                        // wait until HSE ready
-	RCC->CFGR |= 2 << PLLMUL;    // mult by 9 --->72MHz
-	RCC->CFGR |= 1 << PLLSCR;    // APB1 = 36MHz. See bus clocks.
-	RCC->CFGR |= 1 << APP1BCLK;  // APB1 = 36MHz. See bus clocks.
-	RCC->CR |= 1 << PLL;         // enable PLL
-	while (!(RCC->CR & (1 << PLLLOCKED)))
-		;            // wait until locked
-	RCC->CFGR |= 2;  // PLL as clock source
-	__clk = 50;
-#endif
-#ifdef Freq8
-	__clk = 8;
-#endif
-}
+initClk(void);
 void
-delayus(unsigned long __t)
-{
-	unsigned long __l = (((__t * 1000) - (30 * CYCLETIME)) / (5 * CYCLETIME));
-	unsigned long __i = 0;
-	while (__i < __l) {
-		__nop();
-		__i++;
-	}
-}
+delayus(unsigned long __t);
 void
-delayms(unsigned long __t)
-{
-#ifdef Freq25
-	unsigned long __l = ((__t * 5000) - 6);
-#endif
-#ifdef Freq50
-	unsigned long __l = ((__t * 10000) - 6);
-#endif
-#ifdef Freq8
-	unsigned long __l = ((__t * 1600) - 6);
-#endif
-	unsigned long __i = 0;
-	while (__i < __l) {
-		__nop();
-		__i++;
-	}
-}
+delayms(unsigned long __t);
+
+/* Bus clocks in Hz, decoded from the live RCC->CFGR setting */
+uint32_t
+clk_get_sysclk(void);
+uint32_t
+clk_get_hclk(void);
+uint32_t
+clk_get_pclk1(void);
+uint32_t
+clk_get_pclk2(void);
+uint32_t
+clk_get_timclk1(void);
 #endif
@@ -148,7 +148,13 @@ typedef struct {
 } NVIC_Type;
 
 #define SRAM_BASE ((uint32_t)0x20000000)
+#ifdef SIM_HOST
+/* The host simulation keeps the register blocks in plain memory, see sim.h */
+extern uint32_t sim_periph[], sim_ppb[];
+#define PERIPH_BASE ((uintptr_t)sim_periph)
+#else
 #define PERIPH_BASE ((uint32_t)0x40000000)
+#endif
 
 /* General definitions */
 #define TRUE 1
@@ -198,7 +204,11 @@ typedef struct {
 /* --- ARM Cortex-M3 specific definitions ---------------------------------- */
 
 /* Private peripheral bus - Internal */
+#ifdef SIM_HOST
+#define PPBI_BASE ((uintptr_t)sim_ppb)
+#else
 #define PPBI_BASE 0xE0000000
+#endif
 #define ITM_BASE (PPBI_BASE + 0x0000)
 #define DWT_BASE (PPBI_BASE + 0x1000)
 #define FPB_BASE (PPBI_BASE + 0x2000)
@@ -224,4 +234,71 @@ typedef struct {
 
 #define USART1_BASE (APB2PERIPH_BASE + 0x3800)
 
+/* --- PRIMASK critical sections ------------------------------------------- */
+
+/* Code for the hot interrupt paths, run from SRAM in ISR_IN_RAM builds: no flash wait
+ * states (2 at 72 MHz) and no prefetch refill after each taken branch. The startup code
+ * copies .RamFunc along with .data, calls out to flash go through linker veneers. */
+#if ISR_IN_RAM && !defined(SIM_HOST)
+#define RAMFUNC __attribute__((section(".RamFunc")))
+#else
+#define RAMFUNC
+#endif
+
+/* Mask interrupts and return the previous PRIMASK, irq_restore() puts it back, so the
+ * pair nests. The host build (SIM_HOST) keeps PRIMASK in the simulator instead. */
+#ifdef SIM_HOST
+uint32_t
+sim_irq_save(void);
+void
+sim_irq_restore(uint32_t primask);
+void
+sim_wfi(void);
+#define irq_save() sim_irq_save()
+#define irq_restore(primask) sim_irq_restore(primask)
+#define cpu_wfi() sim_wfi()
+#else
+static inline uint32_t
+irq_save(void)
+{
+	uint32_t primask;
+	__asm volatile("mrs %0, primask\n\tcpsid i" : "=r"(primask)::"memory");
+	return primask;
+}
+
+static inline void
+irq_restore(uint32_t primask)
+{
+	__asm volatile("msr primask, %0" ::"r"(primask) : "memory");
+}
+
+/* Sleep until an interrupt is pending. With interrupts masked the core still wakes, and
+ * the handler runs once irq_restore() unmasks them, so a check made under irq_save()
+ * cannot miss the event it waits for. */
+static inline void
+cpu_wfi(void)
+{
+	__asm volatile("dsb\n\twfi" ::: "memory");
+}
+#endif
+
+/* Register side effects for the host build. The simulator's registers are plain memory it
+ * looks at only when told: SIM_SYNC() in a polling loop or before reading a computed
+ * register (CYCCNT, SysTick VAL) lets the hardware catch up, SIM_READ() and SIM_WRITE()
+ * follow an access that does something by itself, like a DR read popping a byte or a
+ * channel enable starting a transfer. Nothing on the target. */
+#ifdef SIM_HOST
+void
+sim_sync(void);
+void
+sim_access(volatile void *reg, int write);
+#define SIM_SYNC() sim_sync()
+#define SIM_READ(reg) sim_access(&(reg), 0)
+#define SIM_WRITE(reg) sim_access(&(reg), 1)
+#else
+#define SIM_SYNC() ((void)0)
+#define SIM_READ(reg) ((void)0)
+#define SIM_WRITE(reg) ((void)0)
+#endif
+
 #endif
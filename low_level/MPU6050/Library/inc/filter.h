@@ -0,0 +1,35 @@
+/* @file 			 : filter.h
+ *  @Description: Boxcar decimator for raw MPU6050 samples.
+ *
+ *  Averages every `ratio` input samples into one output in integer accumulators, so the
+ *  sensor can run fast for anti-aliasing while the link only carries the output rate.
+ *  Averaging N samples also cuts white noise by sqrt(N).
+ */
+#ifndef FILTER_H
+#define FILTER_H
+
+#ifndef COMMON_H
+#include "common.h"
+#endif
+#ifndef MPU6050_RES_DEFINE_H_
+#include "mpu.h"
+#endif
+
+#define DECIM_MAX_RATIO 4096  // keeps int16 sums inside int32 with headroom
+
+typedef struct {
+	int32_t acc[10];    // AX AY AZ TEMP GX GY GZ MX MY MZ running sums
+	uint32_t t_first;   // timestamp of the first sample in the window
+	uint16_t ratio;     // inputs per output
+	uint16_t count;     // inputs summed so far
+} decim_t;
+
+int
+decim_init(decim_t *d, uint16_t ratio);
+void
+decim_reset(decim_t *d);
+int
+decim_push(decim_t *d, const mpu_raw_t *in, uint32_t timestamp, mpu_raw_t *out,
+           uint32_t *out_time);
+
+#endif
@@ -0,0 +1,36 @@
+/* @file 			 : flash.h
+ *  @Description: Page erase and half-word programming of the internal flash.
+ *
+ *  The last 1 KB page is kept out of the program by the linker script and holds
+ *  settings that have to survive a reset, see FLASH_SETTINGS_PAGE.
+ */
+#ifndef FLASH_H
+#define FLASH_H
+
+#ifndef COMMON_H
+#include "common.h"
+#endif
+
+#define FLASH_PAGE_SIZE 1024
+#define FLASH_SETTINGS_PAGE 0x0800FC00  // SETTINGS region in stm32f103x8_flash.ld
+
+#define FLASH_UNLOCK_KEY1 0x45670123
+#define FLASH_UNLOCK_KEY2 0xCDEF89AB
+#define FLASH_STAT_BSY (1 << 0)
+#define FLASH_STAT_PGERR (1 << 2)
+#define FLASH_STAT_WRPRTERR (1 << 4)
+#define FLASH_STAT_EOP (1 << 5)
+#define FLASH_CTRL_PG (1 << 0)
+#define FLASH_CTRL_PER (1 << 1)
+#define FLASH_CTRL_STRT (1 << 6)
+#define FLASH_CTRL_LOCK (1 << 7)
+
+#define FLASH_ERASE_TIMEOUT_US 50000  // 20 to 40 ms per page
+#define FLASH_PROGRAM_TIMEOUT_US 100  // 52 to 70 us per half-word
+
+int
+flash_erase_page(uint32_t addr);
+int
+flash_program(uint32_t addr, const void *data, uint16_t len);
+
+#endif
@@ -0,0 +1,40 @@
+/* @file 			 : fusion.h
+ *  @Description: Mahony attitude filter in fixed point, no FPU needed.
+ *
+ *  The quaternion is kept as Q30 and updated once per sample from the raw accel and gyro
+ *  words: the gyro is integrated and the accel pulls roll and pitch back towards
+ *  gravity. Yaw has no reference without a magnetometer and drifts with the gyro bias.
+ */
+#ifndef FUSION_H
+#define FUSION_H
+
+#ifndef COMMON_H
+#include "common.h"
+#endif
+#ifndef MPU6050_RES_DEFINE_H_
+#include "mpu.h"
+#endif
+
+#define FUSION_ONE (1L << 30)  // 1.0 in Q30
+#ifndef FUSION_KP_Q16
+#define FUSION_KP_Q16 32768  // 0.5, accel correction gain (Mahony twoKp = 1)
+#endif
+#ifndef FUSION_KI_Q16
+#define FUSION_KI_Q16 0  // gyro bias learning gain, off
+#endif
+
+typedef struct {
+	int32_t q[4];      // w x y z, Q30
+	int32_t bias[3];   // integral feedback, Q24 rad/s
+} fusion_t;
+
+void
+fusion_init(fusion_t *f);
+void
+fusion_update(fusion_t *f, const mpu_raw_t *raw, uint8_t gyro_fs, uint32_t dt_us);
+void
+fusion_quat_q14(const fusion_t *f, int16_t *q);
+void
+fusion_euler_cdeg(const fusion_t *f, int32_t *rpy);
+
+#endif
@@ -11,6 +11,20 @@
 #define DISABLE 0
 #define ACKNOWLEDGE 1
 #define NOACKNOWLEDGE 0
+#define I2C_SPEED_STANDARD 100000UL
+#define I2C_SPEED_FAST 400000UL
+
+/* Every wait on the bus gives up after I2C_TIMEOUT_US, an asynchronous read after that
+ * plus its bytes at the bus speed. A timeout or a bus error clears the bus, see
+ * i2c_recover(), and a blocking transfer is then tried I2C_RETRIES more times. */
+#ifndef I2C_TIMEOUT_US
+#define I2C_TIMEOUT_US 500
+#endif
+#ifndef I2C_RETRIES
+#define I2C_RETRIES 1
+#endif
+#define I2C_CLEAR_PULSES 9   // SCL pulses of a bus clear, a whole byte and its ACK
+#define I2C_CLEAR_HALF_US 5  // 100 kHz
 
 #define I2C1_BASE (APB1PERIPH_BASE + 0x5400)
 #define I2C2_BASE (APB1PERIPH_BASE + 0x5800)
@@ -20,6 +34,7 @@
 #define disableI2C2Interrupt() I2C2->CR2 &= ~(1 << 9)
 #define enableI2C2BufferInterrupt() I2C2->CR2 |= (1 << 10)
 #define disableI2C2BufferInterrupt() I2C2->CR2 &= ~(1 << 10)
+#define I2C_INDEX(I2CP) ((I2CP) == I2C2)  // i2c_stats[] index
 
 typedef struct {
 	__IO uint16_t CR1;
@@ -42,8 +57,19 @@ typedef struct {
 	uint16_t RESERVED8;
 } I2C_TypeDef;
 
+/* Per bus, since reset */
+typedef struct {
+	uint32_t errors;      // NACK, bus error, lost arbitration, overrun, held bus
+	uint32_t timeouts;    // waits and asynchronous reads past their deadline
+	uint32_t retries;     // blocking transfers run again after a bus clear
+	uint32_t recoveries;  // i2c_recover() runs
+	uint8_t failing;      // bus clears in a row that left a line low
+} i2c_stats_t;
+
+extern i2c_stats_t i2c_stats[2];  // I2C1, I2C2
+
 void
-I2CInit(I2C_TypeDef *I2CP, unsigned char rm);
+I2CInit(I2C_TypeDef *I2CP, unsigned char rm, uint32_t speed);
 void
 I2CErrorInterrupt(I2C_TypeDef *I2CP, char ITERREN);
 void
@@ -58,5 +84,42 @@ int
 I2C_Addr(I2C_TypeDef *I2CP, unsigned char adr);
 int
 I2C_Read(I2C_TypeDef *I2CP);
+int
+i2c_read_regs(I2C_TypeDef *I2CP, uint8_t adr, uint8_t reg, uint8_t *buf, uint16_t len);
+int
+i2c_write_regs(I2C_TypeDef *I2CP, uint8_t adr, uint8_t reg, const uint8_t *buf, uint16_t len);
+
+/* DMA receive on DMA1 channel 7 (I2C1_RX), the address phase by interrupt. The callback
+ * runs from the interrupt with 1 on success or -1 on an error, or from i2c_poll() with -1
+ * after a timeout. */
+typedef void (*i2c_callback_t)(int status);
+
+void
+i2c1_dma_init(void);
+int
+i2c1_dma_read(uint8_t adr, uint8_t reg, uint8_t *buf, uint16_t len, i2c_callback_t callback);
+int
+i2c1_dma_busy(void);
+
+/* Interrupt-driven receive on I2C2, whose DMA channels are taken by USART1 */
+void
+i2c2_it_init(void);
+int
+i2c2_it_read(uint8_t adr, uint8_t reg, uint8_t *buf, uint16_t len, i2c_callback_t callback);
+int
+i2c2_it_busy(void);
+
+/* Either bus, picks DMA or interrupt reception */
+int
+i2c_async_read(I2C_TypeDef *I2CP, uint8_t adr, uint8_t reg, uint8_t *buf, uint16_t len,
+               i2c_callback_t callback);
+int
+i2c_async_busy(I2C_TypeDef *I2CP);
+
+/* Bus supervision from the main loop */
+int
+i2c_recover(I2C_TypeDef *I2CP);
+void
+i2c_poll(I2C_TypeDef *I2CP);
 
 #endif
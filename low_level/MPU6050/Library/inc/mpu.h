@@ -119,4 +119,165 @@
 #define FIFO_R_W 0x74
 #define WHO_AM_I 0x75
 
+/* 8-bit I2C write address with AD0 low, and with AD0 high for a second sensor per bus */
+#define MPU6050_ADDR 0xD0
+#define MPU6050_ADDR_AD0 0xD2
+
+/* Sensors sampled together, at most 4: two per bus */
+#ifndef MPU_COUNT
+#define MPU_COUNT 1
+#endif
+
+/* Bytes in one ACCEL_XOUT_H..GYRO_ZOUT_L burst read */
+#define MPU_FRAME_SIZE 14
+
+/* Auxiliary magnetometer, an HMC5883L polled by the MPU's own I2C master through SLV0.
+ * Its 6 bytes land in EXT_SENS_DATA_00.., right behind GYRO_ZOUT_L, so one burst read
+ * (or one FIFO frame) carries all 9 axes. */
+#define MPU_MAG_SIZE 6
+#define MPU_FRAME_MAX (MPU_FRAME_SIZE + MPU_MAG_SIZE)  // burst read with the magnetometer
+#define HMC5883L_ADDR 0x1E                           // 7-bit, as the aux master wants it
+#define HMC5883L_CRA 0x00
+#define HMC5883L_DATA 0x03  // X, Z, Y, big-endian
+#define HMC5883L_CRA_75HZ 0x78  // 8 averaged samples, 75 Hz output
+#define HMC5883L_CRB_1G3 0x20   // ±1.3 Ga, 1090 LSB/Ga
+#define HMC5883L_MODE_CONT 0x00
+#define HMC5883L_RATE 75
+#define USER_CTRL_I2C_MST_EN (1 << 5)
+#define INT_PIN_CFG_BYPASS (1 << 1)
+#define I2C_MST_CTRL_WAIT_ES (1 << 6)  // hold data ready until the slave data is in
+#define I2C_MST_CLK_400K 13
+#define I2C_SLV_READ 0x80
+#define I2C_SLV_EN 0x80
+#define I2C_MST_DELAY_SLV0 (1 << 0)
+#define I2C_MST_DELAY_ES_SHADOW (1 << 7)
+#define FIFO_EN_SLV0 (1 << 0)
+
+#ifndef I2C_H
+#include "i2c.h"
+#endif
+
+/* Full-scale selection written at init, AFS_SEL / FS_SEL 0..3 */
+#ifndef MPU_ACCEL_FS
+#define MPU_ACCEL_FS 0  // ±2 g
+#endif
+#ifndef MPU_GYRO_FS
+#define MPU_GYRO_FS 0  // ±250 deg/s
+#endif
+
+/* One decoded sample, still in sensor LSBs */
+typedef struct {
+	int16_t accel[3];
+	int16_t temp;
+	int16_t gyro[3];
+	int16_t mag[3];  // zero without the aux magnetometer
+} mpu_raw_t;
+
+/* FIFO batch drain */
+#define MPU_FIFO_SIZE 1024
+#define USER_CTRL_FIFO_EN (1 << 6)
+#define USER_CTRL_FIFO_RESET (1 << 2)
+#define FIFO_EN_FRAME 0xF8  // TEMP, XG, YG, ZG, ACCEL: same 14-byte layout as a burst read
+#define INT_STATUS_FIFO_OFLOW (1 << 4)
+#define INT_STATUS_DATA_RDY (1 << 0)
+#define INT_ENABLE_FIFO_OFLOW (1 << 4)
+#define INT_ENABLE_DATA_RDY (1 << 0)
+
+/* Accel-only cycle mode with wake-on-motion */
+#define PWR_MGMT_1_SLEEP (1 << 6)
+#define PWR_MGMT_1_CYCLE (1 << 5)
+#define PWR_MGMT_1_TEMP_DIS (1 << 3)
+#define PWR_MGMT_2_STBY_G 0x07           // STBY_XG, YG, ZG
+#define PWR_MGMT_2_LP_WAKE(n) ((n) << 6)  // cycle mode wake-ups, MPU_LP_WAKE_*
+#define MPU_LP_WAKE_1HZ25 0
+#define MPU_LP_WAKE_5HZ 1
+#define MPU_LP_WAKE_20HZ 2
+#define MPU_LP_WAKE_40HZ 3
+#define ACCEL_CONFIG_HPF_5HZ 1  // ACCEL_HPF, motion compares the high-passed accel
+#define MOT_DETECT_ON_DELAY_3MS (3 << 4)  // ACCEL_ON_DELAY, accel settling per wake-up
+#define INT_ENABLE_MOT (1 << 6)
+#define INT_STATUS_MOT (1 << 6)
+#define MPU_MOT_LSB_MG 2  // MOT_THR scale, mg per count
+
+/* Sensor profile, everything that sets rate, bandwidth and scaling.
+ * ODR = gyro rate / (1 + smplrt_div), gyro rate is 8 kHz with dlpf 0 and 1 kHz otherwise.
+ * The accel output is 1 kHz whatever the divider, faster ODRs repeat accel samples.
+ */
+typedef struct {
+	uint8_t smplrt_div;  // SMPLRT_DIV
+	uint8_t dlpf;        // CONFIG DLPF_CFG 0..6, 0 = 260 Hz .. 6 = 5 Hz bandwidth
+	uint8_t gyro_fs;     // FS_SEL 0..3, ±250/500/1000/2000 deg/s
+	uint8_t accel_fs;    // AFS_SEL 0..3, ±2/4/8/16 g
+	uint8_t fifo;        // nonzero buffers frames in the sensor FIFO
+	uint8_t mag;         // nonzero polls the aux magnetometer into every frame
+} mpu_config_t;
+
+/* One sensor: where it sits and the profile last written to it */
+typedef struct {
+	I2C_TypeDef *bus;  // I2C1 or I2C2
+	uint8_t addr;      // MPU6050_ADDR or MPU6050_ADDR_AD0
+	mpu_config_t cfg;  // power-on register defaults until mpu_configure()
+} mpu_dev_t;
+
+/* Hardware bias offsets, added inside the sensor before the data registers.
+ * Gyro LSB is 1/32.8 deg/s whatever FS_SEL, accel LSB about 1/2048 g whatever AFS_SEL.
+ * Bit 0 of each accel word is the factory temperature trim and is never changed. */
+typedef struct {
+	int16_t accel[3];  // XA_OFFS_H..ZA_OFFS_L_TC, factory trimmed
+	int16_t gyro[3];   // XG_OFFS_USRH..ZG_OFFS_USRL, 0 at power-on
+} mpu_offsets_t;
+
+#define MPU_CALIB_MAX 2048  // samples, keeps the int16 sums well inside int32
+#define MPU_DRDY_TIMEOUT_US 50000  // longest sample period of any profile is 32 ms
+
+extern const mpu_config_t mpu_profile_low_power;  // 50 Hz, 10 Hz bandwidth, finest ranges
+extern const mpu_config_t mpu_profile_vibration;  // 1 kHz, 260 Hz bandwidth, widest ranges
+
+void
+mpu_decode(const uint8_t *frame, mpu_raw_t *raw);
+void
+mpu_decode_mag(const uint8_t *ext, mpu_raw_t *raw);
+int32_t
+mpu_accel_cg(int16_t raw, uint8_t fs);
+int32_t
+mpu_gyro_cdps(int16_t raw, uint8_t fs);
+int32_t
+mpu_temp_cc(int16_t raw);
+
+int
+mpu_init(mpu_dev_t *dev, const mpu_config_t *cfg);
+int
+mpu_configure(mpu_dev_t *dev, const mpu_config_t *cfg);
+const mpu_config_t *
+mpu_config(const mpu_dev_t *dev);
+uint32_t
+mpu_sample_period_us(const mpu_dev_t *dev);
+uint8_t
+mpu_odr_to_div(uint8_t dlpf, uint32_t hz);
+uint8_t
+mpu_frame_size(const mpu_dev_t *dev);
+int
+mpu_read_frame(mpu_dev_t *dev, uint8_t *frame, i2c_callback_t callback);
+
+int
+mpu_read_offsets(mpu_dev_t *dev, mpu_offsets_t *offs);
+int
+mpu_write_offsets(mpu_dev_t *dev, const mpu_offsets_t *offs);
+int
+mpu_calibrate(mpu_dev_t *dev, uint16_t samples, mpu_offsets_t *offs);
+
+int
+mpu_cycle_enter(mpu_dev_t *dev, uint8_t threshold, uint8_t lp_wake);
+int
+mpu_cycle_exit(mpu_dev_t *dev);
+int
+mpu_int_status(mpu_dev_t *dev);
+
+int
+mpu_fifo_reset(mpu_dev_t *dev);
+int
+mpu_fifo_frames(mpu_dev_t *dev);
+int
+mpu_fifo_read(mpu_dev_t *dev, uint8_t *buf, uint16_t frames, i2c_callback_t callback);
+
 #endif /* MPU6050_RES_DEFINE_H_ */
\ No newline at end of file
@@ -274,6 +274,19 @@ typedef struct {
 #define SPI_CR1_DFF (1 << 11)
 #define REMAP 1
 #define NO_REMAP 0
+
+#define SPI_DMA_SLOTS 2  // one transfer on the wire, one queued behind it
+
+/* spi_dma_transceive() gives up after SPI_DMA_TIMEOUT_US plus SPI_DMA_BYTE_US per byte,
+ * one byte at FPCLK/256 on a 72 MHz APB2 */
+#ifndef SPI_DMA_TIMEOUT_US
+#define SPI_DMA_TIMEOUT_US 1000
+#endif
+#define SPI_DMA_BYTE_US 32
+
+/* Completion callback, status is 1 on success and -1 on a DMA error */
+typedef void (*spi_callback_t)(int status);
+
 void
 spi_reset(SPI_TypeDef *SPI);
 int
@@ -370,9 +383,14 @@ spi_disable_rx_dma(SPI_TypeDef *SPI);
 void
 spi_set_standard_mode(SPI_TypeDef *SPI, uint8_t mode);
 int
-spi_dma_transceive(uint8_t *tx_buf, int tx_len, uint8_t *rx_buf, int rx_len);
+spi_dma_init(SPI_TypeDef *SPI);
+int
+spi_dma_submit(SPI_TypeDef *SPI, const uint8_t *tx, uint8_t *rx, uint16_t len,
+               spi_callback_t callback);
 int
-spi2_dma_transceive(uint8_t *tx_buf, int tx_len, uint8_t *rx_buf, int rx_len);
+spi_dma_busy(SPI_TypeDef *SPI);
+int
+spi_dma_transceive(uint8_t *tx_buf, int tx_len, uint8_t *rx_buf, int rx_len);
 void
 spi1_dma_receive(uint8_t *rx_buf, int rx_len);
 void
@@ -0,0 +1,86 @@
+/* @file 			 : norlog.h
+ *  @Description: Sample capture log on an external SPI NOR flash (W25Qxx and alike).
+ *
+ *  The whole chip is one circular log of 256-byte pages, written strictly in order, so
+ *  every sector is erased once per lap and wears evenly. Each page is self-describing,
+ *  little-endian:
+ *    0   magic     NORLOG_MAGIC
+ *    2   session   capture number, +1 per norlog_start()
+ *    4   seq       page number over the life of the chip, never reused
+ *    8   time      micros() of the first sample in the page
+ *    12  count     samples in the page, 1..NORLOG_PAYLOAD / size
+ *    13  size      bytes per sample
+ *    14  samples   count * size bytes, the rest 0xFF
+ *    254 crc       telemetry_crc16() of bytes 0..253
+ *  The write position is found again at power-up from the highest seq on the chip.
+ *
+ *  Full pages are programmed from norlog_poll() in the main loop, through the SPI1 DMA
+ *  queue, while the next page fills: norlog_append() is a copy of one sample. Erasing
+ *  (30 to 400 ms a sector) runs ahead of the write position in the background, the
+ *  erased space set with norlog_erase_ahead() bounds how long a capture can go at full
+ *  rate without waiting for it.
+ *
+ *  norlog_dump() sends every valid page, oldest first, as it is on the chip to USART1,
+ *  paced by the TX ring, then an empty page header (count 0) as the end marker. Capture
+ *  and readout exclude each other.
+ *
+ *  Wiring: SPI1 on PA5 SCK, PA6 MISO, PA7 MOSI, chip select on PA4.
+ */
+#ifndef NORLOG_H
+#define NORLOG_H
+
+#ifndef COMMON_H
+#include "common.h"
+#endif
+
+#define NORLOG_PAGE_SIZE 256
+#define NORLOG_SECTOR_SIZE 4096
+#define NORLOG_HEADER_SIZE 14
+#define NORLOG_PAYLOAD (NORLOG_PAGE_SIZE - NORLOG_HEADER_SIZE - 2)  // 240 bytes of samples
+#define NORLOG_MAGIC 0x474C  // "LG"
+#ifndef NORLOG_PAGE_BUFS
+#define NORLOG_PAGE_BUFS 4  // 1 KB RAM, about 17 ms of one sensor at 4 kHz
+#endif
+
+/* SPI NOR commands, the set every 25-series part shares */
+#define NOR_CMD_WREN 0x06
+#define NOR_CMD_RDSR 0x05
+#define NOR_CMD_READ 0x03
+#define NOR_CMD_PP 0x02
+#define NOR_CMD_SE 0x20  // 4 KB sector erase
+#define NOR_CMD_JEDEC_ID 0x9F
+#define NOR_CMD_RELEASE_PD 0xAB
+#define NOR_SR_WIP (1 << 0)
+
+typedef struct {
+	uint32_t size;          // chip size in bytes, from the JEDEC ID
+	uint32_t pages;         // pages programmed since norlog_init()
+	uint32_t dropped;       // samples refused, every page buffer was full
+	uint32_t errors;        // SPI DMA errors, the page is lost
+	uint16_t session;       // current or last capture
+	uint8_t capturing;
+	uint8_t dumping;
+} norlog_stats_t;
+
+extern norlog_stats_t norlog_stats;
+
+int
+norlog_init(void);
+int
+norlog_erase_ahead(uint32_t bytes);
+int
+norlog_start(uint8_t size);
+void
+norlog_append(const uint8_t *sample, uint32_t time);
+void
+norlog_stop(void);
+int
+norlog_dump(void);
+void
+norlog_poll(void);
+uint32_t
+norlog_erased(void);
+int
+norlog_idle(void);
+
+#endif
@@ -117,6 +117,34 @@
 /* STIR: Software Trigger Interrupt Register */
 #define NVIC_STIR MMIO32(STIR_BASE)
 
+/* AIRCR: priority grouping, SHPR: system handler priorities (handler 4 + i) */
+#define SCB_AIRCR MMIO32(SCB_BASE + 0x0C)
+#define SCB_AIRCR_VECTKEY (0x05FAUL << 16)
+#define SCB_AIRCR_PRIGROUP_MASK (7UL << 8)
+#define SCB_AIRCR_PRIGROUP_16_0 (3UL << 8)  // all 4 implemented bits preempt, no subpriority
+#define SCB_SHPR(i) MMIO8(SCB_BASE + 0x18 + (i))
+#define SCB_SHPR_SYSTICK 11
+
+/* --- Interrupt priority plan --------------------------------------------- */
+
+/* The F103 implements the top 4 bits of each priority byte, 16 preemption levels, lower
+ * preempts higher. nvic_priority_init() puts every interrupt on one of these levels:
+ *   SAMPLE        data-ready EXTI0, I2C1 RX DMA (channel 7), I2C1/I2C2 event and error.
+ *                 One level on purpose: the acquisition chain steps the same state from
+ *                 all of them, so they must not preempt each other.
+ *   COMMS         USART1 TX/RX DMA (channels 4, 5), USART1 IDLE, CAN TX and RX
+ *   STORAGE       SPI1 DMA (channels 2, 3) of the flash log
+ *   HOUSEKEEPING  SysTick, timers and everything not listed
+ * A data-ready edge therefore waits at most for another SAMPLE handler to finish and for
+ * irq_save() sections, never for telemetry or log traffic. Level 0 stays free. */
+#define NVIC_PRIO_BITS 4
+#define NVIC_PRIO(level) ((level) << (8 - NVIC_PRIO_BITS))
+#define NVIC_PRIO_SAMPLE NVIC_PRIO(1)
+#define NVIC_PRIO_COMMS NVIC_PRIO(4)
+#define NVIC_PRIO_STORAGE NVIC_PRIO(6)
+#define NVIC_PRIO_HOUSEKEEPING NVIC_PRIO(8)
+#define NVIC_IRQ_COUNT 68
+
 /* --- IRQ channel numbers-------------------------------------------------- */
 
 /* Cortex M3 System Interrupts */
@@ -152,4 +180,6 @@ void
 nvic_set_priority(u8 irqn, u8 priority);
 void
 nvic_generate_software_interrupt(u8 irqn);
+void
+nvic_priority_init(void);
 #endif
@@ -0,0 +1,66 @@
+/* @file 			 : prof.h
+ *  @Description: Cycle counts of hot-path stages from the Cortex-M3 DWT cycle counter.
+ *
+ *  PROF_BEGIN(stage) ... PROF_END(stage) inside one function adds a measurement to the
+ *  stage's min, max, mean and log2 histogram. For spans across functions or interrupts
+ *  keep prof_now() yourself and call prof_record(). Each stage must be recorded from one
+ *  context only, main loop or a single interrupt level, so the sums need no locking.
+ *  Without PROFILING the macros compile to nothing, the counter costs one load per mark.
+ */
+#ifndef PROF_H
+#define PROF_H
+
+#ifndef COMMON_H
+#include "common.h"
+#endif
+
+#ifndef PROFILING
+#define PROFILING 0
+#endif
+
+#define DEMCR MMIO32(SCS_BASE + 0xDFC)
+#define DEMCR_TRCENA (1 << 24)
+#define DWT_CTRL MMIO32(DWT_BASE + 0x00)
+#define DWT_CYCCNT MMIO32(DWT_BASE + 0x04)
+#define DWT_CTRL_CYCCNTENA (1 << 0)
+
+#define PROF_STAGES 8
+#define PROF_BINS 12
+#define PROF_BIN0_CYCLES 64  // bin i counts spans below 64 << i cycles, the last one the rest
+
+typedef struct {
+	uint32_t count;            // spans recorded since prof_reset()
+	uint32_t min, max;         // cycles
+	uint64_t sum;              // cycles, mean = sum / count
+	uint32_t hist[PROF_BINS];
+} prof_stage_t;
+
+extern prof_stage_t prof_stage[PROF_STAGES];
+
+#if PROFILING
+#define PROF_BEGIN(stage) uint32_t prof_t0_##stage = DWT_CYCCNT
+#define PROF_END(stage) prof_record((stage), DWT_CYCCNT - prof_t0_##stage)
+#else
+#define PROF_BEGIN(stage) ((void)0)
+#define PROF_END(stage) ((void)0)
+#endif
+
+static inline uint32_t
+prof_now(void)
+{
+	SIM_SYNC();
+	return DWT_CYCCNT;
+}
+
+void
+prof_init(void);
+void
+prof_reset(void);
+void
+prof_take(uint8_t stage, prof_stage_t *copy);
+void
+prof_record(uint8_t stage, uint32_t cycles);
+uint32_t
+prof_mean(const prof_stage_t *s);
+
+#endif
@@ -0,0 +1,107 @@
+/* @file 			 : sampleq.h
+ *  @Description: Single-producer / single-consumer queue of raw MPU6050 frames.
+ *
+ *  The producer is interrupt code (EXTI + DMA complete), the consumer is the main loop.
+ *  Each side only ever writes its own index, and a 32-bit aligned load or store is atomic
+ *  on the Cortex-M3, so no interrupts need to be masked. The compiler barriers keep the
+ *  slot accesses on the right side of the index update, and a single core needs nothing
+ *  stronger. Slots are filled in place so the DMA can write straight into them.
+ *
+ *  Indices run freely and wrap at 2^32, SAMPLEQ_LEN must be a power of two.
+ */
+#ifndef SAMPLEQ_H
+#define SAMPLEQ_H
+
+#ifndef COMMON_H
+#include "common.h"
+#endif
+#ifndef MPU6050_RES_DEFINE_H_
+#include "mpu.h"
+#endif
+#include <stddef.h>
+
+#ifndef SAMPLEQ_LEN
+#define SAMPLEQ_LEN 16
+#endif
+#ifndef SAMPLEQ_FRAME_SIZE
+#define SAMPLEQ_FRAME_SIZE (MPU_COUNT * MPU_FRAME_MAX)  // one frame per sensor, mag included
+#endif
+
+#define SAMPLEQ_BARRIER() __asm volatile("" ::: "memory")
+
+typedef struct {
+	uint32_t time;                  // sample time in microseconds
+	uint8_t frame[SAMPLEQ_FRAME_SIZE];  // ACCEL_XOUT_H.. per sensor at MPU_FRAME_MAX stride
+} sample_slot_t;
+
+typedef struct {
+	sample_slot_t slot[SAMPLEQ_LEN];
+	volatile uint32_t head;        // written by the producer only
+	volatile uint32_t tail;        // written by the consumer only
+	volatile uint32_t high_water;  // most slots ever in use, producer side
+	volatile uint32_t overruns;    // frames refused because the queue was full
+} sampleq_t;
+
+/** @brief Frames waiting, safe from either side. */
+static inline uint32_t
+sampleq_count(const sampleq_t *q)
+{
+	return q->head - q->tail;
+}
+
+/** @brief Producer: slot to fill next, or NULL (and one overrun counted) when full.
+        The slot is not visible to the consumer until sampleq_publish().
+*/
+static inline sample_slot_t *
+sampleq_write_slot(sampleq_t *q)
+{
+	uint32_t head = q->head;
+
+	if (head - q->tail >= SAMPLEQ_LEN) {
+		q->overruns++;
+		return NULL;
+	}
+	return &q->slot[head % SAMPLEQ_LEN];
+}
+
+/** @brief Producer: hand the slot from sampleq_write_slot() to the consumer. */
+static inline void
+sampleq_publish(sampleq_t *q)
+{
+	uint32_t used;
+
+	SAMPLEQ_BARRIER();  // slot contents before the index that exposes them
+	q->head++;
+	used = q->head - q->tail;
+	if (used > q->high_water)
+		q->high_water = used;
+}
+
+/** @brief Consumer: oldest published slot, or NULL when empty. */
+static inline const sample_slot_t *
+sampleq_read_slot(const sampleq_t *q)
+{
+	uint32_t tail = q->tail;
+
+	if (tail == q->head)
+		return NULL;
+	SAMPLEQ_BARRIER();  // index before the slot contents it covers
+	return &q->slot[tail % SAMPLEQ_LEN];
+}
+
+/** @brief Consumer: done with the slot from sampleq_read_slot(), give it back. */
+static inline void
+sampleq_release(sampleq_t *q)
+{
+	SAMPLEQ_BARRIER();  // finish reading the slot before the producer may reuse it
+	q->tail++;
+}
+
+/** @brief Consumer: drop everything published so far. */
+static inline void
+sampleq_flush(sampleq_t *q)
+{
+	q->tail = q->head;
+}
+
+#endif
@@ -0,0 +1,59 @@
+/* @file 			 : sched.h
+ *  @Description: Cooperative run-to-completion task scheduler.
+ *
+ *  Tasks are plain functions that do a bounded amount of work and return. Each one waits
+ *  on event bits, on a period in SysTick milliseconds, or on both. Interrupt handlers
+ *  raise events with sched_signal(), sched_step() runs the highest priority task that is
+ *  ready and returns, so a higher priority task never waits longer than the longest task
+ *  below it. With nothing ready the core sleeps in WFI until the next interrupt, SysTick
+ *  included, which is also what lets periodic tasks fall due.
+ *
+ *  Events are one word of bits the application defines, several tasks may share one.
+ *  sched_step() hands each raised event to every task waiting on it, and each of them
+ *  runs once for it in priority order. A task's events are cleared just before it runs,
+ *  so an event raised while it runs makes it ready again and none is lost.
+ *
+ *  sched_set_idle() swaps the WFI for the application's own sleep, i.e. STOP mode while
+ *  the peripherals are quiet.
+ */
+#ifndef SCHED_H
+#define SCHED_H
+
+#ifndef COMMON_H
+#include "common.h"
+#endif
+
+#ifndef SCHED_MAX_TASKS
+#define SCHED_MAX_TASKS 8
+#endif
+
+typedef void (*sched_task_fn)(void);
+
+typedef struct {
+	sched_task_fn run;
+	uint8_t prio;        // 0 runs first
+	uint32_t events;     // event bits that make it ready
+	uint32_t pending;    // of those, raised and not yet run for
+	uint32_t period_ms;  // 0 for events only
+	uint32_t next;       // millis() when the period falls due
+	uint32_t runs;
+	uint8_t id;          // sched_add() order
+} sched_task_t;
+
+extern volatile uint32_t sched_events;  // raised and not yet handed to the tasks
+extern uint32_t sched_idle_count;       // times sched_step() found nothing to run
+
+int
+sched_add(sched_task_fn run, uint8_t prio, uint32_t events, uint32_t period_ms);
+void
+sched_signal(uint32_t events);
+int
+sched_step(void);
+void
+sched_run(void);
+const sched_task_t *
+sched_task(int id);
+void
+sched_set_idle(sched_task_fn idle);
+
+#endif
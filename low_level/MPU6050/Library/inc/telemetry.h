@@ -0,0 +1,144 @@
+/* @file 			 : telemetry.h
+ *  @Description: Binary telemetry frame sent to the Raspberry Pi host.
+ *
+ *  Frame layout, multi-byte fields little-endian:
+ *    0  sync      0xA5 0x5A, second byte 0x5C..0x5E for sensors 1..3 of a multi-IMU node
+ *    2  seq       u16, increments per frame, gaps mean lost frames
+ *    4  timestamp u32, sample time in microseconds
+ *    8  raw       7 x i16: AX AY AZ TEMP GX GY GZ in sensor LSBs, averaged when decimating
+ *   22  crc       u16 CRC-16/CCITT-FALSE over bytes 2..21
+ *
+ *  Attitude frame, same header with the second sync byte 0x5B:
+ *    8  quat      4 x i16: W X Y Z, Q14 (16384 = 1.0)
+ *   16  crc       u16 over bytes 2..15
+ *
+ *  Magnetometer frame, second sync byte 0x5F, follows the raw frame of the same seq:
+ *    8  sensor    u8, 0..3
+ *    9  reserved  u8, 0
+ *   10  mag       3 x i16: MX MY MZ in HMC5883L LSBs
+ *   16  crc       u16 over bytes 2..15
+ *
+ *  Delta frame, second sync byte 0x51, FMT DELTA: up to TELEMETRY_DELTA_BATCH samples of
+ *  one sensor, each one as its change from the sample before:
+ *    2  seq       u8, low byte of the first sample's seq, the others follow one by one
+ *    3  sensor    u8, 0..3
+ *    4  len       u8, payload bytes
+ *    5  payload   per sample 8 zig-zag varints: the change of the sample interval in
+ *                 microseconds, then the changes of AX AY AZ TEMP GX GY GZ
+ *  5+len crc      u16 over bytes 2..4+len
+ *  Zig-zag maps d >= 0 to 2d and d < 0 to -2d - 1, a varint carries 7 bits per byte, low
+ *  bits first, bit 7 set on every byte but the last. The raw frame is the keyframe: the
+ *  chain restarts from it with an interval change of 0 before the first sample, and it
+ *  goes out every TELEMETRY_DELTA_KEY samples, after a lost sample and after FMT DELTA.
+ *  A host that missed a frame or joined late drops delta frames until the next keyframe.
+ *  A quiet sensor at 1 kHz takes about 10 bytes per sample instead of 24.
+ *
+ *  Profiling frame, second sync byte 0x50, one per stage in PROFILING builds:
+ *    8  stage     u8
+ *    9  bins      u8, PROF_BINS
+ *   10  count     u32, spans since the previous report
+ *   14  min       u32, cycles
+ *   18  max       u32, cycles
+ *   22  mean      u32, cycles
+ *   26  hist      12 x u16, bin i below 64 << i cycles, saturating
+ *   50  crc       u16 over bytes 2..49
+ *
+ *  CAN, two 8-byte standard data frames per sample, little-endian:
+ *    TELEMETRY_CAN_ID(node, 2 * sensor)      AX AY AZ TEMP
+ *    TELEMETRY_CAN_ID(node, 2 * sensor + 1)  GX GY GZ seq
+ *    TELEMETRY_CAN_ID(node, 8 + sensor)      MX MY MZ seq, only with the magnetometer on
+ *  The bus CRC and ACK cover integrity, seq pairs the two frames and shows losses.
+ *  CAN DELTA sends one frame per sample in place of the pair while every channel moved by
+ *  less than 128 LSBs, the pair is the keyframe as on USART1:
+ *    TELEMETRY_CAN_ID(node, 12 + sensor)     seq low byte, 7 x i8 changes AX..GZ
+ */
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#ifndef COMMON_H
+#include "common.h"
+#endif
+#ifndef MPU6050_RES_DEFINE_H_
+#include "mpu.h"
+#endif
+#ifndef PROF_H
+#include "prof.h"
+#endif
+
+#define TELEMETRY_FORMAT_TEXT 0
+#define TELEMETRY_FORMAT_BINARY 1
+#define TELEMETRY_FORMAT_ATTITUDE 2
+#define TELEMETRY_FORMAT_DELTA 3
+#ifndef TELEMETRY_FORMAT
+#define TELEMETRY_FORMAT TELEMETRY_FORMAT_BINARY
+#endif
+
+#define TELEMETRY_SYNC0 0xA5
+#define TELEMETRY_SYNC1 0x5A
+#define TELEMETRY_CHANNELS 7
+#define TELEMETRY_FRAME_SIZE 24
+#define TELEMETRY_SYNC1_IMU(n) ((n) ? 0x5B + (n) : TELEMETRY_SYNC1)
+#define TELEMETRY_ATT_SYNC1 0x5B
+#define TELEMETRY_ATT_FRAME_SIZE 18
+#define TELEMETRY_MAG_SYNC1 0x5F
+#define TELEMETRY_MAG_FRAME_SIZE 18
+#define TELEMETRY_PROF_SYNC1 0x50
+#define TELEMETRY_DELTA_SYNC1 0x51
+#define TELEMETRY_DELTA_BATCH 4  // samples per delta frame, the latency it adds
+#define TELEMETRY_DELTA_KEY 64   // samples per keyframe, the longest a host waits to resync
+#define TELEMETRY_DELTA_SAMPLE_MAX (5 + TELEMETRY_CHANNELS * 3)  // varint bytes, worst case
+#define TELEMETRY_DELTA_FRAME_MAX (7 + TELEMETRY_DELTA_BATCH * TELEMETRY_DELTA_SAMPLE_MAX)
+#define TELEMETRY_DELTA_OUT_MAX (TELEMETRY_DELTA_FRAME_MAX + TELEMETRY_FRAME_SIZE)
+#define TELEMETRY_PROF_FRAME_SIZE (28 + 2 * PROF_BINS)
+#define TELEMETRY_CAN_ID(node, n) (0x100 + ((node) << 4) + (n))  // node 0..15
+#define TELEMETRY_CAN_DELTA(sensor) (12 + (sensor))  // n of the delta frames
+#define TELEMETRY_TEXT_MAX 80  // "$" + 7 x "-327.68," + "\r\n" fits with room to spare
+
+/* Delta coding state of one sensor on one link */
+typedef struct {
+	int16_t prev[TELEMETRY_CHANNELS];  // last sample sent, AX AY AZ TEMP GX GY GZ
+	uint16_t seq;                      // seq expected next, any other one is a keyframe
+	uint8_t since_key;                 // samples since the keyframe, 0 sends one next
+} telemetry_delta_t;
+
+/* USART1 delta encoder: the chain plus the frame being filled */
+typedef struct {
+	telemetry_delta_t d;
+	uint32_t prev_time;
+	int32_t prev_dt;  // sample interval before prev_time
+	uint8_t count;    // samples in frame, 0 = none open
+	uint8_t len;      // bytes in frame
+	uint8_t frame[TELEMETRY_DELTA_FRAME_MAX];
+} telemetry_batch_t;
+
+uint16_t
+telemetry_crc16(const uint8_t *data, uint16_t len);
+uint16_t
+telemetry_pack(uint8_t *out, uint8_t sensor, uint16_t seq, uint32_t timestamp,
+               const mpu_raw_t *raw);
+uint16_t
+telemetry_pack_attitude(uint8_t *out, uint16_t seq, uint32_t timestamp, const int16_t *quat);
+uint16_t
+telemetry_pack_mag(uint8_t *out, uint8_t sensor, uint16_t seq, uint32_t timestamp,
+                   const mpu_raw_t *raw);
+uint16_t
+telemetry_pack_prof(uint8_t *out, uint16_t seq, uint32_t timestamp, uint8_t stage,
+                    const prof_stage_t *prof);
+void
+telemetry_pack_can_mag(uint8_t *mag, uint16_t seq, const mpu_raw_t *raw);
+void
+telemetry_pack_can(uint8_t *accel, uint8_t *gyro, uint16_t seq, const mpu_raw_t *raw);
+uint16_t
+telemetry_pack_text(char *out, const int32_t *centi);
+void
+telemetry_delta_reset(telemetry_delta_t *d);
+uint16_t
+telemetry_pack_delta(telemetry_batch_t *b, uint8_t *out, uint8_t sensor, uint16_t seq,
+                     uint32_t timestamp, const mpu_raw_t *raw);
+uint16_t
+telemetry_flush_delta(telemetry_batch_t *b, uint8_t *out);
+int
+telemetry_pack_can_delta(telemetry_delta_t *d, uint8_t *delta, uint16_t seq,
+                         const mpu_raw_t *raw);
+
+#endif
@@ -27,7 +27,14 @@
 #define readCaptureValueCH2(TIMER) TIMER->CCR2
 #define readCaptureValueCH3(TIMER) TIMER->CCR3
 #define readCaptureValueCH4(TIMER) TIMER->CCR4
-#define micros() ((MILLIS * 1000) + (TIM6->CNT - 1))
+
+/* SysTick time base for millis()/micros() */
+#define SYSTICK ((SYSTICK_TypeDef *)SYS_TICK_BASE)
+#define SYSTICK_CTRL_ENABLE (1 << 0)
+#define SYSTICK_CTRL_TICKINT (1 << 1)
+#define SYSTICK_CTRL_CLKSOURCE (1 << 2)  // HCLK, not HCLK/8
+#define SCB_ICSR MMIO32(SCB_BASE + 0x04)
+#define SCB_ICSR_PENDSTSET (1 << 26)
 
 #define TIM2 ((TIM_GP_TypeDef *)TIM2_BASE)
 #define TIM3 ((TIM_GP_TypeDef *)TIM3_BASE)
@@ -75,6 +82,15 @@ typedef struct {
 	uint16_t RESERVED17;
 } TIM_GP_TypeDef;
 
+typedef struct {
+	__IO uint32_t CTRL;
+	__IO uint32_t LOAD;
+	__IO uint32_t VAL;
+	__IO uint32_t CALIB;
+} SYSTICK_TypeDef;
+
+extern volatile unsigned long MILLIS;
+
 /*Function Prototypes*/
 void
 timerInit(TIM_GP_TypeDef *TIMER, unsigned int prescaler);
@@ -100,4 +116,14 @@ unsigned long
 millis(void);
 void
 microsInit(void);
+uint32_t
+micros(void);
+uint32_t
+deadline_us(uint32_t us);
+int
+deadline_expired(uint32_t deadline);
+void
+delay_us(uint32_t us);
+void
+delay_ms(uint32_t ms);
 #endif
@@ -78,8 +78,16 @@ void
 usartInit(USART_TypeDef *usart, uint32_t br, int setremap);
 
 #endif /* __STM32F1xx_HAL_H */
+int32_t
+usart_get_baudrate(USART_TypeDef *usart, uint32_t baud);
+int32_t
+usart_set_baudrate(USART_TypeDef *usart, uint32_t baud);
+void
+usart_tx_flush(void);
 void
 Send_String(USART_TypeDef *uart, char *str);
+void
+Send_Bytes(USART_TypeDef *uart, const uint8_t *data, uint16_t len);
 unsigned char
 GetChar(USART_TypeDef *urt);
 void
@@ -89,6 +97,40 @@ GetString(USART_TypeDef *uart, char *data);
 unsigned char
 RecvString(USART_TypeDef *uart, unsigned char *x, unsigned char size);
 
+/* Non-blocking USART1 transmit: usart_write() queues into a ring that DMA1 channel 4
+ * drains in the background. */
+#ifndef USART_TX_BUF_SIZE
+#define USART_TX_BUF_SIZE 512  // bytes, power of two
+#endif
+
+extern volatile uint32_t usart_tx_dropped;
+
+void
+usart_tx_init(void);
+int
+usart_write(const uint8_t *data, uint16_t len);
+uint16_t
+usart_tx_space(void);
+int
+usart_tx_idle(void);
+
+/* Background USART1 receive: DMA1 channel 5 fills a circular buffer, the half/full
+ * transfer and IDLE interrupts publish how far it got, usart_rx_read() copies out. */
+#ifndef USART_RX_BUF_SIZE
+#define USART_RX_BUF_SIZE 128  // bytes, power of two
+#endif
+
+extern volatile uint32_t usart_rx_overruns;
+
+typedef void (*usart_callback_t)(int status);
+
+void
+usart_rx_init(void);
+void
+usart_rx_set_callback(usart_callback_t cb);
+uint16_t
+usart_rx_read(uint8_t *data, uint16_t max);
+
 void
 dma_read_usart1(char *data, int size);
 void
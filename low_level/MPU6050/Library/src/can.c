@@ -1,5 +1,28 @@
 #include "can.h"
+#include "clk.h"
 CAN_msg CAN_TxMsg, CAN_RxMsg;
+/* Software TX queue behind the three CAN1 mailboxes, drained by the TX interrupt */
+static CAN_msg can_tx_queue[CAN_TX_QUEUE_LEN];
+static volatile uint16_t can_tx_head, can_tx_tail;
+volatile uint32_t can_tx_dropped;
+
+/* Enter or leave initialization mode, 1 once the controller acknowledged it */
+static int
+can_init_mode(CAN_TypeDef *CAN, int enter)
+{
+	int timeout = 10000;
+
+	if (enter)
+		CAN->MCR = (CAN->MCR & ~CAN_MCR_SLEEP) | CAN_MCR_INRQ;
+	else
+		CAN->MCR &= ~CAN_MCR_INRQ;  // completes after 11 recessive bits on the bus
+	while (!(CAN->MSR & CAN_MSR_INAK) == !!enter) {
+		if (--timeout == 0)
+			return -1;
+	}
+	return 1;
+}
+
 /** @brief CAN initialization.
 
 This initialize the CAN BUS enables it's clock
@@ -10,6 +33,10 @@ This initialize the CAN BUS enables it's clock
 *Enable Overrun FIFO Functionality
 *Go for Normal Mode
 
+CAN1 sits on PB8 (RX) / PB9 (TX), the only CAN pins on the F103C8 besides the USB
+pair PA11/PA12. Frames are retransmitted until acknowledged, so a node that loses
+arbitration on a shared bus retries instead of dropping the frame.
+
     @param[in] CANx. i.e CAN1  @ref
     @param[in] __mode to decide the mode (POLLING \OR INTERRUPT).
     @example     canInit(CAN1,INTERRUPT);
@@ -22,41 +49,89 @@ canInit(CAN_TypeDef *CAN, int _mode)
 	if (CAN == CAN1) {
 		RCC->APB1ENR |= 1 << 25;  // enable clock for CAN1
 		RCC->APB2ENR |= 0x01;     // enable clock for Alternate Function
-		RCC->APB2ENR |= 1 << 5;   // enable clock for GPIO D
+		RCC->APB2ENR |= 1 << 3;   // enable clock for GPIO B
 
 		AFIO->MAPR &= ~(3 << 13);  // reset CAN remap
-		AFIO->MAPR |= 3 << 13;     //   set CAN remap, use PD0, PD1
+		AFIO->MAPR |= 2 << 13;     //   set CAN remap, use PB8, PB9
 
-		GPIOD->CRL &= ~(0x0F << 0);
-		GPIOD->CRL |= (0x08 << 0);  // CAN RX pin PD.0 input push pull
-		GPIOD->CRL &= ~(0x0F << 4);
-		GPIOD->CRL |= (0x0B << 4);  // TX pin PD.1 AF output push pull
+		GPIOB->CRH &= ~(0x0F << 0);
+		GPIOB->CRH |= (0x08 << 0);  // CAN RX pin PB.8 input pull-up
+		GPIOB->ODR |= 1 << 8;
+		GPIOB->CRH &= ~(0x0F << 4);
+		GPIOB->CRH |= (0x0B << 4);  // TX pin PB.9 AF output push pull
 	} else if (CAN == CAN2) {
 		RCC->APB1ENR |= 1 << 26;  // enable clock for CAN2
 		RCC->APB2ENR |= 0x01;     // enable clock for Alternate Function
 		RCC->APB2ENR |= 1 << 3;   // enable clock for GPIO B
 
 		AFIO->MAPR &= ~(1 << 22);  // reset CAN remap
-		AFIO->MAPR |= 1 << 22;     //   set CAN remap, use PD0, PD1
+		AFIO->MAPR |= 1 << 22;     //   set CAN remap, use PB5, PB6
 
 		GPIOB->CRL &= ~(0x0F << 20);
 		GPIOB->CRL |= (0x08 << 20);  // CAN RX pin PB.5 input push pull
 		GPIOB->CRL &= ~(0x0F << 24);
 		GPIOB->CRL |= (0x0B << 24);  // TX pin PB.6 AF output push pull
 	}
-	CAN->MCR = 1;         // init mode
-	CAN->MCR = (1 << 4);  // no retransmission
-	CAN->IER = _mode;     // FIFO 0 msg pending
-	// CAN->IER =  1<<3;
+	can_init_mode(CAN, 1);  // BTR is only writable in init mode
+	CAN->MCR |= CAN_MCR_TXFP;
+	CAN->IER = _mode;       // FIFO 0 msg pending
 	CAN->MCR &= ~(1 << 3);  // overun fifo
 	CAN->BTR = 0x031C0009;  // bit-timing
-	CAN->MCR &= ~1;         // normal operating mode, reset INRQ
+	can_init_mode(CAN, 0);  // normal operating mode, reset INRQ
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief Set the bit rate from the live PCLK1, sample point at 87.5%.
+        The largest time quantum count from 16 down to 8 that divides PCLK1 exactly is
+        used, so i.e. 125k, 250k and 500k all work from an 8 MHz PCLK1.
+        @param[in] CAN      CAN1
+        @param[in] bitrate  bits per second
+        @return 1 on success, -1 when PCLK1 can't produce the rate or the bus never idles
+        @example   can_set_bitrate(CAN1, 500000);
+*/
+int
+can_set_bitrate(CAN_TypeDef *CAN, uint32_t bitrate)
+{
+	uint32_t pclk = clk_get_pclk1();
+
+	for (uint32_t tq = 16; tq >= 8; tq--) {
+		uint32_t brp = pclk / (bitrate * tq);
+		uint32_t ts2 = (tq + 4) / 8;
+		uint32_t ts1 = tq - 1 - ts2;
+
+		if (brp == 0 || brp > 1024 || brp * bitrate * tq != pclk)
+			continue;
+		if (can_init_mode(CAN, 1) < 0)
+			return -1;
+		CAN->BTR = (CAN->BTR & 0xC0000000) | ((ts2 - 1) << 20) | ((ts1 - 1) << 16) | (brp - 1);
+		return can_init_mode(CAN, 0);
+	}
+	return -1;
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief Switch between normal, loopback and silent loopback operation.
+        @param[in] CAN   CAN1
+        @param[in] mode  0, CAN_BTR_LBKM or CAN_BTR_LBKM | CAN_BTR_SILM
+        @return 1 on success, -1 if init mode can't be entered or left
+        @example   can_set_test_mode(CAN1, CAN_BTR_LBKM | CAN_BTR_SILM);  // bench without a bus
+*/
+int
+can_set_test_mode(CAN_TypeDef *CAN, uint32_t mode)
+{
+	if (can_init_mode(CAN, 1) < 0)
+		return -1;
+	CAN->BTR = (CAN->BTR & ~(CAN_BTR_LBKM | CAN_BTR_SILM)) | mode;
+	return can_init_mode(CAN, 0);
 }
 
 void
 CAN_wrMsg(CAN_TypeDef *CAN, CAN_msg *msg, int mailIndex)
 {
-	CAN->sTxMailBox[mailIndex].TIR = (unsigned int)(msg->id << 3) | 4;
+	if (msg->format == STANDARD_FORMAT)
+		CAN->sTxMailBox[mailIndex].TIR = (unsigned int)(msg->id << 21);
+	else
+		CAN->sTxMailBox[mailIndex].TIR = (unsigned int)(msg->id << 3) | 4;
 	if (msg->type == DATA_FRAME)  // DATA FRAME
 		CAN->sTxMailBox[mailIndex].TIR &= ~(1 << 1);
 	else  // REMOTE FRAME
@@ -70,8 +145,55 @@ CAN_wrMsg(CAN_TypeDef *CAN, CAN_msg *msg, int mailIndex)
 	     ((unsigned int)msg->data[5] << 8) | ((unsigned int)msg->data[4]));
 	CAN->sTxMailBox[mailIndex].TDTR &= ~0xf;  // Setup length
 	CAN->sTxMailBox[mailIndex].TDTR |= (msg->len & 0xf);
-	CAN->sTxMailBox[mailIndex].TIR |= 1;  // transmit message
+	CAN->sTxMailBox[mailIndex].TIR |= CAN_TIR_TXRQ;  // transmit message
 }
+
+/* Move queued frames into whichever mailboxes TSR reports empty */
+static void
+can_tx_pump(void)
+{
+	uint32_t tsr;
+
+	while (can_tx_tail != can_tx_head && ((tsr = CAN1->TSR) & CAN_TSR_TME_ALL)) {
+		CAN_wrMsg(CAN1, &can_tx_queue[can_tx_tail % CAN_TX_QUEUE_LEN], CAN_TSR_CODE(tsr));
+		can_tx_tail++;
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief Queue one frame on CAN1, never waits for a mailbox.
+        Frames go out in the order they were queued. The TX mailbox empty interrupt
+        refills the mailboxes, NVIC_USB_HP_CAN_TX_IRQ has to be enabled.
+        @param[in] msg  frame, copied
+        @return 1 when queued, -1 when the queue is full (counted in can_tx_dropped)
+        @example   can_send(&msg);
+*/
+int
+can_send(const CAN_msg *msg)
+{
+	int ret = 1;
+
+	CAN1->IER &= ~CAN_IER_TMEIE;  // the TX interrupt is the only other queue user
+	if ((uint16_t)(can_tx_head - can_tx_tail) >= CAN_TX_QUEUE_LEN) {
+		can_tx_dropped++;
+		ret = -1;
+	} else {
+		can_tx_queue[can_tx_head % CAN_TX_QUEUE_LEN] = *msg;
+		can_tx_head++;
+	}
+	can_tx_pump();
+	CAN1->IER |= CAN_IER_TMEIE;
+	return ret;
+}
+
+/* A mailbox finished, refill it from the queue */
+void
+USB_HP_CAN_TX_IRQHandler(void)
+{
+	CAN1->TSR = CAN_TSR_RQCP_ALL;  // write 1 to clear
+	can_tx_pump();
+}
+
 /** @brief CAN Transmit.
 
 Sends a dedicated Message
@@ -79,108 +201,253 @@ Sends a dedicated Message
 *Specify Message ID
 *Specify ID Type (EXTENDED \OR STANDARD)
 *Specify Frame Type (DATA_FRAME \OR REMOTE_FRAME)
-*Specify which Mailbox to send the Message
-*Send Message
+*Send Message in the first empty mailbox
 
     @param[in] CANx. i.e CAN1  @ref
     @param[in] id Message ID
     @param[in] ID Type (EXTENDED \OR STANDARD)
     @param[in] Frame Type (DATA_FRAME \OR REMOTE_FRAME)
-  @param[in] Mailbox to send the Message
-    @example   canInit(CAN1,INTERRUPT);
+    @return mailbox used, -1 when all three are still pending
+    @example   canTransmit(CAN1, 0x100, STANDARD_FORMAT, DATA_FRAME, data);
 
 */
-void
-canTransmit(CAN_TypeDef *CAN, int id, char idtype, char ftype, unsigned char *m, int _mailIndex)
+int
+canTransmit(CAN_TypeDef *CAN, int id, char idtype, char ftype, unsigned char *m)
 {
 	int i;
+	uint32_t tsr = CAN->TSR;
+
+	if (!(tsr & CAN_TSR_TME_ALL))
+		return -1;
 	CAN_TxMsg.id = id;  // initialise message to send
 	for (i = 0; i < 8; i++)
 		CAN_TxMsg.data[i] = m[i];
 	CAN_TxMsg.len = 8;
 	CAN_TxMsg.format = idtype;
 	CAN_TxMsg.type = ftype;
-	CAN_wrMsg(CAN, &CAN_TxMsg, _mailIndex);  // transmit message
+	CAN_wrMsg(CAN, &CAN_TxMsg, CAN_TSR_CODE(tsr));  // transmit message
+	return CAN_TSR_CODE(tsr);
 }
-// Initialise Filters
+/* Filter banks handed out so far, and per FIFO a list bank with its second ID slot free */
+static uint8_t can_filter_used;
+static int8_t can_filter_half[2] = {-1, -1};
+
+/* FR1/FR2 layout of an identifier in a 32-bit filter */
+static uint32_t
+can_filter_word(unsigned int id, unsigned char format)
+{
+	if (format == STANDARD_FORMAT)
+		return (uint32_t)id << 21;
+	return ((uint32_t)id << 3) | CAN_ID_IDE;
+}
+
+/* Program one 32-bit bank and switch it on, filters are only writable under FINIT */
+static void
+can_filter_set(int bank, uint32_t fr1, uint32_t fr2, int list, unsigned char fifo)
+{
+	CAN1->FMR |= CAN_FMR_FINIT;
+	CAN1->FA1R &= ~(1UL << bank);  // deactivate filter
+	CAN1->FS1R |= 1UL << bank;     // set 32-bit scale configuration
+	if (list)
+		CAN1->FM1R |= 1UL << bank;  // 2 32-bit identifier list mode
+	else
+		CAN1->FM1R &= ~(1UL << bank);  // identifier + mask mode
+	if (fifo == FIFO1)
+		CAN1->FFA1R |= 1UL << bank;
+	else
+		CAN1->FFA1R &= ~(1UL << bank);
+	CAN1->sFilterRegister[bank].FR1 = fr1;
+	CAN1->sFilterRegister[bank].FR2 = fr2;
+	CAN1->FA1R |= 1UL << bank;  // activate filter
+	CAN1->FMR &= ~CAN_FMR_FINIT;
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief Switch off every filter bank, nothing is received until filters are added.
+*/
 void
-CAN_wrFilter(CAN_TypeDef *CAN, unsigned int id, unsigned char format, unsigned char mess_type)
+can_filter_clear(void)
 {
-	static unsigned short CAN_filterIdx;
-	unsigned int CAN_msgId = 0;
-	if (CAN == CAN2) {
-		CAN_filterIdx = 14;
-		CAN1->FMR = (CAN1->FMR & 0xFFFF0000) | (CAN_filterIdx << 8) | 1;
-		CAN1->FMR &= ~1;
-	} else {
-		CAN_filterIdx = 0;
-	}
-	CAN1->FMR = 1;
-	if (CAN_filterIdx > 27) {  // check if Filter Memory is full
-		return;
-	}
-	// Setup identifier information
-	if (format == STANDARD_FORMAT) {                // Standard ID
-		CAN_msgId |= (unsigned int)(id << 21) | 0;  // CAN_ID_STD;
-	} else {                                        // Extended ID
-		CAN_msgId |= (unsigned int)(id << 3) | 4;   // CAN_ID_EXT;
-	}
-	if (mess_type == REMOTE_FRAME)
-		CAN_msgId |= 2;
+	CAN1->FMR |= CAN_FMR_FINIT;
+	CAN1->FA1R = 0;
+	CAN1->FMR &= ~CAN_FMR_FINIT;
+	can_filter_used = 0;
+	can_filter_half[0] = can_filter_half[1] = -1;
+}
 
-	CAN1->FA1R &= ~(unsigned int)(1 << CAN_filterIdx);  // deactivate filter
+/*---------------------------------------------------------------------------*/
+/** @brief Accept one exact data frame ID, two IDs share a list-mode bank.
+        @param[in] id      11 or 29 bit identifier
+        @param[in] format  STANDARD_FORMAT or EXTENDED_FORMAT
+        @param[in] fifo    FIFO0 or FIFO1
+        @return bank used, -1 when all CAN_FILTER_BANKS are taken
+        @example   can_filter_add_id(0x080, STANDARD_FORMAT, FIFO0);
+*/
+int
+can_filter_add_id(unsigned int id, unsigned char format, unsigned char fifo)
+{
+	uint32_t word = can_filter_word(id, format);
+	int half = fifo == FIFO1;
+	int bank = can_filter_half[half];
 
-	// initialize filter
-	CAN1->FS1R |= (unsigned int)(1 << CAN_filterIdx);  // set 32-bit scale configuration
-	CAN1->FM1R |= (unsigned int)(1 << CAN_filterIdx);  // set 2 32-bit identifier list mode
+	if (bank >= 0) {
+		can_filter_set(bank, CAN1->sFilterRegister[bank].FR1, word, 1, fifo);
+		can_filter_half[half] = -1;
+		return bank;
+	}
+	if (can_filter_used >= CAN_FILTER_BANKS)
+		return -1;
+	bank = can_filter_used++;
+	can_filter_set(bank, word, word, 1, fifo);  // second slot repeats the ID until used
+	can_filter_half[half] = bank;
+	return bank;
+}
 
-	CAN1->sFilterRegister[CAN_filterIdx].FR1 = CAN_msgId;  //  32-bit identifier
-	CAN1->sFilterRegister[CAN_filterIdx].FR2 = CAN_msgId;  //  32-bit identifier
+/*---------------------------------------------------------------------------*/
+/** @brief Accept every data frame whose ID matches id in the bits set in mask.
+        @param[in] id      11 or 29 bit identifier
+        @param[in] mask    1 bits must match, 0 bits are don't care
+        @param[in] format  STANDARD_FORMAT or EXTENDED_FORMAT, always compared
+        @param[in] fifo    FIFO0 or FIFO1
+        @return bank used, -1 when all CAN_FILTER_BANKS are taken
+        @example   can_filter_add_mask(0x100, 0x700, STANDARD_FORMAT, FIFO1);  // 0x100..0x1FF
+*/
+int
+can_filter_add_mask(unsigned int id, unsigned int mask, unsigned char format, unsigned char fifo)
+{
+	int bank;
 
-	CAN1->FFA1R &= ~(unsigned int)(1 << CAN_filterIdx);  // assign filter to FIFO 0
-	CAN1->FA1R |= (unsigned int)(1 << CAN_filterIdx);    // activate filter
+	if (can_filter_used >= CAN_FILTER_BANKS)
+		return -1;
+	bank = can_filter_used++;
+	can_filter_set(bank, can_filter_word(id, format),
+	               can_filter_word(mask, format) | CAN_ID_IDE | CAN_ID_RTR, 0, fifo);
+	return bank;
+}
 
-	CAN_filterIdx += 1;  // increase filter index
-	CAN1->RF0R = RELEASE;
+// Initialise Filters
+void
+CAN_wrFilter(CAN_TypeDef *CAN, unsigned int id, unsigned char format, unsigned char mess_type)
+{
+	if (mess_type == REMOTE_FRAME) {  // list entries only match data frames, mask the RTR bit in
+		if (can_filter_used < CAN_FILTER_BANKS) {
+			uint32_t word = can_filter_word(id, format) | CAN_ID_RTR;
+
+			can_filter_set(can_filter_used++, word, word, 1, FIFO0);
+		}
+		return;
+	}
+	can_filter_add_id(id, format, FIFO0);
 }
 void
 filtersInit(CAN_TypeDef *CAN, int _id)
 {
-	CAN1->FMR = 1;                                       // init mode for filters
 	CAN_wrFilter(CAN, _id, EXTENDED_FORMAT, DATA_FRAME); /* Enable reception of messages */
-	CAN1->FMR &= ~1;  // reset Initialisation mode for filter banks
-	                  /* leave init mode */
 }
 /*----------------------------------------------------------------------------
 CAN Receive code
  *----------------------------------------------------------------------------*/
 
+/** @brief Copy the oldest frame out of a receive FIFO and release it.
+        @param[in] CAN        CAN1
+        @param[out] msg       received frame
+        @param[in] fifoIndex  FIFO0 or FIFO1, must hold a frame
+*/
 void
 canRead(CAN_TypeDef *CAN, CAN_msg *msg, int fifoIndex)
 {
-	if ((CAN->sFIFOMailBox[fifoIndex].RIR & 0x4) == 0) {  // CAN_ID_EXT) == 0) { // Standard ID
+	CAN_FIFOMailBox_TypeDef *mb = &CAN->sFIFOMailBox[fifoIndex];
+	uint32_t rir = mb->RIR, rdtr = mb->RDTR, rdlr = mb->RDLR, rdhr = mb->RDHR;
+
+	if (fifoIndex == FIFO0)
+		CAN->RF0R = RELEASE;
+	else
+		CAN->RF1R = RELEASE;
+
+	if ((rir & CAN_ID_IDE) == 0) {  // Standard ID
 		msg->format = STANDARD_FORMAT;
-		msg->id = (unsigned int)0x000007FF & (CAN->sFIFOMailBox[fifoIndex].RIR >> 21);
+		msg->id = 0x000007FF & (rir >> 21);
 	} else {  // Extended ID
 		msg->format = EXTENDED_FORMAT;
-		msg->id = (unsigned int)0x1FFFFFFF & ((CAN->sFIFOMailBox[fifoIndex].RIR >> 3));
+		msg->id = 0x1FFFFFFF & (rir >> 3);
 	}
-	// Read type information
-	if ((CAN->sFIFOMailBox[fifoIndex].RIR & 0x2) == 0) {  // CAN_RTR_REMOTE) == 0) {
-		msg->type = DATA_FRAME;                           // DATA   FRAME
-	} else {
-		msg->type = REMOTE_FRAME;  // REMOTE FRAME
+	msg->type = (rir & CAN_ID_RTR) ? REMOTE_FRAME : DATA_FRAME;
+	msg->len = rdtr & 0x0F;         // Read length (number of received bytes)
+	msg->filter = (rdtr >> 8) & 0xFF;
+	for (int i = 0; i < 4; i++) {  // Read data bytes
+		msg->data[i] = rdlr >> (8 * i);
+		msg->data[4 + i] = rdhr >> (8 * i);
 	}
-	// Read length (number of received bytes)
-	msg->len = (unsigned char)0x0000000F & CAN->sFIFOMailBox[fifoIndex].RDTR;
-	// Read data bytes
-	msg->data[0] = (unsigned int)0x000000FF & (CAN->sFIFOMailBox[fifoIndex].RDLR);
-	msg->data[1] = (unsigned int)0x000000FF & (CAN->sFIFOMailBox[fifoIndex].RDLR >> 8);
-	msg->data[2] = (unsigned int)0x000000FF & (CAN->sFIFOMailBox[fifoIndex].RDLR >> 16);
-	msg->data[3] = (unsigned int)0x000000FF & (CAN->sFIFOMailBox[fifoIndex].RDLR >> 24);
-
-	msg->data[4] = (unsigned int)0x000000FF & (CAN->sFIFOMailBox[fifoIndex].RDHR);
-	msg->data[5] = (unsigned int)0x000000FF & (CAN->sFIFOMailBox[fifoIndex].RDHR >> 8);
-	msg->data[6] = (unsigned int)0x000000FF & (CAN->sFIFOMailBox[fifoIndex].RDHR >> 16);
-	msg->data[7] = (unsigned int)0x000000FF & (CAN->sFIFOMailBox[fifoIndex].RDHR >> 24);
+}
+
+/* Frames moved out of the hardware FIFOs by the RX interrupts, read with can_receive() */
+static CAN_msg can_rx_queue[CAN_RX_QUEUE_LEN];
+static volatile uint16_t can_rx_head, can_rx_tail;
+volatile uint32_t can_rx_overruns;
+
+/* Empty one hardware FIFO into the RX queue. Both RX interrupts produce into the queue,
+ * so they have to stay at the same priority and never preempt each other. */
+static void
+can_rx_drain(int fifo)
+{
+	__IO uint32_t *rfr = fifo == FIFO0 ? &CAN1->RF0R : &CAN1->RF1R;
+
+	if (*rfr & CAN_RFR_FOVR) {
+		*rfr = CAN_RFR_FOVR;  // write 1 to clear
+		can_rx_overruns++;
+	}
+	while (*rfr & CAN_RFR_FMP) {
+		uint16_t head = can_rx_head;
+
+		if ((uint16_t)(head - can_rx_tail) >= CAN_RX_QUEUE_LEN) {
+			*rfr = RELEASE;  // no room, drop it in place
+			can_rx_overruns++;
+			continue;
+		}
+		canRead(CAN1, &can_rx_queue[head % CAN_RX_QUEUE_LEN], fifo);
+		__asm volatile("" ::: "memory");  // frame copied before it is published
+		can_rx_head = head + 1;
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief Receive both FIFOs by interrupt.
+        NVIC_USB_LP_CAN_RX0_IRQ and NVIC_CAN_RX1_IRQ have to be enabled as well.
+        @example   can_rx_init(); can_filter_add_id(0x080, STANDARD_FORMAT, FIFO0);
+*/
+void
+can_rx_init(void)
+{
+	CAN1->IER |= CAN_IER_FMPIE0 | CAN_IER_FOVIE0 | CAN_IER_FMPIE1 | CAN_IER_FOVIE1;
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief Take the oldest received frame, never waits.
+        @param[out] msg  frame, written only when 1 is returned
+        @return 1 when a frame was read, 0 when none is waiting
+*/
+int
+can_receive(CAN_msg *msg)
+{
+	uint16_t tail = can_rx_tail;
+
+	if (tail == can_rx_head)
+		return 0;
+	__asm volatile("" ::: "memory");
+	*msg = can_rx_queue[tail % CAN_RX_QUEUE_LEN];
+	__asm volatile("" ::: "memory");  // frame copied before the slot is given back
+	can_rx_tail = tail + 1;
+	return 1;
+}
+
+void
+USB_LP_CAN_RX0_IRQHandler(void)
+{
+	can_rx_drain(FIFO0);
+}
+
+void
+CAN_RX1_IRQHandler(void)
+{
+	can_rx_drain(FIFO1);
 }
@@ -0,0 +1,197 @@
+#include "clk.h"
+
+#define RCC_CFGR_SWS(cfgr) (((cfgr) >> 2) & 0x3)
+#define RCC_CFGR_HPRE(cfgr) (((cfgr) >> 4) & 0xF)
+#define RCC_CFGR_PPRE1(cfgr) (((cfgr) >> 8) & 0x7)
+#define RCC_CFGR_PPRE2(cfgr) (((cfgr) >> 11) & 0x7)
+#define RCC_CFGR_PLLSRC (1 << 16)
+#define RCC_CFGR_PLLXTPRE (1 << 17)
+#define RCC_CFGR_PLLMUL(cfgr) (((cfgr) >> 18) & 0xF)
+
+/*---------------------------------------------------------------------------*/
+/** @brief Run the core at 72 MHz from the crystal through the PLL.
+        HSE x CLK_PLL_MUL with two flash wait states and the prefetch buffer, AHB /1,
+        APB1 /2 to stay within 36 MHz, APB2 /1 and the ADC at PCLK2 / 6. If the crystal does
+        not start the PLL runs from HSI / 2 x 16 instead, 64 MHz.
+        HSI stays on either way, flash program and erase need it.
+        Call first in main(): the drivers read the bus clocks when they are initialised,
+        millisInit(), I2CInit(), usartInit() and can_set_bitrate() included.
+        @return 1 on HSE, -1 when it fell back to HSI
+        @example   clk_init();
+                   millisInit();
+*/
+int
+clk_init(void)
+{
+	uint32_t cfgr, loops = 0;
+	int ret = 1;
+
+	RCC->CR |= RCC_CR_HSEON;
+	while (!(RCC->CR & RCC_CR_HSERDY)) {
+		SIM_SYNC();
+		if (++loops > CLK_HSE_STARTUP_LOOPS) {
+			RCC->CR &= ~RCC_CR_HSEON;
+			ret = -1;
+			break;
+		}
+	}
+
+	/* Wait states before the clock goes up, the other way round on the way down */
+	FLASH->ACR = FLASH_ACR_PRFTBE | FLASH_ACR_LATENCY_2;
+
+	RCC->CFGR &= ~RCC_CFGR_SW_MASK;  // back on HSI while the PLL is reprogrammed
+	while (RCC_CFGR_SWS(RCC->CFGR) != 0)
+		SIM_SYNC();
+	RCC->CR &= ~RCC_CR_PLLON;
+	while (RCC->CR & RCC_CR_PLLRDY)
+		SIM_SYNC();
+
+	cfgr = RCC_CFGR_PPRE1_DIV2 | RCC_CFGR_ADCPRE_DIV6;
+	if (ret > 0)
+		cfgr |= RCC_CFGR_PLLSRC | (CLK_PLL_MUL - 2) << 18;
+	else
+		cfgr |= (16 - 2) << 18;
+	RCC->CFGR = cfgr;
+	RCC->CR |= RCC_CR_PLLON;
+	while (!(RCC->CR & RCC_CR_PLLRDY))
+		SIM_SYNC();
+	RCC->CFGR = cfgr | RCC_CFGR_SW_PLL;
+	while (RCC_CFGR_SWS(RCC->CFGR) != RCC_CFGR_SW_PLL)
+		SIM_SYNC();
+
+	__clk = clk_get_hclk() / 1000000;
+	return ret;
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief STOP mode until an EXTI line fires, then back to full speed.
+        Every clock stops, SRAM and the registers are kept, about 25 uA with the regulator
+        in low-power mode. Call it with interrupts masked (irq_save()), after the check that
+        there is nothing to do: a wake-up edge in between keeps it from sleeping, and its
+        handler runs once the caller unmasks, on the restored clock.
+        Only EXTI wakes the core from here, the MPU INT pin included, USART1 RX does not.
+        SysTick stops too, so millis() and micros() miss the time spent in STOP, and a DMA
+        transfer still running would freeze halfway.
+        @return clk_init() result, the core wakes up on HSI
+        @example   primask = irq_save(); if (nothing pending) clk_stop(); irq_restore(primask);
+*/
+int
+clk_stop(void)
+{
+	RCC->APB1ENR |= RCC_APB1ENR_PWREN;
+	PWR_CR = (PWR_CR & ~PWR_CR_PDDS) | PWR_CR_LPDS | PWR_CR_CWUF;
+	SCB_SCR |= SCB_SCR_SLEEPDEEP;
+	cpu_wfi();
+	SCB_SCR &= ~SCB_SCR_SLEEPDEEP;  // plain WFI sleeps again from here on
+	return clk_init();
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief Legacy entry point, same as clk_init(). */
+void
+initClk()
+{
+	clk_init();
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief Busy-wait, for before millisInit(). Afterwards delay_us() is exact.
+        The loop is about 5 cycles per pass at __clk MHz, flash wait states make it a little
+        longer, never shorter.
+*/
+void
+delayus(unsigned long __t)
+{
+	unsigned long __l = __t * __clk / 5;
+	unsigned long __i = 0;
+	while (__i < __l) {
+		__asm volatile("nop");
+		__i++;
+	}
+}
+void
+delayms(unsigned long __t)
+{
+	while (__t--)
+		delayus(1000);
+}
+
+/** @brief Get the system clock.
+        @return SYSCLK in Hz, from the clock source selected in RCC->CFGR
+        @example   uint32_t f = clk_get_sysclk();
+*/
+uint32_t
+clk_get_sysclk(void)
+{
+	uint32_t cfgr = RCC->CFGR;
+	uint32_t mul, in;
+
+	switch (RCC_CFGR_SWS(cfgr)) {
+	case 1:
+		return HSE_VALUE;
+	case 2:
+		mul = RCC_CFGR_PLLMUL(cfgr) + 2;
+		if (mul > 16)
+			mul = 16;
+		if (!(cfgr & RCC_CFGR_PLLSRC))
+			in = HSI_VALUE / 2;
+		else if (cfgr & RCC_CFGR_PLLXTPRE)
+			in = HSE_VALUE / 2;
+		else
+			in = HSE_VALUE;
+		return in * mul;
+	default:
+		return HSI_VALUE;
+	}
+}
+
+/** @brief Get the AHB clock.
+        @return HCLK in Hz
+        @example   uint32_t f = clk_get_hclk();
+*/
+uint32_t
+clk_get_hclk(void)
+{
+	static const uint8_t ahb_shift[16] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 2, 3, 4, 6, 7, 8, 9};
+
+	return clk_get_sysclk() >> ahb_shift[RCC_CFGR_HPRE(RCC->CFGR)];
+}
+
+/* APB prescaler field: 0xx = /1, 100 = /2, 101 = /4, 110 = /8, 111 = /16 */
+static uint32_t
+apb_clock(uint32_t ppre)
+{
+	return ppre < 4 ? clk_get_hclk() : clk_get_hclk() >> (ppre - 3);
+}
+
+/** @brief Get the APB1 clock (I2C, USART2/3, CAN, TIM2-4).
+        @return PCLK1 in Hz
+        @example   uint32_t f = clk_get_pclk1();
+*/
+uint32_t
+clk_get_pclk1(void)
+{
+	return apb_clock(RCC_CFGR_PPRE1(RCC->CFGR));
+}
+
+/** @brief Get the APB2 clock (USART1, SPI1, GPIO, AFIO).
+        @return PCLK2 in Hz
+        @example   uint32_t f = clk_get_pclk2();
+*/
+uint32_t
+clk_get_pclk2(void)
+{
+	return apb_clock(RCC_CFGR_PPRE2(RCC->CFGR));
+}
+
+/** @brief Get the clock of TIM2-TIM7, twice PCLK1 when APB1 is divided.
+        @return timer kernel clock in Hz, 72 MHz after clk_init()
+        @example   timerInit(TIM2, clk_get_timclk1() / 1000000);  // 1 us ticks
+*/
+uint32_t
+clk_get_timclk1(void)
+{
+	uint32_t pclk1 = clk_get_pclk1();
+
+	return RCC_CFGR_PPRE1(RCC->CFGR) < 4 ? pclk1 : 2 * pclk1;
+}
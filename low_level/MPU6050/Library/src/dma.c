@@ -189,6 +189,7 @@ void
 dma_enable_channel(u32 dma, u8 channel)
 {
 	DMA_CCR(dma, channel) |= DMA_CCR_EN;
+	SIM_WRITE(DMA_CCR(dma, channel));
 }
 /** @brief Disable DMA channel.
         @param[in] DMA i.e DMA1
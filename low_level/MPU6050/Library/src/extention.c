@@ -10,11 +10,7 @@
 void
 extentionWrite(unsigned char adrs, unsigned char reg, unsigned char value)
 {
-	I2C_Start(I2C2);       // see I2C_CR1 for code
-	I2C_Addr(I2C2, adrs);  // see I2C_DR for code
-	I2C_Write(I2C2, reg);
-	I2C_Write(I2C2, value);
-	I2C_Stop(I2C2);
+	i2c_write_regs(I2C2, adrs, reg, &value, 1);
 }
 /*---------------------------------------------------------------------------*/
 /** @brief I2C initialization.
@@ -26,13 +22,9 @@ extentionWrite(unsigned char adrs, unsigned char reg, unsigned char value)
 int
 extentionRead(unsigned char adrs, unsigned char reg)
 {
-	int r;
-	I2C_Start(I2C2);       // see I2C_CR1 for code
-	I2C_Addr(I2C2, adrs);  // see I2C_DR for code
-	I2C_Write(I2C2, reg);
-	I2C_Start(I2C2);           // see I2C_CR1 for code
-	I2C_Addr(I2C2, adrs | 1);  // see I2C_DR for code
-	r = I2C_Read(I2C2, NOACKNOWLEDGE);
-	I2C_Stop(I2C2);
+	uint8_t r;
+
+	if (i2c_read_regs(I2C2, adrs, reg, &r, 1) < 0)
+		return -1;
 	return r;
 }
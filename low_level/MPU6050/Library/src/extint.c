@@ -1,4 +1,14 @@
 #include "extint.h"
+#include "nvic.h"
+
+/* NVIC interrupt of EXTI line 0..15, lines 5-9 and 10-15 share one */
+static u8
+EXTI_Irq(char interrupt_number)
+{
+	if (interrupt_number < 5)
+		return NVIC_EXTI0_IRQ + interrupt_number;
+	return interrupt_number < 10 ? NVIC_EXTI9_5_IRQ : NVIC_EXTI15_10_IRQ;
+}
 /*---------------------------------------------------------------------------*/
 /** @brief External Interrupt Pin Enable.
 
@@ -11,7 +21,8 @@ void
 EXTInterruptPinEnable(char interrupt_number, char pin)
 {
 	RCC->APB2ENR |= (1) | (1 << (pin + 2));
-	AFIO->EXTICR[(interrupt_number / 4)] |= (pin << (interrupt_number % 4));
+	AFIO->EXTICR[(interrupt_number / 4)] &= ~(0xF << ((interrupt_number % 4) * 4));
+	AFIO->EXTICR[(interrupt_number / 4)] |= (pin << ((interrupt_number % 4) * 4));
 }
 /** @brief External Interrupt Enable.
 
@@ -29,13 +40,8 @@ EXTInterruptEnable(char interrupt_number, char rising, char failing)
 	EXTI->RTSR |= (rising << interrupt_number);
 	EXTI->FTSR |= (failing << interrupt_number);
 
-	if (interrupt_number < 5) {
-		NVIC->ISER[0] |= (1 << (6 + interrupt_number));
-	} else if (interrupt_number > 4 && interrupt_number < 10) {
-		NVIC->ISER[0] |= 1 << 23;
-	} else if (interrupt_number > 10 && interrupt_number < 16) {
-		NVIC->ISER[1] |= 1 << 8;
-	}
+	if (interrupt_number < 16)
+		nvic_enable_irq(EXTI_Irq(interrupt_number));
 }
 /** @brief External Interrupt Disable.
 
@@ -50,24 +56,22 @@ EXTInterruptDisable(char interrupt_number)
 	EXTI->RTSR &= ~(1 << interrupt_number);
 	EXTI->FTSR &= ~(1 << interrupt_number);
 
-	if (interrupt_number < 5) {
-		NVIC->ISER[0] &= ~(1 << (6 + interrupt_number));
-	} else if (interrupt_number > 4 && interrupt_number < 10) {
-		NVIC->ISER[0] &= ~(1 << 23);
-	} else if (interrupt_number > 10 && interrupt_number < 16) {
-		NVIC->ISER[1] &= ~(1 << 8);
-	}
+	if (interrupt_number < 16)
+		nvic_disable_irq(EXTI_Irq(interrupt_number));  // shared 5-9 / 10-15 vectors too
 }
 
 /** @brief Reset External Interrupt.
 
 This reset external interrupt from 0 to 15.
+PR is write-1-to-clear, so only the requested line is written to avoid
+acknowledging other pending lines.
 
 @param[in] interrupt_number char. External interrupt number values 0-15\
 */
 void
 resetExternalInterrupt(char interrupt_number)
 {
-	EXTI->PR |= (1 << interrupt_number);
+	EXTI->PR = (1 << interrupt_number);
+	SIM_WRITE(EXTI->PR);
 	EXTI->IMR |= (1 << interrupt_number);
 }
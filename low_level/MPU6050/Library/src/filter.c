@@ -0,0 +1,74 @@
+#include "filter.h"
+
+/* Rounded sum / n, symmetric around zero */
+static int16_t
+div_round(int32_t sum, int32_t n)
+{
+	return (int16_t)(sum >= 0 ? (sum + n / 2) / n : (sum - n / 2) / n);
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief Set the decimation ratio and start an empty window.
+        @param[out] d     decimator state
+        @param[in] ratio  1..DECIM_MAX_RATIO, 1 passes every sample through
+        @return 1 on success, -1 when ratio is out of range
+        @example   decim_init(&decim, 10);  // 1 kHz in, 100 Hz out
+*/
+int
+decim_init(decim_t *d, uint16_t ratio)
+{
+	if (ratio == 0 || ratio > DECIM_MAX_RATIO)
+		return -1;
+	d->ratio = ratio;
+	decim_reset(d);
+	return 1;
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief Drop the partial window, i.e. after the sensor scaling changed.
+        @param[in,out] d  decimator state
+*/
+void
+decim_reset(decim_t *d)
+{
+	for (int i = 0; i < 10; i++)
+		d->acc[i] = 0;
+	d->count = 0;
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief Add one sample, produce the window average every ratio samples.
+        @param[in,out] d     decimator state
+        @param[in] in        input sample
+        @param[in] timestamp input sample time in microseconds
+        @param[out] out      averaged sample, written only when 1 is returned
+        @param[out] out_time middle of the averaged window
+        @return 1 when out holds a new sample, 0 otherwise
+*/
+int
+decim_push(decim_t *d, const mpu_raw_t *in, uint32_t timestamp, mpu_raw_t *out,
+           uint32_t *out_time)
+{
+	int i;
+
+	if (d->count == 0)
+		d->t_first = timestamp;
+	for (i = 0; i < 3; i++) {
+		d->acc[i] += in->accel[i];
+		d->acc[4 + i] += in->gyro[i];
+		d->acc[7 + i] += in->mag[i];
+	}
+	d->acc[3] += in->temp;
+	if (++d->count < d->ratio)
+		return 0;
+
+	for (i = 0; i < 3; i++) {
+		out->accel[i] = div_round(d->acc[i], d->ratio);
+		out->gyro[i] = div_round(d->acc[4 + i], d->ratio);
+		out->mag[i] = div_round(d->acc[7 + i], d->ratio);
+	}
+	out->temp = div_round(d->acc[3], d->ratio);
+	*out_time = d->t_first + (timestamp - d->t_first) / 2;
+	decim_reset(d);
+	return 1;
+}
@@ -0,0 +1,89 @@
+#include "flash.h"
+#include "timer.h"
+
+static void
+flash_unlock(void)
+{
+	if (FLASH->CR & FLASH_CTRL_LOCK) {
+		FLASH->KEYR = FLASH_UNLOCK_KEY1;
+		FLASH->KEYR = FLASH_UNLOCK_KEY2;
+	}
+}
+
+static void
+flash_lock(void)
+{
+	FLASH->CR |= FLASH_CTRL_LOCK;
+}
+
+/* Wait for the running erase or program and collect its error flags */
+static int
+flash_wait(uint32_t timeout_us)
+{
+	uint32_t deadline = deadline_us(timeout_us);
+	uint32_t sr;
+
+	while (FLASH->SR & FLASH_STAT_BSY) {
+		if (deadline_expired(deadline))
+			return -1;
+	}
+	sr = FLASH->SR;
+	FLASH->SR = FLASH_STAT_PGERR | FLASH_STAT_WRPRTERR | FLASH_STAT_EOP;  // write 1 to clear
+	return (sr & (FLASH_STAT_PGERR | FLASH_STAT_WRPRTERR)) ? -1 : 1;
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief Erase one 1 KB page to 0xFF.
+        The CPU stalls on any flash fetch meanwhile, so interrupts run late by up to
+        the erase time unless their handlers sit in RAM.
+        @param[in] addr  any address inside the page
+        @return 1 on success, -1 on timeout or a protected page
+*/
+int
+flash_erase_page(uint32_t addr)
+{
+	int ret;
+
+	flash_unlock();
+	FLASH->CR |= FLASH_CTRL_PER;
+	FLASH->AR = addr;
+	FLASH->CR |= FLASH_CTRL_STRT;
+	ret = flash_wait(FLASH_ERASE_TIMEOUT_US);
+	FLASH->CR &= ~FLASH_CTRL_PER;
+	flash_lock();
+	return ret;
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief Program erased flash one half-word at a time and read it back.
+        @param[in] addr  half-word aligned destination, erased beforehand
+        @param[in] data  source, half-word aligned
+        @param[in] len   bytes, an odd last byte is programmed with 0xFF above it
+        @return 1 on success, -1 if a half-word failed or doesn't read back
+        @example   flash_erase_page(FLASH_SETTINGS_PAGE);
+                   flash_program(FLASH_SETTINGS_PAGE, &rec, sizeof(rec));
+*/
+int
+flash_program(uint32_t addr, const void *data, uint16_t len)
+{
+	const uint16_t *src = data;
+	volatile uint16_t *dst = (volatile uint16_t *)addr;
+	uint16_t half;
+	int ret = 1;
+
+	flash_unlock();
+	FLASH->CR |= FLASH_CTRL_PG;
+	for (uint16_t i = 0; i < (len + 1) / 2 && ret > 0; i++) {
+		if (2 * i + 1 < len)
+			half = src[i];
+		else  // the last byte alone, never read past the caller's object
+			half = 0xFF00 | ((const uint8_t *)data)[2 * i];
+		dst[i] = half;
+		ret = flash_wait(FLASH_PROGRAM_TIMEOUT_US);
+		if (ret > 0 && dst[i] != half)
+			ret = -1;
+	}
+	FLASH->CR &= ~FLASH_CTRL_PG;
+	flash_lock();
+	return ret;
+}
@@ -0,0 +1,180 @@
+#include "fusion.h"
+
+/* Gyro LSB in rad/s as Q24, for FS_SEL 0..3 (131, 65.5, 32.8, 16.4 LSB per deg/s) */
+static const int32_t gyro_rad_q24[4] = {2235, 4470, 8927, 17855};
+
+/* atan(2^-i) in degrees, Q16 */
+static const int32_t cordic_atan_q16[16] = {
+	2949120, 1740967, 919879, 466945, 234379, 117304, 58666, 29335,
+	14668,   7334,    3667,   1833,   917,    458,    229,    115,
+};
+
+/* Q30 product, one SMULL on the M3 */
+static inline int32_t
+q30_mul(int32_t a, int32_t b)
+{
+	return (int32_t)(((int64_t)a * b) >> 30);
+}
+
+static uint32_t
+isqrt32(uint32_t v)
+{
+	uint32_t root = 0, bit = 1UL << 30;
+
+	while (bit > v)
+		bit >>= 2;
+	while (bit) {
+		if (v >= root + bit) {
+			v -= root + bit;
+			root = (root >> 1) + bit;
+		} else {
+			root >>= 1;
+		}
+		bit >>= 2;
+	}
+	return root;
+}
+
+/* atan2(y, x) in hundredths of a degree by CORDIC vectoring, inputs up to Q30 */
+static int32_t
+atan2_cdeg(int32_t y, int32_t x)
+{
+	int32_t angle = 0, t;
+
+	x >>= 2;  // headroom for the CORDIC gain of 1.65
+	y >>= 2;
+	if (x < 0) {  // rotate into the right half plane first
+		angle = y >= 0 ? 180L << 16 : -(180L << 16);
+		x = -x;
+		y = -y;
+	}
+	for (int i = 0; i < 16; i++) {
+		t = x;
+		if (y > 0) {
+			x += y >> i;
+			y -= t >> i;
+			angle += cordic_atan_q16[i];
+		} else {
+			x -= y >> i;
+			y += t >> i;
+			angle -= cordic_atan_q16[i];
+		}
+	}
+	return (int32_t)(((int64_t)angle * 100 + 0x8000) >> 16);
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief Start from level, zero bias.
+        @param[out] f  filter state
+*/
+void
+fusion_init(fusion_t *f)
+{
+	f->q[0] = FUSION_ONE;
+	f->q[1] = f->q[2] = f->q[3] = 0;
+	f->bias[0] = f->bias[1] = f->bias[2] = 0;
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief Advance the attitude by one sample.
+        @param[in,out] f  filter state
+        @param[in] raw    decoded sample, sensor LSBs
+        @param[in] gyro_fs FS_SEL the gyro was read with
+        @param[in] dt_us  time since the previous sample, 0 skips the gyro step
+        @example   fusion_update(&att, &raw, mpu_config()->gyro_fs, t - last_t);
+*/
+void
+fusion_update(fusion_t *f, const mpu_raw_t *raw, uint8_t gyro_fs, uint32_t dt_us)
+{
+	int32_t q0 = f->q[0], q1 = f->q[1], q2 = f->q[2], q3 = f->q[3];
+	int32_t g[3], h[3], a[3], v[3], e[3];
+	uint32_t half_dt, norm;
+	int i;
+
+	if (dt_us > 1000000)
+		dt_us = 1000000;  // a stall longer than a second is not worth integrating
+	half_dt = (uint32_t)(((uint64_t)dt_us << 31) / 1000000);  // dt / 2 in seconds, Q32
+	for (i = 0; i < 3; i++)
+		g[i] = raw->gyro[i] * gyro_rad_q24[gyro_fs & 3];  // Q24 rad/s
+
+	norm = isqrt32((uint32_t)(raw->accel[0] * raw->accel[0]) +
+	               (uint32_t)(raw->accel[1] * raw->accel[1]) +
+	               (uint32_t)(raw->accel[2] * raw->accel[2]));
+	if (norm) {  // free fall gives no gravity reference
+		for (i = 0; i < 3; i++)
+			a[i] = raw->accel[i] * 32768 / (int32_t)norm * 32768;  // unit vector, Q30
+
+		// Gravity as the current attitude sees it, in the sensor frame
+		v[0] = 2 * (q30_mul(q1, q3) - q30_mul(q0, q2));
+		v[1] = 2 * (q30_mul(q0, q1) + q30_mul(q2, q3));
+		v[2] = q30_mul(q0, q0) - q30_mul(q1, q1) - q30_mul(q2, q2) + q30_mul(q3, q3);
+
+		// Its misalignment with the measured gravity, a x v
+		e[0] = q30_mul(a[1], v[2]) - q30_mul(a[2], v[1]);
+		e[1] = q30_mul(a[2], v[0]) - q30_mul(a[0], v[2]);
+		e[2] = q30_mul(a[0], v[1]) - q30_mul(a[1], v[0]);
+
+		for (i = 0; i < 3; i++) {
+			int32_t ki = (int32_t)(((int64_t)e[i] * FUSION_KI_Q16) >> 22);  // Q24 rad/s
+
+			f->bias[i] += (int32_t)(((int64_t)ki * half_dt) >> 31);
+			g[i] += (int32_t)(((int64_t)e[i] * FUSION_KP_Q16) >> 22) + f->bias[i];
+		}
+	}
+
+	// q += q * (0, g) * dt / 2
+	for (i = 0; i < 3; i++)
+		h[i] = (int32_t)(((int64_t)g[i] * half_dt) >> 26);  // Q30 half angle
+	f->q[0] = q0 - q30_mul(q1, h[0]) - q30_mul(q2, h[1]) - q30_mul(q3, h[2]);
+	f->q[1] = q1 + q30_mul(q0, h[0]) + q30_mul(q2, h[2]) - q30_mul(q3, h[1]);
+	f->q[2] = q2 + q30_mul(q0, h[1]) - q30_mul(q1, h[2]) + q30_mul(q3, h[0]);
+	f->q[3] = q3 + q30_mul(q0, h[2]) + q30_mul(q1, h[1]) - q30_mul(q2, h[0]);
+
+	// The norm only drifts a little per step, one Newton step of 1/sqrt around 1 holds it
+	norm = 0;
+	for (i = 0; i < 4; i++)
+		norm += q30_mul(f->q[i], f->q[i]);
+	norm = (3 * (uint32_t)FUSION_ONE - norm) >> 1;
+	for (i = 0; i < 4; i++)
+		f->q[i] = q30_mul(f->q[i], (int32_t)norm);
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief Quaternion as four Q14 words, w x y z, for the attitude telemetry frame.
+        @param[in] f   filter state
+        @param[out] q  4 values, 16384 = 1.0
+*/
+void
+fusion_quat_q14(const fusion_t *f, int16_t *q)
+{
+	for (int i = 0; i < 4; i++) {
+		int32_t v = (f->q[i] + 0x8000) >> 16;
+
+		q[i] = v > 32767 ? 32767 : v;  // only w = 1.0 exactly rounds past the top
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief Roll, pitch and yaw in hundredths of a degree, aerospace order.
+        @param[in] f     filter state
+        @param[out] rpy  3 values, -18000..18000 (pitch -9000..9000)
+*/
+void
+fusion_euler_cdeg(const fusion_t *f, int32_t *rpy)
+{
+	int32_t q0 = f->q[0], q1 = f->q[1], q2 = f->q[2], q3 = f->q[3];
+	int32_t s = 2 * (q30_mul(q0, q2) - q30_mul(q3, q1));  // sin(pitch)
+	uint32_t c2;
+
+	if (s > FUSION_ONE)
+		s = FUSION_ONE;
+	else if (s < -FUSION_ONE)
+		s = -FUSION_ONE;
+	c2 = (uint32_t)(FUSION_ONE - q30_mul(s, s));  // cos^2, Q30
+
+	rpy[0] = atan2_cdeg(2 * (q30_mul(q0, q1) + q30_mul(q2, q3)),
+	                    FUSION_ONE - 2 * (q30_mul(q1, q1) + q30_mul(q2, q2)));
+	rpy[1] = atan2_cdeg(s, (int32_t)(isqrt32(c2) << 15));
+	rpy[2] = atan2_cdeg(2 * (q30_mul(q0, q3) + q30_mul(q1, q2)),
+	                    FUSION_ONE - 2 * (q30_mul(q2, q2) + q30_mul(q3, q3)));
+}
@@ -1,35 +1,188 @@
 #include "i2c.h"
+#include "clk.h"
+#include "dma.h"
 #include "gpio.h"
+#include "nvic.h"
+#include "prof.h"
 //#include "FreeRTOS.h"
 //#include "semphr.h"
 
-/*---------------------------------------------------------------------------*/
-/** @brief I2C initialization.
+#include <stddef.h>
 
+#define I2C_CR1_PE (1 << 0)
+#define I2C_CR1_START (1 << 8)
+#define I2C_CR1_STOP (1 << 9)
+#define I2C_CR1_ACK (1 << 10)
+#define I2C_CR1_POS (1 << 11)
+#define I2C_CR1_SWRST (1 << 15)
+#define I2C_CR2_FREQ 0x3F
+#define I2C_CR2_ITERREN (1 << 8)
+#define I2C_CR2_ITEVTEN (1 << 9)
+#define I2C_CR2_ITBUFEN (1 << 10)
+#define I2C_CR2_DMAEN (1 << 11)
+#define I2C_CR2_LAST (1 << 12)
+#define I2C_SR1_SB (1 << 0)
+#define I2C_SR1_ADDR (1 << 1)
+#define I2C_SR1_BTF (1 << 2)
+#define I2C_SR1_RXNE (1 << 6)
+#define I2C_SR1_TXE (1 << 7)
+#define I2C_SR1_BERR (1 << 8)
+#define I2C_SR1_ARLO (1 << 9)
+#define I2C_SR1_ERRORS (0x0F << 8)  // BERR, ARLO, AF, OVR
+#define I2C_SR2_BUSY (1 << 1)
+#define I2C1_RX_DMA_CHANNEL DMA_CHANNEL7
+#define GPIO_OUT_OD 0x6  // CNF/MODE nibble: general purpose open-drain, 2 MHz
+#define GPIO_AF_OD 0xF   // alternate function open-drain, 50 MHz
 
-@param[in]
-@param[in]
+i2c_stats_t i2c_stats[2];
+
+/* Asynchronous read, one per bus. The address phase (START, address, register, repeated
+ * START, address) steps through the event interrupt, then I2C1 hands the data to DMA and
+ * I2C2 takes it byte by byte. */
+enum {
+	I2C_ST_IDLE,
+	I2C_ST_START,    // waiting for SB, then the write address
+	I2C_ST_ADDR_W,   // waiting for ADDR, then the register
+	I2C_ST_REG,      // waiting for BTF, then the repeated START
+	I2C_ST_RESTART,  // waiting for SB, then the read address
+	I2C_ST_ADDR_R,   // waiting for ADDR, then the data phase
+	I2C_ST_DATA,     // I2C1 DMA or I2C2 RXNE/BTF until the last byte
+	I2C_ST_RECOVER,  // i2c_recover() has the pins
+	I2C_ST_BLOCKING, // i2c_read_regs() or i2c_write_regs() has the bus
+};
+
+static struct {
+	I2C_TypeDef *regs;
+	volatile uint8_t state;    // I2C_ST_*
+	volatile uint8_t recover;  // a bus clear is due, see i2c_poll()
+	uint8_t adr, reg;
+	uint8_t *buf;
+	volatile uint16_t left;    // I2C2 bytes still to come
+	i2c_callback_t callback;
+	uint32_t deadline;         // DWT_CYCCNT at which the running read is given up
+	uint16_t byte_us;          // 9 SCL periods at the programmed speed
+	uint8_t scl, sda;          // GPIOB pins, for the bus clear
+} i2c_bus[2] = {{.regs = I2C1}, {.regs = I2C2}};
+
+#define I2C_BUS(I2CP) (&i2c_bus[I2C_INDEX(I2CP)])
+
+/* Deadlines come from the DWT cycle counter: it runs in every context, interrupt handlers
+ * above SysTick included, and costs one load to read. */
+static uint32_t
+i2c_deadline(uint32_t us)
+{
+	SIM_SYNC();
+	return DWT_CYCCNT + us * (uint32_t)__clk;
+}
+
+static int
+i2c_expired(uint32_t deadline)
+{
+	SIM_SYNC();
+	return (int32_t)(DWT_CYCCNT - deadline) >= 0;
+}
+
+static void
+i2c_spin_us(uint32_t us)
+{
+	uint32_t deadline = i2c_deadline(us);
+
+	while (!i2c_expired(deadline))
+		;
+}
+
+/* DR and SR2 accesses that act by themselves, marked for the host simulation */
+static inline uint8_t
+i2c_dr_read(I2C_TypeDef *I2CP)
+{
+	uint8_t byte = (uint8_t)I2CP->DR;
+
+	SIM_READ(I2CP->DR);
+	return byte;
+}
+
+static inline void
+i2c_dr_write(I2C_TypeDef *I2CP, uint8_t byte)
+{
+	I2CP->DR = byte;
+	SIM_WRITE(I2CP->DR);
+}
+
+/* SR2 read after SR1 showed ADDR: clears ADDR and lets the transfer go on */
+static inline void
+i2c_clear_addr(I2C_TypeDef *I2CP)
+{
+	(void)I2CP->SR2;
+	SIM_READ(I2CP->SR2);
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief I2C initialization.
+        CCR and TRISE are computed from the live PCLK1, so the bus speed holds whatever
+        the APB1 clock is. Above 100 kHz the fast mode is used, with the 16/9 duty cycle
+        when PCLK1 divides evenly and 2:1 otherwise (rounded so the bus never runs above speed).
+        Also starts the DWT cycle counter the transfer deadlines are kept in.
+@param[in] I2CP  I2C1 or I2C2
+@param[in] rm    REMAP or NOREMAP (I2C1 only)
+@param[in] speed bus clock in Hz i.e I2C_SPEED_STANDARD or I2C_SPEED_FAST
+@example   I2CInit(I2C1, NOREMAP, I2C_SPEED_FAST);
 */
 void
-I2CInit(I2C_TypeDef *I2CP, unsigned char rm)
+I2CInit(I2C_TypeDef *I2CP, unsigned char rm, uint32_t speed)
 {
+	uint32_t pclk1 = clk_get_pclk1();
+	uint32_t freq = pclk1 / 1000000;  // CR2 FREQ in MHz
+	uint32_t ccr;
+	uint32_t trise;
+
+	if (speed == 0)
+		speed = I2C_SPEED_STANDARD;
+	if (speed <= I2C_SPEED_STANDARD) {
+		ccr = (pclk1 + 2 * speed - 1) / (2 * speed);
+		if (ccr < 4)
+			ccr = 4;        // minimum allowed in standard mode
+		trise = freq + 1;  // 1000 ns max rise time
+	} else {
+		if (speed > I2C_SPEED_FAST)
+			speed = I2C_SPEED_FAST;
+		if (pclk1 % (25 * speed) == 0) {
+			ccr = pclk1 / (25 * speed) | (1 << 14);  // DUTY: Tlow/Thigh = 16/9
+		} else {
+			ccr = (pclk1 + 3 * speed - 1) / (3 * speed);  // Tlow/Thigh = 2
+		}
+		if ((ccr & 0xFFF) == 0)
+			ccr |= 1;
+		ccr |= (1 << 15);               // F/S: fast mode
+		trise = freq * 300 / 1000 + 1;  // 300 ns max rise time
+	}
+
 	RCC->APB2ENR |= 9;  // Enable AF & GPOPB
 	if (I2CP == I2C1) {
 		RCC->APB1ENR |= 1 << 21;  // Enable Clock for I2C1
 		if (rm == 1) {
 			AFIO->MAPR |= 1 << 1;      //   set USART1 remap
 			GPIOB->CRH |= 0x000000FF;  // PB9,8 Open drain
+			i2c_bus[0].scl = 8;
+			i2c_bus[0].sda = 9;
 		} else {
-			GPIOB->CRL = 0xFF000000;  // PB7,6 Open drain
+			GPIOB->CRL |= 0xFF000000;  // PB7,6 Open drain
+			i2c_bus[0].scl = 6;
+			i2c_bus[0].sda = 7;
 		}
 	} else if (I2CP == I2C2) {
 		RCC->APB1ENR |= 1 << 22;   // Enable Clock for I2C2
 		GPIOB->CRH |= 0x0000FF00;  // PB11,10 Open drain
+		i2c_bus[1].scl = 10;
+		i2c_bus[1].sda = 11;
 	}
+	I2C_BUS(I2CP)->byte_us = 9000000 / speed + 1;
+	DEMCR |= DEMCR_TRCENA;
+	DWT_CTRL |= DWT_CTRL_CYCCNTENA;
+
 	I2CP->CR1 = 0;         // disable I2C peripheral
-	I2CP->CR2 = (1 << 3);  // 8MHz HSI
-	I2CP->CCR = 40;        // 40*125n=5000 ns *2(High & Low) =10,000 ns 1/10,000 = 100 KHz	I2C Freq
-	I2CP->TRISE = 9;       // Max rise time divided by 1/Freq +1
+	I2CP->CR2 = freq;     // APB1 clock in MHz
+	I2CP->CCR = ccr;
+	I2CP->TRISE = trise;  // Max rise time divided by 1/Freq +1
 	I2CP->CR1 = 1;         // enable I2C peripheral
 }
 /*---------------------------------------------------------------------------*/
@@ -42,10 +195,7 @@ I2CInit(I2C_TypeDef *I2CP, unsigned char rm)
 void
 I2CErrorInterrupt(I2C_TypeDef *I2CP, char ITERREN)
 {
-	if (I2CP == I2C1)
-		NVIC->ISER[1] |= (1 << 0);
-	if (I2CP == I2C2)
-		NVIC->ISER[1] |= (1 << 2);
+	nvic_enable_irq(I2CP == I2C1 ? NVIC_I2C1_ER_IRQ : NVIC_I2C2_ER_IRQ);
 	I2CP->CR1 &= ~(1 << 8);  // disable I2C peripheral
 	I2CP->CR2 |= (ITERREN << 8);
 	I2CP->CR1 |= (1 << 0);  // enable I2C peripheral
@@ -61,113 +211,737 @@ I2CErrorInterrupt(I2C_TypeDef *I2CP, char ITERREN)
 void
 I2CEventInterrupt(I2C_TypeDef *I2CP, char ITEVTEN)
 {
-	//	if(I2CP==I2C1) NVIC->ISER[0]|=(1<<31);
-	if (I2CP == I2C2)
-		NVIC->ISER[1] |= (1 << 1);
+	nvic_enable_irq(I2CP == I2C1 ? NVIC_I2C1_EV_IRQ : NVIC_I2C2_EV_IRQ);
 	I2CP->CR1 &= ~(1 << 8);  // disable I2C peripheral
 	I2CP->CR2 |= (ITEVTEN << 9);
 	I2CP->CR1 |= (1 << 0);  // enable I2C peripheral
 }
 
-/*---------------------------------------------------------------------------*/
-/** @brief Timer initialization.
-
+/* A NACK, a bus error or lost arbitration in SR1: cleared and counted. Bus errors and
+ * lost arbitration mean a slave is out of step with the master, so they ask for a bus
+ * clear, a NACK is an answer. */
+static int
+i2c_sr1_error(I2C_TypeDef *I2CP, uint16_t sr1)
+{
+	if (!(sr1 & I2C_SR1_ERRORS))
+		return 0;
+	I2CP->SR1 &= ~I2C_SR1_ERRORS;  // write 0 to clear
+	i2c_stats[I2C_INDEX(I2CP)].errors++;
+	if (sr1 & (I2C_SR1_BERR | I2C_SR1_ARLO))
+		I2C_BUS(I2CP)->recover = 1;
+	return 1;
+}
 
-@param[in]
-@param[in]
-*/
-int
-I2C_Start(I2C_TypeDef *I2CP)
+/* Wait for SR1 flags, giving up at once on an error and after I2C_TIMEOUT_US otherwise.
+ * A timeout means a slave holds the bus, so it asks for a bus clear. */
+static int
+i2c_wait_sr1(I2C_TypeDef *I2CP, uint16_t flag)
 {
-	unsigned int timeoutcount;
-	I2CP->CR1 |= 1 << 8;  // I2C Start
-	for (timeoutcount = 0; !(I2CP->SR1 & 0x0001); timeoutcount++) {
-		if (timeoutcount > 10000) {
+	uint32_t deadline = i2c_deadline(I2C_TIMEOUT_US);
+	uint16_t sr1;
+
+	while (!((sr1 = I2CP->SR1) & flag)) {
+		if (i2c_sr1_error(I2CP, sr1))
+			return -1;
+		if (i2c_expired(deadline)) {
+			i2c_stats[I2C_INDEX(I2CP)].timeouts++;
+			I2C_BUS(I2CP)->recover = 1;
 			return -1;
 		}
-	}  // wait for start bit - see status register
+	}
 	return 1;
 }
-/*---------------------------------------------------------------------------*/
-/** @brief Timer initialization.
 
+/* Same for a flag to clear, in CR1 or SR2 */
+static int
+i2c_wait_clear(I2C_TypeDef *I2CP, volatile uint16_t *reg, uint16_t flag)
+{
+	uint32_t deadline = i2c_deadline(I2C_TIMEOUT_US);
 
-@param[in]
-@param[in]
+	while (*reg & flag) {
+		if (i2c_expired(deadline)) {
+			i2c_stats[I2C_INDEX(I2CP)].timeouts++;
+			I2C_BUS(I2CP)->recover = 1;
+			return -1;
+		}
+	}
+	return 1;
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief Send START and wait for SB.
+        @return 1 on success, -1 after I2C_TIMEOUT_US
+*/
+int
+I2C_Start(I2C_TypeDef *I2CP)
+{
+	I2CP->CR1 |= I2C_CR1_START;
+	return i2c_wait_sr1(I2CP, I2C_SR1_SB);
+}
+/*---------------------------------------------------------------------------*/
+/** @brief Send STOP and wait for the bus to go idle.
+        @return 1 on success, -1 after I2C_TIMEOUT_US
 */
 int
 I2C_Stop(I2C_TypeDef *I2CP)
 {
-	unsigned int timeoutcount;
-	I2CP->CR1 |= 1 << 9;
-	for (timeoutcount = 0; (I2CP->SR2 & 0x0002); timeoutcount++) {
-		if (timeoutcount > 10000) {
-			return -1;
+	I2CP->CR1 |= I2C_CR1_STOP;
+	return i2c_wait_clear(I2CP, &I2CP->SR2, I2C_SR2_BUSY);
+}
+/*---------------------------------------------------------------------------*/
+/** @brief Send one data byte and wait for TXE.
+        @return 1 on success, -1 on a NACK or after I2C_TIMEOUT_US
+*/
+int
+I2C_Write(I2C_TypeDef *I2CP, unsigned char c)
+{
+	i2c_dr_write(I2CP, c);
+	return i2c_wait_sr1(I2CP, I2C_SR1_TXE);
+}
+/*---------------------------------------------------------------------------*/
+/** @brief Send the slave address after START and clear ADDR.
+        @return 1 on success, -1 on a NACK or after I2C_TIMEOUT_US
+*/
+int
+I2C_Addr(I2C_TypeDef *I2CP, unsigned char adr)
+{
+	i2c_dr_write(I2CP, adr);  // Write to I2C Address register
+	if (i2c_wait_sr1(I2CP, I2C_SR1_ADDR) < 0)
+		return -1;
+	i2c_clear_addr(I2CP);  // dummy read to clear - see status register 2
+	return 1;
+}
+/*---------------------------------------------------------------------------*/
+/** @brief Wait for a received byte and read it.
+        @return the byte, -1 after I2C_TIMEOUT_US
+*/
+int
+I2C_Read(I2C_TypeDef *I2CP)
+{
+	if (i2c_wait_sr1(I2CP, I2C_SR1_RXNE) < 0)
+		return -1;
+	return (int)i2c_dr_read(I2CP);
+}
+
+/* Give up on a blocking transfer: STOP without waiting, the bus may be held */
+static void
+i2c_abort(I2C_TypeDef *I2CP)
+{
+	I2CP->CR1 &= ~I2C_CR1_POS;
+	I2CP->CR1 |= I2C_CR1_STOP;
+}
+
+static int
+i2c_read_once(I2C_TypeDef *I2CP, uint8_t adr, uint8_t reg, uint8_t *buf, uint16_t len)
+{
+	uint32_t primask;
+
+	if (I2C_Start(I2CP) < 0 || I2C_Addr(I2CP, adr & ~1) < 0 || I2C_Write(I2CP, reg) < 0)
+		goto fail;
+
+	if (I2C_Start(I2CP) < 0)  // repeated START
+		goto fail;
+	i2c_dr_write(I2CP, adr | 1);
+	if (i2c_wait_sr1(I2CP, I2C_SR1_ADDR) < 0)
+		goto fail;
+
+	if (len == 1) {
+		I2CP->CR1 &= ~I2C_CR1_ACK;
+		primask = irq_save();  // ACK/STOP must land before the next byte is clocked
+		i2c_clear_addr(I2CP);  // clear ADDR
+		I2CP->CR1 |= I2C_CR1_STOP;
+		irq_restore(primask);
+		if (i2c_wait_sr1(I2CP, I2C_SR1_RXNE) < 0)
+			goto fail;
+		buf[0] = i2c_dr_read(I2CP);
+	} else if (len == 2) {
+		I2CP->CR1 |= I2C_CR1_POS | I2C_CR1_ACK;
+		primask = irq_save();
+		i2c_clear_addr(I2CP);  // clear ADDR
+		I2CP->CR1 &= ~I2C_CR1_ACK;  // NACK applies to the byte after the current one
+		irq_restore(primask);
+		if (i2c_wait_sr1(I2CP, I2C_SR1_BTF) < 0)
+			goto fail;
+		I2CP->CR1 |= I2C_CR1_STOP;
+		buf[0] = i2c_dr_read(I2CP);
+		buf[1] = i2c_dr_read(I2CP);
+		I2CP->CR1 &= ~I2C_CR1_POS;
+	} else {
+		I2CP->CR1 |= I2C_CR1_ACK;
+		i2c_clear_addr(I2CP);  // clear ADDR
+		for (; len > 3; len--) {
+			if (i2c_wait_sr1(I2CP, I2C_SR1_RXNE) < 0)
+				goto fail;
+			*buf++ = i2c_dr_read(I2CP);
 		}
-	}  // wait for start bit - see status register
+		/* N-2 in DR, N-1 in the shift register */
+		if (i2c_wait_sr1(I2CP, I2C_SR1_BTF) < 0)
+			goto fail;
+		I2CP->CR1 &= ~I2C_CR1_ACK;
+		*buf++ = i2c_dr_read(I2CP);
+		/* N-1 in DR, N in the shift register */
+		if (i2c_wait_sr1(I2CP, I2C_SR1_BTF) < 0)
+			goto fail;
+		I2CP->CR1 |= I2C_CR1_STOP;
+		*buf++ = i2c_dr_read(I2CP);
+		if (i2c_wait_sr1(I2CP, I2C_SR1_RXNE) < 0)
+			goto fail;
+		*buf = i2c_dr_read(I2CP);
+	}
+	/* STOP is already requested, wait for it to go out before the next START */
+	return i2c_wait_clear(I2CP, &I2CP->CR1, I2C_CR1_STOP);
+
+fail:
+	i2c_abort(I2CP);
+	return -1;
+}
+
+static int
+i2c_write_once(I2C_TypeDef *I2CP, uint8_t adr, uint8_t reg, const uint8_t *buf, uint16_t len)
+{
+	if (I2C_Start(I2CP) < 0 || I2C_Addr(I2CP, adr & ~1) < 0 || I2C_Write(I2CP, reg) < 0)
+		goto fail;
+	while (len--) {
+		if (I2C_Write(I2CP, *buf++) < 0)
+			goto fail;
+	}
+	if (i2c_wait_sr1(I2CP, I2C_SR1_BTF) < 0)  // last byte fully shifted out
+		goto fail;
+	return I2C_Stop(I2CP);
+
+fail:
+	i2c_abort(I2CP);
+	return -1;
+}
+
+/* Take an idle bus for a blocking transfer, so no asynchronous read can start on it from
+ * an interrupt until i2c_release() */
+static int
+i2c_claim(int b)
+{
+	uint32_t primask = irq_save();
+	int ok = i2c_bus[b].state == I2C_ST_IDLE;
+
+	if (ok)
+		i2c_bus[b].state = I2C_ST_BLOCKING;
+	irq_restore(primask);
+	return ok;
+}
+
+static int
+i2c_release(int b, int ret)
+{
+	i2c_bus[b].state = I2C_ST_IDLE;
+	return ret;
+}
+
+/* Blocking transfers hold the bus: a failure that asked for a bus clear gets one and the
+ * transfer is run again, up to I2C_RETRIES times. */
+static int
+i2c_retry(I2C_TypeDef *I2CP, int attempt)
+{
+	if (attempt == I2C_RETRIES || !I2C_BUS(I2CP)->recover)
+		return 0;
+	i2c_recover(I2CP);
+	i2c_stats[I2C_INDEX(I2CP)].retries++;
 	return 1;
 }
+
 /*---------------------------------------------------------------------------*/
-/** @brief Timer initialization.
+/** @brief Read consecutive registers from a slave.
+        The register pointer is written, then a repeated START (no STOP, no delay) turns
+        the bus around for the read. The end of the transfer follows the RM0008 sequences
+        for 1, 2 and more than 2 bytes so the slave is NACKed on exactly the last byte.
+        Every wait has a deadline of I2C_TIMEOUT_US and a NACK ends the transfer at once.
+        A timeout or bus error clears the bus and runs the read again.
+        @param[in] I2CP I2C1 or I2C2
+        @param[in] adr  8-bit slave write address i.e 0xD0
+        @param[in] reg  first register to read
+        @param[out] buf destination for len bytes
+        @param[in] len  number of bytes, at least 1
+        @return 1 on success, -1 on a NACK, a timeout or a busy bus
+        @example   i2c_read_regs(I2C1, 0xD0, WHO_AM_I, &id, 1);
+*/
+int
+i2c_read_regs(I2C_TypeDef *I2CP, uint8_t adr, uint8_t reg, uint8_t *buf, uint16_t len)
+{
+	int b = I2C_INDEX(I2CP);
 
+	if (len == 0 || !i2c_claim(b))
+		return -1;
+	for (int attempt = 0;; attempt++) {
+		if (i2c_read_once(I2CP, adr, reg, buf, len) > 0)
+			return i2c_release(b, 1);
+		if (!i2c_retry(I2CP, attempt))
+			return i2c_release(b, -1);
+	}
+}
 
-@param[in]
-@param[in]
+/*---------------------------------------------------------------------------*/
+/** @brief Write consecutive registers of a slave in one transaction.
+        Deadlines, bus clear and retry as for i2c_read_regs().
+        @param[in] I2CP I2C1 or I2C2
+        @param[in] adr  8-bit slave write address i.e 0xD0
+        @param[in] reg  first register to write
+        @param[in] buf  len bytes to write
+        @param[in] len  number of bytes
+        @return 1 on success, -1 on a NACK, a timeout or a busy bus
+        @example   i2c_write_regs(I2C1, 0xD0, PWR_MGMT_1, &value, 1);
 */
 int
-I2C_Write(I2C_TypeDef *I2CP, unsigned char c)
+i2c_write_regs(I2C_TypeDef *I2CP, uint8_t adr, uint8_t reg, const uint8_t *buf, uint16_t len)
 {
-	unsigned int timeoutcount;
-	I2CP->DR = c;
-	for (timeoutcount = 0; !(I2CP->SR1 & (1 << 7)); timeoutcount++) {
-		if (timeoutcount > 10000) {
-			return -1;
-		}
-	}  // wait for start bit - see status register
+	int b = I2C_INDEX(I2CP);
+
+	if (!i2c_claim(b))
+		return -1;
+	for (int attempt = 0;; attempt++) {
+		if (i2c_write_once(I2CP, adr, reg, buf, len) > 0)
+			return i2c_release(b, 1);
+		if (!i2c_retry(I2CP, attempt))
+			return i2c_release(b, -1);
+	}
+}
+
+/* GPIOB pin configuration nibble */
+static void
+i2c_pin_mode(uint8_t pin, uint32_t mode)
+{
+	volatile uint32_t *cr = pin < 8 ? &GPIOB->CRL : &GPIOB->CRH;
+	uint32_t shift = (pin & 7) * 4;
+
+	*cr = (*cr & ~(0xFUL << shift)) | mode << shift;
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief Free a bus a slave is holding, and reset the peripheral.
+        A slave that lost track mid-byte (a master reset, a glitch) keeps SDA low until it
+        has clocked out the rest of its byte. With the peripheral off the pins are driven
+        as GPIO: up to 9 SCL pulses at 100 kHz until SDA is released, then a STOP. SWRST
+        then clears BUSY and any stuck state in the peripheral, and the timing registers
+        are written back. About 100 us, main loop only.
+        An idle bus is taken for the clear and given back after it. A bus already taken
+        for one, by i2c_poll() or a blocking transfer, stays with its owner.
+        @param[in] I2CP I2C1 or I2C2
+        @return 1 when both lines are high afterwards, -1 while a slave still holds one
+                or an asynchronous read is running
+        @example   if (i2c_stats[0].timeouts != seen) i2c_recover(I2C1);
+*/
+int
+i2c_recover(I2C_TypeDef *I2CP)
+{
+	int b = I2C_INDEX(I2CP);
+	uint16_t cr2 = I2CP->CR2 & I2C_CR2_FREQ, ccr = I2CP->CCR, trise = I2CP->TRISE;
+	uint32_t scl = 1UL << i2c_bus[b].scl, sda = 1UL << i2c_bus[b].sda;
+	uint32_t primask = irq_save();
+	uint8_t owner = i2c_bus[b].state;
+	int ok;
+
+	if (owner == I2C_ST_IDLE)
+		i2c_bus[b].state = I2C_ST_RECOVER;
+	irq_restore(primask);
+	if (owner != I2C_ST_IDLE && owner != I2C_ST_RECOVER && owner != I2C_ST_BLOCKING)
+		return -1;
+	I2CP->CR1 = 0;
+	GPIOB->BSRR = scl | sda;  // released, the pull-ups set the level
+	i2c_pin_mode(i2c_bus[b].scl, GPIO_OUT_OD);
+	i2c_pin_mode(i2c_bus[b].sda, GPIO_OUT_OD);
+	for (int i = 0; i < I2C_CLEAR_PULSES && !(GPIOB->IDR & sda); i++) {
+		GPIOB->BRR = scl;
+		i2c_spin_us(I2C_CLEAR_HALF_US);
+		GPIOB->BSRR = scl;
+		i2c_spin_us(I2C_CLEAR_HALF_US);
+	}
+	GPIOB->BRR = sda;  // STOP: SDA rises while SCL is high
+	i2c_spin_us(I2C_CLEAR_HALF_US);
+	GPIOB->BSRR = sda;
+	i2c_spin_us(I2C_CLEAR_HALF_US);
+	ok = (GPIOB->IDR & (scl | sda)) == (scl | sda);
+	i2c_pin_mode(i2c_bus[b].scl, GPIO_AF_OD);
+	i2c_pin_mode(i2c_bus[b].sda, GPIO_AF_OD);
+
+	I2CP->CR1 = I2C_CR1_SWRST;
+	SIM_WRITE(I2CP->CR1);
+	I2CP->CR1 = 0;
+	I2CP->CR2 = cr2;
+	I2CP->CCR = ccr;
+	I2CP->TRISE = trise;
+	I2CP->CR1 = I2C_CR1_PE;
+
+	i2c_stats[b].recoveries++;
+	i2c_stats[b].failing = ok ? 0 : i2c_stats[b].failing + 1;
+	i2c_bus[b].recover = !ok;
+	if (owner != I2C_ST_BLOCKING)
+		i2c_bus[b].state = I2C_ST_IDLE;
+	return ok ? 1 : -1;
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief Prepare DMA1 channel 7 for I2C1 reception.
+        Enables the DMA clock, the channel 7 interrupt and the I2C1 event and error
+        interrupts the address phase runs on. Call once after I2CInit(I2C1, ...).
+        @example   i2c1_dma_init();
+*/
+void
+i2c1_dma_init(void)
+{
+	CLOCK_BUS_HIGH |= DMACLOCK_ENABLE;
+	dma_channel_reset(DMA1, I2C1_RX_DMA_CHANNEL);
+	nvic_enable_irq(NVIC_DMA1_CHANNEL7_IRQ);
+	nvic_enable_irq(NVIC_I2C1_EV_IRQ);
+	nvic_enable_irq(NVIC_I2C1_ER_IRQ);
+}
+
+/* Start the address phase of an asynchronous read, the rest runs from the interrupts */
+static int
+i2c_async_start(int b, uint8_t adr, uint8_t reg, uint8_t *buf, uint16_t len,
+                i2c_callback_t callback)
+{
+	I2C_TypeDef *I2CP = i2c_bus[b].regs;
+	uint32_t primask;
+
+	primask = irq_save();
+	if (i2c_bus[b].state != I2C_ST_IDLE) {
+		irq_restore(primask);
+		return -1;
+	}
+	if (I2CP->SR2 & I2C_SR2_BUSY) {  // idle master, held bus: a slave is stuck
+		i2c_stats[b].errors++;
+		i2c_bus[b].recover = 1;
+		irq_restore(primask);
+		return -1;
+	}
+	i2c_bus[b].state = I2C_ST_START;
+	irq_restore(primask);
+
+	i2c_bus[b].adr = adr;
+	i2c_bus[b].reg = reg;
+	i2c_bus[b].buf = buf;
+	i2c_bus[b].left = len;
+	i2c_bus[b].callback = callback;
+	i2c_bus[b].deadline = i2c_deadline(I2C_TIMEOUT_US + (len + 4) * i2c_bus[b].byte_us);
+	I2CP->CR2 |= I2C_CR2_ITEVTEN | I2C_CR2_ITERREN;
+	I2CP->CR1 |= I2C_CR1_START;
 	return 1;
 }
+
+/* End an asynchronous read and run its callback */
+static RAMFUNC void
+i2c_async_finish(int b, int status)
+{
+	I2C_TypeDef *I2CP = i2c_bus[b].regs;
+	i2c_callback_t callback = i2c_bus[b].callback;
+
+	if (b == 0)
+		dma_disable_channel(DMA1, I2C1_RX_DMA_CHANNEL);
+	I2CP->CR2 &= ~(I2C_CR2_ITERREN | I2C_CR2_ITEVTEN | I2C_CR2_ITBUFEN | I2C_CR2_DMAEN |
+	               I2C_CR2_LAST);
+	I2CP->CR1 &= ~I2C_CR1_ACK;
+	i2c_bus[b].state = I2C_ST_IDLE;
+	if (callback)
+		callback(status);
+}
+
+/* DMA1 channel 7 for the data phase of an I2C1 read, armed before the read address goes
+ * out. LAST makes the peripheral NACK the final byte by itself. */
+static RAMFUNC void
+i2c1_dma_arm(uint8_t *buf, uint16_t len)
+{
+	dma_channel_reset(DMA1, I2C1_RX_DMA_CHANNEL);
+	dma_set_peripheral_address(DMA1, I2C1_RX_DMA_CHANNEL, (u32)&I2C1->DR);
+	dma_set_memory_address(DMA1, I2C1_RX_DMA_CHANNEL, (u32)buf);
+	dma_set_number_of_data(DMA1, I2C1_RX_DMA_CHANNEL, len);
+	dma_set_read_from_peripheral(DMA1, I2C1_RX_DMA_CHANNEL);
+	dma_enable_memory_increment_mode(DMA1, I2C1_RX_DMA_CHANNEL);
+	dma_set_peripheral_size(DMA1, I2C1_RX_DMA_CHANNEL, DMA_CCR_PSIZE_8BIT);
+	dma_set_memory_size(DMA1, I2C1_RX_DMA_CHANNEL, DMA_CCR_MSIZE_8BIT);
+	dma_set_priority(DMA1, I2C1_RX_DMA_CHANNEL, DMA_CCR_PL_VERY_HIGH);
+	dma_enable_transfer_complete_interrupt(DMA1, I2C1_RX_DMA_CHANNEL);
+	dma_enable_transfer_error_interrupt(DMA1, I2C1_RX_DMA_CHANNEL);
+	dma_enable_channel(DMA1, I2C1_RX_DMA_CHANNEL);
+	I2C1->CR2 |= I2C_CR2_DMAEN | I2C_CR2_LAST;
+}
+
+/* I2C2 data phase: RXNE takes every byte except the last three, which end on BTF per
+ * RM0008 so the clock is stretched while ACK and STOP are changed. */
+static RAMFUNC void
+i2c2_it_data(uint16_t sr1)
+{
+	if (i2c_bus[1].left > 3) {
+		if (sr1 & I2C_SR1_RXNE) {
+			*i2c_bus[1].buf++ = i2c_dr_read(I2C2);
+			if (--i2c_bus[1].left == 3)
+				I2C2->CR2 &= ~I2C_CR2_ITBUFEN;  // the last three end on BTF
+		}
+	} else if (i2c_bus[1].left == 1) {
+		if (sr1 & I2C_SR1_RXNE) {
+			*i2c_bus[1].buf = i2c_dr_read(I2C2);
+			i2c_bus[1].left = 0;
+			i2c_async_finish(1, 1);
+		}
+	} else if (sr1 & I2C_SR1_BTF) {
+		if (i2c_bus[1].left == 3) {  // N-2 in DR, N-1 in the shift register
+			I2C2->CR1 &= ~I2C_CR1_ACK;
+			*i2c_bus[1].buf++ = i2c_dr_read(I2C2);
+		} else {  // N-1 in DR, N in the shift register
+			I2C2->CR1 |= I2C_CR1_STOP;
+			*i2c_bus[1].buf++ = i2c_dr_read(I2C2);
+			I2C2->CR2 |= I2C_CR2_ITBUFEN;  // N arrives on RXNE
+		}
+		i2c_bus[1].left--;
+	}
+}
+
+/* Event interrupt of either bus: one step of the address phase, or I2C2 data */
+static RAMFUNC void
+i2c_async_event(int b)
+{
+	I2C_TypeDef *I2CP = i2c_bus[b].regs;
+	uint16_t sr1 = I2CP->SR1;
+
+	switch (i2c_bus[b].state) {
+	case I2C_ST_START:
+		if (sr1 & I2C_SR1_SB) {
+			i2c_dr_write(I2CP, i2c_bus[b].adr & ~1);
+			i2c_bus[b].state = I2C_ST_ADDR_W;
+		}
+		break;
+	case I2C_ST_ADDR_W:
+		if (sr1 & I2C_SR1_ADDR) {
+			i2c_clear_addr(I2CP);  // clear ADDR
+			i2c_dr_write(I2CP, i2c_bus[b].reg);
+			i2c_bus[b].state = I2C_ST_REG;
+		}
+		break;
+	case I2C_ST_REG:
+		if (sr1 & I2C_SR1_BTF) {
+			I2CP->CR1 |= I2C_CR1_START;  // repeated START, clears BTF
+			i2c_bus[b].state = I2C_ST_RESTART;
+		}
+		break;
+	case I2C_ST_RESTART:
+		if (sr1 & I2C_SR1_SB) {
+			if (b == 0)
+				i2c1_dma_arm(i2c_bus[0].buf, i2c_bus[0].left);
+			I2CP->CR1 |= I2C_CR1_ACK;
+			i2c_dr_write(I2CP, i2c_bus[b].adr | 1);
+			i2c_bus[b].state = I2C_ST_ADDR_R;
+		}
+		break;
+	case I2C_ST_ADDR_R:
+		if (sr1 & I2C_SR1_ADDR) {
+			if (b == 0)
+				I2CP->CR2 &= ~I2C_CR2_ITEVTEN;  // DMA from here, errors still interrupt
+			else if (i2c_bus[1].left > 3)
+				I2CP->CR2 |= I2C_CR2_ITBUFEN;
+			i2c_bus[b].state = I2C_ST_DATA;
+			i2c_clear_addr(I2CP);  // clear ADDR, the data phase starts
+		}
+		break;
+	case I2C_ST_DATA:
+		if (b == 1)
+			i2c2_it_data(sr1);
+		break;
+	default:
+		I2CP->CR2 &= ~(I2C_CR2_ITEVTEN | I2C_CR2_ITBUFEN);  // nothing of ours running
+		break;
+	}
+}
+
+/* Error interrupt of either bus: NACK, bus error, lost arbitration or overrun */
+static void
+i2c_async_error(int b)
+{
+	I2C_TypeDef *I2CP = i2c_bus[b].regs;
+
+	i2c_sr1_error(I2CP, I2CP->SR1);
+	I2CP->CR1 |= I2C_CR1_STOP;
+	if (i2c_bus[b].state != I2C_ST_IDLE && i2c_bus[b].state != I2C_ST_RECOVER &&
+	    i2c_bus[b].state != I2C_ST_BLOCKING)
+		i2c_async_finish(b, -1);
+	else
+		I2CP->CR2 &= ~I2C_CR2_ITERREN;
+}
+
 /*---------------------------------------------------------------------------*/
-/** @brief Timer initialization.
+/** @brief Read a block of registers from an I2C1 slave, data phase by DMA.
+        The whole transfer runs from interrupts, the call returns at once: the event
+        interrupt walks the address phase (register pointer, repeated START), then DMA1
+        channel 7 moves the bytes into buf back to back with no CPU work per byte. STOP
+        is sent and the callback runs from the transfer-complete interrupt.
+        A transfer that outlives its deadline is ended by i2c_poll().
+        @param[in] adr      8-bit slave write address i.e 0xD0
+        @param[in] reg      first register to read
+        @param[in] buf      destination, must stay valid until the callback runs
+        @param[in] len      number of bytes, at least 2
+        @param[in] callback completion callback, may be NULL
+        @return 1 when the transfer was started, -1 if busy, len < 2 or the bus is held
+        @example   i2c1_dma_read(0xD0, ACCEL_XOUT_H, frame, 14, frame_done);
+*/
+int
+i2c1_dma_read(uint8_t adr, uint8_t reg, uint8_t *buf, uint16_t len, i2c_callback_t callback)
+{
+	if (len < 2)
+		return -1;
+	return i2c_async_start(0, adr, reg, buf, len, callback);
+}
 
+/*---------------------------------------------------------------------------*/
+/** @brief Check whether an i2c1_dma_read() transfer is still running.
+        @return 1 while the transfer is running, 0 when idle
+*/
+int
+i2c1_dma_busy(void)
+{
+	return i2c_bus[0].state != I2C_ST_IDLE;
+}
 
-@param[in]
-@param[in]
+RAMFUNC void
+DMA1_Channel7_IRQHandler(void)
+{
+	int status = (DMA1_ISR & DMA_ISR_TEIF(I2C1_RX_DMA_CHANNEL)) ? -1 : 1;
+
+	DMA1_IFCR = DMA_IFCR_CIF(I2C1_RX_DMA_CHANNEL);
+	I2C1->CR1 |= I2C_CR1_STOP;  // STOP after the last byte
+	if (i2c_bus[0].state == I2C_ST_DATA)
+		i2c_async_finish(0, status);
+	else
+		dma_disable_channel(DMA1, I2C1_RX_DMA_CHANNEL);
+}
+
+RAMFUNC void
+I2C1_EV_IRQHandler(void)
+{
+	i2c_async_event(0);
+}
+
+void
+I2C1_ER_IRQHandler(void)
+{
+	i2c_async_error(0);
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief Enable the I2C2 event and error interrupts for i2c2_it_read().
+        Call once after I2CInit(I2C2, ...).
+        @example   i2c2_it_init();
+*/
+void
+i2c2_it_init(void)
+{
+	nvic_enable_irq(NVIC_I2C2_EV_IRQ);
+	nvic_enable_irq(NVIC_I2C2_ER_IRQ);
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief Read a block of registers from an I2C2 slave, all by interrupt.
+        I2C2 has no usable DMA here: its channels 4 and 5 carry the USART1 TX ring and RX.
+        Same contract as i2c1_dma_read(), the data phase runs from the event interrupt too.
+        @param[in] adr      8-bit slave write address i.e 0xD0
+        @param[in] reg      first register to read
+        @param[in] buf      destination, must stay valid until the callback runs
+        @param[in] len      number of bytes, at least 3
+        @param[in] callback completion callback, may be NULL
+        @return 1 when the transfer was started, -1 if busy, len < 3 or the bus is held
+        @example   i2c2_it_read(0xD0, ACCEL_XOUT_H, frame, 14, frame_done);
 */
 int
-I2C_Addr(I2C_TypeDef *I2CP, unsigned char adr)
+i2c2_it_read(uint8_t adr, uint8_t reg, uint8_t *buf, uint16_t len, i2c_callback_t callback)
 {
-	unsigned int timeoutcount;
-	I2CP->DR = adr | 0;  // Write to I2C Address register
-	for (timeoutcount = 0; !(I2CP->SR1 & 0x0002); timeoutcount++) {
-		if (timeoutcount > 10000) {
-			return -1;
-		}
-	}           // wait for start bit - see status register
-	I2CP->SR2;  // dummy read to clear - see status register 2
-	return 1;
+	if (len < 3)
+		return -1;
+	return i2c_async_start(1, adr, reg, buf, len, callback);
 }
+
 /*---------------------------------------------------------------------------*/
-/** @brief Timer initialization.
+/** @brief Check whether an i2c2_it_read() transfer is still running.
+        @return 1 while the transfer is running, 0 when idle
+*/
+int
+i2c2_it_busy(void)
+{
+	return i2c_bus[1].state != I2C_ST_IDLE;
+}
 
+RAMFUNC void
+I2C2_EV_IRQHandler(void)
+{
+	i2c_async_event(1);
+}
 
-@param[in]
-@param[in]
+void
+I2C2_ER_IRQHandler(void)
+{
+	i2c_async_error(1);
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief Start a non-blocking register block read on either bus.
+        I2C1 reads by DMA, I2C2 by interrupt, so both buses can run at the same time.
+        @param[in] I2CP     I2C1 or I2C2
+        @param[in] adr      8-bit slave write address i.e 0xD0
+        @param[in] reg      first register to read
+        @param[in] buf      destination, must stay valid until the callback runs
+        @param[in] len      number of bytes, at least 3
+        @param[in] callback completion callback, may be NULL
+        @return 1 when the transfer was started, -1 otherwise
+        @example   i2c_async_read(dev->bus, dev->addr, ACCEL_XOUT_H, frame, 14, done);
 */
 int
-I2C_Read(I2C_TypeDef *I2CP)
+i2c_async_read(I2C_TypeDef *I2CP, uint8_t adr, uint8_t reg, uint8_t *buf, uint16_t len,
+               i2c_callback_t callback)
 {
-	unsigned int timeoutcount = 0U;
-	uint8_t rx = 0U;
+	if (I2CP == I2C2)
+		return i2c2_it_read(adr, reg, buf, len, callback);
+	return i2c1_dma_read(adr, reg, buf, len, callback);
+}
 
-	/* Wait for RXNE flag (SR1 bit 6) - data received */
-	for (timeoutcount = 0U; !(I2CP->SR1 & (1U << 6)); ++timeoutcount) {
-		if (timeoutcount > 10000U) {
-			return -1; /* timeout */
-		}
-	}
+/*---------------------------------------------------------------------------*/
+/** @brief Check whether an i2c_async_read() on a bus is still running.
+        @return 1 while the transfer is running, 0 when idle
+*/
+int
+i2c_async_busy(I2C_TypeDef *I2CP)
+{
+	return I2CP == I2C2 ? i2c2_it_busy() : i2c1_dma_busy();
+}
 
-	/* Read data register (clears RXNE) */
-	rx = (uint8_t)(I2CP->DR & 0xFFU);
+/*---------------------------------------------------------------------------*/
+/** @brief Supervise a bus, call from the main loop every millisecond or so.
+        An asynchronous read past its deadline is ended: the bus is cleared with
+        i2c_recover() and then the callback runs with -1, so whoever waits on it goes on
+        within a deadline plus one poll period. A bus clear a blocking transfer or a busy
+        bus asked for is done here too. Never waits otherwise.
+        @param[in] I2CP I2C1 or I2C2
+        @example   i2c_poll(I2C1);
+*/
+void
+i2c_poll(I2C_TypeDef *I2CP)
+{
+	int b = I2C_INDEX(I2CP);
+	i2c_callback_t callback;
+	uint32_t primask = irq_save();
+	int claim;
+
+	if (i2c_bus[b].state == I2C_ST_IDLE || i2c_bus[b].state == I2C_ST_RECOVER ||
+	    i2c_bus[b].state == I2C_ST_BLOCKING || !i2c_expired(i2c_bus[b].deadline)) {
+		/* Take the bus before unmasking, no read may start under the clear */
+		claim = i2c_bus[b].recover && i2c_bus[b].state == I2C_ST_IDLE;
+		if (claim)
+			i2c_bus[b].state = I2C_ST_RECOVER;
+		irq_restore(primask);
+		if (claim)
+			i2c_recover(I2CP);
+		return;
+	}
+	callback = i2c_bus[b].callback;
+	i2c_bus[b].callback = NULL;
+	i2c_async_finish(b, -1);  // quietly, the callback runs once the bus is usable
+	i2c_bus[b].state = I2C_ST_RECOVER;
+	i2c_stats[b].timeouts++;
+	irq_restore(primask);
 
-	return (int)rx;
+	i2c_recover(I2CP);
+	if (callback)
+		callback(-1);
 }
@@ -1,8 +1,518 @@
 #include "mpu.h"
 #include "i2c.h"
+#include "timer.h"
 
 /* Include delay header file */
 #include "mpu.h"      /* Include MPU6050 register define file */
 #include <inttypes.h> /* Include integer type header file */
 #include <stdio.h>    /* Include standard library file */
 #include <stdlib.h>   /* Include standard library file */
+
+/* Gyro LSB/(deg/s) is 131, 65.5, 32.8, 16.4: centi-deg/s = raw * 100 / LSB, as Q16 */
+static const int32_t gyro_cdps_q16[4] = {50027, 100055, 199805, 399610};
+
+/*---------------------------------------------------------------------------*/
+/** @brief Split a 14-byte ACCEL_XOUT_H..GYRO_ZOUT_L frame into signed words.
+        @param[in] frame  MPU_FRAME_SIZE bytes, big-endian as read from the sensor
+        @param[out] raw   decoded sample
+*/
+void
+mpu_decode(const uint8_t *frame, mpu_raw_t *raw)
+{
+	for (int i = 0; i < 3; i++) {
+		raw->accel[i] = (int16_t)((frame[2 * i] << 8) | frame[2 * i + 1]);
+		raw->gyro[i] = (int16_t)((frame[8 + 2 * i] << 8) | frame[9 + 2 * i]);
+	}
+	raw->temp = (int16_t)((frame[6] << 8) | frame[7]);
+	raw->mag[0] = raw->mag[1] = raw->mag[2] = 0;
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief Add the magnetometer words from the EXT_SENS_DATA part of a frame.
+        @param[in] ext   MPU_MAG_SIZE bytes at frame + MPU_FRAME_SIZE, HMC5883L X Z Y order
+        @param[out] raw  sample, mpu_decode() already run on it
+*/
+void
+mpu_decode_mag(const uint8_t *ext, mpu_raw_t *raw)
+{
+	raw->mag[0] = (int16_t)((ext[0] << 8) | ext[1]);
+	raw->mag[2] = (int16_t)((ext[2] << 8) | ext[3]);
+	raw->mag[1] = (int16_t)((ext[4] << 8) | ext[5]);
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief Accelerometer reading in hundredths of g, no floating point.
+        Sensitivity is 16384 >> fs LSB/g, so the divide is a rounding shift.
+        @param[in] raw  sensor value
+        @param[in] fs   AFS_SEL 0..3
+        @example   mpu_accel_cg(raw.accel[0], MPU_ACCEL_FS) = 100 at 1 g
+*/
+int32_t
+mpu_accel_cg(int16_t raw, uint8_t fs)
+{
+	int shift = 14 - (fs & 3);
+
+	return (raw * 100 + (1 << (shift - 1))) >> shift;
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief Gyroscope reading in hundredths of deg/s, Q16 multiply instead of a divide.
+        @param[in] raw  sensor value
+        @param[in] fs   FS_SEL 0..3
+*/
+int32_t
+mpu_gyro_cdps(int16_t raw, uint8_t fs)
+{
+	return (int32_t)(((int64_t)raw * gyro_cdps_q16[fs & 3] + 0x8000) >> 16);
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief Die temperature in hundredths of a degree C, raw / 340 + 36.53.
+        @param[in] raw  TEMP_OUT value
+*/
+int32_t
+mpu_temp_cc(int16_t raw)
+{
+	return ((raw * 19275 + 0x8000) >> 16) + 3653;  // 19275 = 100 / 340 in Q16
+}
+
+/* Overflowed FIFO batches, the oldest samples were lost and the FIFO was restarted */
+volatile uint32_t mpu_fifo_overflows;
+
+const mpu_config_t mpu_profile_low_power = {
+	.smplrt_div = 19,  // 1 kHz / 20 = 50 Hz
+	.dlpf = 5,         // 10 Hz bandwidth
+	.gyro_fs = 0,
+	.accel_fs = 0,
+	.fifo = 0,
+	.mag = 0,
+};
+
+const mpu_config_t mpu_profile_vibration = {
+	.smplrt_div = 7,  // 8 kHz / 8 = 1 kHz
+	.dlpf = 0,        // 260 Hz bandwidth
+	.gyro_fs = 3,
+	.accel_fs = 3,
+	.fifo = 1,
+	.mag = 0,
+};
+
+/* Gyro output rate before SMPLRT_DIV */
+static uint32_t
+mpu_gyro_rate(uint8_t dlpf)
+{
+	return (dlpf == 0 || dlpf == 7) ? 8000 : 1000;
+}
+
+/* USER_CTRL bits a profile needs, every write of the register has to keep them */
+static uint8_t
+mpu_user_ctrl(const mpu_config_t *cfg)
+{
+	return (cfg->fifo ? USER_CTRL_FIFO_EN : 0) | (cfg->mag ? USER_CTRL_I2C_MST_EN : 0);
+}
+
+/* Flush the FIFO and restart it with the given USER_CTRL bits */
+static int
+mpu_fifo_restart(mpu_dev_t *dev, uint8_t user_ctrl)
+{
+	uint8_t value = user_ctrl | USER_CTRL_FIFO_RESET;
+
+	if (i2c_write_regs(dev->bus, dev->addr, USER_CTRL, &value, 1) < 0)
+		return -1;
+	return i2c_write_regs(dev->bus, dev->addr, USER_CTRL, &user_ctrl, 1);
+}
+
+/* Set up the HMC5883L through the bypass switch, then hand it to the aux master on SLV0.
+ * Reads are spaced to the magnetometer's own 75 Hz so it isn't polled at every sample. */
+static int
+mpu_mag_setup(mpu_dev_t *dev, const mpu_config_t *cfg)
+{
+	const uint8_t hmc[3] = {HMC5883L_CRA_75HZ, HMC5883L_CRB_1G3, HMC5883L_MODE_CONT};
+	const uint8_t slv0[3] = {I2C_SLV_READ | HMC5883L_ADDR, HMC5883L_DATA,
+	                         I2C_SLV_EN | MPU_MAG_SIZE};
+	uint32_t odr = mpu_gyro_rate(cfg->dlpf) / (1 + cfg->smplrt_div);
+	uint32_t dly = (odr + HMC5883L_RATE - 1) / HMC5883L_RATE - 1;
+	uint8_t off = 0, bypass = INT_PIN_CFG_BYPASS;
+	uint8_t mst = I2C_MST_CTRL_WAIT_ES | I2C_MST_CLK_400K;
+	uint8_t delay = I2C_MST_DELAY_ES_SHADOW | I2C_MST_DELAY_SLV0;
+	uint8_t slv4 = dly > 31 ? 31 : dly;  // I2C_MST_DLY
+
+	if (i2c_write_regs(dev->bus, dev->addr, USER_CTRL, &off, 1) < 0 ||
+	    i2c_write_regs(dev->bus, dev->addr, INT_PIN_CFG, &bypass, 1) < 0)
+		return -1;
+	if (i2c_write_regs(dev->bus, HMC5883L_ADDR << 1, HMC5883L_CRA, hmc, sizeof(hmc)) < 0) {
+		i2c_write_regs(dev->bus, dev->addr, INT_PIN_CFG, &off, 1);
+		return -1;
+	}
+	if (i2c_write_regs(dev->bus, dev->addr, INT_PIN_CFG, &off, 1) < 0 ||
+	    i2c_write_regs(dev->bus, dev->addr, I2C_MST_CTRL, &mst, 1) < 0 ||
+	    i2c_write_regs(dev->bus, dev->addr, I2C_SLV0_ADDR, slv0, sizeof(slv0)) < 0 ||
+	    i2c_write_regs(dev->bus, dev->addr, I2C_SLV4_CTRL, &slv4, 1) < 0)
+		return -1;
+	return i2c_write_regs(dev->bus, dev->addr, I2C_MST_DELAY_CTRL, &delay, 1);
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief Write a sensor profile.
+        SMPLRT_DIV, CONFIG, GYRO_CONFIG and ACCEL_CONFIG are adjacent, so they go out as one
+        4-byte burst, then the FIFO is routed and restarted or switched off. Scaling done
+        with mpu_config() follows automatically. With mag set the HMC5883L is configured
+        and appended to every frame, see mpu_frame_size().
+        @param[in] dev  sensor
+        @param[in] cfg  profile, copied
+        @return 1 on success, -1 on a bad field or bus error
+        @example   mpu_configure(&imu, &mpu_profile_vibration);
+*/
+int
+mpu_configure(mpu_dev_t *dev, const mpu_config_t *cfg)
+{
+	uint8_t regs[4] = {cfg->smplrt_div, cfg->dlpf, cfg->gyro_fs << 3, cfg->accel_fs << 3};
+	uint8_t value = cfg->fifo ? FIFO_EN_FRAME | (cfg->mag ? FIFO_EN_SLV0 : 0) : 0;
+	uint8_t user_ctrl = mpu_user_ctrl(cfg);
+	uint8_t slv0_off = 0;
+
+	if (cfg->dlpf > 6 || cfg->gyro_fs > 3 || cfg->accel_fs > 3)
+		return -1;
+	if (i2c_write_regs(dev->bus, dev->addr, SMPLRT_DIV, regs, sizeof(regs)) < 0)
+		return -1;
+	if (cfg->mag ? mpu_mag_setup(dev, cfg) < 0
+	             : i2c_write_regs(dev->bus, dev->addr, I2C_SLV0_CTRL, &slv0_off, 1) < 0)
+		return -1;
+	if (i2c_write_regs(dev->bus, dev->addr, FIFO_EN, &value, 1) < 0)
+		return -1;
+	if (cfg->fifo) {
+		if (mpu_fifo_restart(dev, user_ctrl) < 0)
+			return -1;
+	} else if (i2c_write_regs(dev->bus, dev->addr, USER_CTRL, &user_ctrl, 1) < 0) {
+		return -1;
+	}
+	dev->cfg = *cfg;
+	return 1;
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief Configure the sensor, enable data ready and wake it up.
+        The registers are writable while the sensor sleeps, so the profile is written first
+        and the wake-up comes last, no delays in between.
+        @param[in] dev  sensor, bus and addr filled in, the bus already initialized
+        @param[in] cfg  boot profile
+        @return 1 on success, -1 on a bad field or bus error
+        @example   mpu_dev_t imu = {I2C1, MPU6050_ADDR}; mpu_init(&imu, &mpu_profile_low_power);
+*/
+int
+mpu_init(mpu_dev_t *dev, const mpu_config_t *cfg)
+{
+	uint8_t value = INT_ENABLE_DATA_RDY;
+
+	if (mpu_configure(dev, cfg) < 0 ||
+	    i2c_write_regs(dev->bus, dev->addr, INT_ENABLE, &value, 1) < 0)
+		return -1;
+	value = 0x00;  // out of sleep, internal 8 MHz oscillator
+	return i2c_write_regs(dev->bus, dev->addr, PWR_MGMT_1, &value, 1);
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief Profile currently in the sensor.
+        @example   mpu_accel_cg(raw.accel[0], mpu_config(&imu)->accel_fs);
+*/
+const mpu_config_t *
+mpu_config(const mpu_dev_t *dev)
+{
+	return &dev->cfg;
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief Time between samples of the active profile.
+        @return period in microseconds
+*/
+uint32_t
+mpu_sample_period_us(const mpu_dev_t *dev)
+{
+	return (1 + dev->cfg.smplrt_div) * 1000000 / mpu_gyro_rate(dev->cfg.dlpf);
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief SMPLRT_DIV giving the output rate nearest to hz.
+        @param[in] dlpf  DLPF_CFG the divider will be used with
+        @param[in] hz    wanted output data rate, clamped to what the divider can reach
+        @return divider value
+        @example   cfg.smplrt_div = mpu_odr_to_div(cfg.dlpf, 200);
+*/
+uint8_t
+mpu_odr_to_div(uint8_t dlpf, uint32_t hz)
+{
+	uint32_t rate = mpu_gyro_rate(dlpf);
+	uint32_t div;
+
+	if (hz == 0)
+		return 255;
+	div = (rate + hz / 2) / hz;
+	if (div == 0)
+		return 0;
+	return div > 256 ? 255 : div - 1;
+}
+
+/* Big-endian words on the bus */
+static void
+get_words(const uint8_t *buf, int16_t *w)
+{
+	for (int i = 0; i < 3; i++)
+		w[i] = (int16_t)((buf[2 * i] << 8) | buf[2 * i + 1]);
+}
+
+static void
+put_words(uint8_t *buf, const int16_t *w)
+{
+	for (int i = 0; i < 3; i++) {
+		buf[2 * i] = (uint16_t)w[i] >> 8;
+		buf[2 * i + 1] = w[i] & 0xFF;
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief Read the hardware bias offsets, two 6-byte bursts.
+        @return 1 on success, -1 on a bus error
+*/
+int
+mpu_read_offsets(mpu_dev_t *dev, mpu_offsets_t *offs)
+{
+	uint8_t buf[6];
+
+	if (i2c_read_regs(dev->bus, dev->addr, XA_OFFS_H, buf, sizeof(buf)) < 0)
+		return -1;
+	get_words(buf, offs->accel);
+	if (i2c_read_regs(dev->bus, dev->addr, XG_OFFS_USRH, buf, sizeof(buf)) < 0)
+		return -1;
+	get_words(buf, offs->gyro);
+	return 1;
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief Write the hardware bias offsets, two 6-byte bursts.
+        The registers are volatile, so this is repeated after every power-up.
+        @return 1 on success, -1 on a bus error
+        @example   if (flash copy valid) mpu_write_offsets(&imu, &saved);
+*/
+int
+mpu_write_offsets(mpu_dev_t *dev, const mpu_offsets_t *offs)
+{
+	uint8_t buf[6];
+
+	put_words(buf, offs->accel);
+	if (i2c_write_regs(dev->bus, dev->addr, XA_OFFS_H, buf, sizeof(buf)) < 0)
+		return -1;
+	put_words(buf, offs->gyro);
+	return i2c_write_regs(dev->bus, dev->addr, XG_OFFS_USRH, buf, sizeof(buf));
+}
+
+/* Rounded a / b for b > 0 */
+static int32_t
+div_round(int32_t a, int32_t b)
+{
+	return a >= 0 ? (a + b / 2) / b : -((-a + b / 2) / b);
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief Null gyro and accel bias from the average of stationary samples.
+        The sensor must lie still with one axis vertical, that axis keeps its 1 g.
+        Corrections are added to the offsets already in the sensor, so running it again
+        refines the result. Data registers are polled on DATA_RDY with the bus to itself,
+        the caller stops any other sampling first.
+        @param[in] dev      sensor, mpu_configure() done
+        @param[in] samples  1..MPU_CALIB_MAX, 256 or more for a settled average
+        @param[out] offs    offsets now in the sensor, for mpu_write_offsets() after a reset
+        @return 1 on success, -1 on a bus error, a data-ready timeout or a bad count
+*/
+int
+mpu_calibrate(mpu_dev_t *dev, uint16_t samples, mpu_offsets_t *offs)
+{
+	int32_t sum[6] = {0};
+	int32_t one_g = 16384 >> dev->cfg.accel_fs;
+	uint8_t frame[MPU_FRAME_SIZE], status;
+	mpu_raw_t raw;
+	int i, up = 0;
+
+	if (samples == 0 || samples > MPU_CALIB_MAX || mpu_read_offsets(dev, offs) < 0)
+		return -1;
+	for (uint16_t n = 0; n < samples; n++) {
+		uint32_t deadline = deadline_us(MPU_DRDY_TIMEOUT_US);
+
+		do {  // reading INT_STATUS clears it, so each sample is counted once
+			if (i2c_read_regs(dev->bus, dev->addr, INT_STATUS, &status, 1) < 0 ||
+			    deadline_expired(deadline))
+				return -1;
+		} while (!(status & INT_STATUS_DATA_RDY));
+		if (i2c_read_regs(dev->bus, dev->addr, ACCEL_XOUT_H, frame, sizeof(frame)) < 0)
+			return -1;
+		mpu_decode(frame, &raw);
+		for (i = 0; i < 3; i++) {
+			sum[i] += raw.accel[i];
+			sum[3 + i] += raw.gyro[i];
+		}
+	}
+	for (i = 0; i < 6; i++)
+		sum[i] = div_round(sum[i], samples);
+	for (i = 1; i < 3; i++) {
+		if ((sum[i] < 0 ? -sum[i] : sum[i]) > (sum[up] < 0 ? -sum[up] : sum[up]))
+			up = i;
+	}
+	sum[up] -= sum[up] < 0 ? -one_g : one_g;  // gravity is signal, not bias
+
+	for (i = 0; i < 3; i++) {
+		int32_t a = offs->accel[i] - div_round(sum[i] * (1 << dev->cfg.accel_fs), 8);
+		int32_t g = offs->gyro[i] - div_round(sum[3 + i] * (1 << dev->cfg.gyro_fs), 4);
+
+		a = a < -32768 ? -32768 : a > 32767 ? 32767 : a;
+		offs->accel[i] = (int16_t)((a & ~1) | (offs->accel[i] & 1));
+		offs->gyro[i] = (int16_t)(g < -32768 ? -32768 : g > 32767 ? 32767 : g);
+	}
+	return mpu_write_offsets(dev, offs);
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief Bytes per burst read and per FIFO frame under the active profile.
+        @return MPU_FRAME_SIZE, or MPU_FRAME_MAX with the magnetometer
+*/
+uint8_t
+mpu_frame_size(const mpu_dev_t *dev)
+{
+	return dev->cfg.mag ? MPU_FRAME_MAX : MPU_FRAME_SIZE;
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief Start a non-blocking ACCEL_XOUT_H.. burst read, magnetometer included if on.
+        @param[in] dev      sensor
+        @param[out] frame   mpu_frame_size() bytes, valid once the callback ran
+        @param[in] callback run from the bus interrupt, see i2c_async_read()
+        @return 1 when the read was started, -1 if the bus is busy or timed out
+*/
+int
+mpu_read_frame(mpu_dev_t *dev, uint8_t *frame, i2c_callback_t callback)
+{
+	return i2c_async_read(dev->bus, dev->addr, ACCEL_XOUT_H, frame, mpu_frame_size(dev),
+	                      callback);
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief Flush the FIFO and restart it on a frame boundary.
+        @return 1 on success, -1 on bus error
+*/
+int
+mpu_fifo_reset(mpu_dev_t *dev)
+{
+	return mpu_fifo_restart(dev, mpu_user_ctrl(&dev->cfg));
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief Number of whole frames waiting in the FIFO.
+        An overflow leaves a partial frame at the read side, so on FIFO_OFLOW the FIFO is
+        reset and 0 is returned.
+        @return frame count, or -1 on bus error
+        @example   int n = mpu_fifo_frames(&imu);
+*/
+int
+mpu_fifo_frames(mpu_dev_t *dev)
+{
+	uint8_t status;
+	uint8_t count[2];
+
+	if (i2c_read_regs(dev->bus, dev->addr, INT_STATUS, &status, 1) < 0)
+		return -1;
+	if (status & INT_STATUS_FIFO_OFLOW) {
+		mpu_fifo_overflows++;
+		return mpu_fifo_reset(dev) < 0 ? -1 : 0;
+	}
+	if (i2c_read_regs(dev->bus, dev->addr, FIFO_COUNTH, count, 2) < 0)
+		return -1;
+	return ((count[0] << 8) | count[1]) / mpu_frame_size(dev);
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief Drain frames from the FIFO in one DMA burst.
+        @param[in] dev      sensor
+        @param[in] buf      frames * mpu_frame_size() bytes
+        @param[in] frames   whole frames to read, at most mpu_fifo_frames()
+        @param[in] callback run from the bus interrupt once the frames are in buf
+        @return 1 when the transfer was started, -1 otherwise
+        @example   mpu_fifo_read(&imu, buf, n, batch_done);
+*/
+int
+mpu_fifo_read(mpu_dev_t *dev, uint8_t *buf, uint16_t frames, i2c_callback_t callback)
+{
+	return i2c_async_read(dev->bus, dev->addr, FIFO_R_W, buf, frames * mpu_frame_size(dev),
+	                      callback);
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief Park the sensor in accel-only cycle mode with the motion interrupt.
+        The gyros and the temperature sensor stop, the accel wakes at the lp_wake rate for
+        one high-passed sample and INT pulses when any axis moved more than threshold
+        (about 10 uA at 1.25 Hz against 3.8 mA awake). FIFO, aux master and data ready are
+        off meanwhile. The profile stays in the dev for mpu_cycle_exit(), so mpu_config()
+        keeps reporting it.
+        @param[in] dev        sensor, mpu_init() done
+        @param[in] threshold  motion threshold in MPU_MOT_LSB_MG mg counts, 1..255
+        @param[in] lp_wake    MPU_LP_WAKE_1HZ25 .. MPU_LP_WAKE_40HZ
+        @return 1 on success, -1 on a bad argument or bus error
+        @example   mpu_cycle_enter(&imu, 20, MPU_LP_WAKE_5HZ);  // 40 mg, 5 Hz
+*/
+int
+mpu_cycle_enter(mpu_dev_t *dev, uint8_t threshold, uint8_t lp_wake)
+{
+	uint8_t off = 0;
+	uint8_t accel = dev->cfg.accel_fs << 3 | ACCEL_CONFIG_HPF_5HZ;
+	uint8_t mot[2] = {threshold, 1};  // MOT_THR, MOT_DUR: no wait past the first sample
+	uint8_t ctrl = MOT_DETECT_ON_DELAY_3MS;
+	uint8_t irq = INT_ENABLE_MOT;
+	uint8_t pwr2 = PWR_MGMT_2_STBY_G | PWR_MGMT_2_LP_WAKE(lp_wake);
+	uint8_t pwr1 = PWR_MGMT_1_CYCLE | PWR_MGMT_1_TEMP_DIS;
+
+	if (threshold == 0 || lp_wake > MPU_LP_WAKE_40HZ)
+		return -1;
+	if (i2c_write_regs(dev->bus, dev->addr, USER_CTRL, &off, 1) < 0 ||
+	    i2c_write_regs(dev->bus, dev->addr, FIFO_EN, &off, 1) < 0 ||
+	    i2c_write_regs(dev->bus, dev->addr, ACCEL_CONFIG, &accel, 1) < 0 ||
+	    i2c_write_regs(dev->bus, dev->addr, MOT_THR, mot, sizeof(mot)) < 0 ||
+	    i2c_write_regs(dev->bus, dev->addr, MOT_DETECT_CTRL, &ctrl, 1) < 0 ||
+	    i2c_write_regs(dev->bus, dev->addr, INT_ENABLE, &irq, 1) < 0 ||
+	    i2c_write_regs(dev->bus, dev->addr, PWR_MGMT_2, &pwr2, 1) < 0)
+		return -1;
+	return i2c_write_regs(dev->bus, dev->addr, PWR_MGMT_1, &pwr1, 1);
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief Leave cycle mode for the profile the sensor had before mpu_cycle_enter().
+        Everything is awake again once this returns and data ready is back on, but the
+        gyros take about 30 ms to settle, so the first samples after a wake carry some
+        gyro offset.
+        @return 1 on success, -1 on a bus error
+        @example   if (INT_STATUS & INT_STATUS_MOT) mpu_cycle_exit(&imu);
+*/
+int
+mpu_cycle_exit(mpu_dev_t *dev)
+{
+	mpu_config_t cfg = dev->cfg;
+	uint8_t value = 0x00;  // awake, internal 8 MHz oscillator, gyros and temp back on
+
+	if (i2c_write_regs(dev->bus, dev->addr, PWR_MGMT_1, &value, 1) < 0 ||
+	    i2c_write_regs(dev->bus, dev->addr, PWR_MGMT_2, &value, 1) < 0 ||
+	    mpu_configure(dev, &cfg) < 0)  // ACCEL_CONFIG without the high-pass, FIFO restarted
+		return -1;
+	value = INT_ENABLE_DATA_RDY;
+	return i2c_write_regs(dev->bus, dev->addr, INT_ENABLE, &value, 1);
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief Read INT_STATUS, which clears it and releases a latched INT pin.
+        @return INT_STATUS_* bits, or -1 on a bus error
+        @example   if (mpu_int_status(&imu) & INT_STATUS_MOT)  // woken by motion
+*/
+int
+mpu_int_status(mpu_dev_t *dev)
+{
+	uint8_t status;
+
+	if (i2c_read_regs(dev->bus, dev->addr, INT_STATUS, &status, 1) < 0)
+		return -1;
+	return status;
+}
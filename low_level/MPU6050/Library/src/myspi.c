@@ -1,4 +1,7 @@
 #include "myspi.h"
+#include "timer.h"
+
+#include <stddef.h>
 
 /** @brief Configure the SPI as Master.
 The SPI peripheral is configured as a master with communication parameters
@@ -17,9 +20,6 @@ the NSS pin.
 spi_lsbfirst.
 @returns int. Error code.
 */
-typedef enum { NONE = 0, ONE, DONE } trans_status;
-volatile trans_status transceive_status;
-
 int
 spi_init_master(SPI_TypeDef *SPI, uint32_t br, uint32_t cpol, uint32_t cpha, uint32_t dff,
                 uint32_t lsbfirst, uint8_t remap)
@@ -51,8 +51,9 @@ spi_init_master(SPI_TypeDef *SPI, uint32_t br, uint32_t cpol, uint32_t cpha, uin
 			RCC->APB2ENR |= 1;          // Enable Alternate Function
 			RCC->APB2ENR |= (1 << 2);   // Enable GPIOA CLOCK
 			RCC->APB2ENR |= (1 << 12);  // Enable SPI1 CLOCK
-			portInitAlt(GPIOA, 0x00A0);
-			GPIOA->CRL |= (8 << 24);
+			/* PA5 SCK and PA7 MOSI AF push-pull, PA6 MISO input, the rest of GPIOA
+			 * (USART1 on PA9/PA10 among them) is left as it is */
+			GPIOA->CRL = (GPIOA->CRL & ~0xFFF00000UL) | 0xB8B00000UL;
 		} else if (SPI == SPI2) {
 			RCC->APB2ENR |= 1;          // Enable Alternate Function
 			RCC->APB2ENR |= (1 << 3);   // Enable GPIOB CLOCK
@@ -309,265 +310,234 @@ spi_enable_ss_output(SPI_TypeDef *SPI)
 	SPI->CR2 |= SPI_CR2_SSOE;
 }
 
-/* SPI transmit completed with DMA */
-void
-DMAChannel3_IRQHandler(void)
-{
-	if ((DMA1_ISR & DMA_ISR_TCIF3) != 0) {
-		DMA1_IFCR |= DMA_IFCR_CTCIF3;
-	}
+/* SPI1 DMA: channel 2 receives, channel 3 transmits. SPI2 has no usable DMA here, its
+ * channels 4 and 5 carry the USART1 TX ring and RX. */
+#define SPI1_RX_DMA_CHANNEL DMA_CHANNEL2
+#define SPI1_TX_DMA_CHANNEL DMA_CHANNEL3
 
-	dma_disable_transfer_complete_interrupt(DMA1, DMA_CHANNEL3);
+typedef struct {
+	const uint8_t *tx;
+	uint8_t *rx;
+	uint16_t len;
+	spi_callback_t callback;
+} spi_dma_xfer_t;
 
-	spi_disable_tx_dma(SPI1);
+/* Ping-pong: slot[head] is on the wire, the other one starts from the interrupt */
+static spi_dma_xfer_t spi1_dma_slot[SPI_DMA_SLOTS];
+static volatile uint8_t spi1_dma_head, spi1_dma_count;
+static const uint8_t spi_dma_fill = 0xFF;  // clocked out when there is no tx buffer
+static uint8_t spi_dma_sink;               // received bytes nobody asked for
 
-	dma_disable_channel(DMA1, DMA_CHANNEL3);
-
-	// transceive_status++;
-}
-/* SPI2 transmit completed with DMA */
-void
-DMAChannel5_IRQHandler(void)
+static void
+Spi1_Dma_Start(const spi_dma_xfer_t *x)
 {
-	if ((DMA1_ISR & DMA_ISR_TCIF5) != 0) {
-		DMA1_IFCR |= DMA_IFCR_CTCIF5;
-	}
-
-	dma_disable_transfer_complete_interrupt(DMA1, DMA_CHANNEL5);
-
-	spi_disable_tx_dma(SPI2);
-
-	dma_disable_channel(DMA1, DMA_CHANNEL5);
-
-	// transceive_status++;
-}
-/* SPI receive completed with DMA */
-void
-DMAChannel2_IRQHandler(void)
+	volatile uint16_t drain;
+
+	while (SPI1->SR & (SPI_SR_RXNE | SPI_SR_OVR))
+		drain = SPI1->DR;  // a stale byte would shift the rx buffer by one
+	(void)drain;
+
+	/* Rx first and at a higher priority, so the byte in DR is always taken before the
+	 * next one lands on it */
+	dma_channel_reset(DMA1, SPI1_RX_DMA_CHANNEL);
+	dma_set_peripheral_address(DMA1, SPI1_RX_DMA_CHANNEL, (u32)&SPI1->DR);
+	dma_set_memory_address(DMA1, SPI1_RX_DMA_CHANNEL, x->rx ? (u32)x->rx : (u32)&spi_dma_sink);
+	dma_set_number_of_data(DMA1, SPI1_RX_DMA_CHANNEL, x->len);
+	dma_set_read_from_peripheral(DMA1, SPI1_RX_DMA_CHANNEL);
+	if (x->rx)
+		dma_enable_memory_increment_mode(DMA1, SPI1_RX_DMA_CHANNEL);
+	dma_set_peripheral_size(DMA1, SPI1_RX_DMA_CHANNEL, DMA_CCR_PSIZE_8BIT);
+	dma_set_memory_size(DMA1, SPI1_RX_DMA_CHANNEL, DMA_CCR_MSIZE_8BIT);
+	dma_set_priority(DMA1, SPI1_RX_DMA_CHANNEL, DMA_CCR_PL_VERY_HIGH);
+	dma_enable_transfer_complete_interrupt(DMA1, SPI1_RX_DMA_CHANNEL);
+	dma_enable_transfer_error_interrupt(DMA1, SPI1_RX_DMA_CHANNEL);
+	dma_enable_channel(DMA1, SPI1_RX_DMA_CHANNEL);
+
+	dma_channel_reset(DMA1, SPI1_TX_DMA_CHANNEL);
+	dma_set_peripheral_address(DMA1, SPI1_TX_DMA_CHANNEL, (u32)&SPI1->DR);
+	dma_set_memory_address(DMA1, SPI1_TX_DMA_CHANNEL, x->tx ? (u32)x->tx : (u32)&spi_dma_fill);
+	dma_set_number_of_data(DMA1, SPI1_TX_DMA_CHANNEL, x->len);
+	dma_set_read_from_memory(DMA1, SPI1_TX_DMA_CHANNEL);
+	if (x->tx)
+		dma_enable_memory_increment_mode(DMA1, SPI1_TX_DMA_CHANNEL);
+	dma_set_peripheral_size(DMA1, SPI1_TX_DMA_CHANNEL, DMA_CCR_PSIZE_8BIT);
+	dma_set_memory_size(DMA1, SPI1_TX_DMA_CHANNEL, DMA_CCR_MSIZE_8BIT);
+	dma_set_priority(DMA1, SPI1_TX_DMA_CHANNEL, DMA_CCR_PL_HIGH);
+	dma_enable_transfer_error_interrupt(DMA1, SPI1_TX_DMA_CHANNEL);
+	dma_enable_channel(DMA1, SPI1_TX_DMA_CHANNEL);
+
+	SPI1->CR2 |= SPI_CR2_RXDMAEN | SPI_CR2_TXDMAEN;
+}
+
+/* The rx channel finishes last: its final byte was clocked in after the final tx byte
+ * went out, so the bus is idle and the next transfer can start right away. */
+static void
+Spi1_Dma_Done(int status)
 {
-	if ((DMA1_ISR & DMA_ISR_TCIF2) != 0) {
-		DMA1_IFCR |= DMA_IFCR_CTCIF2;
-	}
+	spi_callback_t callback;
 
-	dma_disable_transfer_complete_interrupt(DMA1, DMA_CHANNEL2);
+	DMA1_IFCR = DMA_IFCR_CIF(SPI1_RX_DMA_CHANNEL) | DMA_IFCR_CIF(SPI1_TX_DMA_CHANNEL);
+	dma_disable_channel(DMA1, SPI1_RX_DMA_CHANNEL);
+	dma_disable_channel(DMA1, SPI1_TX_DMA_CHANNEL);
+	SPI1->CR2 &= ~(SPI_CR2_RXDMAEN | SPI_CR2_TXDMAEN);
 
-	spi_disable_rx_dma(SPI1);
+	if (!spi1_dma_count)
+		return;
+	callback = spi1_dma_slot[spi1_dma_head].callback;
+	spi1_dma_head = (spi1_dma_head + 1) % SPI_DMA_SLOTS;
+	spi1_dma_count--;
+	if (spi1_dma_count)
+		Spi1_Dma_Start(&spi1_dma_slot[spi1_dma_head]);  // the queued buffer, no gap
+	if (callback)
+		callback(status);
+}
 
-	dma_disable_channel(DMA1, DMA_CHANNEL2);
-	// transceive_status++;
+/*---------------------------------------------------------------------------*/
+/** @brief Prepare DMA1 channels 2 and 3 for spi_dma_submit() on SPI1.
+        Enables the DMA clock and both channel interrupts. Call once after
+        spi_init_master(SPI1, ...) and spi_enable(SPI1).
+        @return 1 on success, -1 for SPI2 and SPI3, which have no free channels
+        @example   spi_dma_init(SPI1);
+*/
+int
+spi_dma_init(SPI_TypeDef *SPI)
+{
+	if (SPI != SPI1)
+		return -1;
+	CLOCK_BUS_HIGH |= DMACLOCK_ENABLE;
+	dma_channel_reset(DMA1, SPI1_RX_DMA_CHANNEL);
+	dma_channel_reset(DMA1, SPI1_TX_DMA_CHANNEL);
+	spi1_dma_head = spi1_dma_count = 0;
+	nvic_enable_irq(NVIC_DMA1_CHANNEL2_IRQ);
+	nvic_enable_irq(NVIC_DMA1_CHANNEL3_IRQ);
+	return 1;
 }
 
-/* SPI3 receive completed with DMA */
-void
-DMAChannel4_IRQHandler(void)
+/*---------------------------------------------------------------------------*/
+/** @brief Queue a full-duplex DMA transfer of 8-bit frames, without waiting for it.
+        Up to SPI_DMA_SLOTS transfers are outstanding: with one on the wire the next is
+        started from its completion interrupt with no idle gap, so a producer fills one
+        buffer while the other is being clocked out. The buffers are used in place, they
+        must stay valid and untouched until the callback. Chip select is the caller's,
+        the callback is the place to release it. Safe from interrupt context, the
+        callback included.
+        @param[in] tx       bytes to send, NULL clocks out 0xFF
+        @param[out] rx      received bytes, NULL discards them
+        @param[in] len      1..65535
+        @param[in] callback run from the DMA interrupt with 1 or -1 on a DMA error, may be NULL
+        @return 1 when started or queued, -1 if both slots are taken, len is 0 or not SPI1
+        @example   spi_dma_submit(SPI1, page[fill ^ 1], NULL, sizeof(page[0]), page_sent);
+*/
+int
+spi_dma_submit(SPI_TypeDef *SPI, const uint8_t *tx, uint8_t *rx, uint16_t len,
+               spi_callback_t callback)
 {
-	if ((DMA1_ISR & DMA_ISR_TCIF4) != 0) {
-		DMA1_IFCR |= DMA_IFCR_CTCIF4;
+	spi_dma_xfer_t *x;
+	uint32_t primask;
+
+	if (SPI != SPI1 || len == 0)
+		return -1;
+	primask = irq_save();
+	if (spi1_dma_count == SPI_DMA_SLOTS) {
+		irq_restore(primask);
+		return -1;
 	}
+	x = &spi1_dma_slot[(spi1_dma_head + spi1_dma_count) % SPI_DMA_SLOTS];
+	x->tx = tx;
+	x->rx = rx;
+	x->len = len;
+	x->callback = callback;
+	if (spi1_dma_count++ == 0)
+		Spi1_Dma_Start(x);
+	irq_restore(primask);
+	return 1;
+}
 
-	dma_disable_transfer_complete_interrupt(DMA1, DMA_CHANNEL4);
-
-	spi_disable_rx_dma(SPI2);
-
-	dma_disable_channel(DMA1, DMA_CHANNEL4);
+/*---------------------------------------------------------------------------*/
+/** @brief Number of spi_dma_submit() transfers not completed yet.
+        @return 0 when idle, up to SPI_DMA_SLOTS
+*/
+int
+spi_dma_busy(SPI_TypeDef *SPI)
+{
+	return SPI == SPI1 ? spi1_dma_count : 0;
 }
 
+/* SPI1 receive complete or error */
 void
-spi1_dma_transmit(uint8_t *tx_buf, int tx_len)
+DMA1_Channel2_IRQHandler(void)
 {
-	volatile uint8_t temp_data;
-	dma_channel_reset(DMA1, DMA_CHANNEL3);
-
-	/* Reset SPI data and status registers.
-	 * Here we assume that the SPI peripheral is NOT
-	 * busy any longer, i.e. the last activity was verified
-	 * complete elsewhere in the program.
-	 */
-	/*
-	    while (SPI1->SR  & (SPI_SR_RXNE | SPI_SR_OVR)) {
-	        temp_data = SPI1->DR ;
-	    }
-	    */
-	transceive_status = ONE;
-	/* Set up tx dma */
-	if (tx_len > 0) {
-		dma_set_peripheral_address(DMA1, DMA_CHANNEL3, (uint32_t)&SPI1->DR);
-		dma_set_memory_address(DMA1, DMA_CHANNEL3, (uint32_t)tx_buf);
-		dma_set_number_of_data(DMA1, DMA_CHANNEL3, tx_len);
-		dma_set_read_from_memory(DMA1, DMA_CHANNEL3);
-		dma_enable_memory_increment_mode(DMA1, DMA_CHANNEL3);
-		dma_set_peripheral_size(DMA1, DMA_CHANNEL3, DMA_CCR_PSIZE_8BIT);
-		dma_set_memory_size(DMA1, DMA_CHANNEL3, DMA_CCR_MSIZE_8BIT);
-		dma_set_priority(DMA1, DMA_CHANNEL3, DMA_CCR_PL_LOW);
-		dma_enable_transfer_complete_interrupt(DMA1, DMA_CHANNEL3);
-		dma_enable_channel(DMA1, DMA_CHANNEL3);
-		spi_enable_tx_dma(SPI1);
-	}
-	while (!(SPI1->SR & SPI_SR_TXE))
-		;  // Wait for bus free
-	while (SPI1->SR & SPI_SR_BSY)
-		;
+	Spi1_Dma_Done((DMA1_ISR & DMA_ISR_TEIF(SPI1_RX_DMA_CHANNEL)) ? -1 : 1);
 }
+
+/* SPI1 transmit error only, completion is taken from the rx side */
 void
-spi1_dma_receive(uint8_t *rx_buf, int rx_len)
+DMA1_Channel3_IRQHandler(void)
 {
-	volatile uint8_t temp_data;
-	dma_channel_reset(DMA1, DMA_CHANNEL2);
-
-	/* Reset SPI data and status registers.
-	 * Here we assume that the SPI peripheral is NOT
-	 * busy any longer, i.e. the last activity was verified
-	 * complete elsewhere in the program.
-	 */
-	/*
-	   while (SPI1->SR  & (SPI_SR_RXNE | SPI_SR_OVR)) {
-	       temp_data = SPI1->DR ;
-	   }
-	   */
-	// transceive_status = ONE;
-	/* Set up tx dma */
-
-	/* Set up rx dma, note it has higher priority to avoid overrun */
-	if (rx_len > 0) {
-		dma_set_peripheral_address(DMA1, DMA_CHANNEL2, (uint32_t)&SPI1->DR);
-		dma_set_memory_address(DMA1, DMA_CHANNEL2, (uint32_t)rx_buf);
-		dma_set_number_of_data(DMA1, DMA_CHANNEL2, rx_len);
-		dma_set_read_from_peripheral(DMA1, DMA_CHANNEL2);
-		dma_enable_memory_increment_mode(DMA1, DMA_CHANNEL2);
-		dma_set_peripheral_size(DMA1, DMA_CHANNEL2, DMA_CCR_PSIZE_8BIT);
-		dma_set_memory_size(DMA1, DMA_CHANNEL2, DMA_CCR_MSIZE_8BIT);
-		dma_set_priority(DMA1, DMA_CHANNEL2, DMA_CCR_PL_HIGH);
-		dma_enable_transfer_complete_interrupt(DMA1, DMA_CHANNEL2);
-		dma_enable_channel(DMA1, DMA_CHANNEL2);
-		spi_enable_rx_dma(SPI1);
-	}
-	while (!(SPI1->SR & SPI_SR_TXE))
-		;
-	// BSY=0
+	if (DMA1_ISR & DMA_ISR_TEIF(SPI1_TX_DMA_CHANNEL))
+		Spi1_Dma_Done(-1);
 }
 
-int
-spi_dma_transceive(uint8_t *tx_buf, int tx_len, uint8_t *rx_buf, int rx_len)
+static volatile int spi_dma_wait_status;
 
+static void
+Spi_Dma_Wait_Done(int status)
 {
-	volatile uint8_t temp_data;
-	/* Check for 0 length in both tx and rx */
-	/*if ((rx_len < 1) && (tx_len < 1)) {
-	     return -1 as error */
-	/*return -1;
+	spi_dma_wait_status = status;
 }
-*/
-	/* Reset DMA channels*/
-	dma_channel_reset(DMA1, DMA_CHANNEL3);
-	dma_channel_reset(DMA1, DMA_CHANNEL2);
-
-	/* Reset SPI data and status registers.
-	 * Here we assume that the SPI peripheral is NOT
-	 * busy any longer, i.e. the last activity was verified
-	 * complete elsewhere in the program.
-	 */
-
-	while (SPI1->SR & (SPI_SR_RXNE | SPI_SR_OVR)) {
-		temp_data = SPI1->DR;
-	}
-
-	/* Set up rx dma, note it has higher priority to avoid overrun */
-	if (rx_len > 0) {
-		dma_set_peripheral_address(DMA1, DMA_CHANNEL2, (uint32_t)&SPI1->DR);
-		dma_set_memory_address(DMA1, DMA_CHANNEL2, (uint32_t)rx_buf);
-		dma_set_number_of_data(DMA1, DMA_CHANNEL2, rx_len);
-		dma_set_read_from_peripheral(DMA1, DMA_CHANNEL2);
-		dma_enable_memory_increment_mode(DMA1, DMA_CHANNEL2);
-		dma_set_peripheral_size(DMA1, DMA_CHANNEL2, DMA_CCR_PSIZE_8BIT);
-		dma_set_memory_size(DMA1, DMA_CHANNEL2, DMA_CCR_MSIZE_8BIT);
-		dma_set_priority(DMA1, DMA_CHANNEL2, DMA_CCR_PL_VERY_HIGH);
-		dma_enable_transfer_complete_interrupt(DMA1, DMA_CHANNEL2);
-		dma_enable_channel(DMA1, DMA_CHANNEL2);
-		spi_enable_rx_dma(SPI1);
-	}
 
-	transceive_status = ONE;
-	/* Set up tx dma */
-	if (tx_len > 0) {
-		dma_set_peripheral_address(DMA1, DMA_CHANNEL3, (uint32_t)&SPI1->DR);
-		dma_set_memory_address(DMA1, DMA_CHANNEL3, (uint32_t)tx_buf);
-		dma_set_number_of_data(DMA1, DMA_CHANNEL3, tx_len);
-		dma_set_read_from_memory(DMA1, DMA_CHANNEL3);
-		dma_enable_memory_increment_mode(DMA1, DMA_CHANNEL3);
-		dma_set_peripheral_size(DMA1, DMA_CHANNEL3, DMA_CCR_PSIZE_8BIT);
-		dma_set_memory_size(DMA1, DMA_CHANNEL3, DMA_CCR_MSIZE_8BIT);
-		dma_set_priority(DMA1, DMA_CHANNEL3, DMA_CCR_PL_HIGH);
-		dma_enable_transfer_complete_interrupt(DMA1, DMA_CHANNEL3);
-		dma_enable_channel(DMA1, DMA_CHANNEL3);
-		spi_enable_tx_dma(SPI1);
-	}
-	while (!(SPI1->SR & SPI_SR_TXE))
-		;  // Wait for bus free
-	while (SPI1->SR & SPI_SR_BSY)
-		;
+/* Stop both channels and drop the queue, after a transfer that never completed */
+static void
+Spi1_Dma_Abort(void)
+{
+	uint32_t primask = irq_save();
 
-	return 0;
+	DMA1_IFCR = DMA_IFCR_CIF(SPI1_RX_DMA_CHANNEL) | DMA_IFCR_CIF(SPI1_TX_DMA_CHANNEL);
+	dma_disable_channel(DMA1, SPI1_RX_DMA_CHANNEL);
+	dma_disable_channel(DMA1, SPI1_TX_DMA_CHANNEL);
+	SPI1->CR2 &= ~(SPI_CR2_RXDMAEN | SPI_CR2_TXDMAEN);
+	spi1_dma_head = spi1_dma_count = 0;
+	irq_restore(primask);
 }
-// spi2
 
+/*---------------------------------------------------------------------------*/
+/** @brief Blocking DMA transfer on SPI1, waits for the completion interrupt.
+        With both buffers the lengths must match, SPI clocks the same count each way.
+        Not from an interrupt at or above the DMA priority, it would time out. A transfer
+        still running after SPI_DMA_TIMEOUT_US plus SPI_DMA_BYTE_US per byte (SPI1 not
+        enabled, the DMA clock off) is stopped and the queue emptied.
+        @return 1 when done, -1 on a length mismatch, a busy queue, a DMA error or a timeout
+*/
 int
-spi2_dma_transceive(uint8_t *tx_buf, int tx_len, uint8_t *rx_buf, int rx_len)
+spi_dma_transceive(uint8_t *tx_buf, int tx_len, uint8_t *rx_buf, int rx_len)
+{
+	int len = tx_len > rx_len ? tx_len : rx_len;
+	uint32_t deadline;
+
+	if (tx_len > 0 && rx_len > 0 && tx_len != rx_len)
+		return -1;
+	spi_dma_wait_status = 0;
+	if (spi_dma_submit(SPI1, tx_len > 0 ? tx_buf : NULL, rx_len > 0 ? rx_buf : NULL,
+	                   (uint16_t)len, Spi_Dma_Wait_Done) < 0)
+		return -1;
+	deadline = deadline_us(SPI_DMA_TIMEOUT_US + (uint32_t)len * SPI_DMA_BYTE_US);
+	while (!spi_dma_wait_status) {
+		if (deadline_expired(deadline)) {
+			Spi1_Dma_Abort();
+			return spi_dma_wait_status ? spi_dma_wait_status : -1;
+		}
+	}
+	return spi_dma_wait_status;
+}
 
+void
+spi1_dma_transmit(uint8_t *tx_buf, int tx_len)
 {
-	volatile uint8_t temp_data;
-	/* Check for 0 length in both tx and rx */
-	/*if ((rx_len < 1) && (tx_len < 1)) {
-	     return -1 as error */
-	/*return -1;
+	spi_dma_transceive(tx_buf, tx_len, NULL, 0);
 }
-*/
-	/* Reset DMA channels*/
-	dma_channel_reset(DMA1, DMA_CHANNEL4);
-	dma_channel_reset(DMA1, DMA_CHANNEL5);
-
-	/* Reset SPI data and status registers.
-	 * Here we assume that the SPI peripheral is NOT
-	 * busy any longer, i.e. the last activity was verified
-	 * complete elsewhere in the program.
-	 */
-
-	while (SPI2->SR & (SPI_SR_RXNE | SPI_SR_OVR)) {
-		temp_data = SPI1->DR;
-	}
-	/* Set up rx dma, note it has higher priority to avoid overrun */
-	if (rx_len > 0) {
-		dma_set_peripheral_address(DMA1, DMA_CHANNEL4, (uint32_t)&SPI2->DR);
-		dma_set_memory_address(DMA1, DMA_CHANNEL4, (uint32_t)rx_buf);
-		dma_set_number_of_data(DMA1, DMA_CHANNEL4, rx_len);
-		dma_set_read_from_peripheral(DMA1, DMA_CHANNEL4);
-		dma_enable_memory_increment_mode(DMA1, DMA_CHANNEL4);
-		dma_set_peripheral_size(DMA1, DMA_CHANNEL4, DMA_CCR_PSIZE_8BIT);
-		dma_set_memory_size(DMA1, DMA_CHANNEL4, DMA_CCR_MSIZE_8BIT);
-		dma_set_priority(DMA1, DMA_CHANNEL4, DMA_CCR_PL_VERY_HIGH);
-		dma_enable_transfer_complete_interrupt(DMA1, DMA_CHANNEL4);
-		dma_enable_channel(DMA1, DMA_CHANNEL4);
-		spi_enable_rx_dma(SPI2);
-	}
 
-	transceive_status = ONE;
-	/* Set up tx dma */
-	if (tx_len > 0) {
-		dma_set_peripheral_address(DMA1, DMA_CHANNEL5, (uint32_t)&SPI2->DR);
-		dma_set_memory_address(DMA1, DMA_CHANNEL5, (uint32_t)tx_buf);
-		dma_set_number_of_data(DMA1, DMA_CHANNEL5, tx_len);
-		dma_set_read_from_memory(DMA1, DMA_CHANNEL5);
-		dma_enable_memory_increment_mode(DMA1, DMA_CHANNEL5);
-		dma_set_peripheral_size(DMA1, DMA_CHANNEL5, DMA_CCR_PSIZE_8BIT);
-		dma_set_memory_size(DMA1, DMA_CHANNEL5, DMA_CCR_MSIZE_8BIT);
-		dma_set_priority(DMA1, DMA_CHANNEL5, DMA_CCR_PL_HIGH);
-		dma_enable_transfer_complete_interrupt(DMA1, DMA_CHANNEL5);
-		dma_enable_channel(DMA1, DMA_CHANNEL5);
-		spi_enable_tx_dma(SPI2);
-	}
-	/* if(PINA&0x0020==0)
-	{ // for 100 ms then an error happened
-   return -1;
-	}
-	else*/
-	return 0;
+void
+spi1_dma_receive(uint8_t *rx_buf, int rx_len)
+{
+	spi_dma_transceive(NULL, 0, rx_buf, rx_len);
 }
@@ -0,0 +1,540 @@
+/* @file 			 : norlog.c
+ *  @Description: Sample capture log on an external SPI NOR flash, see norlog.h.
+ */
+#include "norlog.h"
+#include "myspi.h"
+#include "telemetry.h"
+#include "timer.h"
+#include "usart.h"
+
+#include <string.h>
+
+#define NOR_CS_PIN 4            // PA4
+#define NOR_POLL_US 50          // status register polling interval while the chip is busy
+#define NOR_INIT_TIMEOUT_US 500000  // a chip erase left running by a reset still blocks init
+#define NOR_PAGES_PER_SECTOR (NORLOG_SECTOR_SIZE / NORLOG_PAGE_SIZE)
+#define NOR_CS_HIGH_READS 4     // GPIOA reads between two commands, >= 100 ns, tSHSL is 50 ns
+
+/* What the SPI bus is doing, the DMA callbacks put it back to NOR_OP_IDLE */
+enum { NOR_OP_IDLE, NOR_OP_PROGRAM, NOR_OP_ERASE, NOR_OP_STATUS, NOR_OP_READ };
+
+norlog_stats_t norlog_stats;
+
+/* Addresses are virtual: they only ever grow and the chip address is addr & mask, which
+ * stays right across the 2^32 wrap because the size is a power of two. */
+static struct {
+	uint32_t mask;
+	uint32_t head;          // next page to program
+	uint32_t erased_end;    // the chip is erased from head up to here
+	uint32_t erase_target;  // erased space wanted ahead of head
+	uint32_t seq;           // seq of the next page
+	volatile uint8_t op;    // NOR_OP_*
+	volatile uint8_t wip;   // the chip is programming or erasing
+	uint32_t poll_at;       // micros() deadline of the next status read
+	uint8_t size;           // bytes per sample of the running capture
+	uint8_t fill;           // samples in the page being filled
+	volatile uint32_t queued;  // full pages handed over, written by the main loop only
+	volatile uint32_t done;    // pages programmed, written by the DMA callback only
+	uint32_t dump_addr;     // next page to read out
+	uint32_t dump_left;     // pages left to read out
+	volatile uint8_t dump_read;  // bufs[0] holds the page at dump_addr
+} nor;
+
+/* Page buffers, programmed in place by DMA. bufs[queued % N] is being filled. */
+static uint8_t bufs[NORLOG_PAGE_BUFS][NORLOG_PAGE_SIZE];
+static uint8_t nor_cmd[4];
+static uint8_t nor_status[2];
+static const uint8_t nor_wren = NOR_CMD_WREN;
+static const uint8_t nor_rdsr[2] = {NOR_CMD_RDSR, 0xFF};
+
+static inline void
+Nor_Select(void)
+{
+	GPIOA->BRR = 1 << NOR_CS_PIN;
+}
+
+static inline void
+Nor_Deselect(void)
+{
+	GPIOA->BSRR = 1 << NOR_CS_PIN;
+}
+
+/* End one command and start the next, chip select high for at least tSHSL in between */
+static void
+Nor_Reselect(void)
+{
+	Nor_Deselect();
+	for (int i = 0; i < NOR_CS_HIGH_READS; i++)
+		(void)GPIOA->IDR;
+	Nor_Select();
+}
+
+static void
+Put_U16(uint8_t *p, uint16_t v)
+{
+	p[0] = v & 0xFF;
+	p[1] = v >> 8;
+}
+
+static void
+Put_U32(uint8_t *p, uint32_t v)
+{
+	Put_U16(p, v & 0xFFFF);
+	Put_U16(p + 2, v >> 16);
+}
+
+static uint16_t
+Get_U16(const uint8_t *p)
+{
+	return p[0] | p[1] << 8;
+}
+
+static uint32_t
+Get_U32(const uint8_t *p)
+{
+	return Get_U16(p) | (uint32_t)Get_U16(p + 2) << 16;
+}
+
+static void
+Cmd_Addr(uint8_t cmd, uint32_t addr)
+{
+	nor_cmd[0] = cmd;
+	nor_cmd[1] = (addr >> 16) & 0xFF;
+	nor_cmd[2] = (addr >> 8) & 0xFF;
+	nor_cmd[3] = addr & 0xFF;
+}
+
+/* Header, unused bytes and CRC of a page whose samples are in place */
+static void
+Seal_Page(uint8_t *page, uint32_t time, uint8_t count, uint8_t size)
+{
+	Put_U16(&page[0], NORLOG_MAGIC);
+	Put_U16(&page[2], norlog_stats.session);
+	Put_U32(&page[4], nor.seq++);
+	Put_U32(&page[8], time);
+	page[12] = count;
+	page[13] = size;
+	memset(&page[NORLOG_HEADER_SIZE + count * size], 0xFF, NORLOG_PAYLOAD - count * size);
+	Put_U16(&page[NORLOG_PAGE_SIZE - 2], telemetry_crc16(page, NORLOG_PAGE_SIZE - 2));
+}
+
+static int
+Page_Valid(const uint8_t *page)
+{
+	return Get_U16(&page[0]) == NORLOG_MAGIC &&
+	       Get_U16(&page[NORLOG_PAGE_SIZE - 2]) == telemetry_crc16(page, NORLOG_PAGE_SIZE - 2);
+}
+
+/*---------------------------------------------------------------------------*/
+/* Blocking access for norlog_init(), before the background engine runs */
+
+static int
+Nor_Read_Blocking(uint32_t addr, uint8_t *buf, uint16_t len)
+{
+	int ret;
+
+	Cmd_Addr(NOR_CMD_READ, addr);
+	Nor_Select();
+	ret = spi_dma_transceive(nor_cmd, 4, NULL, 0);
+	if (ret > 0)
+		ret = spi_dma_transceive(NULL, 0, buf, len);
+	Nor_Deselect();
+	return ret;
+}
+
+static int
+Nor_Wait_Blocking(void)
+{
+	uint32_t deadline = deadline_us(NOR_INIT_TIMEOUT_US);
+
+	do {
+		Nor_Select();
+		spi_dma_transceive((uint8_t *)nor_rdsr, 2, nor_status, 2);
+		Nor_Deselect();
+		if (!(nor_status[1] & NOR_SR_WIP))
+			return 1;
+	} while (!deadline_expired(deadline));
+	return -1;
+}
+
+/*---------------------------------------------------------------------------*/
+/* Background engine: each chain runs from the SPI DMA callbacks, chip select included */
+
+/* A chain that could not be queued never calls back: end it here. Whatever it was doing
+ * is tried again by the next norlog_poll(). */
+static void
+Chain_Failed(void)
+{
+	Nor_Deselect();
+	norlog_stats.errors++;
+	nor.op = NOR_OP_IDLE;
+}
+
+static void
+Status_Done(int status)
+{
+	Nor_Deselect();
+	if (status > 0 && !(nor_status[1] & NOR_SR_WIP))
+		nor.wip = 0;
+	nor.op = NOR_OP_IDLE;
+}
+
+static void
+Program_Sent(int status)
+{
+	Nor_Deselect();
+	if (status < 0)
+		norlog_stats.errors++;
+	nor.head += NORLOG_PAGE_SIZE;
+	nor.done++;  // the chip holds the data now, the buffer is free
+	norlog_stats.pages++;
+	nor.wip = 1;
+	nor.poll_at = micros() + NOR_POLL_US;
+	nor.op = NOR_OP_IDLE;
+}
+
+static void
+Erase_Sent(int status)
+{
+	Nor_Deselect();
+	if (status < 0)
+		norlog_stats.errors++;
+	nor.erased_end += NORLOG_SECTOR_SIZE;
+	nor.wip = 1;
+	nor.poll_at = micros() + NOR_POLL_US;
+	nor.op = NOR_OP_IDLE;
+}
+
+/* Write enable went out, now the command itself under a new chip select */
+static void
+Wren_Done(int status)
+{
+	if (status < 0)
+		norlog_stats.errors++;
+	Nor_Reselect();
+	if (nor.op == NOR_OP_PROGRAM) {
+		Cmd_Addr(NOR_CMD_PP, nor.head & nor.mask);
+		if (spi_dma_submit(SPI1, nor_cmd, NULL, 4, NULL) < 0 ||
+		    spi_dma_submit(SPI1, bufs[nor.done % NORLOG_PAGE_BUFS], NULL, NORLOG_PAGE_SIZE,
+		                   Program_Sent) < 0)
+			Chain_Failed();
+	} else {
+		Cmd_Addr(NOR_CMD_SE, nor.erased_end & nor.mask);
+		if (spi_dma_submit(SPI1, nor_cmd, NULL, 4, Erase_Sent) < 0)
+			Chain_Failed();
+	}
+}
+
+static void
+Read_Done(int status)
+{
+	Nor_Deselect();
+	if (status < 0)
+		norlog_stats.errors++;
+	nor.dump_read = 1;
+	nor.op = NOR_OP_IDLE;
+}
+
+static void
+Start_Op(uint8_t op)
+{
+	int ret;
+
+	nor.op = op;
+	Nor_Select();
+	if (op == NOR_OP_STATUS) {
+		ret = spi_dma_submit(SPI1, nor_rdsr, nor_status, 2, Status_Done);
+	} else if (op == NOR_OP_READ) {
+		Cmd_Addr(NOR_CMD_READ, nor.dump_addr & nor.mask);
+		ret = spi_dma_submit(SPI1, nor_cmd, NULL, 4, NULL);
+		if (ret > 0)
+			ret = spi_dma_submit(SPI1, NULL, bufs[0], NORLOG_PAGE_SIZE, Read_Done);
+	} else {
+		ret = spi_dma_submit(SPI1, &nor_wren, NULL, 1, Wren_Done);
+	}
+	if (ret < 0)
+		Chain_Failed();
+}
+
+/* One step of norlog_dump(), returns 0 once the end marker is out */
+static int
+Dump_Step(void)
+{
+	uint32_t skip;
+
+	if (nor.dump_read) {
+		if (!Page_Valid(bufs[0])) {
+			/* Pages are programmed in order, so an erased page means the rest of its
+			 * sector is erased too. A torn one may have good pages after it. */
+			skip = 1;
+			if (Get_U16(&bufs[0][0]) == 0xFFFF)
+				skip = NOR_PAGES_PER_SECTOR -
+				       (nor.dump_addr & (NORLOG_SECTOR_SIZE - 1)) / NORLOG_PAGE_SIZE;
+			if (skip > nor.dump_left)  // head's own sector, the readout ends at head
+				skip = nor.dump_left;
+			nor.dump_addr += skip * NORLOG_PAGE_SIZE;
+			nor.dump_left -= skip;
+		} else if (usart_tx_space() < NORLOG_PAGE_SIZE) {
+			return 1;
+		} else {
+			usart_write(bufs[0], NORLOG_PAGE_SIZE);
+			nor.dump_addr += NORLOG_PAGE_SIZE;
+			nor.dump_left--;
+		}
+		nor.dump_read = 0;
+	}
+	if (nor.dump_left) {
+		Start_Op(NOR_OP_READ);
+		return 1;
+	}
+	if (usart_tx_space() < NORLOG_PAGE_SIZE)
+		return 1;
+	Seal_Page(bufs[0], micros(), 0, 0);
+	nor.seq--;  // the marker is not on the chip
+	usart_write(bufs[0], NORLOG_PAGE_SIZE);
+	return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief Bring up SPI1 and the chip, and find the end of the log.
+        Reads the JEDEC ID for the size, then the first page header of every sector for the
+        highest seq. The newest sector is searched for its first free page, new pages go
+        there and nothing is treated as erased after it, so a sector erase cut short by a
+        power loss is simply done again. Blocks for 10 to 100 ms, depending on the size.
+        @return 1 on success, -1 if no chip answers or the size is outside 64 KB..16 MB
+        @example   if (norlog_init() > 0) norlog_erase_ahead(256 * 1024);
+*/
+int
+norlog_init(void)
+{
+	static const uint8_t id_cmd[4] = {NOR_CMD_JEDEC_ID, 0xFF, 0xFF, 0xFF};
+	static const uint8_t wake = NOR_CMD_RELEASE_PD;
+	uint8_t id[4], hdr[NORLOG_HEADER_SIZE];
+	uint32_t sector, best = 0, best_seq = 0, last_seq = 0, page;
+	int found = 0;
+
+	memset(&nor, 0, sizeof(nor));
+	memset(&norlog_stats, 0, sizeof(norlog_stats));
+
+	spi_init_master(SPI1, SPI_CR1_BAUDRATE_FPCLK_DIV_4, SPI_CR1_CPOL_CLK_TO_0_WHEN_IDLE,
+	                SPI_CR1_CPHA_CLK_TRANSITION_1, SPI_CR1_DFF_8BIT, SPI_CR1_MSBFIRST, NO_REMAP);
+	Nor_Deselect();  // then PA4 push-pull at 50 MHz, GPIOA is clocked now
+	GPIOA->CRL = (GPIOA->CRL & ~(0xFUL << (4 * NOR_CS_PIN))) | (0x3UL << (4 * NOR_CS_PIN));
+	spi_enable_software_slave_management(SPI1);
+	spi_set_nss_high(SPI1);
+	spi_enable(SPI1);
+	spi_dma_init(SPI1);
+
+	Nor_Select();
+	spi_dma_transceive((uint8_t *)&wake, 1, NULL, 0);  // in case it was left powered down
+	Nor_Deselect();
+	delay_us(50);
+	Nor_Select();
+	spi_dma_transceive((uint8_t *)id_cmd, 4, id, 4);
+	Nor_Deselect();
+	if (id[1] == 0x00 || id[1] == 0xFF || id[3] < 16 || id[3] > 24)
+		return -1;
+	norlog_stats.size = 1UL << id[3];
+	nor.mask = norlog_stats.size - 1;
+	if (Nor_Wait_Blocking() < 0)
+		return -1;
+
+	for (sector = 0; sector < norlog_stats.size; sector += NORLOG_SECTOR_SIZE) {
+		if (Nor_Read_Blocking(sector, hdr, sizeof(hdr)) < 0)
+			return -1;
+		if (Get_U16(&hdr[0]) != NORLOG_MAGIC)
+			continue;
+		if (!found || Get_U32(&hdr[4]) > best_seq) {
+			best = sector;
+			best_seq = Get_U32(&hdr[4]);
+			norlog_stats.session = Get_U16(&hdr[2]);
+		}
+		found = 1;
+	}
+	if (found) {
+		for (page = 0; page < NOR_PAGES_PER_SECTOR; page++) {
+			if (Nor_Read_Blocking(best + page * NORLOG_PAGE_SIZE, hdr, sizeof(hdr)) < 0)
+				return -1;
+			if (Get_U16(&hdr[0]) != NORLOG_MAGIC)
+				break;
+			last_seq = Get_U32(&hdr[4]);
+			norlog_stats.session = Get_U16(&hdr[2]);
+		}
+		nor.head = best + page * NORLOG_PAGE_SIZE;
+		nor.seq = last_seq + 1;
+	}
+	/* The rest of the newest sector is erased, the next sector is not known to be */
+	nor.erased_end = (nor.head + NORLOG_SECTOR_SIZE - 1) & ~(NORLOG_SECTOR_SIZE - 1);
+	return 1;
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief Keep this much erased space ahead of the write position, in the background.
+        Erasing takes the oldest data in the log, so ask for what the next capture needs:
+        a sensor at 4 kHz fills about 60 KB per second. A capture running past it waits
+        for each sector, and may drop samples while it does.
+        @param[in] bytes  rounded up to whole sectors, capped at the chip size less one sector
+        @return 1, or -1 before norlog_init() succeeded
+        @example   norlog_erase_ahead(10 * 60 * 1024);  // 10 s at 4 kHz
+*/
+int
+norlog_erase_ahead(uint32_t bytes)
+{
+	if (!norlog_stats.size)
+		return -1;
+	bytes = (bytes + NORLOG_SECTOR_SIZE - 1) & ~(NORLOG_SECTOR_SIZE - 1);
+	if (bytes > norlog_stats.size - NORLOG_SECTOR_SIZE)
+		bytes = norlog_stats.size - NORLOG_SECTOR_SIZE;
+	nor.erase_target = bytes;
+	return 1;
+}
+
+/** @brief Erased space ahead of the write position.
+        @return bytes that can be captured without an erase in the way
+*/
+uint32_t
+norlog_erased(void)
+{
+	return nor.erased_end - nor.head;
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief Start a new capture session, samples follow with norlog_append().
+        @param[in] size  bytes per sample, 1..NORLOG_PAYLOAD, i.e. 14 per sensor frame
+        @return 1, or -1 with no chip, a dump running or a bad size
+*/
+int
+norlog_start(uint8_t size)
+{
+	if (!norlog_stats.size || norlog_stats.dumping || size == 0 || size > NORLOG_PAYLOAD)
+		return -1;
+	if (norlog_stats.capturing)
+		norlog_stop();
+	nor.size = size;
+	nor.fill = 0;
+	norlog_stats.session++;
+	norlog_stats.capturing = 1;
+	return 1;
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief Add one sample to the capture, main loop only.
+        Copies into the current page buffer, a full page is queued for norlog_poll(). With
+        every buffer still waiting for the chip the sample is dropped and counted.
+        @param[in] sample  norlog_start() size bytes
+        @param[in] time    micros() of the sample, kept for the first one in each page
+*/
+void
+norlog_append(const uint8_t *sample, uint32_t time)
+{
+	uint8_t *page;
+	uint8_t per_page;
+
+	if (!norlog_stats.capturing)
+		return;
+	if (nor.queued - nor.done == NORLOG_PAGE_BUFS) {
+		norlog_stats.dropped++;
+		return;
+	}
+	page = bufs[nor.queued % NORLOG_PAGE_BUFS];
+	if (nor.fill == 0)
+		Put_U32(&page[8], time);
+	memcpy(&page[NORLOG_HEADER_SIZE + nor.fill * nor.size], sample, nor.size);
+	per_page = NORLOG_PAYLOAD / nor.size;
+	if (++nor.fill < per_page)
+		return;
+	Seal_Page(page, Get_U32(&page[8]), nor.fill, nor.size);
+	nor.fill = 0;
+	nor.queued++;
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief End the capture, a partly filled page is queued as it is. */
+void
+norlog_stop(void)
+{
+	uint8_t *page = bufs[nor.queued % NORLOG_PAGE_BUFS];
+
+	if (!norlog_stats.capturing)
+		return;
+	if (nor.fill) {
+		Seal_Page(page, Get_U32(&page[8]), nor.fill, nor.size);
+		nor.fill = 0;
+		nor.queued++;
+	}
+	norlog_stats.capturing = 0;
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief Start sending the whole log to USART1, oldest page first.
+        Raise the baud rate first, 16 MB take 80 s at 2 Mbaud. Any other use of
+        usart_write() while it runs mixes into the page stream.
+        @return 1, or -1 with no chip, a capture running or pages still being written
+*/
+int
+norlog_dump(void)
+{
+	if (!norlog_stats.size || norlog_stats.capturing || norlog_stats.dumping ||
+	    nor.queued != nor.done)
+		return -1;
+	/* From the sector after the write position round to it: the oldest sector is the next
+	 * one to be erased, and what follows head in its own sector is a lap older still. */
+	nor.dump_addr = (nor.head & ~(NORLOG_SECTOR_SIZE - 1)) + NORLOG_SECTOR_SIZE;
+	nor.dump_left = (nor.head + norlog_stats.size - nor.dump_addr) / NORLOG_PAGE_SIZE;
+	nor.dump_read = 0;
+	norlog_stats.dumping = 1;
+	return 1;
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief Run the log, call from the main loop as often as possible.
+        Never waits: it starts at most one SPI chain, or checks on the chip while it is
+        busy, and returns. Full pages go first, erasing only runs when none is waiting or
+        none can be written, so a capture loses as little as possible to it.
+*/
+void
+norlog_poll(void)
+{
+	uint32_t sector;
+
+	if (!norlog_stats.size || nor.op != NOR_OP_IDLE)
+		return;
+	if (nor.wip) {
+		if (deadline_expired(nor.poll_at)) {
+			nor.poll_at = micros() + NOR_POLL_US;
+			Start_Op(NOR_OP_STATUS);
+		}
+		return;
+	}
+	if (nor.queued != nor.done && nor.erased_end - nor.head >= NORLOG_PAGE_SIZE) {
+		Start_Op(NOR_OP_PROGRAM);
+		return;
+	}
+	if (norlog_stats.dumping) {
+		norlog_stats.dumping = Dump_Step();
+		return;
+	}
+	sector = nor.head & ~(NORLOG_SECTOR_SIZE - 1);
+	if ((nor.erased_end - nor.head < nor.erase_target || nor.queued != nor.done) &&
+	    nor.erased_end + NORLOG_SECTOR_SIZE - sector <= norlog_stats.size)
+		Start_Op(NOR_OP_ERASE);
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief Nothing for norlog_poll() to do until more samples arrive.
+        No SPI chain or chip operation running, no full page waiting, no readout and the
+        erase target met, so the core may stop its clocks.
+        @return 1 when idle, 0 otherwise
+*/
+int
+norlog_idle(void)
+{
+	uint32_t sector = nor.head & ~(NORLOG_SECTOR_SIZE - 1);
+
+	if (!norlog_stats.size)
+		return 1;
+	if (nor.op != NOR_OP_IDLE || nor.wip || nor.queued != nor.done || norlog_stats.dumping)
+		return 0;
+	return nor.erased_end - nor.head >= nor.erase_target ||
+	       nor.erased_end + NORLOG_SECTOR_SIZE - sector > norlog_stats.size;
+}
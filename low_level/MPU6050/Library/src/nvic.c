@@ -19,6 +19,7 @@ void
 nvic_enable_irq(u8 irqn)
 {
 	NVIC_ISER(irqn / 32) = (1 << (irqn % 32));
+	SIM_WRITE(NVIC_ISER(irqn / 32));
 }
 
 /** @brief disable Interrupt for the desired peripheral request.
@@ -29,6 +30,7 @@ void
 nvic_disable_irq(u8 irqn)
 {
 	NVIC_ICER(irqn / 32) = (1 << (irqn % 32));
+	SIM_WRITE(NVIC_ICER(irqn / 32));
 }
 /** @brief Get the pending Interrupt for the desired peripheral request.
         @param[in] interrupt Request which represents IRQ from peripheral
@@ -37,6 +39,7 @@ nvic_disable_irq(u8 irqn)
 u8
 nvic_get_pending_irq(u8 irqn)
 {
+	SIM_SYNC();
 	return NVIC_ISPR(irqn / 32) & (1 << (irqn % 32)) ? 1 : 0;
 }
 /** @brief Set the pending Interrupt for the desired peripheral request.
@@ -47,6 +50,7 @@ void
 nvic_set_pending_irq(u8 irqn)
 {
 	NVIC_ISPR(irqn / 32) = (1 << (irqn % 32));
+	SIM_WRITE(NVIC_ISPR(irqn / 32));
 }
 /** @brief Clear the pending Interrupt for the desired peripheral request.
         @param[in] interrupt Request which represents IRQ from peripheral
@@ -56,6 +60,7 @@ void
 nvic_clear_pending_irq(u8 irqn)
 {
 	NVIC_ICPR(irqn / 32) = (1 << (irqn % 32));
+	SIM_WRITE(NVIC_ICPR(irqn / 32));
 }
 /** @brief Get the Active Interrupt for the desired peripheral request (check if this peripheral has
    sent IRQ).
@@ -65,6 +70,7 @@ nvic_clear_pending_irq(u8 irqn)
 u8
 nvic_get_active_irq(u8 irqn)
 {
+	SIM_SYNC();
 	return NVIC_IABR(irqn / 32) & (1 << (irqn % 32)) ? 1 : 0;
 }
 /** @brief Get the Active Interrupt for the desired peripheral request.
@@ -74,12 +80,13 @@ nvic_get_active_irq(u8 irqn)
 u8
 nvic_get_irq_enabled(u8 irqn)
 {
+	SIM_SYNC();
 	return NVIC_ISER(irqn / 32) & (1 << (irqn % 32)) ? 1 : 0;
 }
 /** @brief Set the priority Interrupt for the desired peripheral request.
         @param[in] interrupt Request which represents IRQ from peripheral
-        @param[in] interrupt priority
-        @example nvic_set_priority(NVIC_ADC1_2_IRQ);
+        @param[in] interrupt priority, NVIC_PRIO(level) or one of the NVIC_PRIO_* levels
+        @example nvic_set_priority(NVIC_ADC1_2_IRQ, NVIC_PRIO_HOUSEKEEPING);
 */
 void
 nvic_set_priority(u8 irqn, u8 priority)
@@ -96,3 +103,43 @@ nvic_generate_software_interrupt(u8 irqn)
 	if (irqn <= 239)
 		NVIC_STIR |= irqn;
 }
+
+/* Interrupts above HOUSEKEEPING, see the priority plan in nvic.h */
+static const struct {
+	u8 irqn;
+	u8 priority;
+} irq_plan[] = {
+	{NVIC_EXTI0_IRQ, NVIC_PRIO_SAMPLE},
+	{NVIC_DMA1_CHANNEL7_IRQ, NVIC_PRIO_SAMPLE},
+	{NVIC_I2C1_EV_IRQ, NVIC_PRIO_SAMPLE},
+	{NVIC_I2C1_ER_IRQ, NVIC_PRIO_SAMPLE},
+	{NVIC_I2C2_EV_IRQ, NVIC_PRIO_SAMPLE},
+	{NVIC_I2C2_ER_IRQ, NVIC_PRIO_SAMPLE},
+	{NVIC_DMA1_CHANNEL4_IRQ, NVIC_PRIO_COMMS},
+	{NVIC_DMA1_CHANNEL5_IRQ, NVIC_PRIO_COMMS},
+	{NVIC_USART1_IRQ, NVIC_PRIO_COMMS},
+	{NVIC_USB_HP_CAN_TX_IRQ, NVIC_PRIO_COMMS},
+	{NVIC_USB_LP_CAN_RX0_IRQ, NVIC_PRIO_COMMS},
+	{NVIC_CAN_RX1_IRQ, NVIC_PRIO_COMMS},
+	{NVIC_DMA1_CHANNEL2_IRQ, NVIC_PRIO_STORAGE},
+	{NVIC_DMA1_CHANNEL3_IRQ, NVIC_PRIO_STORAGE},
+};
+
+/** @brief Apply the interrupt priority plan of nvic.h.
+        Call once at boot, before any driver enables its interrupt: the reset priority
+        of every interrupt is 0, the highest. Sets the grouping to preemption only, then
+        every interrupt and SysTick to HOUSEKEEPING and the planned ones to their level.
+        @example nvic_priority_init();
+*/
+void
+nvic_priority_init(void)
+{
+	u32 aircr = SCB_AIRCR & ~(0xFFFFUL << 16) & ~SCB_AIRCR_PRIGROUP_MASK;
+
+	SCB_AIRCR = SCB_AIRCR_VECTKEY | aircr | SCB_AIRCR_PRIGROUP_16_0;
+	for (u8 irqn = 0; irqn < NVIC_IRQ_COUNT; irqn++)
+		nvic_set_priority(irqn, NVIC_PRIO_HOUSEKEEPING);
+	SCB_SHPR(SCB_SHPR_SYSTICK) = NVIC_PRIO_HOUSEKEEPING;
+	for (u8 i = 0; i < sizeof(irq_plan) / sizeof(irq_plan[0]); i++)
+		nvic_set_priority(irq_plan[i].irqn, irq_plan[i].priority);
+}
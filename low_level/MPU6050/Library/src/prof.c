@@ -0,0 +1,94 @@
+#include "prof.h"
+
+prof_stage_t prof_stage[PROF_STAGES];
+
+/*---------------------------------------------------------------------------*/
+/** @brief Start the DWT cycle counter and clear all stages.
+        CYCCNT counts core clocks and wraps every 2^32 cycles, spans are taken as the
+        unsigned difference so one wrap in between is harmless.
+*/
+void
+prof_init(void)
+{
+	DEMCR |= DEMCR_TRCENA;
+	DWT_CYCCNT = 0;
+	DWT_CTRL |= DWT_CTRL_CYCCNTENA;
+	prof_reset();
+}
+
+static void
+prof_clear(prof_stage_t *s)
+{
+	s->count = 0;
+	s->min = UINT32_MAX;
+	s->max = 0;
+	s->sum = 0;
+	for (int b = 0; b < PROF_BINS; b++)
+		s->hist[b] = 0;
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief Clear every stage.
+*/
+void
+prof_reset(void)
+{
+	for (int i = 0; i < PROF_STAGES; i++)
+		prof_clear(&prof_stage[i]);
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief Copy a stage and clear it in one step, so the next report covers a fresh
+        interval. Interrupts are masked for the copy, stages recorded from a handler
+        can't tear.
+        @param[in] stage  0..PROF_STAGES-1
+        @param[out] copy  counters since the previous take
+*/
+void
+prof_take(uint8_t stage, prof_stage_t *copy)
+{
+	uint32_t primask;
+
+	primask = irq_save();
+	*copy = prof_stage[stage];
+	prof_clear(&prof_stage[stage]);
+	irq_restore(primask);
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief Add one span to a stage.
+        @param[in] stage   0..PROF_STAGES-1, out of range is ignored
+        @param[in] cycles  core clocks, see prof_now()
+        @example   uint32_t t = prof_now(); ... prof_record(STAGE_ACQ, prof_now() - t);
+*/
+void
+prof_record(uint8_t stage, uint32_t cycles)
+{
+	prof_stage_t *s;
+	uint32_t limit = PROF_BIN0_CYCLES;
+	int b = 0;
+
+	if (stage >= PROF_STAGES)
+		return;
+	s = &prof_stage[stage];
+	s->count++;
+	s->sum += cycles;
+	if (cycles < s->min)
+		s->min = cycles;
+	if (cycles > s->max)
+		s->max = cycles;
+	while (b < PROF_BINS - 1 && cycles >= limit) {
+		limit <<= 1;
+		b++;
+	}
+	s->hist[b]++;
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief Mean cycles of a stage, 0 before the first span.
+*/
+uint32_t
+prof_mean(const prof_stage_t *s)
+{
+	return s->count ? (uint32_t)(s->sum / s->count) : 0;
+}
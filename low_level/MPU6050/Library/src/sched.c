@@ -0,0 +1,145 @@
+/* @file 			 : sched.c
+ *  @Description: Cooperative task scheduler, see sched.h.
+ */
+#include "sched.h"
+#include "timer.h"
+
+#include <stddef.h>
+
+volatile uint32_t sched_events;
+uint32_t sched_idle_count;
+
+static sched_task_t tasks[SCHED_MAX_TASKS];  // kept in prio order
+static int task_count;
+static uint32_t task_events;  // every event some task waits on
+static sched_task_fn idle_fn;  // NULL sleeps in WFI
+
+/*---------------------------------------------------------------------------*/
+/** @brief Register a task, before sched_run().
+        Tasks of equal priority run in the order they were added.
+        @param[in] run        the task, returns once its work is done
+        @param[in] prio       0 first
+        @param[in] events     event bits that make it ready, 0 for none
+        @param[in] period_ms  run it every period_ms too, 0 for events only
+        @return task id for sched_task(), in order of addition, -1 when the table is full
+        @example   sched_add(Command_Task, 2, EV_RX, 20);
+*/
+int
+sched_add(sched_task_fn run, uint8_t prio, uint32_t events, uint32_t period_ms)
+{
+	int i;
+
+	if (task_count == SCHED_MAX_TASKS || !run)
+		return -1;
+	for (i = task_count; i > 0 && tasks[i - 1].prio > prio; i--)
+		tasks[i] = tasks[i - 1];
+	tasks[i].run = run;
+	tasks[i].prio = prio;
+	tasks[i].events = events;
+	tasks[i].pending = 0;
+	tasks[i].period_ms = period_ms;
+	tasks[i].next = millis() + period_ms;
+	tasks[i].runs = 0;
+	tasks[i].id = task_count;
+	task_events |= events;
+	return task_count++;
+}
+
+/** @brief Task by the id sched_add() returned, for its run count.
+        @return the task, NULL for an unknown id
+*/
+const sched_task_t *
+sched_task(int id)
+{
+	for (int i = 0; i < task_count; i++) {
+		if (tasks[i].id == id)
+			return &tasks[i];
+	}
+	return NULL;
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief Sleep some other way while no task is ready.
+        The function runs with interrupts masked and must return with them still masked,
+        the interrupt that wakes it runs once sched_step() unmasks. It may also decide
+        not to sleep at all, sched_step() is called again right away.
+        @param[in] idle  the sleep, NULL for plain WFI
+        @example   sched_set_idle(Power_Idle);  // clk_stop() once the buses are quiet
+*/
+void
+sched_set_idle(sched_task_fn idle)
+{
+	idle_fn = idle;
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief Raise events, from any context.
+        @param[in] events  bits, the tasks waiting on any of them become ready
+        @example   sched_signal(EV_SAMPLE);  // from the DMA complete callback
+*/
+void
+sched_signal(uint32_t events)
+{
+	uint32_t primask = irq_save();
+
+	sched_events |= events;
+	irq_restore(primask);
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief Run the highest priority ready task once, or sleep until an interrupt.
+        For a loop that has more to do between tasks, sched_run() otherwise.
+        @return 1 when a task ran, 0 after sleeping
+*/
+int
+sched_step(void)
+{
+	uint32_t now = millis();
+	uint32_t primask, raised;
+	sched_task_t *t;
+	int i;
+
+	/* Take the raised events all at once, every task waiting on one gets it */
+	primask = irq_save();
+	raised = sched_events & task_events;
+	sched_events &= ~raised;
+	irq_restore(primask);
+	for (i = 0; i < task_count; i++)
+		tasks[i].pending |= tasks[i].events & raised;
+
+	for (i = 0; i < task_count; i++) {
+		t = &tasks[i];
+		if (t->pending) {
+			t->pending = 0;
+		} else if (!t->period_ms || (int32_t)(now - t->next) < 0) {
+			continue;
+		}
+		if (t->period_ms && (int32_t)(now - t->next) >= 0) {
+			t->next += t->period_ms;
+			if ((int32_t)(now - t->next) >= 0)
+				t->next = now + t->period_ms;  // late by a whole period, skip the missed runs
+		}
+		t->run();
+		t->runs++;
+		return 1;
+	}
+
+	primask = irq_save();
+	if (!(sched_events & task_events) && millis() == now) {
+		sched_idle_count++;
+		if (idle_fn)
+			idle_fn();
+		else
+			cpu_wfi();
+	}
+	irq_restore(primask);
+	return 0;
+}
+
+/** @brief Run the tasks forever. */
+void
+sched_run(void)
+{
+	for (;;)
+		sched_step();
+}
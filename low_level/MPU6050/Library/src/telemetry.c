@@ -0,0 +1,395 @@
+#include "telemetry.h"
+
+#include <string.h>
+
+/* CRC-16/CCITT-FALSE (poly 0x1021, init 0xFFFF), one nibble per table lookup */
+static const uint16_t crc16_nibble[16] = {
+	0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+	0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF,
+};
+
+/** @brief CRC-16/CCITT-FALSE of a buffer.
+        @param[in] data bytes to check
+        @param[in] len  number of bytes
+        @return CRC, 0x29B1 for "123456789"
+*/
+uint16_t
+telemetry_crc16(const uint8_t *data, uint16_t len)
+{
+	uint16_t crc = 0xFFFF;
+
+	while (len--) {
+		crc = (crc << 4) ^ crc16_nibble[(crc >> 12) ^ (*data >> 4)];
+		crc = (crc << 4) ^ crc16_nibble[(crc >> 12) ^ (*data & 0x0F)];
+		data++;
+	}
+	return crc;
+}
+
+/* Sync, seq and timestamp shared by all binary frames */
+static void
+put_header(uint8_t *out, uint8_t sync1, uint16_t seq, uint32_t timestamp)
+{
+	out[0] = TELEMETRY_SYNC0;
+	out[1] = sync1;
+	out[2] = seq & 0xFF;
+	out[3] = seq >> 8;
+	out[4] = timestamp & 0xFF;
+	out[5] = (timestamp >> 8) & 0xFF;
+	out[6] = (timestamp >> 16) & 0xFF;
+	out[7] = timestamp >> 24;
+}
+
+/* Append the CRC of bytes 2..len-3 */
+static void
+put_crc(uint8_t *out, uint16_t len)
+{
+	uint16_t crc = telemetry_crc16(&out[2], len - 4);
+
+	out[len - 2] = crc & 0xFF;
+	out[len - 1] = crc >> 8;
+}
+
+/* Little-endian i16 */
+static void
+put_i16(uint8_t *out, int16_t v)
+{
+	out[0] = (uint16_t)v & 0xFF;
+	out[1] = (uint16_t)v >> 8;
+}
+
+/** @brief Build one binary telemetry frame from a decoded MPU6050 sample.
+        No scaling is done, the words go out in sensor LSBs.
+        @param[out] out       TELEMETRY_FRAME_SIZE bytes
+        @param[in] sensor     0..3, selects the second sync byte
+        @param[in] seq        frame sequence number, the same for all sensors of one sample
+        @param[in] timestamp  sample time in microseconds
+        @param[in] raw        sample, see mpu_decode()
+        @return frame length in bytes
+        @example   Send_Bytes(USART1, buf, telemetry_pack(buf, 0, seq++, t, &raw));
+*/
+uint16_t
+telemetry_pack(uint8_t *out, uint8_t sensor, uint16_t seq, uint32_t timestamp,
+               const mpu_raw_t *raw)
+{
+	int i;
+
+	put_header(out, TELEMETRY_SYNC1_IMU(sensor), seq, timestamp);
+	for (i = 0; i < 3; i++) {
+		put_i16(&out[8 + 2 * i], raw->accel[i]);
+		put_i16(&out[16 + 2 * i], raw->gyro[i]);
+	}
+	put_i16(&out[14], raw->temp);
+	put_crc(out, TELEMETRY_FRAME_SIZE);
+	return TELEMETRY_FRAME_SIZE;
+}
+
+/** @brief Build one attitude frame, 18 bytes instead of 24 for the raw channels.
+        @param[out] out       TELEMETRY_ATT_FRAME_SIZE bytes
+        @param[in] seq        frame sequence number, shared with the raw frames
+        @param[in] timestamp  sample time in microseconds
+        @param[in] quat       W X Y Z in Q14, see fusion_quat_q14()
+        @return frame length in bytes
+*/
+uint16_t
+telemetry_pack_attitude(uint8_t *out, uint16_t seq, uint32_t timestamp, const int16_t *quat)
+{
+	put_header(out, TELEMETRY_ATT_SYNC1, seq, timestamp);
+	for (int i = 0; i < 4; i++)
+		put_i16(&out[8 + 2 * i], quat[i]);
+	put_crc(out, TELEMETRY_ATT_FRAME_SIZE);
+	return TELEMETRY_ATT_FRAME_SIZE;
+}
+
+/** @brief Build the magnetometer frame sent after a raw frame when the HMC5883L is on.
+        @param[out] out       TELEMETRY_MAG_FRAME_SIZE bytes
+        @param[in] sensor     0..3
+        @param[in] seq        sequence number of the raw frame it belongs to
+        @param[in] timestamp  sample time in microseconds
+        @param[in] raw        sample, see mpu_decode_mag()
+        @return frame length in bytes
+*/
+uint16_t
+telemetry_pack_mag(uint8_t *out, uint8_t sensor, uint16_t seq, uint32_t timestamp,
+                   const mpu_raw_t *raw)
+{
+	put_header(out, TELEMETRY_MAG_SYNC1, seq, timestamp);
+	out[8] = sensor;
+	out[9] = 0;
+	for (int i = 0; i < 3; i++)
+		put_i16(&out[10 + 2 * i], raw->mag[i]);
+	put_crc(out, TELEMETRY_MAG_FRAME_SIZE);
+	return TELEMETRY_MAG_FRAME_SIZE;
+}
+
+/* Little-endian u32 */
+static void
+put_u32(uint8_t *out, uint32_t v)
+{
+	out[0] = v & 0xFF;
+	out[1] = (v >> 8) & 0xFF;
+	out[2] = (v >> 16) & 0xFF;
+	out[3] = v >> 24;
+}
+
+/** @brief Build the profiling side-channel frame of one stage.
+        @param[out] out       TELEMETRY_PROF_FRAME_SIZE bytes
+        @param[in] seq        report sequence number, separate from the sample frames
+        @param[in] timestamp  report time in microseconds
+        @param[in] stage      stage index, see prof.h
+        @param[in] prof       stage counters
+        @return frame length in bytes
+*/
+uint16_t
+telemetry_pack_prof(uint8_t *out, uint16_t seq, uint32_t timestamp, uint8_t stage,
+                    const prof_stage_t *prof)
+{
+	put_header(out, TELEMETRY_PROF_SYNC1, seq, timestamp);
+	out[8] = stage;
+	out[9] = PROF_BINS;
+	put_u32(&out[10], prof->count);
+	put_u32(&out[14], prof->count ? prof->min : 0);
+	put_u32(&out[18], prof->max);
+	put_u32(&out[22], prof_mean(prof));
+	for (int i = 0; i < PROF_BINS; i++) {
+		uint32_t n = prof->hist[i];
+
+		out[26 + 2 * i] = (n > 0xFFFF ? 0xFFFF : n) & 0xFF;
+		out[27 + 2 * i] = (n > 0xFFFF ? 0xFFFF : n) >> 8;
+	}
+	put_crc(out, TELEMETRY_PROF_FRAME_SIZE);
+	return TELEMETRY_PROF_FRAME_SIZE;
+}
+
+/** @brief Pack the magnetometer into the third CAN frame of a sample.
+        @param[out] mag  8 bytes for TELEMETRY_CAN_ID(node, 8 + sensor)
+        @param[in] seq   sample sequence number, same as the accel/gyro pair
+        @param[in] raw   sample, HMC5883L LSBs
+*/
+void
+telemetry_pack_can_mag(uint8_t *mag, uint16_t seq, const mpu_raw_t *raw)
+{
+	for (int i = 0; i < 3; i++)
+		put_i16(&mag[2 * i], raw->mag[i]);
+	mag[6] = seq & 0xFF;
+	mag[7] = seq >> 8;
+}
+
+/** @brief Split one sample over the two 8-byte CAN frames.
+        @param[out] accel  8 bytes for TELEMETRY_CAN_ID(node, 0)
+        @param[out] gyro   8 bytes for TELEMETRY_CAN_ID(node, 1)
+        @param[in] seq     sample sequence number
+        @param[in] raw     sample, sensor LSBs
+*/
+void
+telemetry_pack_can(uint8_t *accel, uint8_t *gyro, uint16_t seq, const mpu_raw_t *raw)
+{
+	for (int i = 0; i < 3; i++) {
+		put_i16(&accel[2 * i], raw->accel[i]);
+		put_i16(&gyro[2 * i], raw->gyro[i]);
+	}
+	put_i16(&accel[6], raw->temp);
+	gyro[6] = seq & 0xFF;
+	gyro[7] = seq >> 8;
+}
+
+/* Write v / 100 as [-]I.FF, returns the number of characters */
+static uint16_t
+put_centi(char *out, int32_t v)
+{
+	char digits[10];
+	uint32_t u;
+	uint16_t n = 0, len = 0;
+
+	if (v < 0) {
+		out[len++] = '-';
+		u = -(uint32_t)v;
+	} else {
+		u = v;
+	}
+	do {
+		digits[n++] = '0' + u % 10;
+		u /= 10;
+	} while (u || n < 3);  // at least one integer digit and two decimals
+	while (n > 2)
+		out[len++] = digits[--n];
+	out[len++] = '.';
+	out[len++] = digits[1];
+	out[len++] = digits[0];
+	return len;
+}
+
+/** @brief Build the $AX,AY,AZ,TEMP,GX,GY,GZ\r\n debug line from fixed-point values.
+        Same text as the old "%.2f" output, without printf or float support.
+        @param[out] out   at least TELEMETRY_TEXT_MAX characters, not NUL terminated
+        @param[in] centi  TELEMETRY_CHANNELS values in hundredths (g, deg C, deg/s)
+        @return line length in bytes
+*/
+uint16_t
+telemetry_pack_text(char *out, const int32_t *centi)
+{
+	uint16_t len = 0;
+
+	out[len++] = '$';
+	for (int i = 0; i < TELEMETRY_CHANNELS; i++) {
+		if (i)
+			out[len++] = ',';
+		len += put_centi(&out[len], centi[i]);
+	}
+	out[len++] = '\r';
+	out[len++] = '\n';
+	return len;
+}
+
+/* AX AY AZ TEMP GX GY GZ, the order of the raw frame */
+static void
+get_channels(const mpu_raw_t *raw, int16_t *v)
+{
+	for (int i = 0; i < 3; i++) {
+		v[i] = raw->accel[i];
+		v[4 + i] = raw->gyro[i];
+	}
+	v[3] = raw->temp;
+}
+
+/* A keyframe is due: none sent yet, a sample was lost, or the chain is long enough */
+static int
+delta_key_due(const telemetry_delta_t *d, uint16_t seq)
+{
+	return !d->since_key || d->since_key >= TELEMETRY_DELTA_KEY || seq != d->seq;
+}
+
+/* The host now holds this sample, the next delta starts from it */
+static void
+delta_keep(telemetry_delta_t *d, uint16_t seq, const int16_t *v, int key)
+{
+	memcpy(d->prev, v, sizeof(d->prev));
+	d->seq = seq + 1;
+	d->since_key = key ? 1 : d->since_key + 1;
+}
+
+/* Zig-zag varint of d, returns the byte after it */
+static uint8_t *
+put_varint(uint8_t *out, int32_t d)
+{
+	uint32_t u = (uint32_t)d << 1 ^ (uint32_t)(d >> 31);
+
+	while (u >= 0x80) {
+		*out++ = (uint8_t)(u | 0x80);
+		u >>= 7;
+	}
+	*out++ = (uint8_t)u;
+	return out;
+}
+
+/** @brief Make the next sample of a chain go out as a keyframe.
+        For a link that dropped a frame, or a host that has to resync.
+        @param[in] d  delta state, zeroed state needs no reset
+*/
+void
+telemetry_delta_reset(telemetry_delta_t *d)
+{
+	d->since_key = 0;
+}
+
+/** @brief Add one sample to a sensor's delta frame, see the delta frame layout.
+        The sample goes into the open frame, which is closed and returned once it holds
+        TELEMETRY_DELTA_BATCH samples. When a keyframe is due the open frame is closed
+        first and the sample goes out as a raw frame behind it.
+        @param[in,out] b      encoder of this sensor
+        @param[out] out       TELEMETRY_DELTA_OUT_MAX bytes
+        @param[in] sensor     0..3
+        @param[in] seq        sample sequence number, a gap forces a keyframe
+        @param[in] timestamp  sample time in microseconds
+        @param[in] raw        sample, see mpu_decode()
+        @return bytes in out to send, 0 while the frame fills
+        @example   usart_write(buf, telemetry_pack_delta(&enc, buf, 0, seq++, t, &raw));
+*/
+uint16_t
+telemetry_pack_delta(telemetry_batch_t *b, uint8_t *out, uint8_t sensor, uint16_t seq,
+                     uint32_t timestamp, const mpu_raw_t *raw)
+{
+	int16_t v[TELEMETRY_CHANNELS];
+	int32_t dt = (int32_t)(timestamp - b->prev_time);
+	uint8_t *p;
+	uint16_t len;
+
+	get_channels(raw, v);
+	if (delta_key_due(&b->d, seq)) {
+		len = telemetry_flush_delta(b, out);
+		len += telemetry_pack(out + len, sensor, seq, timestamp, raw);
+		delta_keep(&b->d, seq, v, 1);
+		b->prev_time = timestamp;
+		b->prev_dt = 0;
+		return len;
+	}
+	if (!b->count) {
+		b->frame[0] = TELEMETRY_SYNC0;
+		b->frame[1] = TELEMETRY_DELTA_SYNC1;
+		b->frame[2] = seq & 0xFF;
+		b->frame[3] = sensor;
+		b->len = 5;
+	}
+	p = put_varint(&b->frame[b->len], (int32_t)((uint32_t)dt - (uint32_t)b->prev_dt));
+	for (int i = 0; i < TELEMETRY_CHANNELS; i++)
+		p = put_varint(p, (int32_t)v[i] - b->d.prev[i]);
+	b->len = p - b->frame;
+	b->prev_time = timestamp;
+	b->prev_dt = dt;
+	delta_keep(&b->d, seq, v, 0);
+	if (++b->count < TELEMETRY_DELTA_BATCH)
+		return 0;
+	return telemetry_flush_delta(b, out);
+}
+
+/** @brief Close a sensor's open delta frame early, i.e. before leaving FMT DELTA.
+        @param[in,out] b  encoder of this sensor
+        @param[out] out   TELEMETRY_DELTA_FRAME_MAX bytes
+        @return bytes in out to send, 0 when no frame was open
+*/
+uint16_t
+telemetry_flush_delta(telemetry_batch_t *b, uint8_t *out)
+{
+	uint16_t len = b->len + 2;
+
+	if (!b->count)
+		return 0;
+	b->frame[4] = b->len - 5;
+	memcpy(out, b->frame, b->len);
+	put_crc(out, len);
+	b->count = 0;
+	return len;
+}
+
+/** @brief Pack one sample into a single CAN delta frame when every change fits in i8.
+        @param[in,out] d  delta state of this sensor on CAN
+        @param[out] delta 8 bytes for TELEMETRY_CAN_ID(node, TELEMETRY_CAN_DELTA(sensor))
+        @param[in] seq    sample sequence number, a gap forces a keyframe
+        @param[in] raw    sample, sensor LSBs
+        @return 1 when delta holds the frame, 0 when the sample must go out as the
+                telemetry_pack_can() pair, the keyframe
+*/
+int
+telemetry_pack_can_delta(telemetry_delta_t *d, uint8_t *delta, uint16_t seq,
+                         const mpu_raw_t *raw)
+{
+	int16_t v[TELEMETRY_CHANNELS];
+	int32_t change;
+
+	get_channels(raw, v);
+	if (delta_key_due(d, seq))
+		goto key;
+	for (int i = 0; i < TELEMETRY_CHANNELS; i++) {
+		change = (int32_t)v[i] - d->prev[i];
+		if (change < -128 || change > 127)
+			goto key;
+		delta[1 + i] = (uint8_t)change;
+	}
+	delta[0] = seq & 0xFF;
+	delta_keep(d, seq, v, 0);
+	return 1;
+
+key:
+	delta_keep(d, seq, v, 1);
+	return 0;
+}
@@ -1,5 +1,9 @@
 #include "timer.h"
-unsigned long MILLIS = 0, MICROS = 0;
+#include "clk.h"
+#include "nvic.h"
+volatile unsigned long MILLIS = 0;
+unsigned long MICROS = 0;
+static uint32_t ticks_per_us = 8;  // SysTick counts per microsecond, HCLK / 1 MHz
 /*---------------------------------------------------------------------------*/
 /** @brief Timer initialization.
 
@@ -9,7 +13,7 @@ note this will set update event flag.
 
 @param[in] TIMER TIM_GP_TypeDef. Timer register address base @ref
 TIMx_BASE
-@param[in] prescaler Unsigned int. Prescaler values 0...0xFFFF.
+@param[in] prescaler Unsigned int. Divider of clk_get_timclk1(), values 1...0x10000.
 */
 void
 timerInit(TIM_GP_TypeDef *TIMER, unsigned int prescaler)
@@ -23,6 +27,8 @@ timerInit(TIM_GP_TypeDef *TIMER, unsigned int prescaler)
 		timer_number = 4;
 	else if (TIMER == TIM5)
 		timer_number = 5;
+	else
+		return;  // not a general-purpose timer
 
 	RCC->APB1ENR |= (1 << (timer_number - 2));
 	RCC->APB2ENR |= (1) | (1 << (timer_number - 1));
@@ -40,7 +46,7 @@ note this will set update event flag.
 
 @param[in] TIMER TIM_GP_TypeDef. Timer register address base @ref
 TIMx_BASE
-@param[in] prescaler Unsigned int. Prescaler values 0...0xFFFF.
+@param[in] prescaler Unsigned int. Divider of clk_get_timclk1(), values 1...0x10000.
 @param[in] source char. source values INTERNAL,EXTERNAL,EM1,EM2,EM3
 @param[in] dir char. direction values UP or DOWN.
 */
@@ -56,6 +62,8 @@ advancedTimerInit(TIM_GP_TypeDef *TIMER, unsigned int prescaler, unsigned int so
 		timer_number = 4;
 	else if (TIMER == TIM5)
 		timer_number = 5;
+	else
+		return;  // not a general-purpose timer
 
 	RCC->APB1ENR |= (1 << (timer_number - 2));
 	RCC->APB2ENR |= (1) | (1 << (timer_number - 1));
@@ -218,13 +226,13 @@ enableTimerInterrupt(TIM_GP_TypeDef *TIMER, char update, char channel)
 	if (channel != 0)
 		TIMER->DIER |= 1 << channel;
 	if (TIMER == TIM2)
-		NVIC->ISER[0] |= 1 << 28;
+		nvic_enable_irq(NVIC_TIM2_IRQ);
 	else if (TIMER == TIM3)
-		NVIC->ISER[0] |= 1 << 29;
+		nvic_enable_irq(NVIC_TIM3_IRQ);
 	else if (TIMER == TIM4)
-		NVIC->ISER[0] |= 1 << 30;
+		nvic_enable_irq(NVIC_TIM4_IRQ);
 	else if (TIMER == TIM5)
-		NVIC->ISER[1] |= 1 << 18;
+		nvic_enable_irq(NVIC_TIM5_IRQ);
 }
 /*---------------------------------------------------------------------------*/
 /** @brief Disable  timer  interrupt.
@@ -241,47 +249,107 @@ disableTimerInterrupt(TIM_GP_TypeDef *TIMER, char channel)
 	if (channel != 0)
 		TIMER->DIER &= ~(1 << channel);
 	if (TIMER == TIM2)
-		NVIC->ISER[0] &= ~(1 << 28);
+		nvic_disable_irq(NVIC_TIM2_IRQ);
 	else if (TIMER == TIM3)
-		NVIC->ISER[0] &= ~(1 << 29);
+		nvic_disable_irq(NVIC_TIM3_IRQ);
 	else if (TIMER == TIM4)
-		NVIC->ISER[0] &= ~(1 << 30);
+		nvic_disable_irq(NVIC_TIM4_IRQ);
 	else if (TIMER == TIM5)
-		NVIC->ISER[1] &= ~(1 << 18);
+		nvic_disable_irq(NVIC_TIM5_IRQ);
 }
 /*---------------------------------------------------------------------------*/
 /** @brief Millis initialization.
 
-This initialize the timer 6 enable it's clock, Select up counting mode and Internal Clock.
-note this will set update event flag.
-
-@param[in] TIMER TIM_GP_TypeDef. Timer register address base @ref
-TIMx_BASE
-@param[in] prescaler Unsigned int. Prescaler values 0...0xFFFF.
+This starts SysTick from HCLK with a 1 ms period. Its interrupt counts MILLIS and the
+current count inside the millisecond gives micros(), so the same time base serves both.
+Call again after changing the system clock.
 */
 void
 millisInit()
 {
-	RCC->APB1ENR |= (1 << (4));
-	TIM6->CR1 = 0x0000;
-	TIM6->SMCR &= ~(0x07);
-	TIM6->PSC = 7;
-	TIM6->ARR = 999;
-	TIM6->CR1 = 1;
-	TIM6->DIER |= 0x01;
-	NVIC->ISER[1] |= 1 << 22;
+	uint32_t hclk = clk_get_hclk();
+
+	ticks_per_us = hclk / 1000000;
+	SYSTICK->CTRL = 0;
+	SYSTICK->LOAD = hclk / 1000 - 1;
+	SYSTICK->VAL = 0;
+	SYSTICK->CTRL = SYSTICK_CTRL_CLKSOURCE | SYSTICK_CTRL_TICKINT | SYSTICK_CTRL_ENABLE;
+	SIM_WRITE(SYSTICK->CTRL);
+}
+/*---------------------------------------------------------------------------*/
+/** @brief Micros initialization, same SysTick time base as millisInit(). */
+void
+microsInit()
+{
+	millisInit();
 }
 /*---------------------------------------------------------------------------*/
-/*
-void TIM6_IRQHandler(){
-    if(TIM6->SR & 1){
-      MILLIS+=1 ;
-      TIM6->SR &= ~1;
-    }
-}*/
+void
+SysTick_Handler(void)
+{
+	MILLIS++;
+}
 /*---------------------------------------------------------------------------*/
 unsigned long
 millis()
 {
 	return MILLIS;
 }
+/*---------------------------------------------------------------------------*/
+/** @brief Microseconds since millisInit(), wraps after about 71 minutes.
+
+Safe from any context. If SysTick has rolled over but its interrupt has not run yet
+(interrupts masked, or called from an equal or higher priority handler) the pending
+flag is seen and the missing millisecond is added, so time never steps backwards.
+*/
+uint32_t
+micros(void)
+{
+	uint32_t primask, ms, val;
+
+	primask = irq_save();
+	SIM_SYNC();
+	ms = MILLIS;
+	val = SYSTICK->VAL;
+	if (SCB_ICSR & SCB_ICSR_PENDSTSET) {
+		val = SYSTICK->VAL;  // re-read, the wrap may have happened after the first read
+		ms++;
+	}
+	irq_restore(primask);
+
+	return ms * 1000 + (SYSTICK->LOAD - val) / ticks_per_us;
+}
+/*---------------------------------------------------------------------------*/
+/** @brief Deadline us microseconds from now, for deadline_expired().
+@example   uint32_t t = deadline_us(500); while (!deadline_expired(t)) do_work();
+*/
+uint32_t
+deadline_us(uint32_t us)
+{
+	return micros() + us;
+}
+/*---------------------------------------------------------------------------*/
+/** @brief Check a deadline without blocking, correct across the micros() wrap.
+@return 1 once the deadline has passed, 0 before
+*/
+int
+deadline_expired(uint32_t deadline)
+{
+	return (int32_t)(micros() - deadline) >= 0;
+}
+/*---------------------------------------------------------------------------*/
+void
+delay_us(uint32_t us)
+{
+	uint32_t deadline = deadline_us(us);
+
+	while (!deadline_expired(deadline))
+		;
+}
+/*---------------------------------------------------------------------------*/
+void
+delay_ms(uint32_t ms)
+{
+	while (ms--)
+		delay_us(1000);
+}
@@ -33,10 +33,12 @@ This initialize the GPIO enables it's clock
 
 */
 #include "usart.h"
+#include "clk.h"
 #include "dma.h"
+#include "nvic.h"
 
 // double rate,Div;
-int __clk = 8;  // Default to 8 MHz if not initialized by initClk()
+int __clk = 8;  // HSI until clk_init() switches to the PLL
 
 /*
 void usartremap(USART_TypeDef *usart, int setmap){
@@ -107,16 +109,61 @@ usartInit(USART_TypeDef *usart, uint32_t br, int setremap)
 		GPIOD->CRH |= (0x04UL << 8);   // Rx (PD2) in floating
 		RCC->APB1ENR |= RCC_APB1ENR_USART5EN;
 	}
-	//    Div= ((__clk) / (16 * (br/pow(1000,2))));
-	//	rate=Div*16;   // fraction
-
-	usart->BRR = __clk * 1000000 / br;            // set baudrate
+	usart_set_baudrate(usart, br);                // set baudrate
 	                                              //	usart->CR1 =1<<12;   // for 9 bit
 	usart->CR1 |= (USART_CR1_RE | USART_CR1_TE);  // RX, TX enable
 	usart->CR1 |= USART_CR1_UE;                   // USART enable/
 	usart->CR3 |= USART_DMA_EN;
 }
 
+/* With 16x oversampling BRR holds the mantissa in bits 15:4 and the fraction in
+ * sixteenths in bits 3:0, so together they are just PCLK / baud, rounded to nearest.
+ * USART1 runs from PCLK2, the others from PCLK1. Returns 0 when out of range. */
+static uint32_t
+usart_brr(USART_TypeDef *usart, uint32_t baud, uint32_t *pclk)
+{
+	uint32_t brr;
+
+	*pclk = (usart == USART1) ? clk_get_pclk2() : clk_get_pclk1();
+	if (baud == 0)
+		return 0;
+	brr = (*pclk + baud / 2) / baud;
+	return (brr < 16 || brr > 0xFFFF) ? 0 : brr;
+}
+
+/** @brief Baud rate the hardware would really produce for a request.
+        @param[in] *usart i.e USART1
+        @param[in] baud   requested baud rate
+        @return achievable baud rate, or -1 if it is above PCLK / 16
+        @example   usart_get_baudrate(USART1, 921600);
+*/
+int32_t
+usart_get_baudrate(USART_TypeDef *usart, uint32_t baud)
+{
+	uint32_t pclk;
+	uint32_t brr = usart_brr(usart, baud, &pclk);
+
+	return brr ? (int32_t)((pclk + brr / 2) / brr) : -1;
+}
+
+/** @brief Set the baud rate from the live bus clock, with fractional BRR rounding.
+        @param[in] *usart i.e USART1
+        @param[in] baud   requested baud rate
+        @return the baud rate actually produced, or -1 (BRR unchanged) if out of range
+        @example   usart_set_baudrate(USART1, 921600);
+*/
+int32_t
+usart_set_baudrate(USART_TypeDef *usart, uint32_t baud)
+{
+	uint32_t pclk;
+	uint32_t brr = usart_brr(usart, baud, &pclk);
+
+	if (!brr)
+		return -1;
+	usart->BRR = brr;
+	return (pclk + brr / 2) / brr;
+}
+
 /** @brief     Send character.
         @param[in] *uart i.e USART1
         @param[in] ch i.e 'a'
@@ -126,8 +173,9 @@ void
 sendChar(USART_TypeDef *uart, char ch)
 {
 	while (!(uart->SR & USART_SR_TXE))
-		;
+		SIM_SYNC();
 	uart->DR = (ch & 0xFF);
+	SIM_WRITE(uart->DR);
 }
 
 /** @brief     Recieve character.
@@ -139,9 +187,13 @@ sendChar(USART_TypeDef *uart, char ch)
 unsigned char
 GetChar(USART_TypeDef *urt)
 {
+	unsigned char ch;
+
 	while (!(urt->SR & USART_SR_RXNE))
-		;
-	return ((unsigned char)(urt->DR & 0xFF));
+		SIM_SYNC();
+	ch = (unsigned char)(urt->DR & 0xFF);
+	SIM_READ(urt->DR);
+	return ch;
 }
 /** @brief     Recieve String.
         @param[in] *uart i.e USART1
@@ -159,6 +211,8 @@ GetString(USART_TypeDef *uart, char *data)
 	while (temp != '\n' && i < 5) {
 		data[i] = temp;
 		i++;
+		if (i < 5)
+			temp = GetChar(uart);
 	}
 }
 //*******************************
@@ -198,6 +252,251 @@ Send_String(USART_TypeDef *uart, char *str)
 	}
 }
 
+/** @brief Send a binary buffer, NUL bytes included.
+        @param[in] *uart i.e USART1
+        @param[in] *data bytes to send
+        @param[in] len   number of bytes
+        @example   Send_Bytes(USART1, frame, sizeof(frame));
+*/
+void
+Send_Bytes(USART_TypeDef *uart, const uint8_t *data, uint16_t len)
+{
+	while (len--) {
+		sendChar(uart, *data++);
+	}
+}
+
+#define USART1_TX_DMA_CHANNEL DMA_CHANNEL4
+#define USART_TX_MASK (USART_TX_BUF_SIZE - 1)
+
+static uint8_t usart_tx_buf[USART_TX_BUF_SIZE];
+static volatile uint16_t usart_tx_head;  // free running, written by usart_write() only
+static volatile uint16_t usart_tx_tail;  // free running, written by the DMA interrupt only
+static volatile uint16_t usart_tx_busy;  // bytes in the running DMA chunk, 0 when idle
+volatile uint32_t usart_tx_dropped;      // bytes refused because the ring was full
+
+/* Start DMA on the next contiguous run of queued bytes, stopping at the ring wrap. Runs
+ * from the channel 4 interrupt, or from usart_write() with that interrupt masked. */
+static void
+usart_tx_start(void)
+{
+	uint16_t tail = usart_tx_tail;
+	uint16_t offset = tail & USART_TX_MASK;
+	uint16_t count = usart_tx_head - tail;
+
+	if (count > USART_TX_BUF_SIZE - offset)
+		count = USART_TX_BUF_SIZE - offset;
+	usart_tx_busy = count;
+	if (count == 0)
+		return;
+
+	dma_disable_channel(DMA1, USART1_TX_DMA_CHANNEL);
+	dma_set_memory_address(DMA1, USART1_TX_DMA_CHANNEL, (u32)&usart_tx_buf[offset]);
+	dma_set_number_of_data(DMA1, USART1_TX_DMA_CHANNEL, count);
+	dma_enable_channel(DMA1, USART1_TX_DMA_CHANNEL);
+}
+
+/** @brief Set up DMA1 channel 4 to drain the USART1 transmit ring.
+        Call once after usartInit(USART1, ...). dma_write_usart1() uses the same channel
+        and must not be mixed with usart_write().
+        @example   usart_tx_init();
+*/
+void
+usart_tx_init(void)
+{
+	CLOCK_BUS_HIGH |= DMACLOCK_ENABLE;
+	dma_channel_reset(DMA1, USART1_TX_DMA_CHANNEL);
+	dma_set_peripheral_address(DMA1, USART1_TX_DMA_CHANNEL, (u32)&USART1->DR);
+	dma_set_read_from_memory(DMA1, USART1_TX_DMA_CHANNEL);
+	dma_enable_memory_increment_mode(DMA1, USART1_TX_DMA_CHANNEL);
+	dma_set_peripheral_size(DMA1, USART1_TX_DMA_CHANNEL, DMA_CCR_PSIZE_8BIT);
+	dma_set_memory_size(DMA1, USART1_TX_DMA_CHANNEL, DMA_CCR_MSIZE_8BIT);
+	dma_set_priority(DMA1, USART1_TX_DMA_CHANNEL, DMA_CCR_PL_MEDIUM);  // below I2C1 RX
+	dma_enable_transfer_complete_interrupt(DMA1, USART1_TX_DMA_CHANNEL);
+	USART1->CR3 |= USART_DMA_EN;
+	nvic_enable_irq(NVIC_DMA1_CHANNEL4_IRQ);
+}
+
+/** @brief Queue bytes for USART1 without waiting.
+        The whole buffer is queued or nothing is, so a binary frame is never cut short.
+        Call from one context only, normally the main loop.
+        @param[in] *data bytes to send, copied before returning
+        @param[in] len   number of bytes
+        @return len when queued, -1 when the ring is full (counted in usart_tx_dropped)
+        @example   usart_write(frame, sizeof(frame));
+*/
+int
+usart_write(const uint8_t *data, uint16_t len)
+{
+	uint16_t head = usart_tx_head;
+	uint16_t space = USART_TX_BUF_SIZE - (uint16_t)(head - usart_tx_tail);
+	uint16_t i;
+
+	if (len > space) {
+		usart_tx_dropped += len;
+		return -1;
+	}
+	for (i = 0; i < len; i++)
+		usart_tx_buf[(head + i) & USART_TX_MASK] = data[i];
+	__asm volatile("" ::: "memory");  // bytes are in the ring before head moves
+	usart_tx_head = head + len;
+
+	nvic_disable_irq(NVIC_DMA1_CHANNEL4_IRQ);
+	if (usart_tx_busy == 0)
+		usart_tx_start();
+	nvic_enable_irq(NVIC_DMA1_CHANNEL4_IRQ);
+	return len;
+}
+
+/** @brief Free room in the transmit ring.
+        @return bytes usart_write() would take right now
+        @example   if (usart_tx_space() >= sizeof(frame)) usart_write(frame, sizeof(frame));
+*/
+uint16_t
+usart_tx_space(void)
+{
+	return USART_TX_BUF_SIZE - (uint16_t)(usart_tx_head - usart_tx_tail);
+}
+
+/** @brief Everything queued by usart_write() has left the wire, last stop bit included.
+        @return 1 when idle, 0 while bytes are queued or shifting out
+*/
+int
+usart_tx_idle(void)
+{
+	return !usart_tx_busy && usart_tx_head == usart_tx_tail && (USART1->SR & USART_SR_TC);
+}
+
+/** @brief Wait until everything queued by usart_write() has left the wire.
+        Use before changing the baud rate.
+*/
+void
+usart_tx_flush(void)
+{
+	while (usart_tx_busy || usart_tx_head != usart_tx_tail)
+		SIM_SYNC();
+	while (!(USART1->SR & USART_SR_TC))
+		SIM_SYNC();
+}
+
+void
+DMA1_Channel4_IRQHandler(void)
+{
+	DMA1_IFCR = DMA_IFCR_CIF(USART1_TX_DMA_CHANNEL);
+	usart_tx_tail += usart_tx_busy;
+	usart_tx_start();  // chain the next chunk, if any
+}
+
+#define USART1_RX_DMA_CHANNEL DMA_CHANNEL5
+#define USART_RX_MASK (USART_RX_BUF_SIZE - 1)
+#define USART_CR1_IDLEIE (1 << 4)
+#define USART_CR3_DMAR (1 << 6)
+
+static uint8_t usart_rx_buf[USART_RX_BUF_SIZE];
+static volatile uint16_t usart_rx_head;  // free running, written by the RX interrupts only
+static uint16_t usart_rx_tail;           // free running, written by usart_rx_read() only
+volatile uint32_t usart_rx_overruns;     // bytes overwritten before they were read
+static usart_callback_t usart_rx_callback;
+
+/* Move the head up to the DMA write position. The HT/TC interrupts fire every half
+ * buffer, so the DMA can never lap the last published head unnoticed. */
+static void
+usart_rx_update(void)
+{
+	uint16_t pos = USART_RX_BUF_SIZE - DMA_CNDTR(DMA1, USART1_RX_DMA_CHANNEL);
+	uint16_t head = usart_rx_head;
+
+	usart_rx_head = head + ((pos - head) & USART_RX_MASK);
+	if (usart_rx_head != head && usart_rx_callback)
+		usart_rx_callback(1);
+}
+
+/** @brief Have the RX interrupts call cb whenever new bytes are in the buffer.
+        Called in interrupt context, at most once per half buffer or end of burst, so it
+        should only flag the reader, i.e. with sched_signal().
+        @param[in] cb  status is always 1, NULL to stop
+        @example   usart_rx_set_callback(Rx_Ready);
+*/
+void
+usart_rx_set_callback(usart_callback_t cb)
+{
+	usart_rx_callback = cb;
+}
+
+/** @brief Start circular DMA reception on USART1.
+        Call once after usartInit(USART1, ...). dma_read_usart1() uses the same channel
+        and must not be mixed with usart_rx_read().
+        @example   usart_rx_init();
+*/
+void
+usart_rx_init(void)
+{
+	CLOCK_BUS_HIGH |= DMACLOCK_ENABLE;
+	dma_channel_reset(DMA1, USART1_RX_DMA_CHANNEL);
+	dma_set_peripheral_address(DMA1, USART1_RX_DMA_CHANNEL, (u32)&USART1->DR);
+	dma_set_memory_address(DMA1, USART1_RX_DMA_CHANNEL, (u32)usart_rx_buf);
+	dma_set_number_of_data(DMA1, USART1_RX_DMA_CHANNEL, USART_RX_BUF_SIZE);
+	dma_set_read_from_peripheral(DMA1, USART1_RX_DMA_CHANNEL);
+	dma_enable_memory_increment_mode(DMA1, USART1_RX_DMA_CHANNEL);
+	dma_enable_circular_mode(DMA1, USART1_RX_DMA_CHANNEL);
+	dma_set_peripheral_size(DMA1, USART1_RX_DMA_CHANNEL, DMA_CCR_PSIZE_8BIT);
+	dma_set_memory_size(DMA1, USART1_RX_DMA_CHANNEL, DMA_CCR_MSIZE_8BIT);
+	dma_set_priority(DMA1, USART1_RX_DMA_CHANNEL, DMA_CCR_PL_MEDIUM);
+	dma_enable_half_transfer_interrupt(DMA1, USART1_RX_DMA_CHANNEL);
+	dma_enable_transfer_complete_interrupt(DMA1, USART1_RX_DMA_CHANNEL);
+	dma_enable_channel(DMA1, USART1_RX_DMA_CHANNEL);
+
+	USART1->CR3 |= USART_CR3_DMAR;
+	USART1->CR1 |= USART_CR1_IDLEIE;  // end of a burst from the host
+	nvic_enable_irq(NVIC_DMA1_CHANNEL5_IRQ);
+	nvic_enable_irq(NVIC_USART1_IRQ);
+}
+
+/** @brief Copy received bytes out of the USART1 circular buffer.
+        Never blocks. If the host sent more than USART_RX_BUF_SIZE bytes since the last
+        call, the oldest are lost and counted in usart_rx_overruns.
+        @param[out] *data destination
+        @param[in] max    size of data
+        @return number of bytes copied
+        @example   n = usart_rx_read(line, sizeof(line));
+*/
+uint16_t
+usart_rx_read(uint8_t *data, uint16_t max)
+{
+	uint16_t head = usart_rx_head;
+	uint16_t count = head - usart_rx_tail;
+	uint16_t i;
+
+	if (count > USART_RX_BUF_SIZE) {
+		usart_rx_overruns += count - USART_RX_BUF_SIZE;
+		usart_rx_tail = head - USART_RX_BUF_SIZE;
+		count = USART_RX_BUF_SIZE;
+	}
+	if (count > max)
+		count = max;
+	for (i = 0; i < count; i++)
+		data[i] = usart_rx_buf[(usart_rx_tail + i) & USART_RX_MASK];
+	usart_rx_tail += count;
+	return count;
+}
+
+void
+DMA1_Channel5_IRQHandler(void)
+{
+	DMA1_IFCR = DMA_IFCR_CIF(USART1_RX_DMA_CHANNEL);
+	usart_rx_update();
+}
+
+void
+USART1_IRQHandler(void)
+{
+	if (USART1->SR & USART_SR_IDLE) {
+		(void)USART1->DR;  // SR then DR read clears IDLE
+		SIM_READ(USART1->DR);
+		usart_rx_update();
+	}
+}
+
 /** @brief Send String aka Array of Characters Using Direct Memory Access Channel for USART1.
         @param[in] *data i.e char *device="Hello Mcu";
         @example   dma_write_usart1(device,10); and or \or
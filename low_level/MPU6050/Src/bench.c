@@ -0,0 +1,351 @@
+/* @file 			 : bench.c
+ *  @Description: On-target driver benchmarks, the MPU6050_bench firmware.
+ *
+ *  Runs the same suite every BENCH_PERIOD_MS and prints one results table on USART1:
+ *    i2c     14-byte ACCEL_XOUT_H burst at 100 and 400 kHz, blocking and DMA (MPU on I2C1)
+ *    spi     BENCH_SPI_BYTES on SPI1, polled spi_xfer() vs spi_dma_submit(), whole and as
+ *            two ping-pong halves
+ *    uart    BENCH_UART_BYTES, polled sendChar() vs the usart_write() DMA ring, and the CPU
+ *            time usart_write() itself takes
+ *    can     8-byte frames through CAN1 in silent loopback, no transceiver needed
+ *  Times come from the DWT cycle counter, so they don't depend on the SysTick rate.
+ *  A row with fewer ok runs than BENCH_RUNS had bus errors or timeouts.
+ */
+#include "can.h"
+#include "clk.h"
+#include "dma.h"
+#include "i2c.h"
+#include "mpu.h"
+#include "myspi.h"
+#include "nvic.h"
+#include "prof.h"
+#include "timer.h"
+#include "usart.h"
+
+#define BENCH_BAUD 115200
+#define BENCH_PERIOD_MS 10000
+#define BENCH_RUNS 100         /* repetitions per row, UART rows use BENCH_UART_RUNS */
+#define BENCH_UART_RUNS 4
+#define BENCH_SPI_BYTES 256
+#define BENCH_UART_BYTES 256
+#define BENCH_CAN_BITRATE 500000
+#define BENCH_CAN_ID 0x7F0
+#define BENCH_TIMEOUT_US 10000
+#define BENCH_ROWS 12
+#define BENCH_LINE_MAX 80
+
+typedef struct {
+	const char *name;
+	uint32_t runs;          // runs that completed
+	uint32_t min_us, mean_us, max_us;
+	uint32_t rate;          // throughput at the mean, 0 when it doesn't apply
+	const char *rate_unit;
+} bench_row_t;
+
+static bench_row_t rows[BENCH_ROWS];
+static int row_count;
+static uint32_t hclk_mhz;
+static uint8_t tx_buf[BENCH_SPI_BYTES], rx_buf[BENCH_SPI_BYTES];
+
+/* Turn the counters of prof stage 0 into a table row. bytes > 0 adds bytes per second,
+ * bytes < 0 operations per second, 0 no rate. */
+static void
+Add_Row(const char *name, int32_t bytes, const char *rate_unit)
+{
+	prof_stage_t s;
+	bench_row_t *r;
+
+	prof_take(0, &s);
+	if (row_count == BENCH_ROWS)
+		return;
+	r = &rows[row_count++];
+	r->name = name;
+	r->runs = s.count;
+	r->min_us = s.count ? s.min / hclk_mhz : 0;
+	r->mean_us = prof_mean(&s) / hclk_mhz;
+	r->max_us = s.max / hclk_mhz;
+	r->rate_unit = rate_unit;
+	if (!s.count || !r->mean_us || !bytes)
+		r->rate = 0;
+	else if (bytes > 0)
+		r->rate = (uint32_t)((uint64_t)bytes * 1000000 / r->mean_us);
+	else
+		r->rate = 1000000 / r->mean_us;
+}
+
+static int
+Wait_I2c1(void)
+{
+	uint32_t deadline = deadline_us(BENCH_TIMEOUT_US);
+
+	while (i2c1_dma_busy()) {
+		i2c_poll(I2C1);  // ends a held bus after I2C_TIMEOUT_US
+		if (deadline_expired(deadline))
+			return -1;
+	}
+	return 1;
+}
+
+static volatile int i2c_status;
+
+static void
+I2c_Done(int status)
+{
+	i2c_status = status;
+}
+
+static void
+Bench_I2c(uint32_t speed, const char *name, const char *name_dma)
+{
+	uint8_t frame[MPU_FRAME_SIZE];
+	uint32_t t;
+
+	I2CInit(I2C1, NOREMAP, speed);
+	for (int i = 0; i < BENCH_RUNS; i++) {
+		t = prof_now();
+		if (i2c_read_regs(I2C1, MPU6050_ADDR, ACCEL_XOUT_H, frame, sizeof(frame)) > 0)
+			prof_record(0, prof_now() - t);
+	}
+	Add_Row(name, sizeof(frame), "B/s");
+
+	for (int i = 0; i < BENCH_RUNS; i++) {
+		i2c_status = 0;
+		t = prof_now();
+		if (i2c1_dma_read(MPU6050_ADDR, ACCEL_XOUT_H, frame, sizeof(frame), I2c_Done) < 0 ||
+		    Wait_I2c1() < 0)
+			continue;
+		if (i2c_status > 0)
+			prof_record(0, prof_now() - t);
+	}
+	Add_Row(name_dma, sizeof(frame), "B/s");
+}
+
+static int
+Wait_Spi1(void)
+{
+	uint32_t deadline = deadline_us(BENCH_TIMEOUT_US);
+
+	while (spi_dma_busy(SPI1)) {
+		if (deadline_expired(deadline))
+			return -1;
+	}
+	return 1;
+}
+
+static volatile int spi_errors;
+
+static void
+Spi_Done(int status)
+{
+	if (status < 0)
+		spi_errors++;
+}
+
+/* SPI1 runs with nothing attached, or MOSI looped to MISO, the timing is the same.
+ * The ping-pong row sends the same bytes as two queued halves, the second one started
+ * from the first one's completion interrupt. */
+static void
+Bench_Spi(void)
+{
+	uint32_t t;
+
+	spi_init_master(SPI1, SPI_CR1_BAUDRATE_FPCLK_DIV_8, SPI_CR1_CPOL_CLK_TO_0_WHEN_IDLE,
+	                SPI_CR1_CPHA_CLK_TRANSITION_1, SPI_CR1_DFF_8BIT, SPI_CR1_MSBFIRST, NO_REMAP);
+	spi_enable_software_slave_management(SPI1);
+	spi_set_nss_high(SPI1);
+	spi_enable(SPI1);
+	spi_dma_init(SPI1);
+	for (int i = 0; i < BENCH_SPI_BYTES; i++)
+		tx_buf[i] = i;
+
+	for (int i = 0; i < BENCH_RUNS; i++) {
+		t = prof_now();
+		for (int n = 0; n < BENCH_SPI_BYTES; n++)
+			rx_buf[n] = spi_xfer(SPI1, tx_buf[n]);
+		prof_record(0, prof_now() - t);
+	}
+	Add_Row("spi 256B polled", BENCH_SPI_BYTES, "B/s");
+
+	for (int i = 0; i < BENCH_RUNS; i++) {
+		spi_errors = 0;
+		t = prof_now();
+		if (spi_dma_submit(SPI1, tx_buf, rx_buf, BENCH_SPI_BYTES, Spi_Done) < 0 ||
+		    Wait_Spi1() < 0)
+			continue;
+		if (!spi_errors)
+			prof_record(0, prof_now() - t);
+	}
+	Add_Row("spi 256B dma", BENCH_SPI_BYTES, "B/s");
+
+	for (int i = 0; i < BENCH_RUNS; i++) {
+		spi_errors = 0;
+		t = prof_now();
+		if (spi_dma_submit(SPI1, tx_buf, rx_buf, BENCH_SPI_BYTES / 2, Spi_Done) < 0 ||
+		    spi_dma_submit(SPI1, &tx_buf[BENCH_SPI_BYTES / 2], &rx_buf[BENCH_SPI_BYTES / 2],
+		                   BENCH_SPI_BYTES / 2, Spi_Done) < 0 ||
+		    Wait_Spi1() < 0)
+			continue;
+		if (!spi_errors)
+			prof_record(0, prof_now() - t);
+	}
+	Add_Row("spi 256B pingpong", BENCH_SPI_BYTES, "B/s");
+}
+
+static void
+Bench_Uart(void)
+{
+	uint8_t msg[BENCH_UART_BYTES];
+	uint32_t t;
+
+	for (int i = 0; i < BENCH_UART_BYTES; i++)
+		msg[i] = 'U';  // 0x55, an even bit pattern for a scope
+	usart_tx_flush();
+
+	for (int i = 0; i < BENCH_UART_RUNS; i++) {
+		t = prof_now();
+		for (int n = 0; n < BENCH_UART_BYTES; n++)
+			sendChar(USART1, msg[n]);
+		while (!(USART1->SR & USART_SR_TC))
+			;
+		prof_record(0, prof_now() - t);
+	}
+	Add_Row("uart 256B polled", BENCH_UART_BYTES, "B/s");
+
+	for (int i = 0; i < BENCH_UART_RUNS; i++) {
+		t = prof_now();
+		usart_write(msg, sizeof(msg));
+		usart_tx_flush();
+		prof_record(0, prof_now() - t);
+	}
+	Add_Row("uart 256B dma", BENCH_UART_BYTES, "B/s");
+
+	for (int i = 0; i < BENCH_UART_RUNS; i++) {
+		t = prof_now();
+		usart_write(msg, sizeof(msg));
+		prof_record(0, prof_now() - t);
+		usart_tx_flush();
+	}
+	Add_Row("uart write() cpu", 0, "");
+}
+
+/* One frame in flight at a time, so the mean is the send to receive latency */
+static void
+Bench_Can(void)
+{
+	CAN_msg tx = {.id = BENCH_CAN_ID, .len = 8, .format = STANDARD_FORMAT, .type = DATA_FRAME};
+	CAN_msg rx;
+	uint32_t t, deadline;
+	int ok;
+
+	for (int i = 0; i < BENCH_RUNS; i++) {
+		tx.data[0] = i;
+		t = prof_now();
+		if (can_send(&tx) < 0)
+			continue;
+		deadline = deadline_us(BENCH_TIMEOUT_US);
+		while (!(ok = can_receive(&rx) > 0) && !deadline_expired(deadline))
+			;
+		if (ok)
+			prof_record(0, prof_now() - t);
+	}
+	Add_Row("can 8B loopback", -1, "frm/s");
+}
+
+/* Right-align v in width characters, returns the characters written */
+static int
+Put_Num(char *out, uint32_t v, int width)
+{
+	char digits[10];
+	int n = 0, len = 0;
+
+	do {
+		digits[n++] = '0' + v % 10;
+		v /= 10;
+	} while (v);
+	while (width-- > n)
+		out[len++] = ' ';
+	while (n)
+		out[len++] = digits[--n];
+	return len;
+}
+
+static int
+Put_Str(char *out, const char *s, int width)
+{
+	int len = 0;
+
+	while (*s)
+		out[len++] = *s++;
+	while (len < width)
+		out[len++] = ' ';
+	return len;
+}
+
+static void
+Print_Line(const char *line, uint16_t len)
+{
+	usart_tx_flush();  // the ring only holds a few lines
+	usart_write((const uint8_t *)line, len);
+}
+
+static void
+Print_Table(void)
+{
+	char line[BENCH_LINE_MAX];
+	int len;
+
+	len = Put_Str(line, "\r\nbench               runs   min_us  mean_us   max_us     rate\r\n", 0);
+	Print_Line(line, len);
+	for (int i = 0; i < row_count; i++) {
+		const bench_row_t *r = &rows[i];
+
+		len = Put_Str(line, r->name, 18);
+		len += Put_Num(&line[len], r->runs, 6);
+		len += Put_Num(&line[len], r->min_us, 9);
+		len += Put_Num(&line[len], r->mean_us, 9);
+		len += Put_Num(&line[len], r->max_us, 9);
+		if (r->rate) {
+			len += Put_Num(&line[len], r->rate, 9);
+			line[len++] = ' ';
+			len += Put_Str(&line[len], r->rate_unit, 0);
+		}
+		line[len++] = '\r';
+		line[len++] = '\n';
+		Print_Line(line, len);
+	}
+}
+
+int
+main()
+{
+	clk_init();  // 72 MHz before any driver reads the bus clocks
+	nvic_priority_init();
+	millisInit();
+	prof_init();
+	hclk_mhz = clk_get_hclk() / 1000000;
+
+	usartInit(USART1, BENCH_BAUD, 0);
+	usart_tx_init();
+	I2CInit(I2C1, NOREMAP, I2C_SPEED_FAST);
+	i2c1_dma_init();
+
+	canInit(CAN1, POLLING);
+	can_set_bitrate(CAN1, BENCH_CAN_BITRATE);
+	can_set_test_mode(CAN1, CAN_BTR_LBKM | CAN_BTR_SILM);
+	can_filter_add_mask(0, 0, STANDARD_FORMAT, FIFO0);  // everything
+	can_rx_init();
+	nvic_enable_irq(NVIC_USB_HP_CAN_TX_IRQ);
+	nvic_enable_irq(NVIC_USB_LP_CAN_RX0_IRQ);
+
+	while (1) {
+		row_count = 0;
+		prof_reset();
+		Bench_I2c(I2C_SPEED_STANDARD, "i2c 14B 100k", "i2c 14B 100k dma");
+		Bench_I2c(I2C_SPEED_FAST, "i2c 14B 400k", "i2c 14B 400k dma");
+		Bench_Spi();
+		Bench_Uart();
+		Bench_Can();
+		Print_Table();
+		delay_ms(BENCH_PERIOD_MS);
+	}
+}
@@ -18,173 +18,1095 @@
  ******************************************************************************
  */
 
+#if TELEMETRY_CAN
+#include "can.h"
+#endif
+#include "clk.h"
+#include "extint.h"
+#include "filter.h"
+#include "flash.h"
+#include "fusion.h"
 #include "i2c.h"
 #include "mpu.h"
+#if FLASH_LOG
+#include "norlog.h"
+#endif
+#include "nvic.h"
+#include "prof.h"
+#include "sampleq.h"
+#include "sched.h"
+#include "telemetry.h"
+#include "timer.h"
 #include "usart.h"
+#if WATCHDOG
+#include "watchdog.h"
+#endif
 #include <inttypes.h> /* Include integer type header file */
-#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
-float Acc_x, Acc_y, Acc_z, Temperature, Gyro_x, Gyro_y, Gyro_z;
+/* Sampling modes:
+ * MPU_SAMPLE_POLL reads one frame and then waits 50 ms.
+ * MPU_SAMPLE_INT reads one frame on every data-ready edge of the MPU INT pin, so the
+ * sample rate follows SMPLRT_DIV. Frames are queued for the sample task to drain.
+ * MPU_SAMPLE_FIFO lets the sensor buffer samples in its 1024-byte FIFO and drains up to
+ * MPU_FIFO_BATCH whole frames per DMA burst, one bus transaction per many samples.
+ * INT and FIFO builds only differ in the boot profile, the fifo field of the active
+ * profile picks the path at runtime.
+ *
+ * Wake-on-motion (INT and FIFO builds, see WOM): once the first sensor has moved less than
+ * the threshold for WOM_QUIET_MS, every sensor is parked in accel-only cycle mode and the
+ * MPU INT pin carries the motion interrupt instead of data ready. The core sleeps in STOP
+ * in between, and the first motion interrupt brings the active profile back at full rate.
+ */
+#define MPU_SAMPLE_POLL 0
+#define MPU_SAMPLE_INT 1
+#define MPU_SAMPLE_FIFO 2
+#ifndef MPU_SAMPLE_MODE
+#define MPU_SAMPLE_MODE MPU_SAMPLE_INT
+#endif
+
+#define MPU_INT_LINE EXTI0 /* MPU INT is wired to PA0 */
+#define MPU_INT_PORT PA
+#define MPU_FIFO_BATCH 16 /* frames per FIFO drain, 73 fit in the sensor FIFO */
+#ifndef TELEMETRY_BAUD
+#define TELEMETRY_BAUD 9600 /* boot rate, the host can raise it with BAUD */
+#endif
+#ifndef OUTPUT_DECIMATION
+#define OUTPUT_DECIMATION 1 /* sensor samples per telemetry frame at boot, see DECIM */
+#endif
+#ifndef TELEMETRY_CAN
+#define TELEMETRY_CAN 0 /* 1 also streams every sample on CAN1 (PB8/PB9) */
+#endif
+#ifndef FLASH_LOG
+#define FLASH_LOG 0 /* 1 captures raw frames to a SPI NOR flash on SPI1, see LOG */
+#endif
+#ifndef CAN_NODE_ID
+#define CAN_NODE_ID 0 /* 0..15, picks this node's frame IDs on a shared bus */
+#endif
+#ifndef CAN_BITRATE
+#define CAN_BITRATE 500000
+#endif
+#ifndef WOM_THRESHOLD
+#define WOM_THRESHOLD 0 /* boot wake-on-motion threshold in 2 mg steps, 0 = off, see WOM */
+#endif
+#ifndef WATCHDOG
+#define WATCHDOG 0 /* 1 runs the independent watchdog, fed while the I2C buses work */
+#endif
+#define WATCHDOG_MS 1000 /* watchdog window, a stuck CPU or bus resets after this long */
+#define WATCHDOG_CLEARS 3 /* failed bus clears in a row before the watchdog is let run out */
+#define WOM_WAKE MPU_LP_WAKE_5HZ /* accel checks per second while parked */
+#define WOM_QUIET_MS 5000 /* below the threshold this long at full rate parks the sensors */
+#define CAN_CMD_BROADCAST 0x07F             /* host commands for every node */
+#define CAN_CMD_ID(node) (0x080 + (node))  /* host commands for one node */
+#define CALIB_SAMPLES 512 /* stationary samples per CALIB without a count */
+#define CALIB_MAGIC 0x314C4143 /* "CAL1" */
+#define BAUD_TOLERANCE 40 /* max baud error in 1/1000, USART receivers cope with ~4% */
+#define PROF_REPORT_MS 1000 /* profiling frames once a second in PROFILING builds */
+#define POLL_PERIOD_MS 50 /* MPU_SAMPLE_POLL read interval */
+#define FIFO_PERIOD_MS 1 /* FIFO profile drain check, and catch-all for the sample queue */
+#define CMD_PERIOD_MS 20 /* CAN commands are polled, USART1 ones raise EV_RX */
+#define LOG_PERIOD_MS 1 /* norlog_poll(), each run moves the log one SPI chain on */
+#define OUTQ_LEN 4 /* filtered samples waiting for the output task, power of two */
+#define POWER_PERIOD_MS 100 /* wake-on-motion quiet check */
+#define BUS_PERIOD_MS 1 /* i2c_poll() of every bus, ends a hung read a millisecond late at most */
+
+/* Scheduler events and task priorities, see sched.h. Acquisition itself runs in the
+ * EXTI0 and DMA interrupts, the sample task filters what they queued, and the output
+ * task only packs and queues frames, so commands and the log never hold up a read. */
+#define EV_SAMPLE (1 << 0) /* a sample slot was published */
+#define EV_OUTPUT (1 << 1) /* a filtered sample waits in outq */
+#define EV_RX (1 << 2)     /* host bytes arrived on USART1 */
+#define EV_MOTION (1 << 3) /* motion interrupt while the sensors are parked */
+enum {
+	PRIO_BUS,
+	PRIO_SAMPLE,
+	PRIO_POWER,
+	PRIO_OUTPUT,
+	PRIO_LOG,
+	PRIO_CMD,
+	PRIO_REPORT,
+};
+
+/* Profiled stages, the stage byte of the profiling telemetry frames */
+enum {
+	STAGE_ACQ,     // data-ready edge to frame queued, or one FIFO drain / polled read
+	STAGE_DECODE,  // mpu_decode() and decim_push() of one sensor
+	STAGE_FUSION,  // fusion_update()
+	STAGE_CAN,     // packing and queuing the CAN frames of one output sample
+	STAGE_OUTPUT,  // packing and queuing the USART1 frames of one output sample
+	STAGE_CMD,     // Poll_Commands(), one run of the command task
+	STAGE_COUNT,
+};
+
+volatile uint32_t sample_overruns;  // data-ready edges dropped, previous read still running
+volatile uint32_t sample_errors;    // samples lost to a bus or DMA error
+uint32_t cmd_errors;                // host command lines that were not understood
+uint32_t output_overruns;           // filtered samples dropped, the output task fell behind
+
+static uint8_t telemetry_format = TELEMETRY_FORMAT;  // switched at runtime by FMT
+static fusion_t attitude;                            // updated per sample while FMT ATT
+static uint32_t attitude_time;                       // timestamp of the last update, 0 = none
+static decim_t decim[MPU_COUNT];                     // sensor rate to telemetry rate
+static telemetry_batch_t uart_delta[MPU_COUNT];      // FMT DELTA chains
+#if TELEMETRY_CAN
+#define CAN_OUTPUT_DELTA 2
+static uint8_t can_output = 1;  // switched at runtime by CAN ON|OFF|DELTA
+static telemetry_delta_t can_delta[MPU_COUNT];
+#endif
+
+/* One output sample, from Send_Sample() to the output task */
+typedef struct {
+	mpu_raw_t avg[MPU_COUNT];
+	int16_t quat[4];  // FMT ATT only
+	uint16_t n;
+	uint32_t timestamp, avg_time;
+} output_t;
+
+static output_t outq[OUTQ_LEN];
+static uint8_t outq_head, outq_tail;  // both sides run from the scheduler, no ISR
+
+/* Boot profile: 1 kHz, 260 Hz bandwidth, build-time ranges */
+static const mpu_config_t boot_profile = {
+	.smplrt_div = 0x07,
+	.dlpf = 0,
+	.gyro_fs = MPU_GYRO_FS,
+	.accel_fs = MPU_ACCEL_FS,
+	.fifo = MPU_SAMPLE_MODE == MPU_SAMPLE_FIFO && MPU_COUNT == 1,
+	.mag = 0,  // MAG ON once an HMC5883L hangs off the aux bus (GY-87 style boards)
+};
+
+/* Sensor i sits on I2C1 for even i and I2C2 for odd i, AD0 high from the third one on */
+#if MPU_COUNT < 1 || MPU_COUNT > 4
+#error "MPU_COUNT must be 1..4"
+#endif
+#define IMU_BUS(i) ((i) & 1 ? I2C2 : I2C1)
+#define IMU_ADDR(i) ((i) & 2 ? MPU6050_ADDR_AD0 : MPU6050_ADDR)
+static mpu_dev_t imu[MPU_COUNT];
+
+#if MPU_SAMPLE_MODE != MPU_SAMPLE_POLL
+static sampleq_t samples;  // data-ready frames, filled from EXTI0 + DMA, drained by Sample_Task
+
+static uint8_t fifo_buf[MPU_FIFO_BATCH * MPU_FRAME_MAX];  // mpu_frame_size() stride
+static volatile int fifo_status;
+static uint32_t fifo_time;  // micros() of the last frame in fifo_buf
+static int fifo_len, fifo_next;  // frames in fifo_buf, next one to send
+
+uint32_t wom_wakes;                          // parked sensors woken by motion
+static uint8_t wom_threshold = WOM_THRESHOLD;  // switched at runtime by WOM
+static uint8_t stop_allowed = 1;             // switched at runtime by STOP ON|OFF
+static volatile uint8_t parked;  // sensors in cycle mode, EXTI0 is the motion interrupt
+static int16_t wom_ref[3];       // first sensor's accel at the last motion
+static uint32_t wom_last;        // millis() of the last motion at full rate
+#endif
+
+/* Supervise every bus, see i2c_poll(). Also what the main loop spins on while it waits for
+ * a bus, so a held one ends the wait within I2C_TIMEOUT_US. */
+static void
+Bus_Poll(void)
+{
+	i2c_poll(I2C1);
+	if (MPU_COUNT > 1)
+		i2c_poll(I2C2);
+}
+
+static volatile int raw_status;
+
+static void
+Raw_Done(int status)
+{
+	raw_status = status;
+}
 
+/* Read every sensor once and wait for it, into MPU_COUNT frames at MPU_FRAME_MAX stride. */
+int
+Read_RawFrame(uint8_t *frames)
+{
+	for (int i = 0; i < MPU_COUNT; i++) {
+		raw_status = 0;
+		if (mpu_read_frame(&imu[i], frames + i * MPU_FRAME_MAX, Raw_Done) < 0)
+			return -1;
+		while (raw_status == 0)
+			Bus_Poll();
+		if (raw_status < 0)
+			return -1;
+	}
+	return 1;
+}
+
+#if TELEMETRY_CAN
+/* Queue one sample as its accel and gyro frames, both or neither, then the magnetometer.
+ * CAN DELTA replaces the pair with one delta frame whenever the changes fit. */
+static void
+Send_Can(int sensor, const mpu_raw_t *raw, uint16_t seq)
+{
+	CAN_msg msg[3] = {
+		{.id = TELEMETRY_CAN_ID(CAN_NODE_ID, 2 * sensor), .len = 8},
+		{.id = TELEMETRY_CAN_ID(CAN_NODE_ID, 2 * sensor + 1), .len = 8},
+		{.id = TELEMETRY_CAN_ID(CAN_NODE_ID, 8 + sensor), .len = 8},
+	};
+	CAN_msg delta = {.id = TELEMETRY_CAN_ID(CAN_NODE_ID, TELEMETRY_CAN_DELTA(sensor)), .len = 8};
+
+	if (can_output == CAN_OUTPUT_DELTA &&
+	    telemetry_pack_can_delta(&can_delta[sensor], (uint8_t *)delta.data, seq, raw)) {
+		if (can_send(&delta) < 0)
+			telemetry_delta_reset(&can_delta[sensor]);  // the host lost the chain
+	} else {
+		telemetry_pack_can((uint8_t *)msg[0].data, (uint8_t *)msg[1].data, seq, raw);
+		if (can_send(&msg[0]) < 0 || can_send(&msg[1]) < 0) {
+			telemetry_delta_reset(&can_delta[sensor]);
+			return;
+		}
+	}
+	if (!mpu_config(&imu[sensor])->mag)
+		return;
+	telemetry_pack_can_mag((uint8_t *)msg[2].data, seq, raw);
+	can_send(&msg[2]);
+}
+#endif
+
+/* USART1 part of the output task: one output sample in the current telemetry_format */
+static void
+Send_Uart(const output_t *out)
+{
+	const mpu_raw_t *avg = out->avg;
+	uint8_t packet[TELEMETRY_FRAME_SIZE];
+	int i;
+
+	if (telemetry_format == TELEMETRY_FORMAT_ATTITUDE) {
+		usart_write(packet, telemetry_pack_attitude(packet, out->n, out->timestamp, out->quat));
+		return;
+	}
+	if (telemetry_format == TELEMETRY_FORMAT_DELTA) {
+		uint8_t frames[TELEMETRY_DELTA_OUT_MAX];
+		uint16_t len;
+
+		for (i = 0; i < MPU_COUNT; i++) {
+			len = telemetry_pack_delta(&uart_delta[i], frames, i, out->n, out->avg_time,
+			                           &avg[i]);
+			if (len && usart_write(frames, len) < 0)
+				telemetry_delta_reset(&uart_delta[i].d);  // the host lost the chain
+			if (mpu_config(&imu[i])->mag)
+				usart_write(packet,
+				            telemetry_pack_mag(packet, i, out->n, out->avg_time, &avg[i]));
+		}
+		return;
+	}
+	if (telemetry_format == TELEMETRY_FORMAT_TEXT) {
+		char buffer[TELEMETRY_TEXT_MAX];
+		int32_t centi[TELEMETRY_CHANNELS];
+
+		// Scale to hundredths in integer math: g, deg C, deg/s
+		for (i = 0; i < 3; i++) {
+			centi[i] = mpu_accel_cg(avg[0].accel[i], mpu_config(&imu[0])->accel_fs);
+			centi[4 + i] = mpu_gyro_cdps(avg[0].gyro[i], mpu_config(&imu[0])->gyro_fs);
+		}
+		centi[3] = mpu_temp_cc(avg[0].temp);
+
+		// Send all sensor data in a single frame for Raspberry Pi
+		// Format: $AX,AY,AZ,TEMP,GX,GY,GZ\r\n
+		usart_write((const uint8_t *)buffer, telemetry_pack_text(buffer, centi));
+		return;
+	}
+	for (i = 0; i < MPU_COUNT; i++) {
+		usart_write(packet, telemetry_pack(packet, i, out->n, out->avg_time, &avg[i]));
+		if (mpu_config(&imu[i])->mag)
+			usart_write(packet, telemetry_pack_mag(packet, i, out->n, out->avg_time, &avg[i]));
+	}
+}
+
+#if MPU_SAMPLE_MODE != MPU_SAMPLE_POLL
+/* Full-rate half of wake-on-motion: any accel axis of the first sensor more than the
+ * threshold away from where it was at the last motion counts as motion again. Same 2 mg
+ * steps as MOT_THR, on the raw accel where the sensor compares high-passed samples. */
+static void
+Motion_Check(const mpu_raw_t *raw)
+{
+	int32_t thr = (int32_t)wom_threshold * MPU_MOT_LSB_MG * 16384 / 1000 >>
+	              mpu_config(&imu[0])->accel_fs;
+
+	for (int k = 0; k < 3; k++) {
+		if (abs(raw->accel[k] - wom_ref[k]) > thr) {
+			memcpy(wom_ref, raw->accel, sizeof(wom_ref));
+			wom_last = millis();
+			return;
+		}
+	}
+}
+#endif
+
+/* Filter one sample of every sensor and queue every decim ratio-th result for the output
+ * task, timestamp in microseconds. The attitude filter runs on every input sample of the
+ * first sensor, so only its output is decimated. */
 void
-delay_ms(uint32_t ms)
+Send_Sample(const uint8_t *frames, uint32_t timestamp)
 {
-	for (uint32_t i = 0; i < ms * 8000; i++)
-		;
+	static uint16_t seq;
+	output_t *out = &outq[outq_head % OUTQ_LEN];
+	mpu_raw_t raw, avg[MPU_COUNT];
+	uint32_t avg_time = timestamp;
+	int i, ready = 0;
+
+#if FLASH_LOG
+	if (norlog_stats.capturing) {  // every sensor sample, before decimation
+		uint8_t sample[MPU_COUNT * MPU_FRAME_SIZE];
+
+		for (i = 0; i < MPU_COUNT; i++)
+			memcpy(sample + i * MPU_FRAME_SIZE, frames + i * MPU_FRAME_MAX, MPU_FRAME_SIZE);
+		norlog_append(sample, timestamp);
+	}
+#endif
+	for (i = 0; i < MPU_COUNT; i++) {
+		PROF_BEGIN(STAGE_DECODE);
+		mpu_decode(frames + i * MPU_FRAME_MAX, &raw);
+		if (mpu_config(&imu[i])->mag)
+			mpu_decode_mag(frames + i * MPU_FRAME_MAX + MPU_FRAME_SIZE, &raw);
+		ready = decim_push(&decim[i], &raw, timestamp, &avg[i], &avg_time);  // in lockstep
+		PROF_END(STAGE_DECODE);
+#if MPU_SAMPLE_MODE != MPU_SAMPLE_POLL
+		if (i == 0 && wom_threshold)
+			Motion_Check(&raw);
+#endif
+		if (i == 0 && telemetry_format == TELEMETRY_FORMAT_ATTITUDE) {
+			PROF_BEGIN(STAGE_FUSION);
+			fusion_update(&attitude, &raw, mpu_config(&imu[0])->gyro_fs,
+			              attitude_time ? timestamp - attitude_time : 0);
+			attitude_time = timestamp ? timestamp : 1;
+			PROF_END(STAGE_FUSION);
+		}
+	}
+	if (!ready)
+		return;
+	if ((uint8_t)(outq_head - outq_tail) == OUTQ_LEN) {
+		output_overruns++;
+		seq++;  // the host sees the gap
+		return;
+	}
+	memcpy(out->avg, avg, sizeof(avg));
+	if (telemetry_format == TELEMETRY_FORMAT_ATTITUDE)
+		fusion_quat_q14(&attitude, out->quat);
+	out->n = seq++;
+	out->timestamp = timestamp;
+	out->avg_time = avg_time;
+	outq_head++;
+	sched_signal(EV_OUTPUT);
+}
+
+/* Send one queued output sample: text and attitude output cover the first sensor, binary
+ * frames and CAN all of them, each followed by a magnetometer frame when the profile reads
+ * the HMC5883L. */
+static void
+Output_Task(void)
+{
+	const output_t *out = &outq[outq_tail % OUTQ_LEN];
+
+	if (outq_head == outq_tail)
+		return;
+#if TELEMETRY_CAN
+	if (can_output) {
+		PROF_BEGIN(STAGE_CAN);
+		for (int i = 0; i < MPU_COUNT; i++)
+			Send_Can(i, &out->avg[i], out->n);
+		PROF_END(STAGE_CAN);
+	}
+#endif
+#if FLASH_LOG
+	if (!norlog_stats.dumping) {  // USART1 carries the log pages alone
+#endif
+		PROF_BEGIN(STAGE_OUTPUT);
+		Send_Uart(out);
+		PROF_END(STAGE_OUTPUT);
+#if FLASH_LOG
+	}
+#endif
+	outq_tail++;
+	if (outq_head != outq_tail)
+		sched_signal(EV_OUTPUT);
 }
 
 void
-MPU6050_Init() /* Gyro initialization function */
-{
-	// Wake up MPU6050 from sleep mode
-	I2C_Start(I2C1);
-	I2C_Addr(I2C1, 0xD0);        /* Start with device write address */
-	I2C_Write(I2C1, PWR_MGMT_1); /* Write to power management register */
-	I2C_Write(I2C1, 0x00);       /* Wake up from sleep */
-	I2C_Stop(I2C1);
-	delay_ms(10);
+MPU_Int_Init()
+{
+	EXTInterruptPinEnable(MPU_INT_LINE, MPU_INT_PORT);
+	GPIOA->CRL &= ~(0x0FUL << 0);
+	GPIOA->CRL |= (0x04UL << 0);                    // PA0 in floating
+	EXTInterruptEnable(MPU_INT_LINE, TRUE, FALSE);  // data ready is an active-high pulse
+}
+
+#if MPU_SAMPLE_MODE != MPU_SAMPLE_POLL
+/* One acquisition reads every sensor into the same queue slot. Each bus works through its
+ * own sensors (I2C1: 0, 2; I2C2: 1, 3) while the other bus runs in parallel, and the
+ * slot is published once both buses are done. The EXTI0, DMA1 channel 7 and I2C2 event
+ * interrupts all step this state, so they must not preempt each other: nvic_priority_init()
+ * puts them on one level, NVIC_PRIO_SAMPLE. */
+static sample_slot_t *acq_slot;
+static volatile uint8_t acq_buses;  // buses still reading, 0 = idle
+static uint8_t acq_next[2];         // next sensor per bus
+static uint8_t acq_failed;
+static uint32_t acq_cycles;         // prof_now() at the data-ready edge
+
+static RAMFUNC void
+Bus1_Done(int status);
+static RAMFUNC void
+Bus2_Done(int status);
+
+static RAMFUNC void
+Acquire_Next(int bus, int status)
+{
+	uint8_t i = acq_next[bus];
+
+	if (status < 0)
+		acq_failed = 1;
+	if (i < MPU_COUNT && !acq_failed) {
+		acq_next[bus] = i + 2;
+		if (mpu_read_frame(&imu[i], acq_slot->frame + i * MPU_FRAME_MAX,
+		                   bus ? Bus2_Done : Bus1_Done) > 0)
+			return;
+		acq_failed = 1;
+	}
+	if (--acq_buses)
+		return;  // the other bus is still reading
+	if (acq_failed) {
+		sample_errors++;
+	} else {
+		sampleq_publish(&samples);
+		sched_signal(EV_SAMPLE);
+	}
+	if (PROFILING)
+		prof_record(STAGE_ACQ, prof_now() - acq_cycles);
+}
+
+/* A sensor read finished on I2C1 / I2C2, start the next one on the same bus. */
+static RAMFUNC void
+Bus1_Done(int status)
+{
+	Acquire_Next(0, status);
+}
+
+static RAMFUNC void
+Bus2_Done(int status)
+{
+	Acquire_Next(1, status);
+}
+
+/* MPU data ready: start the burst reads straight into the next queue slot. */
+RAMFUNC void
+EXTI0_IRQHandler(void)
+{
+	uint32_t now = micros();
+	sample_slot_t *slot;
+
+	resetExternalInterrupt(MPU_INT_LINE);
+	if (parked) {
+		sched_signal(EV_MOTION);  // the motion interrupt, nothing to read
+		return;
+	}
+	if (acq_buses) {
+		sample_overruns++;  // the previous acquisition is still on the bus
+		return;
+	}
+	slot = sampleq_write_slot(&samples);
+	if (!slot)
+		return;
+	slot->time = now;
+	acq_cycles = prof_now();
+	acq_slot = slot;
+	acq_failed = 0;
+	acq_next[0] = 0;
+	acq_next[1] = 1;
+	acq_buses = MPU_COUNT > 1 ? 2 : 1;
+	Acquire_Next(0, 1);
+	if (MPU_COUNT > 1)
+		Acquire_Next(1, 1);
+}
 
-	// Set sample rate
-	I2C_Start(I2C1);
-	I2C_Addr(I2C1, 0xD0);
-	I2C_Write(I2C1, SMPLRT_DIV); /* Write to sample rate register */
-	I2C_Write(I2C1, 0x07);       /* 1KHz sample rate */
-	I2C_Stop(I2C1);
-	delay_ms(5);
-
-	// Set configuration
-	I2C_Start(I2C1);
-	I2C_Addr(I2C1, 0xD0);
-	I2C_Write(I2C1, CONFIG); /* Write to Configuration register */
-	I2C_Write(I2C1, 0x00);   /* Fs = 8KHz */
-	I2C_Stop(I2C1);
-	delay_ms(5);
-
-	// Set accelerometer configuration (±2g)
-	I2C_Start(I2C1);
-	I2C_Addr(I2C1, 0xD0);
-	I2C_Write(I2C1, ACCEL_CONFIG); /* Write to Accel configuration register */
-	I2C_Write(I2C1, 0x00);         /* Full scale range +/- 2g */
-	I2C_Stop(I2C1);
-	delay_ms(5);
-
-	// Set gyro configuration (±250 degree/s)
-	I2C_Start(I2C1);
-	I2C_Addr(I2C1, 0xD0);
-	I2C_Write(I2C1, GYRO_CONFIG); /* Write to Gyro configuration register */
-	I2C_Write(I2C1, 0x00);        /* Full scale range +/- 250 degree/s */
-	I2C_Stop(I2C1);
-	delay_ms(5);
-
-	// Enable data ready interrupt
-	I2C_Start(I2C1);
-	I2C_Addr(I2C1, 0xD0);
-	I2C_Write(I2C1, INT_ENABLE); /* Write to interrupt enable register */
-	I2C_Write(I2C1, 0x01);       /* Data ready interrupt */
-	I2C_Stop(I2C1);
-	delay_ms(5);
+static void
+Fifo_Done(int status)
+{
+	fifo_status = status;
+}
+
+/* Pull up to MPU_FIFO_BATCH frames out of the sensor FIFO, returns the frame count.
+ * The newest frame in the sensor FIFO is taken as sampled now, older ones one sample
+ * period apart. Only used with a single sensor. */
+static int
+Fifo_Drain(void)
+{
+	uint32_t now = micros();
+	int frames = mpu_fifo_frames(&imu[0]);
+	int behind;  // frames left in the sensor FIFO after this batch
+
+	if (frames <= 0)
+		return 0;
+	behind = frames > MPU_FIFO_BATCH ? frames - MPU_FIFO_BATCH : 0;
+	frames -= behind;
+	fifo_time = now - behind * mpu_sample_period_us(&imu[0]);
+	fifo_status = 0;
+	if (mpu_fifo_read(&imu[0], fifo_buf, frames, Fifo_Done) < 0)
+		return 0;
+	while (fifo_status == 0)
+		Bus_Poll();
+	if (fifo_status < 0) {
+		sample_errors += frames;
+		mpu_fifo_reset(&imu[0]);  // the read side may no longer be frame aligned
+		return 0;
+	}
+	return frames;
+}
+#endif
+
+/* Switch the sensor profile of every sensor from the main loop. The sampling path owns
+ * the buses, so data-ready is held off until any acquisition in flight has finished, and
+ * stays off while the profile buffers in the sensor FIFO. Several sensors are always read
+ * on data-ready, their FIFOs would have to be drained in step. */
+int
+Apply_Profile(const mpu_config_t *profile)
+{
+	mpu_config_t cfg = *profile;
+	int ret = 1;
+
+	if (MPU_COUNT > 1)
+		cfg.fifo = 0;
+#if MPU_SAMPLE_MODE != MPU_SAMPLE_POLL
+	nvic_disable_irq(NVIC_EXTI0_IRQ);
+	while (acq_buses)
+		Bus_Poll();
+#endif
+	for (int i = 0; i < MPU_COUNT; i++) {
+		if (mpu_configure(&imu[i], &cfg) < 0)
+			ret = -1;
+		decim_reset(&decim[i]);  // don't average samples across a range change
+	}
+#if MPU_SAMPLE_MODE != MPU_SAMPLE_POLL
+	sampleq_flush(&samples);  // queued frames were taken with the old scaling
+	fifo_len = fifo_next = 0;
+	if (!mpu_config(&imu[0])->fifo)
+		nvic_enable_irq(NVIC_EXTI0_IRQ);  // a data-ready edge seen meanwhile is still pending
+#endif
+	return ret;
+}
+
+#if MPU_SAMPLE_MODE != MPU_SAMPLE_POLL
+/* Park every sensor in cycle mode, from the main loop like Apply_Profile(). Only the
+ * first sensor's INT is wired, so its motion wakes them all. */
+static int
+Power_Park(void)
+{
+	int ret = 1;
+
+	nvic_disable_irq(NVIC_EXTI0_IRQ);
+	while (acq_buses)
+		Bus_Poll();
+	for (int i = 0; i < MPU_COUNT; i++) {
+		if (mpu_cycle_enter(&imu[i], wom_threshold, WOM_WAKE) < 0)
+			ret = -1;
+	}
+	sampleq_flush(&samples);
+	fifo_len = fifo_next = 0;
+	parked = 1;
+	resetExternalInterrupt(MPU_INT_LINE);  // data-ready edges held off meanwhile
+	nvic_clear_pending_irq(NVIC_EXTI0_IRQ);
+	nvic_enable_irq(NVIC_EXTI0_IRQ);  // FIFO profiles too, INT is the motion interrupt now
+	return ret;
+}
+
+/* Back to the active profile at full rate. */
+static int
+Power_Wake(void)
+{
+	int ret = 1;
+
+	nvic_disable_irq(NVIC_EXTI0_IRQ);
+	parked = 0;
+	for (int i = 0; i < MPU_COUNT; i++) {
+		if (mpu_cycle_exit(&imu[i]) < 0)
+			ret = -1;
+		decim_reset(&decim[i]);
+	}
+	wom_last = millis();
+	if (!mpu_config(&imu[0])->fifo)
+		nvic_enable_irq(NVIC_EXTI0_IRQ);
+	return ret;
 }
+#endif
+
+/* Bias offsets of every sensor as kept in the flash settings page */
+typedef struct {
+	uint32_t magic;                  // CALIB_MAGIC, erased flash reads 0xFFFFFFFF
+	uint16_t count;                  // MPU_COUNT of the build that saved it
+	uint16_t crc;                    // telemetry_crc16() over offs
+	mpu_offsets_t offs[MPU_COUNT];
+} calib_record_t;
+
+/* Write the saved offsets back into every sensor after power-up, returns 1 if a valid
+ * record for this sensor count was found and written, 0 if there is none. */
+static int
+Calib_Load(void)
+{
+	const calib_record_t *rec = (const calib_record_t *)FLASH_SETTINGS_PAGE;
+	int ret = 1;
 
+	if (rec->magic != CALIB_MAGIC || rec->count != MPU_COUNT ||
+	    rec->crc != telemetry_crc16((const uint8_t *)rec->offs, sizeof(rec->offs)))
+		return 0;
+	for (int i = 0; i < MPU_COUNT; i++) {
+		if (mpu_write_offsets(&imu[i], &rec->offs[i]) < 0)
+			ret = -1;
+	}
+	return ret;
+}
+
+/* Calibrate every sensor from its average over samples, then keep the result in flash.
+ * Sampling is held off as for a profile switch and restarted on the same profile. */
+static int
+Calibrate(uint16_t samples)
+{
+	calib_record_t rec = {.magic = CALIB_MAGIC, .count = MPU_COUNT};
+	int ret = 1;
+
+	if (WATCHDOG &&
+	    (uint64_t)samples * MPU_COUNT * mpu_sample_period_us(&imu[0]) > WATCHDOG_MS * 750ULL)
+		return -1;  // would outlast the watchdog, nothing feeds it meanwhile
+#if MPU_SAMPLE_MODE != MPU_SAMPLE_POLL
+	nvic_disable_irq(NVIC_EXTI0_IRQ);
+	while (acq_buses)
+		Bus_Poll();
+#endif
+#if WATCHDOG
+	resetWatchDog();
+#endif
+	for (int i = 0; i < MPU_COUNT; i++) {
+		if (mpu_calibrate(&imu[i], samples, &rec.offs[i]) < 0)
+			ret = -1;
+	}
+	if (ret > 0) {
+		rec.crc = telemetry_crc16((const uint8_t *)rec.offs, sizeof(rec.offs));
+		if (flash_erase_page(FLASH_SETTINGS_PAGE) < 0 ||
+		    flash_program(FLASH_SETTINGS_PAGE, &rec, sizeof(rec)) < 0)
+			ret = -1;
+	}
+	if (Apply_Profile(mpu_config(&imu[0])) < 0)
+		ret = -1;
+	return ret;
+}
+
+/* Switch the USART1 telemetry format. Delta frames still filling go out first, and a
+ * new delta chain starts on keyframes. */
+static void
+Set_Format(uint8_t format)
+{
+	uint8_t frame[TELEMETRY_DELTA_FRAME_MAX];
+
+	for (int i = 0; i < MPU_COUNT; i++) {
+		if (telemetry_format == TELEMETRY_FORMAT_DELTA)
+			usart_write(frame, telemetry_flush_delta(&uart_delta[i], frame));
+		telemetry_delta_reset(&uart_delta[i].d);
+	}
+	telemetry_format = format;
+}
+
+/* Reject rates the current PCLK2 can't produce within BAUD_TOLERANCE. */
+static int
+Baud_Ok(unsigned long baud)
+{
+	int32_t actual = usart_get_baudrate(USART1, baud);
+	uint32_t error;
+
+	if (actual < 0)
+		return 0;
+	error = (uint32_t)actual > baud ? (uint32_t)actual - baud : baud - (uint32_t)actual;
+	return error * 1000ULL <= baud * (unsigned long long)BAUD_TOLERANCE;
+}
+
+/* Host commands, one per line:
+ *   RATE <0-255>  SMPLRT_DIV, ODR = gyro rate / (1 + n)
+ *   ODR <hz>      nearest output data rate the current DLPF setting allows
+ *   DLPF <0-6>    CONFIG DLPF_CFG
+ *   ACCEL <0-3>   accel range ±2/4/8/16 g
+ *   GYRO <0-3>    gyro range ±250/500/1000/2000 deg/s
+ *   MAG ON|OFF    HMC5883L on the aux bus read in the same burst, mag frames follow
+ *   PROFILE LOW|VIB|BOOT  low-rate low-power, 1 kHz vibration capture, or boot profile
+ *   DECIM <1-4096>  average n sensor samples into each telemetry frame
+ *   OUT <hz>      telemetry rate, sets DECIM from the current sensor ODR
+ *   CAN ON|OFF|DELTA  CAN1 sample stream, DELTA in one frame per sample while the
+ *                 changes fit, TELEMETRY_CAN builds only
+ *   FMT BIN|TEXT|ATT|DELTA  telemetry format, ATT runs the attitude filter and sends
+ *                 quaternions, DELTA batches changes between keyframes, see telemetry.h
+ *   CALIB [n]     null gyro and accel bias over n (512) samples and save it to flash, the
+ *                 board lies still with one axis vertical. WATCHDOG builds refuse counts
+ *                 that take more than 3/4 of WATCHDOG_MS
+ *   BAUD <rate>   USART1 baud rate i.e 460800, 921600 or 2000000, applied once the
+ *                 queued telemetry has been sent
+ *   LOG START|STOP  raw frames of every sample to the SPI NOR log, FLASH_LOG builds only
+ *   LOG ERASE <kB>  erased space to keep ahead of the log, at the cost of the oldest data
+ *   LOG DUMP      the whole log as 256-byte pages in place of telemetry, see norlog.h
+ *   WOM <0-255>   wake-on-motion threshold in 2 mg steps, 0 keeps the sensors at full
+ *                 rate. Not in MPU_SAMPLE_POLL builds.
+ *   STOP ON|OFF   STOP mode while parked (the default). The USART1 receiver stops with it,
+ *                 so commands only get through after the next motion. OFF sleeps in WFI
+ *                 and keeps listening. WATCHDOG builds never enter STOP.
+ * Any command wakes parked sensors first.
+ */
 void
-MPU_Start_Loc()
+Handle_Command(char *line)
 {
-	// Write mode: Set register address
-	I2C_Start(I2C1);
-	I2C_Addr(I2C1, 0xD0);          /* Device write address */
-	I2C_Write(I2C1, ACCEL_XOUT_H); /* Set start location address */
-	I2C_Stop(I2C1);                /* Stop after setting address */
-	delay_ms(2);
+	char *arg = strchr(line, ' ');
+	unsigned long n = 0;
+	mpu_config_t cfg = *mpu_config(&imu[0]);
+	const mpu_config_t *profile = &cfg;
+
+	if (arg) {
+		*arg++ = 0;
+		n = strtoul(arg, NULL, 0);
+	}
+#if MPU_SAMPLE_MODE != MPU_SAMPLE_POLL
+	if (parked && Power_Wake() < 0)
+		cmd_errors++;
+#endif
+
+	if (!strcmp(line, "FMT") && arg && !strcmp(arg, "BIN")) {
+		Set_Format(TELEMETRY_FORMAT_BINARY);
+		return;
+	} else if (!strcmp(line, "FMT") && arg && !strcmp(arg, "TEXT")) {
+		Set_Format(TELEMETRY_FORMAT_TEXT);
+		return;
+	} else if (!strcmp(line, "FMT") && arg && !strcmp(arg, "ATT")) {
+		fusion_init(&attitude);  // start level, the accel pulls it in within seconds
+		attitude_time = 0;
+		Set_Format(TELEMETRY_FORMAT_ATTITUDE);
+		return;
+	} else if (!strcmp(line, "FMT") && arg && !strcmp(arg, "DELTA")) {
+		Set_Format(TELEMETRY_FORMAT_DELTA);
+		return;
+#if TELEMETRY_CAN
+	} else if (!strcmp(line, "CAN") && arg &&
+	           (!strcmp(arg, "ON") || !strcmp(arg, "OFF") || !strcmp(arg, "DELTA"))) {
+		can_output = !strcmp(arg, "DELTA") ? CAN_OUTPUT_DELTA : !strcmp(arg, "ON");
+		for (int i = 0; i < MPU_COUNT; i++)
+			telemetry_delta_reset(&can_delta[i]);
+		return;
+#endif
+#if FLASH_LOG
+	} else if (!strcmp(line, "LOG") && arg && !strcmp(arg, "START")) {
+		if (norlog_start(MPU_COUNT * MPU_FRAME_SIZE) < 0)
+			cmd_errors++;
+		return;
+	} else if (!strcmp(line, "LOG") && arg && !strcmp(arg, "STOP")) {
+		norlog_stop();
+		return;
+	} else if (!strcmp(line, "LOG") && arg && !strcmp(arg, "DUMP")) {
+		if (norlog_dump() < 0)
+			cmd_errors++;
+		return;
+	} else if (!strcmp(line, "LOG") && arg && !strncmp(arg, "ERASE ", 6)) {
+		if (norlog_erase_ahead(strtoul(arg + 6, NULL, 0) * 1024) < 0)
+			cmd_errors++;
+		return;
+#endif
+#if MPU_SAMPLE_MODE != MPU_SAMPLE_POLL
+	} else if (!strcmp(line, "WOM") && arg && n <= 255) {
+		wom_threshold = n;
+		wom_last = millis();  // a full quiet period from now
+		return;
+	} else if (!strcmp(line, "STOP") && arg && (!strcmp(arg, "ON") || !strcmp(arg, "OFF"))) {
+		stop_allowed = !strcmp(arg, "ON");
+		return;
+#endif
+	} else if (!strcmp(line, "DECIM") && arg && n <= DECIM_MAX_RATIO) {
+		for (int i = 0; i < MPU_COUNT; i++) {
+			if (decim_init(&decim[i], n) < 0)
+				cmd_errors++;
+		}
+		return;
+	} else if (!strcmp(line, "OUT") && arg && n > 0) {
+		n = (1000000 / mpu_sample_period_us(&imu[0]) + n / 2) / n;
+		for (int i = 0; i < MPU_COUNT; i++)
+			decim_init(&decim[i], n < 1 ? 1 : n > DECIM_MAX_RATIO ? DECIM_MAX_RATIO : n);
+		return;
+	} else if (!strcmp(line, "CALIB") && n <= MPU_CALIB_MAX) {
+		if (Calibrate(arg && n ? n : CALIB_SAMPLES) < 0)
+			cmd_errors++;
+		return;
+	} else if (!strcmp(line, "BAUD") && arg && Baud_Ok(n)) {
+		usart_tx_flush();
+		usart_set_baudrate(USART1, n);
+		return;
+	}
 
-	// Read mode: Restart and read from the address
-	I2C_Start(I2C1);
-	I2C_Addr(I2C1, 0xD1); /* Device read address */
+	// Everything else edits the active profile and writes it back in one go
+	if (!strcmp(line, "RATE") && arg && n <= 255) {
+		cfg.smplrt_div = n;
+	} else if (!strcmp(line, "ODR") && arg) {
+		cfg.smplrt_div = mpu_odr_to_div(cfg.dlpf, n);
+	} else if (!strcmp(line, "DLPF") && arg && n <= 6) {
+		cfg.dlpf = n;
+	} else if (!strcmp(line, "ACCEL") && arg && n <= 3) {
+		cfg.accel_fs = n;
+	} else if (!strcmp(line, "GYRO") && arg && n <= 3) {
+		cfg.gyro_fs = n;
+	} else if (!strcmp(line, "MAG") && arg && (!strcmp(arg, "ON") || !strcmp(arg, "OFF"))) {
+		cfg.mag = !strcmp(arg, "ON");
+	} else if (!strcmp(line, "PROFILE") && arg && !strcmp(arg, "LOW")) {
+		profile = &mpu_profile_low_power;
+	} else if (!strcmp(line, "PROFILE") && arg && !strcmp(arg, "VIB")) {
+		profile = &mpu_profile_vibration;
+	} else if (!strcmp(line, "PROFILE") && arg && !strcmp(arg, "BOOT")) {
+		profile = &boot_profile;
+	} else {
+		cmd_errors++;
+		return;
+	}
+	if (Apply_Profile(profile) < 0)
+		cmd_errors++;
 }
 
+/* Collect received bytes into lines and run them, never waits for input. Over CAN every
+ * data frame addressed to this node carries one command of up to 8 characters. */
 void
-Read_RawValue()
+Poll_Commands(void)
 {
-	uint8_t byte_high, byte_low;
+	static char line[32];
+	static uint8_t len;
+	uint8_t rx[16];
+	uint16_t n;
 
-	MPU_Start_Loc(); /* Read Sensor values */
+	while ((n = usart_rx_read(rx, sizeof(rx))) > 0) {
+		for (uint16_t i = 0; i < n; i++) {
+			if (rx[i] == '\r' || rx[i] == '\n') {
+				line[len] = 0;
+				if (len)
+					Handle_Command(line);
+				len = 0;
+			} else if (len < sizeof(line) - 1) {
+				line[len++] = rx[i];
+			}
+		}
+	}
 
-	// Enable ACK for reading
-	I2C1->CR1 |= (1 << 10);  // Set ACK bit
+#if TELEMETRY_CAN
+	CAN_msg msg;
 
-	// Read Accelerometer X
-	byte_high = (uint8_t)I2C_Read(I2C1);
-	byte_low = (uint8_t)I2C_Read(I2C1);
-	Acc_x = (int16_t)((byte_high << 8) | byte_low);
+	while (can_receive(&msg)) {
+		char cmd[9];
+		uint8_t n = msg.len > 8 ? 8 : msg.len;  // DLC 9..15 still means 8 bytes
 
-	// Read Accelerometer Y
-	byte_high = (uint8_t)I2C_Read(I2C1);
-	byte_low = (uint8_t)I2C_Read(I2C1);
-	Acc_y = (int16_t)((byte_high << 8) | byte_low);
+		memcpy(cmd, msg.data, n);
+		cmd[n] = 0;
+		Handle_Command(cmd);
+	}
+#endif
+}
 
-	// Read Accelerometer Z
-	byte_high = (uint8_t)I2C_Read(I2C1);
-	byte_low = (uint8_t)I2C_Read(I2C1);
-	Acc_z = (int16_t)((byte_high << 8) | byte_low);
+#if PROFILING
+/* Every PROF_REPORT_MS send one profiling frame per stage that ran, each covering the
+ * interval since the previous report. */
+static void
+Prof_Report(void)
+{
+	static uint16_t seq;
+	uint8_t packet[TELEMETRY_PROF_FRAME_SIZE];
+	prof_stage_t stage;
 
-	// Read Temperature
-	byte_high = (uint8_t)I2C_Read(I2C1);
-	byte_low = (uint8_t)I2C_Read(I2C1);
-	Temperature = (int16_t)((byte_high << 8) | byte_low);
+#if FLASH_LOG
+	if (norlog_stats.dumping)
+		return;
+#endif
+	for (uint8_t i = 0; i < STAGE_COUNT; i++) {
+		prof_take(i, &stage);
+		if (stage.count)
+			usart_write(packet, telemetry_pack_prof(packet, seq, micros(), i, &stage));
+	}
+	seq++;
+}
+#endif
 
-	// Read Gyroscope X
-	byte_high = (uint8_t)I2C_Read(I2C1);
-	byte_low = (uint8_t)I2C_Read(I2C1);
-	Gyro_x = (int16_t)((byte_high << 8) | byte_low);
+/* Filter one acquired sample per run, the scheduler comes back for the next one after
+ * anything of higher priority. */
+static void
+Sample_Task(void)
+{
+#if MPU_SAMPLE_MODE != MPU_SAMPLE_POLL
+	if (parked)
+		return;  // nothing to drain, and the bus stays quiet for STOP
+	if (!mpu_config(&imu[0])->fifo) {
+		const sample_slot_t *slot = sampleq_read_slot(&samples);
 
-	// Read Gyroscope Y
-	byte_high = (uint8_t)I2C_Read(I2C1);
-	byte_low = (uint8_t)I2C_Read(I2C1);
-	Gyro_y = (int16_t)((byte_high << 8) | byte_low);
+		if (!slot)
+			return;
+		Send_Sample(slot->frame, slot->time);
+		sampleq_release(&samples);
+		if (sampleq_read_slot(&samples))
+			sched_signal(EV_SAMPLE);
+		return;
+	}
+	if (fifo_next == fifo_len) {
+		PROF_BEGIN(STAGE_ACQ);
+		fifo_len = Fifo_Drain();
+		PROF_END(STAGE_ACQ);
+		fifo_next = 0;
+		if (fifo_len == 0)
+			return; /* FIFO holds less than one frame */
+	}
+	Send_Sample(fifo_buf + fifo_next * mpu_frame_size(&imu[0]),
+	            fifo_time - (fifo_len - 1 - fifo_next) * mpu_sample_period_us(&imu[0]));
+	if (++fifo_next < fifo_len)
+		sched_signal(EV_SAMPLE);
+#else
+	uint8_t frame[MPU_COUNT * MPU_FRAME_MAX];
+	uint32_t now = micros();
+	int ok;
 
-	// Read Gyroscope Z - last byte, send NACK
-	I2C1->CR1 &= ~(1 << 10);  // Clear ACK bit for last byte
-	byte_high = (uint8_t)I2C_Read(I2C1);
-	byte_low = (uint8_t)I2C_Read(I2C1);
-	Gyro_z = (int16_t)((byte_high << 8) | byte_low);
+	PROF_BEGIN(STAGE_ACQ);
+	ok = Read_RawFrame(frame);
+	PROF_END(STAGE_ACQ);
+	if (ok > 0)
+		Send_Sample(frame, now);
+#endif
+}
 
-	I2C_Stop(I2C1);
+static void
+Command_Task(void)
+{
+	PROF_BEGIN(STAGE_CMD);
+	Poll_Commands();
+	PROF_END(STAGE_CMD);
+}
+
+#if MPU_SAMPLE_MODE != MPU_SAMPLE_POLL
+/* Wake-on-motion: park the sensors once the first one has been quiet for WOM_QUIET_MS,
+ * bring them back on the motion interrupt. INT_STATUS tells a real motion from a data
+ * ready edge that was still pending when they were parked. */
+static void
+Power_Task(void)
+{
+	int status;
+
+	if (parked) {
+		status = mpu_int_status(&imu[0]);
+		if (status >= 0 && !(status & INT_STATUS_MOT))
+			return;
+		wom_wakes++;
+		if (Power_Wake() < 0)
+			sample_errors++;
+		return;
+	}
+	if (wom_threshold && (int32_t)(millis() - wom_last) >= WOM_QUIET_MS &&
+	    Power_Park() < 0) {
+		sample_errors++;
+		Power_Wake();  // stay at full rate rather than half parked
+		wom_last = millis();
+	}
+}
+
+/* Scheduler idle, interrupts masked: STOP while parked once nothing is left in flight
+ * that STOP would freeze, WFI otherwise. The watchdog keeps counting in STOP with nothing
+ * to feed it, so WATCHDOG builds only ever sleep in WFI. */
+static void
+Power_Idle(void)
+{
+	if (!WATCHDOG && parked && stop_allowed && usart_tx_idle()
+#if FLASH_LOG
+	    && norlog_idle()
+#endif
+#if TELEMETRY_CAN
+	    && (CAN1->TSR & CAN_TSR_TME_ALL) == CAN_TSR_TME_ALL
+#endif
+	)
+		clk_stop();
+	else
+		cpu_wfi();
+}
+#endif
+
+/* Every BUS_PERIOD_MS: time out hung reads and clear held buses. The watchdog is fed here
+ * only, so it runs out when the scheduler stops, or once a bus clear has failed
+ * WATCHDOG_CLEARS times in a row and only a reset of the whole board is left. */
+static void
+Bus_Task(void)
+{
+	Bus_Poll();
+#if WATCHDOG
+	if (i2c_stats[0].failing < WATCHDOG_CLEARS && i2c_stats[1].failing < WATCHDOG_CLEARS)
+		resetWatchDog();
+#endif
+}
+
+/* USART1 received bytes, interrupt context */
+static void
+Rx_Ready(int status)
+{
+	sched_signal(EV_RX);
 }
 
 int
 main()
 {
-	char buffer[64];  // Increased buffer size for single-frame format
-	float Xa, Ya, Za, t = 0;
-	float Xg = 0, Yg = 0, Zg = 0;
+	clk_init();   /* 72 MHz from HSE and the PLL, first: the drivers derive from it */
+	nvic_priority_init(); /* before any driver enables its interrupt */
+	millisInit(); /* SysTick time base for delays and timestamps */
 
 	// Initialize I2C first
-	I2CInit(I2C1, 0); /* Initialize I2C1 */
-	delay_ms(100);    /* Wait for I2C to stabilize */
+	I2CInit(I2C1, NOREMAP, I2C_SPEED_FAST); /* Initialize I2C1 at 400 kHz */
+	i2c1_dma_init();
+	if (MPU_COUNT > 1) {
+		I2CInit(I2C2, NOREMAP, I2C_SPEED_FAST);
+		i2c2_it_init();
+	}
+	delay_ms(100); /* Wait for I2C to stabilize */
 
-	usartInit(USART1, 9600, 0); /* Initialize USART */
+	usartInit(USART1, TELEMETRY_BAUD, 0); /* Initialize USART */
+	usart_tx_init();
+	usart_rx_init();
 	delay_ms(10);
+#if FLASH_LOG
+	norlog_init(); /* no chip only fails the LOG commands */
+#endif
 
-	MPU6050_Init(); /* Initialize MPU6050 */
-	delay_ms(100);
-
-	while (1) {
-		Read_RawValue();
-		delay_ms(50); /* 50ms delay between reads */
-
-		Xa = Acc_x / 16384.0;  // Divide raw value by sensitivity scale factor to get real values
-		Ya = Acc_y / 16384.0;
-		Za = Acc_z / 16384.0;
+#if TELEMETRY_CAN
+	canInit(CAN1, POLLING);
+	can_set_bitrate(CAN1, CAN_BITRATE);
+	nvic_enable_irq(NVIC_USB_HP_CAN_TX_IRQ);
+	can_filter_add_id(CAN_CMD_BROADCAST, STANDARD_FORMAT, FIFO0);
+	can_filter_add_id(CAN_CMD_ID(CAN_NODE_ID), STANDARD_FORMAT, FIFO0);
+	can_rx_init();
+	nvic_enable_irq(NVIC_USB_LP_CAN_RX0_IRQ);
+	nvic_enable_irq(NVIC_CAN_RX1_IRQ);
+#endif
 
-		t = Temperature / 340.0 + 36.53;  // Convert temperature to Celsius
+	for (int i = 0; i < MPU_COUNT; i++) { /* Initialize MPU6050s */
+		imu[i].bus = IMU_BUS(i);
+		imu[i].addr = IMU_ADDR(i);
+		decim_init(&decim[i], OUTPUT_DECIMATION);
+		mpu_init(&imu[i], &boot_profile);
+	}
+	prof_init();
+	Calib_Load(); /* offsets from the last CALIB, the sensor forgets them at power-down */
+	fusion_init(&attitude);
 
-		Xg = Gyro_x / 131.0;  // Gyro sensitivity at ±250 deg/s
-		Yg = Gyro_y / 131.0;
-		Zg = Gyro_z / 131.0;
+#if MPU_SAMPLE_MODE != MPU_SAMPLE_POLL
+	MPU_Int_Init();
+	if (mpu_config(&imu[0])->fifo)
+		nvic_disable_irq(NVIC_EXTI0_IRQ);  // FIFO profile, drained by polling
+#endif
 
-		// Send all sensor data in a single frame for Raspberry Pi
-		// Format: $AX,AY,AZ,TEMP,GX,GY,GZ\r\n
-		snprintf(buffer, sizeof(buffer), "$%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f\r\n",
-		         Xa, Ya, Za, t, Xg, Yg, Zg);
-		Send_String(USART1, buffer);
-	}
-}
\ No newline at end of file
+	usart_rx_set_callback(Rx_Ready);
+	sched_add(Bus_Task, PRIO_BUS, 0, BUS_PERIOD_MS);
+	sched_add(Sample_Task, PRIO_SAMPLE, EV_SAMPLE,
+	          MPU_SAMPLE_MODE == MPU_SAMPLE_POLL ? POLL_PERIOD_MS : FIFO_PERIOD_MS);
+	sched_add(Output_Task, PRIO_OUTPUT, EV_OUTPUT, 0);
+#if MPU_SAMPLE_MODE != MPU_SAMPLE_POLL
+	sched_add(Power_Task, PRIO_POWER, EV_MOTION, POWER_PERIOD_MS);
+	sched_set_idle(Power_Idle);
+#endif
+#if FLASH_LOG
+	sched_add(norlog_poll, PRIO_LOG, 0, LOG_PERIOD_MS);
+#endif
+	sched_add(Command_Task, PRIO_CMD, EV_RX, TELEMETRY_CAN ? CMD_PERIOD_MS : 0);
+#if PROFILING
+	sched_add(Prof_Report, PRIO_REPORT, 0, PROF_REPORT_MS);
+#endif
+#if WATCHDOG
+	initWatchDog(WATCHDOG_MS * 40 / 32, PRESCALE_32); /* LSI ~40 kHz, 0.8 ms per count */
+#endif
+	sched_run(); /* sleeps in WFI whenever no task is ready, STOP while parked */
+}
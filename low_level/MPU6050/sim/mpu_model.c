@@ -0,0 +1,234 @@
+/* @file 			 : mpu_model.c
+ *  @Description: Scripted MPU6050 model, see mpu_model.h.
+ */
+#include "mpu_model.h"
+#include "mpu.h"
+
+#include <stddef.h>
+#include <string.h>
+
+#define PWR_MGMT_1_RESET (1 << 7)
+
+/* Cycle mode wake-up periods by LP_WAKE_CTRL: 1.25, 5, 20, 40 Hz */
+static const uint64_t lp_wake_ns[4] = {800000000, 200000000, 50000000, 25000000};
+
+static void
+mpu_model_reset(mpu_model_t *m)
+{
+	memset(m->reg, 0, sizeof(m->reg));
+	m->reg[PWR_MGMT_1] = PWR_MGMT_1_SLEEP;
+	m->reg[WHO_AM_I] = MPU6050_ADDR >> 1;
+	m->fifo_head = m->fifo_count = 0;
+}
+
+static int
+mpu_model_cycling(const mpu_model_t *m)
+{
+	return (m->reg[PWR_MGMT_1] & (PWR_MGMT_1_CYCLE | PWR_MGMT_1_SLEEP)) == PWR_MGMT_1_CYCLE;
+}
+
+static uint64_t
+mpu_model_period_ns(const mpu_model_t *m)
+{
+	uint8_t dlpf = m->reg[CONFIG] & 7;
+	uint32_t rate = (dlpf == 0 || dlpf == 7) ? 8000 : 1000;
+
+	if (mpu_model_cycling(m))
+		return lp_wake_ns[m->reg[PWR_MGMT_2] >> 6];
+	return (1ULL + m->reg[SMPLRT_DIV]) * 1000000000ULL / rate;
+}
+
+static int16_t
+get_word(const uint8_t *p)
+{
+	return (int16_t)((p[0] << 8) | p[1]);
+}
+
+static void
+put_word(uint8_t *p, int32_t v)
+{
+	if (v > 32767)
+		v = 32767;
+	if (v < -32768)
+		v = -32768;
+	p[0] = (uint8_t)((uint16_t)v >> 8);
+	p[1] = (uint8_t)v;
+}
+
+static void
+mpu_model_fifo_push(mpu_model_t *m, const uint8_t *data, int len)
+{
+	for (int i = 0; i < len; i++) {
+		if (m->fifo_count == sizeof(m->fifo)) {  // oldest byte is overwritten
+			m->fifo_count--;
+			m->reg[INT_STATUS] |= INT_STATUS_FIFO_OFLOW;
+		}
+		m->fifo[(m->fifo_head + m->fifo_count) % sizeof(m->fifo)] = data[i];
+		m->fifo_count++;
+	}
+}
+
+/* Motion when any accel axis moved more than MOT_THR (2 mg steps) since the last sample,
+ * a plain difference in place of the sensor's high-pass filter. */
+static int
+mpu_model_motion(mpu_model_t *m, const int16_t *accel, uint8_t afs)
+{
+	int32_t thr = (int32_t)m->reg[MOT_THR] * 2 * 16384 / 1000 >> afs;
+	int moved = 0;
+
+	for (int i = 0; i < 3; i++) {
+		int32_t d = accel[i] - m->mot_prev[i];
+
+		if (m->reg[MOT_THR] && (d > thr || d < -thr))
+			moved = 1;
+		m->mot_prev[i] = accel[i];
+	}
+	return moved;
+}
+
+/* One sample: script value plus offsets into the data registers, then FIFO and INT.
+ * In cycle mode only the accel is sampled, the gyros read 0. */
+static void
+mpu_model_sample(sim_timer_t *t)
+{
+	mpu_model_t *m = (mpu_model_t *)((uint8_t *)t - offsetof(mpu_model_t, sample));
+	uint8_t *data = &m->reg[ACCEL_XOUT_H];
+	uint8_t afs = (m->reg[ACCEL_CONFIG] >> 3) & 3, gfs = (m->reg[GYRO_CONFIG] >> 3) & 3;
+	uint8_t fifo_en = m->reg[FIFO_EN];
+	int16_t v[7] = {0};
+	int cycling = mpu_model_cycling(m);
+
+	sim_timer_at(t, t->at + mpu_model_period_ns(m));
+	if (m->reg[PWR_MGMT_1] & PWR_MGMT_1_SLEEP)
+		return;
+	if (m->script)
+		m->script(m->samples, v, m->arg);
+	m->samples++;
+
+	for (int i = 0; i < 3; i++) {
+		int32_t a_offs = get_word(&m->reg[XA_OFFS_H + 2 * i]) & ~1;
+		int32_t g_offs = get_word(&m->reg[XG_OFFS_USRH + 2 * i]);
+
+		put_word(&data[2 * i], v[i] + a_offs * 8 / (1 << afs));
+		put_word(&data[8 + 2 * i], cycling ? 0 : v[4 + i] + g_offs * 4 / (1 << gfs));
+		v[i] = get_word(&data[2 * i]);
+	}
+	put_word(&data[6], v[3]);
+	if (mpu_model_motion(m, v, afs)) {
+		m->reg[INT_STATUS] |= INT_STATUS_MOT;
+		if (m->int_line >= 0 && (m->reg[INT_ENABLE] & INT_ENABLE_MOT))
+			sim_exti_pulse(m->int_line);
+	}
+
+	if (m->reg[USER_CTRL] & USER_CTRL_FIFO_EN) {
+		if (fifo_en & 0x08)
+			mpu_model_fifo_push(m, &data[0], 6);
+		if (fifo_en & 0x80)
+			mpu_model_fifo_push(m, &data[6], 2);
+		for (int i = 0; i < 3; i++) {
+			if (fifo_en & (0x40 >> i))
+				mpu_model_fifo_push(m, &data[8 + 2 * i], 2);
+		}
+	}
+	m->reg[INT_STATUS] |= INT_STATUS_DATA_RDY;
+	if (m->int_line >= 0 && (m->reg[INT_ENABLE] & INT_ENABLE_DATA_RDY))
+		sim_exti_pulse(m->int_line);
+}
+
+static void
+mpu_model_start(sim_i2c_dev_t *dev, int read)
+{
+	mpu_model_t *m = (mpu_model_t *)dev;
+
+	m->pointer_next = !read;
+	if (read)
+		memcpy(m->latch, &m->reg[ACCEL_XOUT_H], sizeof(m->latch));
+}
+
+static int
+mpu_model_write(sim_i2c_dev_t *dev, uint8_t byte)
+{
+	mpu_model_t *m = (mpu_model_t *)dev;
+	uint8_t reg = m->ptr;
+
+	if (m->pointer_next) {
+		m->ptr = byte & 0x7F;
+		m->pointer_next = 0;
+		return 1;
+	}
+	if (reg == PWR_MGMT_1 && (byte & PWR_MGMT_1_RESET)) {
+		mpu_model_reset(m);
+		return 1;
+	}
+	if (reg == FIFO_R_W) {
+		mpu_model_fifo_push(m, &byte, 1);
+		return 1;
+	}
+	if (reg != INT_STATUS && reg != WHO_AM_I && (reg < ACCEL_XOUT_H || reg > GYRO_ZOUT_L))
+		m->reg[reg] = byte;
+	if (reg == USER_CTRL && (byte & USER_CTRL_FIFO_RESET)) {
+		m->fifo_head = m->fifo_count = 0;
+		m->reg[USER_CTRL] &= ~USER_CTRL_FIFO_RESET;
+	}
+	/* The next sample follows the new rate or power mode */
+	if (reg == SMPLRT_DIV || reg == CONFIG || reg == PWR_MGMT_1 || reg == PWR_MGMT_2)
+		sim_timer_at(&m->sample, sim_now_ns() + mpu_model_period_ns(m));
+	m->ptr = (m->ptr + 1) & 0x7F;
+	return 1;
+}
+
+static uint8_t
+mpu_model_read(sim_i2c_dev_t *dev, int ack)
+{
+	mpu_model_t *m = (mpu_model_t *)dev;
+	uint8_t reg = m->ptr;
+	uint8_t v;
+
+	(void)ack;
+	if (reg == FIFO_R_W) {
+		if (!m->fifo_count)
+			return 0xFF;
+		v = m->fifo[m->fifo_head];
+		m->fifo_head = (m->fifo_head + 1) % sizeof(m->fifo);
+		m->fifo_count--;
+		return v;  // the pointer stays on FIFO_R_W
+	}
+	if (reg >= ACCEL_XOUT_H && reg <= GYRO_ZOUT_L)
+		v = m->latch[reg - ACCEL_XOUT_H];
+	else if (reg == FIFO_COUNTH)
+		v = m->fifo_count >> 8;
+	else if (reg == FIFO_COUNTL)
+		v = (uint8_t)m->fifo_count;
+	else
+		v = m->reg[reg];
+	if (reg == INT_STATUS)
+		m->reg[INT_STATUS] = 0;
+	m->ptr = (m->ptr + 1) & 0x7F;
+	return v;
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief Put a MPU6050 at its power-on state on a bus and start its sample clock.
+        @param[in] bus       I2C1 or I2C2
+        @param[in] addr      8-bit address, MPU6050_ADDR or MPU6050_ADDR_AD0
+        @param[in] int_line  EXTI line the INT pin drives, -1 when not wired
+        @param[in] script    sample source, NULL for all zeros
+        @example   mpu_model_init(&imu_model, I2C1, MPU6050_ADDR, 0, Tilt_Script, NULL);
+*/
+void
+mpu_model_init(mpu_model_t *m, I2C_TypeDef *bus, uint8_t addr, int8_t int_line,
+               mpu_script_t script, void *arg)
+{
+	memset(m, 0, sizeof(*m));
+	m->dev.addr = addr;
+	m->dev.start = mpu_model_start;
+	m->dev.write = mpu_model_write;
+	m->dev.read = mpu_model_read;
+	m->int_line = int_line;
+	m->script = script;
+	m->arg = arg;
+	m->sample.fire = mpu_model_sample;
+	mpu_model_reset(m);
+	sim_i2c_attach(bus, &m->dev);
+	sim_timer_at(&m->sample, sim_now_ns() + mpu_model_period_ns(m));
+}
@@ -0,0 +1,43 @@
+/* @file 			 : mpu_model.h
+ *  @Description: Scripted MPU6050 behind a simulated I2C bus.
+ *
+ *  Register file with auto-increment, WHO_AM_I, DEVICE_RESET, sleep, the sample rate
+ *  divider and DLPF rate, the offset registers, INT_STATUS read-to-clear with a DATA_RDY
+ *  pulse on an EXTI line, and the 1024-byte FIFO with overflow. A burst read latches the
+ *  data registers when it starts, so a sample landing mid-read never tears a frame.
+ *  Accel-only cycle mode samples at the LP_WAKE_CTRL rate, and motion detection pulses INT
+ *  when an accel axis steps by more than MOT_THR between two samples (no high-pass,
+ *  MOT_DUR ignored). The aux I2C master and DMP are not modelled.
+ *
+ *  Sample values come from a script callback, in LSBs at the programmed ranges before
+ *  the offset registers are added.
+ */
+#ifndef MPU_MODEL_H
+#define MPU_MODEL_H
+
+#include "sim.h"
+
+/* Sample n: accel X/Y/Z, temperature, gyro X/Y/Z */
+typedef void (*mpu_script_t)(uint32_t n, int16_t *out, void *arg);
+
+typedef struct {
+	sim_i2c_dev_t dev;  // first, the bus hands this back
+	uint8_t reg[128];
+	uint8_t latch[14];  // ACCEL_XOUT_H..GYRO_ZOUT_L at the start of a read
+	uint8_t ptr;
+	int pointer_next;   // the next byte written is the register pointer
+	uint8_t fifo[1024];
+	uint16_t fifo_head, fifo_count;
+	sim_timer_t sample;
+	uint32_t samples;   // produced since sim start
+	int16_t mot_prev[3];  // accel of the last sample, for motion detection
+	int8_t int_line;    // EXTI line of the INT pin, -1 for none
+	mpu_script_t script;
+	void *arg;
+} mpu_model_t;
+
+void
+mpu_model_init(mpu_model_t *m, I2C_TypeDef *bus, uint8_t addr, int8_t int_line,
+               mpu_script_t script, void *arg);
+
+#endif
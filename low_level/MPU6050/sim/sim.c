@@ -0,0 +1,1237 @@
+/* @file 			 : sim.c
+ *  @Description: Register memory and peripheral models, see sim.h.
+ *
+ *  The drivers read and write sim_periph and sim_ppb like any RAM. At each sync point the
+ *  watched control registers are compared with what the models last left in them and a
+ *  difference is taken as a driver write (START in CR1, a PLL enable, an IFCR clear). The
+ *  hook of a marked access then applies its own effect, the clock moves, the computed
+ *  registers (SysTick VAL, CYCCNT, the NVIC mirrors) are brought up to date and pending
+ *  interrupts are delivered.
+ */
+#include "sim.h"
+#include "clk.h"
+#include "dma.h"
+#include "extint.h"
+#include "prof.h"
+#include "timer.h"
+#include "usart.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define SIM_PERIPH_SIZE 0x30000  // APB1, APB2 and AHB
+#define SIM_PPB_SIZE 0xF000      // ITM up to the end of the SCS
+#define SIM_WATCH_MAX 16
+
+#define RCC_ADDR ((uint32_t)RCC_BASE)
+#define SYSTICK_ADDR ((uint32_t)SYS_TICK_BASE)
+#define DWT_ADDR ((uint32_t)DWT_BASE)
+#define ICSR_ADDR ((uint32_t)SCB_BASE + 0x04)
+#define ICSR_PENDSTCLR (1UL << 25)
+#define SCR_ADDR ((uint32_t)SCB_BASE + 0x10)
+#define SCR_SLEEPDEEP (1UL << 2)
+
+#define I2C_SR1_SB (1 << 0)
+#define I2C_SR1_ADDR_ (1 << 1)
+#define I2C_SR1_BTF_ (1 << 2)
+#define I2C_SR1_STOPF (1 << 4)
+#define I2C_SR1_RXNE_ (1 << 6)
+#define I2C_SR1_TXE (1 << 7)
+#define I2C_SR1_AF (1 << 10)
+#define I2C_SR1_ERR_MASK 0xDF00  // rc_w0 error flags
+#define I2C_SR2_MSL (1 << 0)
+#define I2C_SR2_BUSY (1 << 1)
+#define I2C_SR2_TRA (1 << 2)
+#define I2C_CR1_PE (1 << 0)
+#define I2C_CR1_START (1 << 8)
+#define I2C_CR1_STOP_ (1 << 9)
+#define I2C_CR1_ACK_ (1 << 10)
+#define I2C_CR1_SWRST (1 << 15)
+#define I2C_CR2_ITERREN_ (1 << 8)
+#define I2C_CR2_ITEVTEN_ (1 << 9)
+#define I2C_CR2_ITBUFEN_ (1 << 10)
+#define I2C_CR2_DMAEN_ (1 << 11)
+#define I2C_CR2_LAST_ (1 << 12)
+
+#define DMA_CCR_EN_ (1 << 0)
+#define DMA_CCR_TCIE_ (1 << 1)
+#define DMA_CCR_HTIE_ (1 << 2)
+#define DMA_CCR_TEIE_ (1 << 3)
+#define DMA_CCR_DIR_ (1 << 4)
+#define DMA_CCR_CIRC_ (1 << 5)
+#define DMA_CCR_MINC_ (1 << 7)
+
+#define USART_CR1_IDLEIE_ (1 << 4)
+#define USART_CR1_RXNEIE (1 << 5)
+#define USART_CR1_TCIE (1 << 6)
+#define USART_CR1_TXEIE (1 << 7)
+#define USART_CR3_DMAR_ (1 << 6)
+#define USART_CR3_DMAT (1 << 7)
+#define USART_RX_FIFO 64
+
+typedef void (*sim_vector_t)(void);
+
+/* Vector table, a handler the firmware doesn't define stays NULL and is never entered */
+#define SIM_HANDLER(name) void name(void) __attribute__((weak));
+SIM_HANDLER(SysTick_Handler)
+SIM_HANDLER(WWDG_IRQHandler)
+SIM_HANDLER(PVD_IRQHandler)
+SIM_HANDLER(TAMPER_IRQHandler)
+SIM_HANDLER(RTC_IRQHandler)
+SIM_HANDLER(FLASH_IRQHandler)
+SIM_HANDLER(RCC_IRQHandler)
+SIM_HANDLER(EXTI0_IRQHandler)
+SIM_HANDLER(EXTI1_IRQHandler)
+SIM_HANDLER(EXTI2_IRQHandler)
+SIM_HANDLER(EXTI3_IRQHandler)
+SIM_HANDLER(EXTI4_IRQHandler)
+SIM_HANDLER(DMA1_Channel1_IRQHandler)
+SIM_HANDLER(DMA1_Channel2_IRQHandler)
+SIM_HANDLER(DMA1_Channel3_IRQHandler)
+SIM_HANDLER(DMA1_Channel4_IRQHandler)
+SIM_HANDLER(DMA1_Channel5_IRQHandler)
+SIM_HANDLER(DMA1_Channel6_IRQHandler)
+SIM_HANDLER(DMA1_Channel7_IRQHandler)
+SIM_HANDLER(ADC1_2_IRQHandler)
+SIM_HANDLER(USB_HP_CAN_TX_IRQHandler)
+SIM_HANDLER(USB_LP_CAN_RX0_IRQHandler)
+SIM_HANDLER(CAN_RX1_IRQHandler)
+SIM_HANDLER(CAN_SCE_IRQHandler)
+SIM_HANDLER(EXTI9_5_IRQHandler)
+SIM_HANDLER(TIM1_BRK_IRQHandler)
+SIM_HANDLER(TIM1_UP_IRQHandler)
+SIM_HANDLER(TIM1_TRG_COM_IRQHandler)
+SIM_HANDLER(TIM1_CC_IRQHandler)
+SIM_HANDLER(TIM2_IRQHandler)
+SIM_HANDLER(TIM3_IRQHandler)
+SIM_HANDLER(TIM4_IRQHandler)
+SIM_HANDLER(I2C1_EV_IRQHandler)
+SIM_HANDLER(I2C1_ER_IRQHandler)
+SIM_HANDLER(I2C2_EV_IRQHandler)
+SIM_HANDLER(I2C2_ER_IRQHandler)
+SIM_HANDLER(SPI1_IRQHandler)
+SIM_HANDLER(SPI2_IRQHandler)
+SIM_HANDLER(USART1_IRQHandler)
+SIM_HANDLER(USART2_IRQHandler)
+SIM_HANDLER(USART3_IRQHandler)
+SIM_HANDLER(EXTI15_10_IRQHandler)
+SIM_HANDLER(RTCAlarm_IRQHandler)
+
+static sim_vector_t sim_vectors[SIM_IRQ_COUNT] = {
+    WWDG_IRQHandler,          PVD_IRQHandler,           TAMPER_IRQHandler,
+    RTC_IRQHandler,           FLASH_IRQHandler,         RCC_IRQHandler,
+    EXTI0_IRQHandler,         EXTI1_IRQHandler,         EXTI2_IRQHandler,
+    EXTI3_IRQHandler,         EXTI4_IRQHandler,         DMA1_Channel1_IRQHandler,
+    DMA1_Channel2_IRQHandler, DMA1_Channel3_IRQHandler, DMA1_Channel4_IRQHandler,
+    DMA1_Channel5_IRQHandler, DMA1_Channel6_IRQHandler, DMA1_Channel7_IRQHandler,
+    ADC1_2_IRQHandler,        USB_HP_CAN_TX_IRQHandler, USB_LP_CAN_RX0_IRQHandler,
+    CAN_RX1_IRQHandler,       CAN_SCE_IRQHandler,       EXTI9_5_IRQHandler,
+    TIM1_BRK_IRQHandler,      TIM1_UP_IRQHandler,       TIM1_TRG_COM_IRQHandler,
+    TIM1_CC_IRQHandler,       TIM2_IRQHandler,          TIM3_IRQHandler,
+    TIM4_IRQHandler,          I2C1_EV_IRQHandler,       I2C1_ER_IRQHandler,
+    I2C2_EV_IRQHandler,       I2C2_ER_IRQHandler,       SPI1_IRQHandler,
+    SPI2_IRQHandler,          USART1_IRQHandler,        USART2_IRQHandler,
+    USART3_IRQHandler,        EXTI15_10_IRQHandler,     RTCAlarm_IRQHandler,
+};
+
+typedef struct {
+	uint32_t base;
+	sim_i2c_dev_t *devs;
+	sim_i2c_dev_t *cur;  // addressed slave
+	enum { I2C_IDLE, I2C_ADDR, I2C_TX, I2C_RX } state;
+	int reading;     // address byte had the read bit
+	int dr_full, shift_full;
+	uint8_t shift;
+	int nacked;      // last byte clocked in was NACKed, the slave has finished
+	int stuck;       // SCL rising edges until a slave releases SDA, see sim_i2c_stick()
+	uint8_t scl, sda;  // GPIOB pins
+} sim_i2c_bus_t;
+
+sim_stats_t sim_stats;
+
+uint32_t sim_periph[SIM_PERIPH_SIZE / 4];
+uint32_t sim_ppb[SIM_PPB_SIZE / 4];
+
+/* Control registers whose writes the drivers don't mark, with the value each had when
+ * the models last looked */
+static uint32_t sim_watch_addr[SIM_WATCH_MAX];
+static uint32_t sim_watch_seen[SIM_WATCH_MAX];
+static int sim_watch_count;
+
+static uint64_t sim_now;
+static uint32_t sim_poll_ns = SIM_ACCESS_NS;
+static sim_timer_t *sim_timers;
+static int sim_primask;
+static int sim_in_handler;
+
+static uint32_t nvic_enabled[2], nvic_pending[2];
+static uint32_t exti_pending;  // PR, kept here as drivers write it with plain stores
+static int systick_pending;
+static uint64_t systick_reload_ns;
+static sim_timer_t systick_timer;
+static uint32_t dwt_base;
+static uint16_t dma_reload[8];
+
+static sim_i2c_bus_t sim_i2c[2] = {
+    {.scl = 6, .sda = 7},
+    {.scl = 10, .sda = 11},
+};
+
+static void (*uart_sink)(uint8_t byte);
+static uint8_t uart_rx_fifo[USART_RX_FIFO];
+static uint16_t uart_rx_head, uart_rx_tail;
+
+/*---------------------------------------------------------------------------*/
+/* Register memory, addresses as the drivers hold them (u32, below 4 GB) */
+
+#define REG(addr) (*(volatile uint32_t *)(uintptr_t)((addr) & ~3U))
+
+/*---------------------------------------------------------------------------*/
+/* Clock */
+
+static uint32_t
+sim_hclk(void)
+{
+	static const uint8_t ahb_shift[16] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 2, 3, 4, 6, 7, 8, 9};
+	uint32_t cfgr = REG(RCC_ADDR + 0x04);
+	uint32_t sysclk, mul, in;
+
+	switch ((cfgr >> 2) & 3) {
+	case 1:
+		sysclk = HSE_VALUE;
+		break;
+	case 2:
+		mul = ((cfgr >> 18) & 0xF) + 2;
+		if (mul > 16)
+			mul = 16;
+		if (!(cfgr & (1 << 16)))
+			in = HSI_VALUE / 2;
+		else
+			in = (cfgr & (1 << 17)) ? HSE_VALUE / 2 : HSE_VALUE;
+		sysclk = in * mul;
+		break;
+	default:
+		sysclk = HSI_VALUE;
+		break;
+	}
+	return sysclk >> ahb_shift[(cfgr >> 4) & 0xF];
+}
+
+static uint32_t
+sim_pclk1(void)
+{
+	uint32_t ppre = (REG(RCC_ADDR + 0x04) >> 8) & 7;
+
+	return ppre < 4 ? sim_hclk() : sim_hclk() >> (ppre - 3);
+}
+
+/** @brief Virtual time since sim_init().
+        @return nanoseconds
+*/
+uint64_t
+sim_now_ns(void)
+{
+	return sim_now;
+}
+
+/** @brief Schedule a timer, re-arming one that is pending moves it.
+        @param[in] t      timer, fire() is called from the simulator with the clock at at_ns
+        @param[in] at_ns  absolute virtual time, the past fires on the next advance
+*/
+void
+sim_timer_at(sim_timer_t *t, uint64_t at_ns)
+{
+	sim_timer_t **p = &sim_timers;
+
+	sim_timer_cancel(t);
+	t->at = at_ns;
+	while (*p && (*p)->at <= at_ns)
+		p = &(*p)->next;
+	t->next = *p;
+	*p = t;
+	t->armed = 1;
+}
+
+void
+sim_timer_cancel(sim_timer_t *t)
+{
+	sim_timer_t **p;
+
+	if (!t->armed)
+		return;
+	for (p = &sim_timers; *p; p = &(*p)->next) {
+		if (*p == t) {
+			*p = t->next;
+			break;
+		}
+	}
+	t->armed = 0;
+}
+
+static void
+sim_advance(uint64_t ns)
+{
+	uint64_t end = sim_now + ns;
+	sim_timer_t *t;
+
+	while ((t = sim_timers) && t->at <= end) {
+		sim_timers = t->next;
+		t->armed = 0;
+		if (t->at > sim_now)
+			sim_now = t->at;
+		t->fire(t);
+	}
+	sim_now = end;
+}
+
+/*---------------------------------------------------------------------------*/
+/* SysTick and DWT */
+
+static uint32_t
+systick_clk(void)
+{
+	return (REG(SYSTICK_ADDR) & SYSTICK_CTRL_CLKSOURCE) ? sim_hclk() : sim_hclk() / 8;
+}
+
+static uint64_t
+systick_period_ns(void)
+{
+	return (uint64_t)((REG(SYSTICK_ADDR + 4) & 0xFFFFFF) + 1) * 1000000000ULL / systick_clk();
+}
+
+static void
+systick_fire(sim_timer_t *t)
+{
+	systick_reload_ns = t->at;
+	if (REG(SYSTICK_ADDR) & SYSTICK_CTRL_TICKINT)
+		systick_pending = 1;
+	sim_timer_at(t, t->at + systick_period_ns());
+}
+
+static void
+systick_restart(void)
+{
+	systick_reload_ns = sim_now;
+	if (REG(SYSTICK_ADDR) & SYSTICK_CTRL_ENABLE)
+		sim_timer_at(&systick_timer, sim_now + systick_period_ns());
+	else
+		sim_timer_cancel(&systick_timer);
+}
+
+static uint32_t
+dwt_cycles(void)
+{
+	return (uint32_t)(sim_now * sim_hclk() / 1000000000ULL);
+}
+
+/*---------------------------------------------------------------------------*/
+/* NVIC */
+
+static int
+sim_irq_line(int irq);
+
+static void
+nvic_sync(void)
+{
+	for (int i = 0; i < 2; i++) {
+		uint32_t pend = nvic_pending[i];
+
+		for (int b = 0; b < 32; b++) {
+			if (i * 32 + b < SIM_IRQ_COUNT && sim_irq_line(i * 32 + b))
+				pend |= 1UL << b;
+		}
+		REG(NVIC_BASE + 0x000 + 4 * i) = nvic_enabled[i];
+		REG(NVIC_BASE + 0x080 + 4 * i) = nvic_enabled[i];
+		REG(NVIC_BASE + 0x100 + 4 * i) = pend;
+		REG(NVIC_BASE + 0x180 + 4 * i) = pend;
+	}
+	if (systick_pending)
+		REG(ICSR_ADDR) |= SCB_ICSR_PENDSTSET;
+	else
+		REG(ICSR_ADDR) &= ~SCB_ICSR_PENDSTSET;
+}
+
+static void
+nvic_write(uint32_t addr, uint32_t val)
+{
+	uint32_t off = addr - NVIC_BASE;
+	int i = (off >> 2) & 7;
+
+	if (i > 1)
+		return;
+	if (off < 0x080)
+		nvic_enabled[i] |= val;
+	else if (off < 0x100)
+		nvic_enabled[i] &= ~val;
+	else if (off < 0x180)
+		nvic_pending[i] |= val;
+	else if (off < 0x200)
+		nvic_pending[i] &= ~val;
+}
+
+/* Highest priority (lowest IP value, then lowest number) pending and enabled IRQ */
+static int
+nvic_next(void)
+{
+	int best = -1;
+	uint8_t best_prio = 0xFF;
+
+	for (int irq = 0; irq < SIM_IRQ_COUNT; irq++) {
+		uint32_t bit = 1UL << (irq & 31);
+		uint8_t prio;
+
+		if (!(nvic_enabled[irq >> 5] & bit))
+			continue;
+		if (!(nvic_pending[irq >> 5] & bit) && !sim_irq_line(irq))
+			continue;
+		prio = NVIC->IP[irq];
+		if (best < 0 || prio < best_prio) {
+			best = irq;
+			best_prio = prio;
+		}
+	}
+	return best;
+}
+
+static void
+sim_settle(void);
+
+/* Run every deliverable handler. Handlers complete before the next one starts, what one
+ * wrote takes effect before the next is chosen. */
+static void
+sim_dispatch(void)
+{
+	int irq;
+
+	if (sim_primask || sim_in_handler)
+		return;
+	sim_in_handler = 1;
+	for (;;) {
+		if (systick_pending && SysTick_Handler) {
+			systick_pending = 0;
+			sim_stats.irqs++;
+			SysTick_Handler();
+			sim_settle();
+			continue;
+		}
+		irq = nvic_next();
+		if (irq < 0 || !sim_vectors[irq])
+			break;
+		nvic_pending[irq >> 5] &= ~(1UL << (irq & 31));
+		sim_stats.irqs++;
+		sim_vectors[irq]();
+		sim_settle();
+		if (sim_primask)
+			break;  // a handler that leaves interrupts masked holds off the rest
+	}
+	sim_in_handler = 0;
+}
+
+/** @brief PRIMASK, see irq_save() in common.h. */
+uint32_t
+sim_irq_save(void)
+{
+	uint32_t old = sim_primask;
+
+	sim_primask = 1;
+	return old;
+}
+
+void
+sim_irq_restore(uint32_t primask)
+{
+	sim_primask = primask & 1;
+	if (!sim_primask) {
+		sim_settle();
+		sim_dispatch();
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+/* EXTI */
+
+static int
+exti_line(int first, int last)
+{
+	uint32_t pr = exti_pending & REG(EXTI_BASE + 0x00);
+
+	return (pr >> first) & ((2UL << (last - first)) - 1) ? 1 : 0;
+}
+
+/** @brief Drive a rising edge into an EXTI line, as a sensor INT pin would. */
+void
+sim_exti_pulse(uint8_t line)
+{
+	uint32_t bit = 1UL << line;
+
+	if ((REG(EXTI_BASE + 0x00) & bit) && (REG(EXTI_BASE + 0x08) & bit)) {
+		exti_pending |= bit;
+		REG(EXTI_BASE + 0x14) = exti_pending;
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+/* DMA1 */
+
+#define DMA_REG(ch, off) REG(DMA1_BASE + 0x08 + 0x14 * ((ch)-1) + (off))
+#define DMA_CCR_ 0x00
+#define DMA_CNDTR_ 0x04
+#define DMA_CPAR_ 0x08
+#define DMA_CMAR_ 0x0C
+
+static void
+dma_flag(int ch, uint32_t flags)
+{
+	REG(DMA1_BASE) |= (flags | 1) << (4 * (ch - 1));  // GIF with it
+}
+
+/* Enabled channel moving data between memory and the register at cpar */
+static int
+dma_find(uint32_t cpar, int to_periph)
+{
+	for (int ch = 1; ch <= 7; ch++) {
+		uint32_t ccr = DMA_REG(ch, DMA_CCR_);
+
+		if ((ccr & DMA_CCR_EN_) && DMA_REG(ch, DMA_CPAR_) == cpar &&
+		    !!(ccr & DMA_CCR_DIR_) == to_periph)
+			return ch;
+	}
+	return 0;
+}
+
+static uint8_t *
+dma_mem(int ch)
+{
+	uint32_t ccr = DMA_REG(ch, DMA_CCR_);
+	uint32_t pos = (ccr & DMA_CCR_MINC_) ? dma_reload[ch] - DMA_REG(ch, DMA_CNDTR_) : 0;
+
+	return (uint8_t *)(uintptr_t)(DMA_REG(ch, DMA_CMAR_) + pos);
+}
+
+/* One byte moved, count down and raise the flags. Returns 1 on the last one. */
+static int
+dma_count(int ch)
+{
+	uint32_t left = DMA_REG(ch, DMA_CNDTR_) - 1;
+
+	DMA_REG(ch, DMA_CNDTR_) = left;
+	if (left == dma_reload[ch] / 2)
+		dma_flag(ch, DMA_ISR_HTIF_BIT);
+	if (left)
+		return 0;
+	dma_flag(ch, DMA_ISR_TCIF_BIT);
+	if (DMA_REG(ch, DMA_CCR_) & DMA_CCR_CIRC_)
+		DMA_REG(ch, DMA_CNDTR_) = dma_reload[ch];
+	return 1;
+}
+
+static void
+uart_tx_byte(uint8_t byte)
+{
+	sim_stats.uart_bytes++;
+	if (uart_sink)
+		uart_sink(byte);
+}
+
+static void
+dma_start(int ch)
+{
+	dma_reload[ch] = DMA_REG(ch, DMA_CNDTR_);
+	if (DMA_REG(ch, DMA_CPAR_) == USART1_BASE + 0x04 && (DMA_REG(ch, DMA_CCR_) & DMA_CCR_DIR_) &&
+	    (REG(USART1_BASE + 0x14) & USART_CR3_DMAT)) {
+		while (DMA_REG(ch, DMA_CNDTR_)) {
+			uart_tx_byte(*dma_mem(ch));
+			if (dma_count(ch) && (DMA_REG(ch, DMA_CCR_) & DMA_CCR_CIRC_))
+				break;
+		}
+	}
+}
+
+/* IFCR clears ISR flags and reads as 0, a CCR write marked by dma_enable_channel()
+ * starts the channel */
+static void
+dma_write(uint32_t addr, uint32_t val)
+{
+	uint32_t off = addr - DMA1_BASE;
+	int ch;
+
+	if (off == 0x04) {
+		REG(DMA1_BASE) &= ~val;
+		REG(addr) = 0;
+		return;
+	}
+	ch = (off - 0x08) / 0x14 + 1;
+	if (ch >= 1 && ch <= 7 && (off - 0x08) % 0x14 == DMA_CCR_ && (val & DMA_CCR_EN_))
+		dma_start(ch);
+}
+
+static int
+dma_line(int ch)
+{
+	uint32_t flags = (REG(DMA1_BASE) >> (4 * (ch - 1))) & 0xF;
+	uint32_t ccr = DMA_REG(ch, DMA_CCR_);
+
+	return (flags & ccr & (DMA_CCR_TCIE_ | DMA_CCR_HTIE_ | DMA_CCR_TEIE_)) ? 1 : 0;
+}
+
+/*---------------------------------------------------------------------------*/
+/* I2C master */
+
+#define I2C_REG(bus, off) REG((bus)->base + (off))
+#define I2C_CR1_ 0x00
+#define I2C_CR2_ 0x04
+#define I2C_DR_ 0x10
+#define I2C_SR1_ 0x14
+#define I2C_SR2_ 0x18
+#define I2C_CCR_ 0x1C
+
+/** @brief Put a slave on a bus, any number of slaves with distinct addresses. */
+void
+sim_i2c_attach(I2C_TypeDef *bus, sim_i2c_dev_t *dev)
+{
+	sim_i2c_bus_t *b = &sim_i2c[bus == I2C2];
+
+	dev->next = b->devs;
+	b->devs = dev;
+}
+
+/* Time for 9 SCL periods, from CCR and the CR2 FREQ field */
+static void
+i2c_wire_byte(sim_i2c_bus_t *bus)
+{
+	uint32_t ccr = I2C_REG(bus, I2C_CCR_);
+	uint32_t freq = I2C_REG(bus, I2C_CR2_) & 0x3F;
+	uint32_t clocks;
+
+	if (!freq)
+		freq = sim_pclk1() / 1000000;
+	if (!(ccr & (1 << 15)))
+		clocks = 2 * (ccr & 0xFFF);
+	else
+		clocks = (ccr & (1 << 14) ? 25 : 3) * (ccr & 0xFFF);
+	sim_stats.i2c_bytes++;
+	sim_advance(9ULL * clocks * 1000 / freq);
+}
+
+static void
+i2c_end(sim_i2c_bus_t *bus)
+{
+	if (bus->cur && bus->cur->stop)
+		bus->cur->stop(bus->cur);
+	bus->cur = NULL;
+	bus->state = I2C_IDLE;
+	I2C_REG(bus, I2C_SR2_) &= ~(I2C_SR2_MSL | I2C_SR2_BUSY | I2C_SR2_TRA);
+	I2C_REG(bus, I2C_SR1_) &= ~(I2C_SR1_TXE | (bus->dr_full ? 0 : I2C_SR1_BTF_));
+}
+
+static void
+i2c_reset(sim_i2c_bus_t *bus)
+{
+	bus->cur = NULL;
+	bus->state = I2C_IDLE;
+	bus->dr_full = bus->shift_full = bus->nacked = 0;
+	I2C_REG(bus, I2C_SR1_) = 0;
+	I2C_REG(bus, I2C_SR2_) = bus->stuck ? I2C_SR2_BUSY : 0;  // BUSY follows the lines
+}
+
+/* Move received bytes: DR to a DMA channel if one is set up, the shift register to DR,
+ * and clock new bytes in while there is room. ACK is sampled as each byte completes,
+ * with DMA and LAST the byte that ends the count is NACKed. */
+static void
+i2c_pump(sim_i2c_bus_t *bus)
+{
+	for (;;) {
+		int ch = (I2C_REG(bus, I2C_CR2_) & I2C_CR2_DMAEN_) ? dma_find(bus->base + I2C_DR_, 0) : 0;
+		int ack;
+		uint8_t byte;
+
+		if (ch && bus->dr_full && DMA_REG(ch, DMA_CNDTR_)) {
+			*dma_mem(ch) = (uint8_t)I2C_REG(bus, I2C_DR_);
+			dma_count(ch);
+			bus->dr_full = 0;
+			if (bus->shift_full) {
+				I2C_REG(bus, I2C_DR_) = bus->shift;
+				bus->shift_full = 0;
+				bus->dr_full = 1;
+			}
+			continue;
+		}
+		if (bus->state != I2C_RX || bus->nacked || bus->stuck ||
+		    (bus->dr_full && bus->shift_full))
+			break;
+		ack = (I2C_REG(bus, I2C_CR1_) & I2C_CR1_ACK_) != 0;
+		if (ch && (I2C_REG(bus, I2C_CR2_) & I2C_CR2_LAST_) &&
+		    DMA_REG(ch, DMA_CNDTR_) - bus->dr_full == 1)
+			ack = 0;
+		byte = bus->cur->read(bus->cur, ack);
+		i2c_wire_byte(bus);
+		if (!bus->dr_full) {
+			I2C_REG(bus, I2C_DR_) = byte;
+			bus->dr_full = 1;
+		} else {
+			bus->shift = byte;
+			bus->shift_full = 1;
+		}
+		bus->nacked = !ack;
+	}
+	I2C_REG(bus, I2C_SR1_) &= ~(I2C_SR1_RXNE_ | I2C_SR1_BTF_);
+	if (bus->dr_full)
+		I2C_REG(bus, I2C_SR1_) |= I2C_SR1_RXNE_;
+	if (bus->shift_full)
+		I2C_REG(bus, I2C_SR1_) |= I2C_SR1_BTF_;
+}
+
+static void
+i2c_write(sim_i2c_bus_t *bus, uint32_t off, uint32_t val)
+{
+	sim_i2c_dev_t *dev;
+
+	switch (off) {
+	case I2C_CR1_:
+		if ((val & I2C_CR1_SWRST) || !(val & I2C_CR1_PE)) {
+			i2c_reset(bus);
+			I2C_REG(bus, I2C_CR1_) = val & ~(I2C_CR1_START | I2C_CR1_STOP_);
+			return;
+		}
+		if (val & I2C_CR1_START) {
+			I2C_REG(bus, I2C_CR1_) &= ~I2C_CR1_START;
+			if (bus->stuck)
+				break;  // SDA is held low, no START can go out
+			bus->state = I2C_ADDR;
+			bus->dr_full = bus->shift_full = bus->nacked = 0;
+			I2C_REG(bus, I2C_SR1_) = (I2C_REG(bus, I2C_SR1_) & I2C_SR1_ERR_MASK) | I2C_SR1_SB;
+			I2C_REG(bus, I2C_SR2_) |= I2C_SR2_MSL | I2C_SR2_BUSY;
+		} else if (val & I2C_CR1_STOP_) {
+			I2C_REG(bus, I2C_CR1_) &= ~I2C_CR1_STOP_;
+			i2c_end(bus);
+		}
+		i2c_pump(bus);
+		break;
+	case I2C_CR2_:
+		i2c_pump(bus);
+		break;
+	case I2C_DR_:
+		if (bus->stuck)
+			break;
+		if (bus->state == I2C_ADDR && (I2C_REG(bus, I2C_SR1_) & I2C_SR1_SB)) {
+			I2C_REG(bus, I2C_SR1_) &= ~I2C_SR1_SB;
+			for (dev = bus->devs; dev && dev->addr != (val & 0xFE); dev = dev->next)
+				;
+			i2c_wire_byte(bus);
+			bus->cur = dev;
+			bus->reading = val & 1;
+			if (!dev) {
+				I2C_REG(bus, I2C_SR1_) |= I2C_SR1_AF;
+				return;
+			}
+			if (dev->start)
+				dev->start(dev, bus->reading);
+			I2C_REG(bus, I2C_SR1_) |= I2C_SR1_ADDR_;
+			if (!bus->reading)
+				I2C_REG(bus, I2C_SR2_) |= I2C_SR2_TRA;
+			else
+				I2C_REG(bus, I2C_SR2_) &= ~I2C_SR2_TRA;
+		} else if (bus->state == I2C_TX) {
+			int ack = bus->cur->write(bus->cur, (uint8_t)val);
+
+			i2c_wire_byte(bus);
+			I2C_REG(bus, I2C_SR1_) |= I2C_SR1_TXE | I2C_SR1_BTF_ | (ack ? 0 : I2C_SR1_AF);
+		}
+		break;
+	}
+}
+
+/* Marked reads: SR2 after SR1 clears ADDR (the SR1 read is taken as done), DR pops */
+static int
+i2c_read(sim_i2c_bus_t *bus, uint32_t off)
+{
+	switch (off) {
+	case I2C_SR2_:
+		if (!(I2C_REG(bus, I2C_SR1_) & I2C_SR1_ADDR_))
+			return 0;
+		I2C_REG(bus, I2C_SR1_) &= ~I2C_SR1_ADDR_;
+		if (bus->reading) {
+			bus->state = I2C_RX;
+			i2c_pump(bus);
+		} else {
+			bus->state = I2C_TX;
+			I2C_REG(bus, I2C_SR1_) |= I2C_SR1_TXE;
+		}
+		return 1;
+	case I2C_DR_:
+		if (!bus->dr_full)
+			return 0;
+		bus->dr_full = 0;
+		if (bus->shift_full) {
+			I2C_REG(bus, I2C_DR_) = bus->shift;
+			bus->shift_full = 0;
+			bus->dr_full = 1;
+		}
+		i2c_pump(bus);
+		return 1;
+	}
+	return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+/* GPIOB, the I2C pins as a bus clear drives them */
+
+#define GPIOB_REG(off) REG(GPIOB_BASE + (off))
+#define GPIO_ODR_ 0x0C
+#define GPIO_BSRR_ 0x10
+#define GPIO_BRR_ 0x14
+
+/* Pin configured as a general purpose output by CRL/CRH */
+static int
+gpio_output(int pin)
+{
+	uint32_t cnf = GPIOB_REG(pin < 8 ? 0 : 4) >> ((pin & 7) * 4) & 0xF;
+
+	return (cnf & 3) && !(cnf & 8);
+}
+
+/* IDR from the levels on the wires: outputs read back ODR, everything else idles high
+ * on its pull-up, and a stuck slave holds its SDA low. */
+static void
+gpio_update(void)
+{
+	uint32_t odr = GPIOB_REG(GPIO_ODR_), idr = 0xFFFF;
+
+	for (int pin = 0; pin < 16; pin++) {
+		if (gpio_output(pin) && !(odr & 1UL << pin))
+			idr &= ~(1UL << pin);
+	}
+	for (int i = 0; i < 2; i++) {
+		if (sim_i2c[i].stuck)
+			idr &= ~(1UL << sim_i2c[i].sda);
+	}
+	GPIOB_REG(0x08) = idr;
+}
+
+static void
+gpio_write(uint32_t off, uint32_t old, uint32_t val)
+{
+	uint32_t prev = GPIOB_REG(GPIO_ODR_), odr = prev;
+
+	if (off == GPIO_ODR_) {
+		prev = old;
+	} else if (off == GPIO_BSRR_) {  // set wins over reset
+		odr = (odr & ~(val >> 16)) | (val & 0xFFFF);
+		GPIOB_REG(off) = 0;
+	} else if (off == GPIO_BRR_) {
+		odr &= ~(val & 0xFFFF);
+		GPIOB_REG(off) = 0;
+	}
+	GPIOB_REG(GPIO_ODR_) = odr;
+	for (int i = 0; i < 2; i++) {  // each SCL rising edge clocks a stuck slave on one bit
+		sim_i2c_bus_t *bus = &sim_i2c[i];
+		uint32_t scl = 1UL << bus->scl;
+
+		if (bus->stuck && gpio_output(bus->scl) && !(prev & scl) && (odr & scl) &&
+		    !--bus->stuck)
+			I2C_REG(bus, I2C_SR2_) &= ~I2C_SR2_BUSY;
+	}
+	gpio_update();
+}
+
+/** @brief Have a slave hold SDA low on a bus, as one that lost track mid-byte does. */
+void
+sim_i2c_stick(I2C_TypeDef *bus, int clocks)
+{
+	sim_i2c_bus_t *b = &sim_i2c[bus == I2C2];
+
+	b->stuck = clocks;
+	I2C_REG(b, I2C_SR2_) |= I2C_SR2_BUSY;
+	gpio_update();
+}
+
+static int
+i2c_ev_line(const sim_i2c_bus_t *bus)
+{
+	uint32_t cr2 = I2C_REG(bus, I2C_CR2_);
+	uint32_t sr1 = I2C_REG(bus, I2C_SR1_);
+
+	if (!(cr2 & I2C_CR2_ITEVTEN_))
+		return 0;
+	if (sr1 & (I2C_SR1_SB | I2C_SR1_ADDR_ | I2C_SR1_BTF_ | I2C_SR1_STOPF))
+		return 1;
+	return (cr2 & I2C_CR2_ITBUFEN_) && (sr1 & (I2C_SR1_RXNE_ | I2C_SR1_TXE));
+}
+
+static int
+i2c_er_line(const sim_i2c_bus_t *bus)
+{
+	return (I2C_REG(bus, I2C_CR2_) & I2C_CR2_ITERREN_) &&
+	       (I2C_REG(bus, I2C_SR1_) & I2C_SR1_ERR_MASK);
+}
+
+/*---------------------------------------------------------------------------*/
+/* USART1 */
+
+#define USART_REG(off) REG(USART1_BASE + (off))
+
+/** @brief Receive every byte USART1 transmits, by DR write or DMA. */
+void
+sim_uart_sink(void (*sink)(uint8_t byte))
+{
+	uart_sink = sink;
+}
+
+/** @brief Bytes arriving on USART1 RX, followed by an idle line.
+        With DMAR set they go straight into the receive DMA channel, otherwise into a
+        small RXNE FIFO read through DR.
+        @return bytes accepted
+*/
+int
+sim_uart_rx(const uint8_t *data, uint16_t len)
+{
+	int ch = (USART_REG(0x14) & USART_CR3_DMAR_) ? dma_find(USART1_BASE + 0x04, 0) : 0;
+	int n;
+
+	for (n = 0; n < len; n++) {
+		if (ch) {
+			if (!DMA_REG(ch, DMA_CNDTR_))
+				break;
+			*dma_mem(ch) = data[n];
+			dma_count(ch);
+		} else {
+			if ((uint16_t)(uart_rx_head - uart_rx_tail) == USART_RX_FIFO)
+				break;
+			uart_rx_fifo[uart_rx_head++ % USART_RX_FIFO] = data[n];
+			USART_REG(0x00) |= USART_SR_RXNE;
+		}
+	}
+	USART_REG(0x00) |= USART_SR_IDLE;
+	sim_dispatch();
+	return n;
+}
+
+static void
+usart_write_reg(uint32_t off, uint32_t val)
+{
+	if (off == 0x04) {
+		uart_tx_byte((uint8_t)val);
+		USART_REG(0x00) |= USART_SR_TXE | USART_SR_TC;
+	}
+}
+
+static int
+usart_read_reg(uint32_t off)
+{
+	if (off != 0x04)
+		return 0;
+	USART_REG(0x00) &= ~(USART_SR_IDLE | USART_SR_ORE | USART_SR_NE | USART_SR_FE);
+	if (uart_rx_head != uart_rx_tail) {
+		uart_rx_tail++;
+		USART_REG(0x00) &= ~USART_SR_RXNE;
+	}
+	if (uart_rx_head != uart_rx_tail) {
+		USART_REG(0x04) = uart_rx_fifo[uart_rx_tail % USART_RX_FIFO];
+		USART_REG(0x00) |= USART_SR_RXNE;
+	}
+	return 1;
+}
+
+static int
+usart_line(void)
+{
+	uint32_t sr = USART_REG(0x00), cr1 = USART_REG(0x0C);
+
+	return ((cr1 & USART_CR1_TXEIE) && (sr & USART_SR_TXE)) ||
+	       ((cr1 & USART_CR1_TCIE) && (sr & USART_SR_TC)) ||
+	       ((cr1 & USART_CR1_RXNEIE) && (sr & USART_SR_RXNE)) ||
+	       ((cr1 & USART_CR1_IDLEIE_) && (sr & USART_SR_IDLE));
+}
+
+/*---------------------------------------------------------------------------*/
+/* Interrupt lines, level sensitive like the peripherals' */
+
+static int
+sim_irq_line(int irq)
+{
+	if (irq >= 6 && irq <= 10)
+		return exti_line(irq - 6, irq - 6);
+	if (irq >= 11 && irq <= 17)
+		return dma_line(irq - 10);
+	switch (irq) {
+	case 23:
+		return exti_line(5, 9);
+	case 31:
+	case 33:
+		return i2c_ev_line(&sim_i2c[irq == 33]);
+	case 32:
+	case 34:
+		return i2c_er_line(&sim_i2c[irq == 34]);
+	case 37:
+		return usart_line();
+	case 40:
+		return exti_line(10, 15);
+	}
+	return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+/* Register writes */
+
+/* A watched register changed from old to val since the models last looked */
+static void
+sim_watch_write(uint32_t addr, uint32_t old, uint32_t val)
+{
+	if (addr >= I2C1_BASE && addr < I2C1_BASE + 0x400) {
+		i2c_write(&sim_i2c[0], addr - I2C1_BASE, val);
+	} else if (addr >= I2C2_BASE && addr < I2C2_BASE + 0x400) {
+		i2c_write(&sim_i2c[1], addr - I2C2_BASE, val);
+	} else if (addr >= GPIOB_BASE && addr < GPIOB_BASE + 0x18) {
+		gpio_write(addr - GPIOB_BASE, old, val);
+	} else if (addr >= DMA1_BASE && addr < DMA1_BASE + 0x400) {
+		dma_write(addr, val);
+	} else if (addr == RCC_ADDR) {  // oscillators and PLL are ready at once
+		REG(addr) = (val & ~0x02020002UL) | ((val & 0x01010001UL) << 1);
+	} else if (addr == RCC_ADDR + 0x04) {
+		REG(addr) = (val & ~0x0CUL) | ((val & 3) << 2);
+		if (REG(SYSTICK_ADDR) & SYSTICK_CTRL_ENABLE)
+			systick_restart();
+	} else if (addr == SYSTICK_ADDR) {
+		if ((old ^ val) & SYSTICK_CTRL_ENABLE)
+			systick_restart();
+	} else if (addr == SYSTICK_ADDR + 4 || addr == SYSTICK_ADDR + 8) {  // LOAD, VAL
+		REG(SYSTICK_ADDR + 8) = 0;
+		systick_restart();
+	} else if (addr == DWT_ADDR + 4) {
+		dwt_base = dwt_cycles() - val;
+	} else if (addr == ICSR_ADDR) {
+		if (val & SCB_ICSR_PENDSTSET)
+			systick_pending = 1;
+		if (val & ICSR_PENDSTCLR)
+			systick_pending = 0;
+		REG(addr) = 0;
+	}
+}
+
+/* A write marked with SIM_WRITE() to a register that isn't watched */
+static void
+sim_marked_write(uint32_t addr, uint32_t val)
+{
+	if (addr == I2C1_BASE + I2C_DR_) {
+		i2c_write(&sim_i2c[0], I2C_DR_, val);
+	} else if (addr == I2C2_BASE + I2C_DR_) {
+		i2c_write(&sim_i2c[1], I2C_DR_, val);
+	} else if (addr >= USART1_BASE && addr < USART1_BASE + 0x400) {
+		usart_write_reg(addr - USART1_BASE, val);
+	} else if (addr == EXTI_BASE + 0x14) {
+		exti_pending &= ~val;
+		REG(addr) = exti_pending;
+	} else if (addr >= DMA1_BASE && addr < DMA1_BASE + 0x400) {
+		dma_write(addr, val);
+	} else if (addr >= NVIC_BASE && addr < NVIC_BASE + 0x200) {
+		nvic_write(addr, val);
+	}
+}
+
+/* Returns 1 when a marked read changed peripheral state */
+static int
+sim_marked_read(uint32_t addr)
+{
+	if (addr >= I2C1_BASE && addr < I2C1_BASE + 0x400)
+		return i2c_read(&sim_i2c[0], addr - I2C1_BASE);
+	if (addr >= I2C2_BASE && addr < I2C2_BASE + 0x400)
+		return i2c_read(&sim_i2c[1], addr - I2C2_BASE);
+	if (addr >= USART1_BASE && addr < USART1_BASE + 0x400)
+		return usart_read_reg(addr - USART1_BASE);
+	return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+/* Sync points */
+
+static void
+sim_watch(uint32_t addr)
+{
+	sim_watch_addr[sim_watch_count++] = addr;
+}
+
+/* Apply the driver writes to watched registers. Returns 1 if there were any. */
+static int
+sim_diff(void)
+{
+	int changed = 0;
+
+	for (int i = 0; i < sim_watch_count; i++) {
+		uint32_t addr = sim_watch_addr[i], val = REG(addr);
+
+		if (val != sim_watch_seen[i]) {
+			sim_watch_write(addr, sim_watch_seen[i], val);
+			sim_watch_seen[i] = REG(addr);
+			changed = 1;
+		}
+	}
+	return changed;
+}
+
+/* Computed registers as the clock now has them, and what the models left in the watched
+ * ones, so only the drivers' next writes show up as a difference */
+static void
+sim_mirror(void)
+{
+	if (REG(SYSTICK_ADDR) & SYSTICK_CTRL_ENABLE) {
+		uint32_t load = REG(SYSTICK_ADDR + 4) & 0xFFFFFF;
+		uint64_t ticks = (sim_now - systick_reload_ns) * systick_clk() / 1000000000ULL;
+
+		REG(SYSTICK_ADDR + 8) = ticks > load ? 0 : load - (uint32_t)ticks;
+	}
+	if (REG(DWT_ADDR) & DWT_CTRL_CYCCNTENA)
+		REG(DWT_ADDR + 4) = dwt_cycles() - dwt_base;
+	nvic_sync();
+	for (int i = 0; i < sim_watch_count; i++)
+		sim_watch_seen[i] = REG(sim_watch_addr[i]);
+}
+
+static void
+sim_settle(void)
+{
+	sim_diff();
+	sim_mirror();
+}
+
+/* Time for the code since the last sync point. A run of them with no effect is a polling
+ * loop, time passes faster there. */
+static void
+sim_step(int effect)
+{
+	sim_stats.syncs++;
+	if (effect)
+		sim_poll_ns = SIM_ACCESS_NS;
+	else if (sim_poll_ns < SIM_POLL_MAX_NS)
+		sim_poll_ns *= 2;
+	sim_advance(sim_poll_ns);
+	sim_mirror();
+	sim_dispatch();
+}
+
+/** @brief SIM_SYNC(), see common.h: the hardware catches up with the drivers. */
+void
+sim_sync(void)
+{
+	sim_step(sim_diff());
+}
+
+/** @brief SIM_READ() and SIM_WRITE(), see common.h: the access just made to reg has an
+        effect of its own. Writes to reg and the others before it apply in program order.
+*/
+void
+sim_access(volatile void *reg, int write)
+{
+	uint32_t addr = (uint32_t)(uintptr_t)reg & ~3U;
+	int effect = sim_diff();
+
+	if (write) {
+		sim_marked_write(addr, REG(addr));
+		effect = 1;
+	} else {
+		effect |= sim_marked_read(addr);
+	}
+	sim_step(effect);
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief Reset the register memory and the models, call before anything touches a
+        peripheral. Registers start at their reset values where a driver depends on one
+        (status flags), zero otherwise.
+*/
+void
+sim_init(void)
+{
+	if ((uintptr_t)sim_periph + sizeof(sim_periph) > UINT32_MAX ||
+	    (uintptr_t)sim_ppb + sizeof(sim_ppb) > UINT32_MAX) {
+		fprintf(stderr, "sim: register memory above 4 GB, link without PIE\n");
+		exit(2);
+	}
+	sim_i2c[0].base = I2C1_BASE;
+	sim_i2c[1].base = I2C2_BASE;
+	REG(RCC_ADDR) = 0x83;  // HSION, HSIRDY
+	REG(USART1_BASE) = USART_SR_TXE | USART_SR_TC;
+	systick_timer.fire = systick_fire;
+
+	/* Clocks before SysTick, DMA flags before the I2C writes that raise new ones, pins
+	 * before the I2C reset a bus clear ends with */
+	sim_watch(RCC_ADDR);
+	sim_watch(RCC_ADDR + 0x04);
+	sim_watch(SYSTICK_ADDR);
+	sim_watch(SYSTICK_ADDR + 4);
+	sim_watch(SYSTICK_ADDR + 8);
+	sim_watch(DWT_ADDR + 4);
+	sim_watch(ICSR_ADDR);
+	sim_watch(DMA1_BASE + 0x04);
+	sim_watch(GPIOB_BASE + GPIO_ODR_);
+	sim_watch(GPIOB_BASE + GPIO_BSRR_);
+	sim_watch(GPIOB_BASE + GPIO_BRR_);
+	for (int i = 0; i < 2; i++) {
+		sim_watch(sim_i2c[i].base + I2C_CR1_);
+		sim_watch(sim_i2c[i].base + I2C_CR2_);
+	}
+	sim_mirror();
+}
+
+/** @brief Wait for the next event, like WFI: returns after at least one handler ran.
+        Pending interrupts are taken first. Exits the program when nothing can ever
+        happen, a model or the firmware is stuck.
+*/
+void
+sim_idle(void)
+{
+	uint64_t irqs = sim_stats.irqs;
+
+	sim_settle();
+	sim_dispatch();
+	while (sim_stats.irqs == irqs) {
+		if (!sim_timers) {
+			fprintf(stderr, "sim: idle with no event scheduled\n");
+			exit(3);
+		}
+		sim_advance(sim_timers->at - sim_now);
+		sim_dispatch();
+	}
+}
+
+/** @brief WFI, see cpu_wfi() in common.h. With interrupts masked it returns as soon as
+        one is pending, without running it: irq_restore() does. Unmasked it is sim_idle().
+        With SLEEPDEEP set it is STOP: SysTick halts and starts a fresh period at the wake-up,
+        so millis() loses the time asleep as on the chip.
+*/
+void
+sim_wfi(void)
+{
+	int stop = REG(SCR_ADDR) & SCR_SLEEPDEEP;
+
+	sim_settle();
+	if (!sim_primask) {
+		sim_idle();
+		return;
+	}
+	if (stop && !systick_pending)
+		sim_timer_cancel(&systick_timer);
+	while (!systick_pending && nvic_next() < 0) {
+		if (!sim_timers) {
+			fprintf(stderr, "sim: wfi with no event scheduled\n");
+			exit(3);
+		}
+		sim_advance(sim_timers->at - sim_now);
+	}
+	if (stop)
+		systick_restart();
+}
+
+/** @brief Let ns of virtual time pass, taking interrupts as they fall due. */
+void
+sim_run_ns(uint64_t ns)
+{
+	uint64_t end = sim_now + ns;
+
+	sim_settle();
+	while (sim_timers && sim_timers->at <= end) {
+		sim_advance(sim_timers->at - sim_now);
+		sim_dispatch();
+	}
+	sim_advance(end - sim_now);
+	sim_dispatch();
+}
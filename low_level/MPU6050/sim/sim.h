@@ -0,0 +1,96 @@
+/* @file 			 : sim.h
+ *  @Description: Host simulation of the STM32F103 peripherals the drivers use.
+ *
+ *  The library sources are built for the PC with SIM_HOST defined, which points
+ *  PERIPH_BASE and PPBI_BASE at two plain arrays, sim_periph and sim_ppb. Driver accesses
+ *  are ordinary loads and stores; the simulator applies the hardware side effects at sync
+ *  points, SIM_SYNC() in polling loops and before computed registers are read, and the
+ *  SIM_READ()/SIM_WRITE() hooks after an access that acts by itself (see common.h). There
+ *  it takes the changes in the control registers as writes (START sets SB, a PLL enable
+ *  sets its ready flag), and a marked SR2 read clears ADDR, a marked DR read pops the next
+ *  byte, a marked channel enable moves the data, and so on.
+ *
+ *  Modelled: RCC ready flags, SysTick, NVIC enable/pending, DWT CYCCNT, EXTI, DMA1 for
+ *  I2C RX and USART1 TX/RX, I2C1/I2C2 master mode, the USART1 data register, STOP
+ *  (WFI with SLEEPDEEP) and the GPIOB pin levels. Other registers read back what was
+ *  written.
+ *
+ *  sim_i2c_stick() makes a slave hold SDA low: the bus reads BUSY, START goes nowhere and a
+ *  transfer on it hangs until that many SCL rising edges were driven on the GPIOB pins
+ *  (I2C1 PB6/PB7, I2C2 PB10/PB11), the way a bus clear frees a real one.
+ *
+ *  Time is virtual: every sync point costs SIM_ACCESS_NS, each I2C byte its time on the
+ *  wire at the programmed SCL rate, and sim_idle() or cpu_wfi() jumps to the next event
+ *  the way WFI would wait for it. Code between sync points and UART and DMA memory
+ *  transfers take no time. Interrupts are delivered at sync points, on sim_idle() and on
+ *  irq_restore(), with handlers run to completion (no preemption between IRQs).
+ *
+ *  DMA addresses are 32 bits, so the register arrays and the DMA buffers must sit below
+ *  4 GB: the simulation links without PIE and DMA buffers must be static, not on the stack.
+ */
+#ifndef SIM_H
+#define SIM_H
+
+#ifndef COMMON_H
+#include "common.h"
+#endif
+#ifndef I2C_H
+#include "i2c.h"
+#endif
+
+#define SIM_ACCESS_NS 50      // one APB access
+#define SIM_POLL_MAX_NS 4000  // a polling loop with no effect is stepped up to this per sync
+#define SIM_IRQ_COUNT 60
+
+/* One I2C slave on a simulated bus */
+typedef struct sim_i2c_dev {
+	uint8_t addr;  // 8-bit write address i.e 0xD0
+	void (*start)(struct sim_i2c_dev *dev, int read);
+	int (*write)(struct sim_i2c_dev *dev, uint8_t byte);  // return 1 to ACK, 0 to NACK
+	uint8_t (*read)(struct sim_i2c_dev *dev, int ack);    // ack 0 ends the read
+	void (*stop)(struct sim_i2c_dev *dev);
+	struct sim_i2c_dev *next;
+} sim_i2c_dev_t;
+
+/* One-shot event on the virtual clock, re-arm from fire() for a periodic one */
+typedef struct sim_timer {
+	uint64_t at;  // ns
+	void (*fire)(struct sim_timer *t);
+	struct sim_timer *next;
+	int armed;
+} sim_timer_t;
+
+typedef struct {
+	uint64_t syncs;     // sync points, SIM_SYNC() and the access hooks
+	uint64_t irqs;      // handlers run, SysTick included
+	uint64_t i2c_bytes;
+	uint64_t uart_bytes;
+} sim_stats_t;
+
+extern sim_stats_t sim_stats;
+
+void
+sim_init(void);
+uint64_t
+sim_now_ns(void);
+void
+sim_idle(void);
+void
+sim_run_ns(uint64_t ns);
+void
+sim_timer_at(sim_timer_t *t, uint64_t at_ns);
+void
+sim_timer_cancel(sim_timer_t *t);
+
+void
+sim_i2c_attach(I2C_TypeDef *bus, sim_i2c_dev_t *dev);
+void
+sim_i2c_stick(I2C_TypeDef *bus, int clocks);
+void
+sim_exti_pulse(uint8_t line);
+void
+sim_uart_sink(void (*sink)(uint8_t byte));
+int
+sim_uart_rx(const uint8_t *data, uint16_t len);
+
+#endif
@@ -0,0 +1,854 @@
+/* @file 			 : sim_main.c
+ *  @Description: Host data-path run and micro-benchmarks, the MPU6050_sim program.
+ *
+ *  Builds the drivers for the PC against the simulated peripherals in sim.c and a scripted
+ *  MPU6050 on I2C1 with INT on EXTI0, then runs seven phases:
+ *    stream  data-ready → EXTI0 → DMA burst read → queue → decode → decimate → fusion →
+ *            telemetry frame → USART1 DMA ring, the same path as the firmware, with the
+ *            scheduler tasks and WFI. Every sample is checked against the script, every
+ *            frame on the UART is re-parsed (sync, CRC, sequence).
+ *    fifo    the 1 kHz profile buffered in the sensor FIFO, drained in batches by DMA
+ *    calib   mpu_calibrate() against a biased script, the residual bias must be gone
+ *    motion  cycle mode with the motion interrupt while the core sits in STOP: no wake-up
+ *            while still, one within a cycle period of a 0.5 g step, then data ready again
+ *    recover a slave holding SDA low in the middle of the stream: i2c_poll() must time the
+ *            read out, clear the bus and let the stream go on a few samples later, and a
+ *            blocking read on a held bus must clear it and succeed on the retry
+ *    delta   the same noisy samples through the USART1 ring as raw and as delta frames,
+ *            decoded back and compared bit for bit, samples per second the link carries
+ *            in each format, resync after a corrupted byte, and the CAN delta frames
+ *    bench   decode, decimation, fusion and framing in tight native loops, no sync points
+ *  The exit status is 0 when every check passed, so a script or CI job can loop on it.
+ *
+ *  Usage: MPU6050_sim [samples] [bench_loops]
+ */
+#include "clk.h"
+#include "extint.h"
+#include "filter.h"
+#include "fusion.h"
+#include "mpu.h"
+#include "mpu_model.h"
+#include "nvic.h"
+#include "prof.h"
+#include "sampleq.h"
+#include "sched.h"
+#include "sim.h"
+#include "telemetry.h"
+#include "timer.h"
+#include "usart.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define SIM_SAMPLES 5000
+#define SIM_BENCH_LOOPS 1000000
+#define SIM_BAUD 921600
+#define SIM_DECIM 10         // 1 kHz in, 100 Hz of telemetry out
+#define SIM_FIFO_PERIOD_MS 8  // drain interval, 8 frames per batch at 1 kHz
+#define SIM_FIFO_BATCH 16
+#define SIM_CALIB_SAMPLES 256
+#define SIM_CALIB_CHECK 64
+#define SIM_CALIB_TOLERANCE 2  // LSBs left after offset rounding
+#define SIM_WOM_THRESHOLD 20  // 40 mg
+#define SIM_WOM_WAKE MPU_LP_WAKE_20HZ
+#define SIM_WOM_PERIOD_NS 50000000ULL  // 20 Hz
+#define SIM_STILL_NS 1000000000ULL  // parked and still before the knock
+#define SIM_WAKE_SAMPLES 8  // data-ready frames wanted within 10 ms of mpu_cycle_exit()
+#define SIM_STUCK_CLOCKS 5  // SCL pulses the stuck slave needs to let go of SDA
+#define SIM_STUCK_PHASE_NS 300000ULL  // into a sample period, while a read is on the bus
+#define SIM_MAX_LOST 4  // samples the stream may lose to one bus clear at 1 kHz
+#define SIM_DELTA_NOISE 8  // LSBs of sensor noise, either sign
+#define SIM_DELTA_GAIN 1.8  // link rate wanted from delta frames, times that of raw ones
+#define SIM_DELTA_CORRUPT 2000  // byte of the delta stream that gets flipped
+#define EV_SAMPLE (1 << 0)
+
+/* The stream and FIFO phases read at 1 kHz with the widest ranges */
+static const mpu_config_t stream_profile = {
+    .smplrt_div = 7, .dlpf = 0, .gyro_fs = 3, .accel_fs = 3, .fifo = 0, .mag = 0};
+
+static mpu_model_t imu_model;
+static mpu_dev_t imu = {.bus = I2C1, .addr = MPU6050_ADDR};
+static sampleq_t samples;
+static uint8_t fifo_buf[SIM_FIFO_BATCH * MPU_FRAME_SIZE];
+static volatile int fifo_status;
+static volatile uint32_t read_errors, overruns;
+static volatile uint32_t motion_irqs;  // EXTI0 edges while parked, the motion phase
+static volatile uint64_t motion_at;    // sim_now_ns() of the first one
+static int parked;
+static int16_t script_bias[7];
+static int script_still;  // sensor at rest: bias only, no waves
+static int failures;
+
+/* Sample n of the script. TEMP carries n so a frame can be traced back to its sample,
+ * the other channels are triangle waves of different periods. */
+static int16_t
+Script_Value(uint32_t n, int ch)
+{
+	static const uint16_t period[7] = {500, 700, 900, 0, 300, 400, 600};
+	uint32_t p = period[ch], phase;
+
+	if (ch == 3)
+		return (int16_t)n;
+	phase = (n * 7 + ch * 97) % p;
+	return (int16_t)((phase < p / 2 ? phase : p - phase) * 8 - p * 2);
+}
+
+static void
+Script(uint32_t n, int16_t *out, void *arg)
+{
+	(void)arg;
+	for (int ch = 0; ch < 7; ch++)
+		out[ch] = (script_still && ch != 3 ? 0 : Script_Value(n, ch)) + script_bias[ch];
+}
+
+static void
+Check(int ok, const char *what)
+{
+	if (!ok) {
+		printf("FAIL %s\n", what);
+		failures++;
+	}
+}
+
+/* Sample index from the TEMP channel, and whether the rest matches the script */
+static int
+Sample_Ok(const mpu_raw_t *raw, uint32_t *n)
+{
+	uint32_t idx = (uint16_t)raw->temp;
+
+	*n = idx;
+	for (int i = 0; i < 3; i++) {
+		if (raw->accel[i] != Script_Value(idx, i) || raw->gyro[i] != Script_Value(idx, 4 + i))
+			return 0;
+	}
+	return 1;
+}
+
+/*---------------------------------------------------------------------------*/
+/* UART side: re-parse what the firmware put on the wire */
+
+static struct {
+	uint8_t buf[TELEMETRY_FRAME_SIZE];
+	int len;
+	uint32_t frames, crc_errors, seq_gaps;
+	uint16_t seq;
+} rx;
+
+static void
+Uart_Byte(uint8_t byte)
+{
+	uint16_t crc, seq;
+
+	if (rx.len == 0 && byte != TELEMETRY_SYNC0)
+		return;
+	if (rx.len == 1 && byte != TELEMETRY_SYNC1) {
+		rx.len = byte == TELEMETRY_SYNC0;
+		return;
+	}
+	rx.buf[rx.len++] = byte;
+	if (rx.len < TELEMETRY_FRAME_SIZE)
+		return;
+	rx.len = 0;
+	crc = rx.buf[22] | rx.buf[23] << 8;
+	if (crc != telemetry_crc16(&rx.buf[2], TELEMETRY_FRAME_SIZE - 4)) {
+		rx.crc_errors++;
+		return;
+	}
+	seq = rx.buf[2] | rx.buf[3] << 8;
+	if (rx.frames && seq != (uint16_t)(rx.seq + 1))
+		rx.seq_gaps++;
+	rx.seq = seq;
+	rx.frames++;
+}
+
+/*---------------------------------------------------------------------------*/
+/* Acquisition, as in the firmware: the data-ready edge starts a DMA read into the queue */
+
+static void
+Frame_Done(int status)
+{
+	if (status > 0) {
+		sampleq_publish(&samples);
+		sched_signal(EV_SAMPLE);
+	} else {
+		read_errors++;
+	}
+}
+
+void
+EXTI0_IRQHandler(void)
+{
+	uint32_t now = micros();
+	sample_slot_t *slot;
+
+	resetExternalInterrupt(EXTI0);
+	if (parked) {
+		if (!motion_irqs++)
+			motion_at = sim_now_ns();
+		return;
+	}
+	if (i2c1_dma_busy()) {
+		overruns++;
+		return;
+	}
+	slot = sampleq_write_slot(&samples);
+	if (!slot)
+		return;
+	slot->time = now;
+	if (mpu_read_frame(&imu, slot->frame, Frame_Done) < 0)
+		read_errors++;
+}
+
+static void
+Fifo_Done(int status)
+{
+	fifo_status = status;
+}
+
+/*---------------------------------------------------------------------------*/
+
+static double
+Host_Seconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void
+Report(const char *phase, uint32_t count, double host_s, uint64_t virt_ns)
+{
+	printf("%-7s %8u samples  %7.3f s simulated  %7.3f s host  %6.2fx real time\n", phase,
+	       count, virt_ns * 1e-9, host_s, host_s > 0 ? virt_ns * 1e-9 / host_s : 0);
+}
+
+static struct {
+	uint32_t consumed, gaps, mismatches, last, t_prev;
+	uint16_t seq;
+	decim_t dec;
+	fusion_t fus;
+} stream;
+
+/* The firmware's sample task, one queued sample per run */
+static void
+Stream_Task(void)
+{
+	static uint8_t frame[TELEMETRY_FRAME_SIZE];
+	const sample_slot_t *slot = sampleq_read_slot(&samples);
+	mpu_raw_t raw, avg;
+	uint32_t n, out_time;
+
+	if (!slot)
+		return;
+	mpu_decode(slot->frame, &raw);
+	if (!Sample_Ok(&raw, &n))
+		stream.mismatches++;
+	if (stream.consumed && n != (uint16_t)(stream.last + 1))
+		stream.gaps++;
+	stream.last = n;
+	if (decim_push(&stream.dec, &raw, slot->time, &avg, &out_time) > 0) {
+		fusion_update(&stream.fus, &avg, stream_profile.gyro_fs,
+		              stream.t_prev ? out_time - stream.t_prev : 0);
+		stream.t_prev = out_time;
+		usart_write(frame, telemetry_pack(frame, 0, stream.seq++, out_time, &avg));
+	}
+	sampleq_release(&samples);
+	stream.consumed++;
+	if (sampleq_read_slot(&samples))
+		sched_signal(EV_SAMPLE);
+}
+
+/* Shares EV_SAMPLE with Stream_Task, below it, so every event reaches both */
+static void
+Watch_Task(void)
+{
+}
+
+static void
+Run_Stream(uint32_t count)
+{
+	uint64_t v0 = sim_now_ns();
+	double h0 = Host_Seconds();
+	uint32_t idle0 = sched_idle_count;
+
+	decim_init(&stream.dec, SIM_DECIM);
+	fusion_init(&stream.fus);
+	Check(mpu_configure(&imu, &stream_profile) > 0, "stream: mpu_configure");
+	sampleq_flush(&samples);
+	Check(sched_add(Stream_Task, 0, EV_SAMPLE, 0) >= 0, "stream: sched_add");
+	Check(sched_add(Watch_Task, 1, EV_SAMPLE, 0) >= 0, "stream: sched_add");
+	nvic_enable_irq(NVIC_EXTI0_IRQ);
+
+	while (stream.consumed < count)
+		sched_step();  // WFI when the queue is empty
+	nvic_disable_irq(NVIC_EXTI0_IRQ);
+	while (i2c1_dma_busy())
+		sim_idle();
+	usart_tx_flush();
+	Report("stream", stream.consumed, Host_Seconds() - h0, sim_now_ns() - v0);
+
+	printf("        %u mismatches, %u gaps, %u overruns, %u read errors, queue high water %u\n",
+	       stream.mismatches, stream.gaps, overruns, read_errors, samples.high_water);
+	printf("        sched: %u task runs, %u shared, %u sleeps\n", sched_task(0)->runs,
+	       sched_task(1)->runs, sched_idle_count - idle0);
+	printf("        uart: %u frames, %u crc errors, %u seq gaps, %u bytes dropped\n", rx.frames,
+	       rx.crc_errors, rx.seq_gaps, usart_tx_dropped);
+	Check(!stream.mismatches && !stream.gaps && !read_errors, "stream: samples");
+	Check(sched_task(1)->runs && sched_task(1)->runs <= sched_task(0)->runs, "stream: sched");
+	Check(rx.frames == stream.seq && !rx.crc_errors && !rx.seq_gaps, "stream: telemetry");
+}
+
+static void
+Run_Fifo(uint32_t count)
+{
+	const mpu_config_t *profile = &mpu_profile_vibration;  // 1 kHz into the FIFO
+	uint32_t consumed = 0, gaps = 0, mismatches = 0, last = 0;
+	uint64_t v0 = sim_now_ns();
+	double h0 = Host_Seconds();
+	mpu_raw_t raw;
+
+	Check(mpu_configure(&imu, profile) > 0, "fifo: mpu_configure");
+	while (consumed < count) {
+		int frames;
+
+		sim_run_ns(SIM_FIFO_PERIOD_MS * 1000000ULL);
+		frames = mpu_fifo_frames(&imu);
+		if (frames <= 0)
+			continue;
+		if (frames > SIM_FIFO_BATCH)
+			frames = SIM_FIFO_BATCH;
+		fifo_status = 0;
+		if (mpu_fifo_read(&imu, fifo_buf, frames, Fifo_Done) < 0) {
+			read_errors++;
+			continue;
+		}
+		while (!fifo_status)
+			sim_idle();
+		for (int i = 0; i < frames && fifo_status > 0; i++) {
+			uint32_t n;
+
+			mpu_decode(&fifo_buf[i * MPU_FRAME_SIZE], &raw);
+			if (!Sample_Ok(&raw, &n))
+				mismatches++;
+			if (consumed && n != (uint16_t)(last + 1))
+				gaps++;
+			last = n;
+			consumed++;
+		}
+	}
+	Report("fifo", consumed, Host_Seconds() - h0, sim_now_ns() - v0);
+	printf("        %u mismatches, %u gaps\n", mismatches, gaps);
+	Check(!mismatches && !gaps, "fifo: samples");
+}
+
+static void
+Run_Calib(void)
+{
+	static const int16_t bias[7] = {300, -200, 150, 0, 50, -40, 30};
+	int32_t sum[6] = {0}, one_g = 16384 >> stream_profile.accel_fs;
+	uint8_t buf[MPU_FRAME_SIZE];
+	mpu_offsets_t offs;
+	mpu_raw_t raw;
+	uint64_t v0 = sim_now_ns();
+	double h0 = Host_Seconds();
+
+	for (int i = 0; i < 7; i++)
+		script_bias[i] = bias[i];
+	script_bias[2] += one_g;  // lying flat, Z up
+	script_still = 1;
+	Check(mpu_configure(&imu, &stream_profile) > 0, "calib: mpu_configure");
+	sim_run_ns(2 * mpu_sample_period_us(&imu) * 1000ULL);  // let the last moving sample go by
+	Check(mpu_calibrate(&imu, SIM_CALIB_SAMPLES, &offs) > 0, "calib: mpu_calibrate");
+
+	for (int n = 0; n < SIM_CALIB_CHECK; n++) {
+		sim_run_ns(mpu_sample_period_us(&imu) * 1000ULL);
+		Check(i2c_read_regs(imu.bus, imu.addr, ACCEL_XOUT_H, buf, sizeof(buf)) > 0,
+		      "calib: read");
+		mpu_decode(buf, &raw);
+		for (int i = 0; i < 3; i++) {
+			sum[i] += raw.accel[i];
+			sum[3 + i] += raw.gyro[i];
+		}
+	}
+	sum[2] -= one_g * SIM_CALIB_CHECK;
+	Report("calib", SIM_CALIB_SAMPLES + SIM_CALIB_CHECK, Host_Seconds() - h0, sim_now_ns() - v0);
+	printf("        residual accel %d %d %d  gyro %d %d %d LSB\n", sum[0] / SIM_CALIB_CHECK,
+	       sum[1] / SIM_CALIB_CHECK, sum[2] / SIM_CALIB_CHECK, sum[3] / SIM_CALIB_CHECK,
+	       sum[4] / SIM_CALIB_CHECK, sum[5] / SIM_CALIB_CHECK);
+	for (int i = 0; i < 6; i++)
+		Check(abs(sum[i] / SIM_CALIB_CHECK) <= SIM_CALIB_TOLERANCE, "calib: residual");
+	for (int i = 0; i < 7; i++)
+		script_bias[i] = 0;
+	script_still = 0;
+}
+
+/* The knock comes from a timer, so the core can stay in STOP until the sensor sees it */
+static void
+Knock(sim_timer_t *t)
+{
+	(void)t;
+	script_bias[0] = (16384 >> stream_profile.accel_fs) / 2;  // 0.5 g along X
+}
+
+static void
+Wake_Timeout(sim_timer_t *t)
+{
+	(void)t;
+	sim_exti_pulse(EXTI0);  // no motion interrupt, let the checks fail instead of hanging
+}
+
+static void
+Run_Motion(void)
+{
+	static sim_timer_t knock = {.fire = Knock}, timeout = {.fire = Wake_Timeout};
+	uint64_t v0 = sim_now_ns(), step_at = v0 + SIM_STILL_NS;
+	double h0 = Host_Seconds();
+	uint32_t ms0, stops = 0, frames = 0, primask;
+	int status;
+
+	script_still = 1;
+	script_bias[2] = 16384 >> stream_profile.accel_fs;  // lying flat, Z up
+	Check(mpu_configure(&imu, &stream_profile) > 0, "motion: mpu_configure");
+	sim_run_ns(2 * mpu_sample_period_us(&imu) * 1000ULL);  // settle at rest first
+	Check(mpu_cycle_enter(&imu, SIM_WOM_THRESHOLD, SIM_WOM_WAKE) > 0, "motion: cycle_enter");
+	parked = 1;
+	motion_irqs = 0;
+	resetExternalInterrupt(EXTI0);  // data-ready edges of the calib phase
+	nvic_clear_pending_irq(NVIC_EXTI0_IRQ);
+	nvic_enable_irq(NVIC_EXTI0_IRQ);
+	sim_timer_at(&knock, step_at);
+	sim_timer_at(&timeout, step_at + SIM_STILL_NS);
+
+	ms0 = millis();
+	while (!motion_irqs) {  // the firmware's parked idle
+		primask = irq_save();
+		clk_stop();
+		stops++;
+		irq_restore(primask);
+	}
+	sim_timer_cancel(&timeout);
+	Check(motion_at >= step_at, "motion: woken while still");
+	Check(motion_at - step_at <= 2 * SIM_WOM_PERIOD_NS, "motion: late wake-up");
+	Check(millis() - ms0 < 10, "motion: SysTick ran in STOP");
+	status = mpu_int_status(&imu);
+	Check(status >= 0 && (status & INT_STATUS_MOT), "motion: INT_STATUS");
+
+	nvic_disable_irq(NVIC_EXTI0_IRQ);
+	parked = 0;
+	Check(mpu_cycle_exit(&imu) > 0, "motion: cycle_exit");
+	sampleq_flush(&samples);
+	nvic_enable_irq(NVIC_EXTI0_IRQ);
+	sim_run_ns(10000000ULL);
+	nvic_disable_irq(NVIC_EXTI0_IRQ);
+	while (i2c1_dma_busy())
+		sim_idle();
+	while (sampleq_read_slot(&samples)) {
+		sampleq_release(&samples);
+		frames++;
+	}
+	Report("motion", frames, Host_Seconds() - h0, sim_now_ns() - v0);
+	printf("        %u STOP entries, wake-up %.1f ms after the step, %u frames in 10 ms\n",
+	       stops, (motion_at - step_at) * 1e-6, frames);
+	Check(frames >= SIM_WAKE_SAMPLES, "motion: data ready after cycle_exit");
+	for (int i = 0; i < 7; i++)
+		script_bias[i] = 0;
+	script_still = 0;
+}
+
+static void
+Stick_Bus(sim_timer_t *t)
+{
+	(void)t;
+	sim_i2c_stick(I2C1, SIM_STUCK_CLOCKS);
+}
+
+/* The firmware's bus task runs every millisecond between the samples it drains */
+static void
+Run_Recover(uint32_t count)
+{
+	static sim_timer_t stick = {.fire = Stick_Bus};
+	static const mpu_offsets_t no_offsets;
+	uint32_t consumed = 0, mismatches = 0, lost = 0, max_lost = 0, last = 0, errors0;
+	uint64_t v0 = sim_now_ns();
+	double h0 = Host_Seconds();
+	i2c_stats_t before = i2c_stats[0];
+	const sample_slot_t *slot;
+	mpu_raw_t raw;
+	uint8_t id;
+
+	Check(mpu_configure(&imu, &stream_profile) > 0, "recover: mpu_configure");
+	Check(mpu_write_offsets(&imu, &no_offsets) > 0, "recover: offsets");  // left by calib
+	sampleq_flush(&samples);
+	errors0 = read_errors;
+	resetExternalInterrupt(EXTI0);
+	nvic_clear_pending_irq(NVIC_EXTI0_IRQ);
+	nvic_enable_irq(NVIC_EXTI0_IRQ);
+	sim_timer_at(&stick, v0 + count / 2 * 1000000ULL + SIM_STUCK_PHASE_NS);  // mid-phase
+	while (consumed < count) {
+		sim_run_ns(1000000ULL);
+		i2c_poll(I2C1);
+		while ((slot = sampleq_read_slot(&samples))) {
+			uint32_t n;
+
+			mpu_decode(slot->frame, &raw);
+			if (!Sample_Ok(&raw, &n))
+				mismatches++;
+			if (consumed) {
+				lost = (uint16_t)(n - last - 1);
+				if (lost > max_lost)
+					max_lost = lost;
+			}
+			last = n;
+			consumed++;
+			sampleq_release(&samples);
+		}
+	}
+	nvic_disable_irq(NVIC_EXTI0_IRQ);
+	while (i2c1_dma_busy())
+		sim_idle();
+	Report("recover", consumed, Host_Seconds() - h0, sim_now_ns() - v0);
+	printf("        %u bus clears, %u timeouts, %u errors, %u reads failed, %u samples lost, %u mismatches\n",
+	       i2c_stats[0].recoveries - before.recoveries, i2c_stats[0].timeouts - before.timeouts,
+	       i2c_stats[0].errors - before.errors, read_errors - errors0, max_lost, mismatches);
+	Check(i2c_stats[0].recoveries - before.recoveries == 1, "recover: one bus clear");
+	Check(!i2c_stats[0].failing, "recover: bus freed");
+	Check(!mismatches && max_lost <= SIM_MAX_LOST, "recover: stream resumed");
+
+	/* Held while idle: the blocking read times out on START, clears the bus, retries */
+	before = i2c_stats[0];
+	sim_i2c_stick(I2C1, SIM_STUCK_CLOCKS);
+	Check(i2c_read_regs(imu.bus, imu.addr, WHO_AM_I, &id, 1) > 0 && id == 0x68,
+	      "recover: blocking retry");
+	Check(i2c_stats[0].retries - before.retries == 1 &&
+	          i2c_stats[0].recoveries - before.recoveries == 1,
+	      "recover: blocking bus clear");
+}
+
+/*---------------------------------------------------------------------------*/
+/* Delta frames: a host decoder written from the layout in telemetry.h */
+
+/* Sample n with noise and a few microseconds of timestamp jitter */
+static void
+Delta_Sample(uint32_t n, mpu_raw_t *raw, uint32_t *t)
+{
+	uint32_t h = n * 2654435761u;
+	int16_t v[7];
+
+	for (int ch = 0; ch < 7; ch++) {
+		h = h * 1103515245u + 12345u;
+		v[ch] = Script_Value(n, ch) + (int16_t)((h >> 16) % (2 * SIM_DELTA_NOISE + 1)) -
+		        SIM_DELTA_NOISE;
+	}
+	for (int i = 0; i < 3; i++) {
+		raw->accel[i] = v[i];
+		raw->gyro[i] = v[4 + i];
+	}
+	raw->temp = v[3];
+	*t = n * 1000 + (h >> 8) % 7;
+}
+
+static struct {
+	uint8_t buf[TELEMETRY_DELTA_FRAME_MAX];
+	int len, need;
+	int synced;
+	uint16_t seq;  // next one expected
+	int16_t prev[7];
+	uint32_t prev_time;
+	int32_t prev_dt;
+	uint32_t bytes, samples, keyframes, wrong, dropped, crc_errors;
+} dx;
+
+/* Zig-zag varint at *p, 0 when it runs past end */
+static int
+Delta_Varint(const uint8_t **p, const uint8_t *end, int32_t *d)
+{
+	uint32_t u = 0;
+
+	for (int shift = 0; *p < end && shift < 35; shift += 7) {
+		uint8_t b = *(*p)++;
+
+		u |= (uint32_t)(b & 0x7F) << shift;
+		if (!(b & 0x80)) {
+			*d = (int32_t)(u >> 1) ^ -(int32_t)(u & 1);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void
+Delta_Check(uint16_t seq, const int16_t *v, uint32_t t)
+{
+	mpu_raw_t raw;
+	uint32_t want_t;
+
+	Delta_Sample(seq, &raw, &want_t);
+	if (t != want_t || v[0] != raw.accel[0] || v[1] != raw.accel[1] || v[2] != raw.accel[2] ||
+	    v[3] != raw.temp || v[4] != raw.gyro[0] || v[5] != raw.gyro[1] || v[6] != raw.gyro[2])
+		dx.wrong++;
+	dx.samples++;
+}
+
+static void
+Delta_Frame(const uint8_t *f, int len)
+{
+	const uint8_t *p = f + 5, *end = f + len - 2;
+	int32_t d, dt;
+	uint8_t seq;
+
+	if ((f[len - 2] | f[len - 1] << 8) != telemetry_crc16(&f[2], len - 4)) {
+		dx.crc_errors++;
+		dx.synced = 0;
+		return;
+	}
+	if (f[1] == TELEMETRY_SYNC1) {  // keyframe
+		for (int i = 0; i < 7; i++)
+			dx.prev[i] = (int16_t)(f[8 + 2 * i] | f[9 + 2 * i] << 8);
+		dx.seq = f[2] | f[3] << 8;
+		dx.prev_time = f[4] | f[5] << 8 | f[6] << 16 | (uint32_t)f[7] << 24;
+		dx.prev_dt = 0;
+		dx.synced = 1;
+		dx.keyframes++;
+		Delta_Check(dx.seq++, dx.prev, dx.prev_time);
+		return;
+	}
+	seq = f[2];
+	if (!dx.synced || seq != (uint8_t)dx.seq) {
+		dx.synced = 0;
+		dx.dropped++;
+		return;
+	}
+	while (p < end) {
+		if (!Delta_Varint(&p, end, &d))
+			break;
+		dt = dx.prev_dt + d;
+		dx.prev_time += dt;
+		dx.prev_dt = dt;
+		for (int i = 0; i < 7 && Delta_Varint(&p, end, &d); i++)
+			dx.prev[i] += d;
+		Delta_Check(dx.seq++, dx.prev, dx.prev_time);
+	}
+}
+
+static void
+Delta_Byte(uint8_t byte)
+{
+	dx.bytes++;
+	if (dx.len == 0 && byte != TELEMETRY_SYNC0)
+		return;
+	if (dx.len == 1 && byte != TELEMETRY_SYNC1 && byte != TELEMETRY_DELTA_SYNC1) {
+		dx.len = byte == TELEMETRY_SYNC0;
+		return;
+	}
+	dx.buf[dx.len++] = byte;
+	if (dx.len == 2)
+		dx.need = byte == TELEMETRY_SYNC1 ? TELEMETRY_FRAME_SIZE : 0;
+	else if (dx.len == 5 && !dx.need)
+		dx.need = 7 + byte;
+	if (!dx.need || dx.len < dx.need)
+		return;
+	Delta_Frame(dx.buf, dx.len);
+	dx.len = dx.need = 0;
+}
+
+static uint32_t delta_sent;  // bytes into the decoder, the corruption test counts them
+
+static void
+Delta_Corrupt_Byte(uint8_t byte)
+{
+	Delta_Byte(delta_sent++ == SIM_DELTA_CORRUPT ? byte ^ 0x10 : byte);
+}
+
+/* Push count samples through usart_write(), returns the samples per second the link
+ * carries at SIM_BAUD, 10 bits per byte. UART time isn't simulated, so it comes from the
+ * bytes per sample. */
+static double
+Delta_Link(uint32_t count, int delta)
+{
+	static telemetry_batch_t enc;
+	uint8_t out[TELEMETRY_DELTA_OUT_MAX];
+	uint32_t t;
+	mpu_raw_t raw;
+	uint16_t len;
+
+	memset(&enc, 0, sizeof(enc));
+	memset(&dx, 0, sizeof(dx));
+	for (uint32_t n = 0; n < count; n++) {
+		Delta_Sample(n, &raw, &t);
+		if (delta)
+			len = telemetry_pack_delta(&enc, out, 0, n, t, &raw);
+		else
+			len = telemetry_pack(out, 0, n, t, &raw);
+		while (usart_tx_space() < len)
+			sim_idle();
+		usart_write(out, len);
+	}
+	if (delta)
+		usart_write(out, telemetry_flush_delta(&enc, out));
+	usart_tx_flush();
+	return SIM_BAUD / 10.0 * count / dx.bytes;
+}
+
+static void
+Run_Delta(uint32_t count)
+{
+	static telemetry_delta_t can;
+	uint64_t v0 = sim_now_ns();
+	double h0 = Host_Seconds(), raw_rate, delta_rate;
+	uint32_t can_deltas = 0, can_wrong = 0, t, lost;
+	uint8_t accel[8], gyro[8], frame[8];
+	int16_t prev[7] = {0};
+	mpu_raw_t raw;
+
+	count &= ~(uint32_t)(TELEMETRY_DELTA_BATCH - 1);
+	sim_uart_sink(Delta_Byte);
+	raw_rate = Delta_Link(count, 0);
+	Check(dx.samples == count && !dx.wrong && !dx.crc_errors, "delta: raw frames");
+	delta_rate = Delta_Link(count, 1);
+	Report("delta", count, Host_Seconds() - h0, sim_now_ns() - v0);
+	printf("        %.1f bytes per sample, %u keyframes: %.0f samples/s at %u baud, %.0f raw "
+	       "(%.2fx)\n", (double)dx.bytes / count, dx.keyframes, delta_rate, SIM_BAUD, raw_rate,
+	       delta_rate / raw_rate);
+	Check(dx.samples == count && !dx.wrong && !dx.crc_errors && !dx.dropped,
+	      "delta: lossless");
+	Check(delta_rate >= SIM_DELTA_GAIN * raw_rate, "delta: link rate");
+
+	delta_sent = 0;
+	sim_uart_sink(Delta_Corrupt_Byte);
+	Delta_Link(count, 1);
+	lost = count - dx.samples;
+	printf("        one corrupted byte: %u samples lost, %u frames dropped to resync\n", lost,
+	       dx.dropped);
+	Check(!dx.wrong && dx.crc_errors == 1 && lost <= TELEMETRY_DELTA_KEY + TELEMETRY_DELTA_BATCH,
+	      "delta: resync");
+	sim_uart_sink(Uart_Byte);
+
+	for (uint32_t n = 0; n < count; n++) {
+		Delta_Sample(n, &raw, &t);
+		if (telemetry_pack_can_delta(&can, frame, n, &raw)) {
+			for (int i = 0; i < 7; i++)
+				prev[i] += (int8_t)frame[1 + i];
+			can_deltas++;
+			can_wrong += frame[0] != (uint8_t)n;
+		} else {
+			telemetry_pack_can(accel, gyro, n, &raw);
+			for (int i = 0; i < 4; i++)
+				prev[i] = (int16_t)(accel[2 * i] | accel[2 * i + 1] << 8);
+			for (int i = 0; i < 3; i++)
+				prev[4 + i] = (int16_t)(gyro[2 * i] | gyro[2 * i + 1] << 8);
+		}
+		can_wrong += prev[0] != raw.accel[0] || prev[3] != raw.temp || prev[6] != raw.gyro[2];
+	}
+	printf("        can: %.2f frames per sample, %u of %u as one delta frame\n",
+	       (2.0 * (count - can_deltas) + can_deltas) / count, can_deltas, count);
+	Check(!can_wrong && can_deltas > count / 2, "delta: can");
+}
+
+/*---------------------------------------------------------------------------*/
+/* Native micro-benchmarks, the stages the main loop runs per sample */
+
+static volatile uint32_t bench_sink;
+
+static void
+Bench_Line(const char *name, uint32_t loops, double s)
+{
+	printf("%-18s %8.1f ns/op  %8.2f Mop/s\n", name, s * 1e9 / loops, loops / s / 1e6);
+}
+
+static void
+Run_Bench(uint32_t loops)
+{
+	uint8_t frames[64][MPU_FRAME_SIZE], out[TELEMETRY_FRAME_SIZE];
+	mpu_raw_t raw[64], avg;
+	uint32_t t_out;
+	decim_t dec;
+	fusion_t fus;
+	double t;
+
+	for (int i = 0; i < 64; i++) {
+		for (int b = 0; b < MPU_FRAME_SIZE; b++)
+			frames[i][b] = (uint8_t)(Script_Value(i, b % 7) >> (b & 1 ? 0 : 8));
+		mpu_decode(frames[i], &raw[i]);
+	}
+
+	t = Host_Seconds();
+	for (uint32_t n = 0; n < loops; n++) {
+		mpu_decode(frames[n & 63], &raw[n & 63]);
+		bench_sink += raw[n & 63].accel[0];
+	}
+	Bench_Line("mpu_decode", loops, Host_Seconds() - t);
+
+	decim_init(&dec, SIM_DECIM);
+	t = Host_Seconds();
+	for (uint32_t n = 0; n < loops; n++)
+		bench_sink += decim_push(&dec, &raw[n & 63], n * 1000, &avg, &t_out);
+	Bench_Line("decim_push /10", loops, Host_Seconds() - t);
+
+	fusion_init(&fus);
+	t = Host_Seconds();
+	for (uint32_t n = 0; n < loops; n++)
+		fusion_update(&fus, &raw[n & 63], stream_profile.gyro_fs, 1000);
+	bench_sink += fus.q[0];
+	Bench_Line("fusion_update", loops, Host_Seconds() - t);
+
+	t = Host_Seconds();
+	for (uint32_t n = 0; n < loops; n++)
+		bench_sink += telemetry_pack(out, 0, n, n * 1000, &raw[n & 63]) + out[22];
+	Bench_Line("telemetry_pack", loops, Host_Seconds() - t);
+
+	t = Host_Seconds();
+	for (uint32_t n = 0; n < loops; n++)
+		bench_sink += telemetry_crc16(frames[n & 63], MPU_FRAME_SIZE);
+	Bench_Line("telemetry_crc16 14B", loops, Host_Seconds() - t);
+
+	{
+		static telemetry_batch_t enc;
+		uint8_t frames_out[TELEMETRY_DELTA_OUT_MAX];
+
+		t = Host_Seconds();
+		for (uint32_t n = 0; n < loops; n++)
+			bench_sink += telemetry_pack_delta(&enc, frames_out, 0, n, n * 1000, &raw[n & 63]);
+		Bench_Line("telemetry_pack_delta", loops, Host_Seconds() - t);
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	uint32_t count = argc > 1 ? strtoul(argv[1], NULL, 0) : SIM_SAMPLES;
+	uint32_t loops = argc > 2 ? strtoul(argv[2], NULL, 0) : SIM_BENCH_LOOPS;
+
+	sim_init();
+	sim_uart_sink(Uart_Byte);
+	mpu_model_init(&imu_model, I2C1, MPU6050_ADDR, EXTI0, Script, NULL);
+
+	Check(clk_init() > 0, "clk_init");
+	nvic_priority_init();
+	millisInit();
+	prof_init();
+	usartInit(USART1, SIM_BAUD, 0);
+	usart_tx_init();
+	I2CInit(I2C1, NOREMAP, I2C_SPEED_FAST);
+	i2c1_dma_init();
+	EXTInterruptPinEnable(EXTI0, PA);
+	EXTInterruptEnable(EXTI0, 1, 0);
+	nvic_disable_irq(NVIC_EXTI0_IRQ);  // on for the stream phase only
+	Check(mpu_init(&imu, &stream_profile) > 0, "mpu_init");
+
+	Run_Stream(count);
+	Run_Fifo(count);
+	Run_Calib();
+	Run_Motion();
+	Run_Recover(count / 4);
+	Run_Delta(count);
+	printf("        %llu sync points, %llu interrupts, %llu i2c bytes, %llu uart bytes\n",
+	       (unsigned long long)sim_stats.syncs, (unsigned long long)sim_stats.irqs,
+	       (unsigned long long)sim_stats.i2c_bytes, (unsigned long long)sim_stats.uart_bytes);
+	Run_Bench(loops);
+
+	printf(failures ? "FAILED, %d checks\n" : "ok\n", failures);
+	return failures ? 1 : 0;
+}